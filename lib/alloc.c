@@ -0,0 +1,175 @@
+// SPDX-License-Identifier: Apache-2.0
+
+#include "alloc.h"
+#include "util.h"
+
+#include <string.h>
+
+/* All hooks are NULL while the libc functions are used. */
+static VarlinkAllocator allocator;
+
+/* Objects and arrays created by this thread take this one, if set. */
+static __thread const VarlinkAllocator *thread_allocator;
+
+static __thread bool counting;
+static __thread VarlinkAllocationStats stats;
+
+static inline void count(size_t size) {
+        if (counting) {
+                stats.n_allocations += 1;
+                stats.n_bytes += size;
+        }
+}
+
+void *varlink_allocator_malloc(const VarlinkAllocator *a, size_t size) {
+        count(size);
+
+        if (!a)
+                a = &allocator;
+
+        if (a->malloc)
+                return a->malloc(size, a->userdata);
+
+        return malloc(size);
+}
+
+void *varlink_allocator_calloc(const VarlinkAllocator *a, size_t n, size_t size) {
+        count(n * size);
+
+        if (!a)
+                a = &allocator;
+
+        if (a->calloc)
+                return a->calloc(n, size, a->userdata);
+
+        return calloc(n, size);
+}
+
+void *varlink_allocator_realloc(const VarlinkAllocator *a, void *ptr, size_t size) {
+        count(size);
+
+        if (!a)
+                a = &allocator;
+
+        if (a->realloc)
+                return a->realloc(ptr, size, a->userdata);
+
+        return realloc(ptr, size);
+}
+
+void varlink_allocator_free(const VarlinkAllocator *a, void *ptr) {
+        if (!a)
+                a = &allocator;
+
+        if (a->free)
+                a->free(ptr, a->userdata);
+        else
+                free(ptr);
+}
+
+char *varlink_allocator_strdup(const VarlinkAllocator *a, const char *s) {
+        size_t n = strlen(s);
+        char *copy;
+
+        copy = varlink_allocator_malloc(a, n + 1);
+        if (!copy)
+                return NULL;
+
+        memcpy(copy, s, n + 1);
+
+        return copy;
+}
+
+void *varlink_malloc(size_t size) {
+        return varlink_allocator_malloc(NULL, size);
+}
+
+void *varlink_calloc(size_t n, size_t size) {
+        return varlink_allocator_calloc(NULL, n, size);
+}
+
+void *varlink_realloc(void *ptr, size_t size) {
+        return varlink_allocator_realloc(NULL, ptr, size);
+}
+
+void varlink_free(void *ptr) {
+        varlink_allocator_free(NULL, ptr);
+}
+
+char *varlink_strndup(const char *s, size_t n) {
+        char *copy;
+
+        n = strnlen(s, n);
+
+        copy = varlink_malloc(n + 1);
+        if (!copy)
+                return NULL;
+
+        memcpy(copy, s, n);
+        copy[n] = '\0';
+
+        return copy;
+}
+
+char *varlink_strdup(const char *s) {
+        return varlink_allocator_strdup(NULL, s);
+}
+
+_public_ long varlink_set_allocator(const VarlinkAllocator *a) {
+        if (!a) {
+                allocator = (VarlinkAllocator){};
+                return 0;
+        }
+
+        if (!a->malloc || !a->calloc || !a->realloc || !a->free)
+                return -VARLINK_ERROR_PANIC;
+
+        allocator = *a;
+
+        return 0;
+}
+
+_public_ long varlink_set_thread_allocator(const VarlinkAllocator *a, const VarlinkAllocator **previousp) {
+        if (a && (!a->malloc || !a->calloc || !a->realloc || !a->free))
+                return -VARLINK_ERROR_PANIC;
+
+        if (previousp)
+                *previousp = thread_allocator;
+
+        thread_allocator = a;
+
+        return 0;
+}
+
+const VarlinkAllocator *varlink_get_thread_allocator(void) {
+        return thread_allocator;
+}
+
+_public_ void varlink_set_allocation_counting(bool enable) {
+        counting = enable;
+
+        if (enable)
+                stats = (VarlinkAllocationStats){};
+}
+
+_public_ void varlink_get_allocation_stats(VarlinkAllocationStats *s) {
+        *s = stats;
+}
+
+uint64_t varlink_allocation_mark(void) {
+        return stats.n_allocations;
+}
+
+void varlink_allocation_count_parse(uint64_t mark) {
+        if (counting) {
+                stats.n_messages_parsed += 1;
+                stats.n_parse_allocations += stats.n_allocations - mark;
+        }
+}
+
+void varlink_allocation_count_reply(uint64_t mark) {
+        if (counting) {
+                stats.n_replies += 1;
+                stats.n_reply_allocations += stats.n_allocations - mark;
+        }
+}
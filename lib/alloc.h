@@ -0,0 +1,47 @@
+// SPDX-License-Identifier: Apache-2.0
+
+#pragma once
+
+#include "varlink.h"
+
+#include <stddef.h>
+
+/*
+ * Allocation functions of the library, they call the allocator set with
+ * varlink_set_allocator(). Memory from these must be released with
+ * varlink_free(); memory from open_memstream() or asprintf() is owned by
+ * libc and still needs free().
+ */
+void *varlink_malloc(size_t size);
+void *varlink_calloc(size_t n, size_t size);
+void *varlink_realloc(void *ptr, size_t size);
+void varlink_free(void *ptr);
+char *varlink_strdup(const char *s);
+char *varlink_strndup(const char *s, size_t n);
+
+/*
+ * Like the functions above, but with @allocator instead of the global
+ * one if it is not NULL. Objects and arrays keep the allocator they were
+ * created with and release their memory with it.
+ */
+void *varlink_allocator_malloc(const VarlinkAllocator *allocator, size_t size);
+void *varlink_allocator_calloc(const VarlinkAllocator *allocator, size_t n, size_t size);
+void *varlink_allocator_realloc(const VarlinkAllocator *allocator, void *ptr, size_t size);
+void varlink_allocator_free(const VarlinkAllocator *allocator, void *ptr);
+char *varlink_allocator_strdup(const VarlinkAllocator *allocator, const char *s);
+
+/* The allocator set with varlink_set_thread_allocator(), or NULL. */
+const VarlinkAllocator *varlink_get_thread_allocator(void);
+
+static inline void varlink_freep(void *p) {
+        varlink_free(*(void **)p);
+}
+
+/*
+ * Returns the number of allocations the calling thread made so far, to
+ * attribute the allocations made after it to an operation with
+ * varlink_allocation_count_parse() or varlink_allocation_count_reply().
+ */
+uint64_t varlink_allocation_mark(void);
+void varlink_allocation_count_parse(uint64_t mark);
+void varlink_allocation_count_reply(uint64_t mark);
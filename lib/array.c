@@ -1,5 +1,6 @@
 // SPDX-License-Identifier: Apache-2.0
 
+#include "alloc.h"
 #include "array.h"
 #include "util.h"
 
@@ -7,6 +8,7 @@
 
 struct VarlinkArray {
         unsigned long refcount;
+        const VarlinkAllocator *allocator;
         VarlinkValueKind element_kind;
 
         VarlinkValue *elements;
@@ -14,12 +16,16 @@ struct VarlinkArray {
         unsigned long n_allocated_elements;
 
         bool writable;
+
+        /* Frozen arrays are shared between threads and counted atomically. */
+        bool frozen;
 };
 
 static long array_append(VarlinkArray *array, VarlinkValue **valuep) {
         if (array->n_elements == array->n_allocated_elements) {
                 array->n_allocated_elements = MAX(array->n_allocated_elements * 2, 16);
-                array->elements = realloc(array->elements, array->n_allocated_elements * sizeof(VarlinkValue));
+                array->elements = varlink_allocator_realloc(array->allocator, array->elements,
+                                                            array->n_allocated_elements * sizeof(VarlinkValue));
                 if (!array->elements)
                         return -VARLINK_ERROR_PANIC;
         }
@@ -36,12 +42,15 @@ VarlinkValueKind varlink_array_get_element_kind(VarlinkArray *array) {
 
 _public_ long varlink_array_new(VarlinkArray **arrayp) {
         _cleanup_(varlink_array_unrefp) VarlinkArray *array = NULL;
+        const VarlinkAllocator *allocator;
 
-        array = calloc(1, sizeof(VarlinkArray));
+        allocator = varlink_get_thread_allocator();
+        array = varlink_allocator_calloc(allocator, 1, sizeof(VarlinkArray));
         if (!array)
                 return -VARLINK_ERROR_PANIC;
 
         array->refcount = 1;
+        array->allocator = allocator;
         array->writable = true;
 
         *arrayp = array;
@@ -74,7 +83,7 @@ long varlink_array_new_from_scanner(VarlinkArray **arrayp, Scanner *scanner, loc
                 if (r < 0)
                         return r;
 
-                if (!varlink_value_read_from_scanner(value, scanner, locale, depth_cnt))
+                if (!varlink_value_read_from_scanner(value, scanner, array->allocator, locale, depth_cnt))
                         return -VARLINK_ERROR_INVALID_JSON;
 
                 /* Accept `null` value for any element kind */
@@ -98,24 +107,51 @@ long varlink_array_new_from_scanner(VarlinkArray **arrayp, Scanner *scanner, loc
 }
 
 _public_ VarlinkArray *varlink_array_ref(VarlinkArray *array) {
-        array->refcount += 1;
+        if (array->frozen)
+                __atomic_add_fetch(&array->refcount, 1, __ATOMIC_RELAXED);
+        else
+                array->refcount += 1;
+
         return array;
 }
 
 _public_ VarlinkArray *varlink_array_unref(VarlinkArray *array) {
-        array->refcount -= 1;
+        unsigned long refcount;
 
-        if (array->refcount == 0) {
+        if (array->frozen)
+                refcount = __atomic_sub_fetch(&array->refcount, 1, __ATOMIC_ACQ_REL);
+        else
+                refcount = --array->refcount;
+
+        if (refcount == 0) {
                 for (unsigned long i = 0; i < array->n_elements; i += 1)
-                        varlink_value_clear(&array->elements[i]);
+                        varlink_value_clear(&array->elements[i], array->allocator);
 
-                free(array->elements);
-                free(array);
+                varlink_allocator_free(array->allocator, array->elements);
+                varlink_allocator_free(array->allocator, array);
         }
 
         return NULL;
 }
 
+long varlink_array_freeze(VarlinkArray *array) {
+        long r;
+
+        if (array->frozen)
+                return 0;
+
+        for (unsigned long i = 0; i < array->n_elements; i += 1) {
+                r = varlink_value_freeze(&array->elements[i]);
+                if (r < 0)
+                        return r;
+        }
+
+        array->writable = false;
+        array->frozen = true;
+
+        return 0;
+}
+
 _public_ void varlink_array_unrefp(VarlinkArray **arrayp) {
         if (*arrayp)
                 varlink_array_unref(*arrayp);
@@ -305,7 +341,7 @@ _public_ long varlink_array_append_string(VarlinkArray *array, const char *strin
                 return r;
 
         v->kind = VARLINK_VALUE_STRING;
-        v->s = strdup(string);
+        v->s = varlink_allocator_strdup(array->allocator, string);
         if (!v->s)
                 return -VARLINK_ERROR_PANIC;
 
@@ -10,6 +10,9 @@
 long varlink_array_new_from_scanner(VarlinkArray **arrayp, Scanner *scanner, locale_t locale, unsigned long depth_cnt);
 long varlink_array_get_value(VarlinkArray *array, unsigned long index, VarlinkValue **valuep);
 VarlinkValueKind varlink_array_get_element_kind(VarlinkArray *array);
+
+/* See varlink_object_freeze(). */
+long varlink_array_freeze(VarlinkArray *array);
 long varlink_array_write_json(VarlinkArray *array,
                               FILE *stream,
                               long indent,
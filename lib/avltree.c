@@ -1,5 +1,6 @@
 // SPDX-License-Identifier: Apache-2.0
 
+#include "alloc.h"
 #include "avltree.h"
 #include "util.h"
 
@@ -7,6 +8,7 @@ struct AVLTree {
         AVLTreeNode *root;
         AVLCompareFunc compare;
         AVLFreepFunc freep;
+        const VarlinkAllocator *allocator;
         unsigned long n_elements;
 };
 
@@ -155,20 +157,26 @@ static AVLTreeNode *node_rebalance(AVLTreeNode *node) {
         return node;
 }
 
-long avl_tree_new(AVLTree **treep, AVLCompareFunc compare, AVLFreepFunc fp) {
+long avl_tree_new_with_allocator(AVLTree **treep, AVLCompareFunc compare, AVLFreepFunc fp,
+                                 const VarlinkAllocator *allocator) {
         AVLTree *tree;
 
-        tree = calloc(1, sizeof(AVLTree));
+        tree = varlink_allocator_calloc(allocator, 1, sizeof(AVLTree));
         if (!tree)
                 return -AVL_ERROR_PANIC;
 
         tree->compare = compare;
         tree->freep = fp;
+        tree->allocator = allocator;
 
         *treep = tree;
         return 0;
 }
 
+long avl_tree_new(AVLTree **treep, AVLCompareFunc compare, AVLFreepFunc fp) {
+        return avl_tree_new_with_allocator(treep, compare, fp, NULL);
+}
+
 static void avl_tree_free_subtree(AVLTree *tree, AVLTreeNode *node) {
         if (!node)
                 return;
@@ -179,12 +187,12 @@ static void avl_tree_free_subtree(AVLTree *tree, AVLTreeNode *node) {
         if (tree->freep)
                 tree->freep(&node->value);
 
-        free(node);
+        varlink_allocator_free(tree->allocator, node);
 }
 
 AVLTree *avl_tree_free(AVLTree *tree) {
         avl_tree_free_subtree(tree, tree->root);
-        free(tree);
+        varlink_allocator_free(tree->allocator, tree);
 
         return NULL;
 }
@@ -222,7 +230,7 @@ long avl_tree_get_elements(AVLTree *tree, void ***elementsp) {
         AVLTreeNode *node;
         unsigned long i = 0;
 
-        elements = malloc((tree->n_elements + 1) * sizeof(void *));
+        elements = varlink_malloc((tree->n_elements + 1) * sizeof(void *));
         if (!elements)
                 return -AVL_ERROR_PANIC;
 
@@ -251,7 +259,7 @@ static long avl_tree_insert_subtree(AVLTree *tree,
         node = *nodep;
 
         if (!node) {
-                node = calloc(1, sizeof(AVLTreeNode));
+                node = varlink_allocator_calloc(tree->allocator, 1, sizeof(AVLTreeNode));
                 if (!node)
                         return -AVL_ERROR_PANIC;
 
@@ -333,7 +341,7 @@ long avl_tree_remove(AVLTree *tree, const void *key) {
 
                 if (rightmost->left) {
                         rightmost->value = rightmost->left->value;
-                        free(rightmost->left);
+                        varlink_allocator_free(tree->allocator, rightmost->left);
                         rightmost->left = NULL;
                         changed = rightmost;
                 } else {
@@ -342,7 +350,7 @@ long avl_tree_remove(AVLTree *tree, const void *key) {
                         else
                                 rightmost->parent->right = NULL;
                         changed = rightmost->parent;
-                        free(rightmost);
+                        varlink_allocator_free(tree->allocator, rightmost);
                 }
 
         } else if (node->right) {
@@ -352,7 +360,7 @@ long avl_tree_remove(AVLTree *tree, const void *key) {
                  * invariant.
                  */
                 node->value = node->right->value;
-                free(node->right);
+                varlink_allocator_free(tree->allocator, node->right);
                 node->right = NULL;
 
                 changed = node;
@@ -369,7 +377,7 @@ long avl_tree_remove(AVLTree *tree, const void *key) {
                         tree->root = NULL;
                 }
 
-                free(node);
+                varlink_allocator_free(tree->allocator, node);
         }
 
         if (changed)
@@ -2,6 +2,8 @@
 
 #pragma once
 
+#include "varlink.h"
+
 #include <stdbool.h>
 #include <stdint.h>
 
@@ -28,6 +30,13 @@ typedef void (*AVLFreepFunc)(void *value);
  */
 long avl_tree_new(AVLTree **treep, AVLCompareFunc compare, AVLFreepFunc fp);
 
+/*
+ * Like avl_tree_new(), but the tree and its nodes are allocated with
+ * @allocator, see varlink_allocator_malloc().
+ */
+long avl_tree_new_with_allocator(AVLTree **treep, AVLCompareFunc compare, AVLFreepFunc fp,
+                                 const VarlinkAllocator *allocator);
+
 /*
  * Frees @tree and calls the the free function passed to avl_tree_new()
  * on every element.
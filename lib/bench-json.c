@@ -0,0 +1,469 @@
+// SPDX-License-Identifier: Apache-2.0
+
+#include "varlink.h"
+#include "util.h"
+
+#include <assert.h>
+#include <dirent.h>
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+/*
+ * Microbenchmarks for the JSON reader and writer.
+ *
+ * The library objects are linked statically with --wrap for the
+ * allocation functions, so every allocation the library makes is counted
+ * here and reported per operation. Buffers grown inside libc by an
+ * open_memstream() stream count as a single allocation.
+ *
+ * "parse-arena" parses with a thread allocator which takes the memory
+ * from a bump arena and resets it after each document, like a service
+ * which releases a request at once.
+ *
+ * "reply" serializes a reply message around the document, "reply-frozen"
+ * the same around a frozen copy with its JSON cached.
+ */
+
+#define BENCH_MIN_NSEC (200 * 1000 * 1000ULL)
+
+void *__real_malloc(size_t size);
+void *__real_calloc(size_t n, size_t size);
+void *__real_realloc(void *ptr, size_t size);
+char *__real_strdup(const char *s);
+char *__real_strndup(const char *s, size_t n);
+FILE *__real_open_memstream(char **ptr, size_t *sizeloc);
+
+void *__wrap_malloc(size_t size);
+void *__wrap_calloc(size_t n, size_t size);
+void *__wrap_realloc(void *ptr, size_t size);
+char *__wrap_strdup(const char *s);
+char *__wrap_strndup(const char *s, size_t n);
+FILE *__wrap_open_memstream(char **ptr, size_t *sizeloc);
+
+static unsigned long long n_allocations;
+
+void *__wrap_malloc(size_t size) {
+        n_allocations += 1;
+        return __real_malloc(size);
+}
+
+void *__wrap_calloc(size_t n, size_t size) {
+        n_allocations += 1;
+        return __real_calloc(n, size);
+}
+
+void *__wrap_realloc(void *ptr, size_t size) {
+        n_allocations += 1;
+        return __real_realloc(ptr, size);
+}
+
+char *__wrap_strdup(const char *s) {
+        n_allocations += 1;
+        return __real_strdup(s);
+}
+
+char *__wrap_strndup(const char *s, size_t n) {
+        n_allocations += 1;
+        return __real_strndup(s, n);
+}
+
+FILE *__wrap_open_memstream(char **ptr, size_t *sizeloc) {
+        n_allocations += 1;
+        return __real_open_memstream(ptr, sizeloc);
+}
+
+typedef struct {
+        char *name;
+        char *json;
+        size_t size;
+        VarlinkObject *object;
+
+        /* The same object frozen with its JSON cached. */
+        VarlinkObject *frozen;
+} Document;
+
+typedef struct {
+        Document *documents;
+        unsigned long n_documents;
+        unsigned long n_allocated;
+} Corpus;
+
+static unsigned long long now_nsec(void) {
+        struct timespec ts;
+
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+
+        return (unsigned long long)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void corpus_add(Corpus *corpus, const char *name, char *json) {
+        Document *document;
+
+        if (corpus->n_documents == corpus->n_allocated) {
+                corpus->n_allocated = MAX(corpus->n_allocated * 2, 16);
+                corpus->documents = realloc(corpus->documents, corpus->n_allocated * sizeof(Document));
+                assert(corpus->documents);
+        }
+
+        document = &corpus->documents[corpus->n_documents];
+        document->name = strdup(name);
+        document->json = json;
+        document->size = strlen(json);
+        assert(varlink_object_new_from_json(&document->object, json) == 0);
+        assert(varlink_object_new_from_json(&document->frozen, json) == 0);
+        assert(varlink_object_freeze(document->frozen, VARLINK_FREEZE_CACHE_JSON) == 0);
+
+        corpus->n_documents += 1;
+}
+
+static void corpus_free(Corpus *corpus) {
+        for (unsigned long i = 0; i < corpus->n_documents; i += 1) {
+                free(corpus->documents[i].name);
+                free(corpus->documents[i].json);
+                varlink_object_unref(corpus->documents[i].object);
+                varlink_object_unref(corpus->documents[i].frozen);
+        }
+
+        free(corpus->documents);
+}
+
+static char *document_strings(void) {
+        _cleanup_(fclosep) FILE *stream = NULL;
+        char *json = NULL;
+        size_t size;
+
+        stream = open_memstream(&json, &size);
+        fputs("{\"strings\":[", stream);
+        for (int i = 0; i < 1000; i += 1)
+                fprintf(stream, "%s\"entry %d with some \\\"escaped\\\" text, \\u00e4\\u00f6\\u00fc and a \\n newline\"",
+                        i > 0 ? "," : "", i);
+        fputs("]}", stream);
+        fclose(stream);
+        stream = NULL;
+
+        return json;
+}
+
+static char *document_numbers(void) {
+        _cleanup_(fclosep) FILE *stream = NULL;
+        char *json = NULL;
+        size_t size;
+
+        stream = open_memstream(&json, &size);
+        fputs("{\"integers\":[", stream);
+        for (int i = 0; i < 1000; i += 1)
+                fprintf(stream, "%s%d", i > 0 ? "," : "", i * 7919 - 500000);
+        fputs("],\"floats\":[", stream);
+        for (int i = 0; i < 1000; i += 1)
+                fprintf(stream, "%s%d.%03de%d", i > 0 ? "," : "", i, i % 1000, i % 20 - 10);
+        fputs("]}", stream);
+        fclose(stream);
+        stream = NULL;
+
+        return json;
+}
+
+static char *document_nested(void) {
+        _cleanup_(fclosep) FILE *stream = NULL;
+        char *json = NULL;
+        size_t size;
+
+        stream = open_memstream(&json, &size);
+        for (int i = 0; i < 500; i += 1)
+                fputs("{\"n\":", stream);
+        fputs("{}", stream);
+        for (int i = 0; i < 500; i += 1)
+                fputs("}", stream);
+        fclose(stream);
+        stream = NULL;
+
+        return json;
+}
+
+static char *document_wide(void) {
+        _cleanup_(fclosep) FILE *stream = NULL;
+        char *json = NULL;
+        size_t size;
+
+        stream = open_memstream(&json, &size);
+        fputs("{", stream);
+        for (int i = 0; i < 1000; i += 1)
+                fprintf(stream, "%s\"field%04d\":%d", i > 0 ? "," : "", (i * 389) % 1000, i);
+        fputs("}", stream);
+        fclose(stream);
+        stream = NULL;
+
+        return json;
+}
+
+static void corpus_add_synthetic(Corpus *corpus) {
+        corpus_add(corpus, "strings", document_strings());
+        corpus_add(corpus, "numbers", document_numbers());
+        corpus_add(corpus, "nested", document_nested());
+        corpus_add(corpus, "wide", document_wide());
+
+        corpus_add(corpus, "call", strdup("{\"method\":\"org.varlink.service.GetInterfaceDescription\","
+                                          "\"parameters\":{\"interface\":\"org.varlink.service\"}}"));
+        corpus_add(corpus, "call-more", strdup("{\"method\":\"org.example.network.Monitor\","
+                                               "\"parameters\":{\"ifindex\":3,\"filter\":[\"link\",\"address\"]},"
+                                               "\"more\":true}"));
+        corpus_add(corpus, "reply", strdup("{\"parameters\":{\"vendor\":\"Varlink\",\"product\":\"Example\","
+                                           "\"version\":\"1\",\"url\":\"https://varlink.org\","
+                                           "\"interfaces\":[\"org.varlink.service\",\"org.example.network\","
+                                           "\"org.example.more\"]}}"));
+        corpus_add(corpus, "reply-error", strdup("{\"error\":\"org.varlink.service.InvalidParameter\","
+                                                 "\"parameters\":{\"parameter\":\"ifindex\"}}"));
+}
+
+static int read_file(const char *path, char **contentsp) {
+        _cleanup_(fclosep) FILE *file = NULL;
+        _cleanup_(fclosep) FILE *stream = NULL;
+        _cleanup_(freep) char *contents = NULL;
+        size_t n_input;
+
+        file = fopen(path, "r");
+        if (!file)
+                return -errno;
+
+        stream = open_memstream(&contents, &n_input);
+        if (!stream)
+                return -errno;
+
+        /* Same wrapping as test-json, the reader only accepts objects. */
+        fputs("{ \"test\" : ", stream);
+
+        for (;;) {
+                char buffer[8192];
+                size_t n;
+
+                n = fread(buffer, 1, sizeof(buffer), file);
+                if (n == 0)
+                        break;
+
+                fwrite(buffer, 1, n, stream);
+        }
+
+        fputs("}", stream);
+        fclose(stream);
+        stream = NULL;
+
+        *contentsp = contents;
+        contents = NULL;
+
+        return 0;
+}
+
+static void corpus_add_directory(Corpus *corpus, const char *directory) {
+        DIR *dir;
+
+        dir = opendir(directory);
+        if (!dir)
+                return;
+
+        for (struct dirent *d = readdir(dir); d; d = readdir(dir)) {
+                _cleanup_(freep) char *path = NULL;
+                char *json;
+                VarlinkObject *object;
+
+                if (strncmp(d->d_name, "y_", 2) != 0)
+                        continue;
+
+                assert(asprintf(&path, "%s/%s", directory, d->d_name) >= 0);
+                if (read_file(path, &json) < 0)
+                        continue;
+
+                /* Some valid documents are still rejected, e.g. for duplicate keys. */
+                if (varlink_object_new_from_json(&object, json) < 0) {
+                        free(json);
+                        continue;
+                }
+                varlink_object_unref(object);
+
+                corpus_add(corpus, d->d_name, json);
+        }
+
+        closedir(dir);
+}
+
+typedef struct {
+        char *buffer;
+        size_t size;
+        size_t used;
+} Arena;
+
+#define ARENA_SIZE (256 * 1024 * 1024)
+
+/* Blocks start with their size, for realloc(). */
+typedef struct {
+        size_t size;
+        size_t padding;
+} ArenaHeader;
+
+static Arena arena;
+
+static void *arena_malloc(size_t size, void *userdata) {
+        Arena *a = userdata;
+        ArenaHeader *header;
+        size_t n = sizeof(ArenaHeader) + ((size + 15) & ~(size_t)15);
+
+        if (a->used + n > a->size)
+                return NULL;
+
+        header = (ArenaHeader *)(a->buffer + a->used);
+        header->size = size;
+        a->used += n;
+
+        return header + 1;
+}
+
+static void *arena_calloc(size_t n, size_t size, void *userdata) {
+        void *p;
+
+        p = arena_malloc(n * size, userdata);
+        if (p)
+                memset(p, 0, n * size);
+
+        return p;
+}
+
+static void *arena_realloc(void *ptr, size_t size, void *userdata) {
+        void *p;
+
+        p = arena_malloc(size, userdata);
+        if (p && ptr)
+                memcpy(p, ptr, MIN(((ArenaHeader *)ptr - 1)->size, size));
+
+        return p;
+}
+
+static void arena_free(void *UNUSED(ptr), void *UNUSED(userdata)) {
+}
+
+static const VarlinkAllocator arena_allocator = {
+        .malloc = arena_malloc,
+        .calloc = arena_calloc,
+        .realloc = arena_realloc,
+        .free = arena_free,
+        .userdata = &arena
+};
+
+typedef void (*BenchFunc)(Document *document);
+
+static void bench_parse(Document *document) {
+        VarlinkObject *object;
+
+        assert(varlink_object_new_from_json(&object, document->json) == 0);
+        varlink_object_unref(object);
+}
+
+static void bench_parse_arena(Document *document) {
+        VarlinkObject *object;
+
+        assert(varlink_set_thread_allocator(&arena_allocator, NULL) == 0);
+        assert(varlink_object_new_from_json(&object, document->json) == 0);
+        varlink_object_unref(object);
+        assert(varlink_set_thread_allocator(NULL, NULL) == 0);
+
+        arena.used = 0;
+}
+
+static void bench_serialize(Document *document) {
+        char *json;
+
+        assert(varlink_object_to_json(document->object, &json) >= 0);
+        free(json);
+}
+
+/* Serializes a reply message with the document as its parameters. */
+static void reply_serialize(VarlinkObject *parameters) {
+        VarlinkObject *message;
+        char *json;
+
+        assert(varlink_object_new(&message) == 0);
+        assert(varlink_object_set_object(message, "parameters", parameters) == 0);
+        assert(varlink_object_to_json(message, &json) >= 0);
+        free(json);
+        varlink_object_unref(message);
+}
+
+static void bench_reply(Document *document) {
+        reply_serialize(document->object);
+}
+
+static void bench_reply_frozen(Document *document) {
+        reply_serialize(document->frozen);
+}
+
+/*
+ * Runs @func on every document in @documents until the minimum time
+ * elapsed and prints the per-operation cost of one pass.
+ */
+static void bench_run(const char *name, const char *operation,
+                      Document *documents, unsigned long n_documents,
+                      BenchFunc func) {
+        unsigned long long start, elapsed;
+        unsigned long long allocations;
+        unsigned long long n_ops = 0;
+        size_t size = 0;
+
+        for (unsigned long i = 0; i < n_documents; i += 1)
+                size += documents[i].size;
+
+        /* Warm up caches and the allocator. */
+        for (unsigned long i = 0; i < n_documents; i += 1)
+                func(&documents[i]);
+
+        allocations = n_allocations;
+        start = now_nsec();
+        do {
+                for (unsigned long i = 0; i < n_documents; i += 1)
+                        func(&documents[i]);
+
+                n_ops += 1;
+                elapsed = now_nsec() - start;
+        } while (elapsed < BENCH_MIN_NSEC);
+        allocations = n_allocations - allocations;
+
+        printf("%-24s %-12s %12.0f %10.2f %12.1f\n",
+               name, operation,
+               (double)elapsed / n_ops,
+               (double)size * n_ops / ((double)elapsed / 1e9) / (1024 * 1024),
+               (double)allocations / n_ops);
+}
+
+int main(int argc, char **argv) {
+        Corpus synthetic = {};
+        Corpus suite = {};
+
+        arena.buffer = malloc(ARENA_SIZE);
+        assert(arena.buffer);
+        arena.size = ARENA_SIZE;
+
+        corpus_add_synthetic(&synthetic);
+        if (argc > 1)
+                corpus_add_directory(&suite, argv[1]);
+
+        printf("%-24s %-12s %12s %10s %12s\n", "document", "operation", "ns/op", "MB/s", "allocs/op");
+
+        for (unsigned long i = 0; i < synthetic.n_documents; i += 1) {
+                bench_run(synthetic.documents[i].name, "parse", &synthetic.documents[i], 1, bench_parse);
+                bench_run(synthetic.documents[i].name, "parse-arena", &synthetic.documents[i], 1, bench_parse_arena);
+                bench_run(synthetic.documents[i].name, "serialize", &synthetic.documents[i], 1, bench_serialize);
+                bench_run(synthetic.documents[i].name, "reply", &synthetic.documents[i], 1, bench_reply);
+                bench_run(synthetic.documents[i].name, "reply-frozen", &synthetic.documents[i], 1, bench_reply_frozen);
+        }
+
+        if (suite.n_documents > 0) {
+                bench_run("tests-json", "parse", suite.documents, suite.n_documents, bench_parse);
+                bench_run("tests-json", "parse-arena", suite.documents, suite.n_documents, bench_parse_arena);
+                bench_run("tests-json", "serialize", suite.documents, suite.n_documents, bench_serialize);
+        }
+
+        corpus_free(&synthetic);
+        corpus_free(&suite);
+        free(arena.buffer);
+
+        return EXIT_SUCCESS;
+}
@@ -0,0 +1,623 @@
+// SPDX-License-Identifier: Apache-2.0
+
+#include "varlink.h"
+#include "util.h"
+
+#include <arpa/inet.h>
+#include <assert.h>
+#include <errno.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <time.h>
+
+/*
+ * End-to-end throughput benchmarks: a VarlinkService driven by a number of
+ * VarlinkConnection clients, over UNIX and TCP sockets, with the service
+ * running in the same event loop as the clients or in a forked process.
+ *
+ * System calls are counted by linking with --wrap for the calls the
+ * library and this harness make, io_uring_enter() through syscall()
+ * included. The counters live in a shared mapping, so the forked service
+ * process reports into the same place.
+ *
+ * Every scenario runs with the service on epoll and on io_uring, when the
+ * kernel supports it. Each one runs in a process of its own, the peak RSS
+ * is a high-water mark over the lifetime of a process.
+ *
+ * Pass --json to print one JSON object per result instead of a table.
+ */
+
+ssize_t __real_read(int fd, void *buf, size_t count);
+ssize_t __real_write(int fd, const void *buf, size_t count);
+int __real_epoll_wait(int epfd, struct epoll_event *events, int maxevents, int timeout);
+int __real_epoll_ctl(int epfd, int op, int fd, struct epoll_event *event);
+int __real_accept4(int fd, struct sockaddr *addr, socklen_t *addrlen, int flags);
+int __real_connect(int fd, const struct sockaddr *addr, socklen_t addrlen);
+int __real_socket(int domain, int type, int protocol);
+int __real_close(int fd);
+long __real_syscall(long number, ...);
+
+ssize_t __wrap_read(int fd, void *buf, size_t count);
+ssize_t __wrap_write(int fd, const void *buf, size_t count);
+int __wrap_epoll_wait(int epfd, struct epoll_event *events, int maxevents, int timeout);
+int __wrap_epoll_ctl(int epfd, int op, int fd, struct epoll_event *event);
+int __wrap_accept4(int fd, struct sockaddr *addr, socklen_t *addrlen, int flags);
+int __wrap_connect(int fd, const struct sockaddr *addr, socklen_t addrlen);
+int __wrap_socket(int domain, int type, int protocol);
+int __wrap_close(int fd);
+long __wrap_syscall(long number, ...);
+
+/* One counter per process, the forked service uses the second one. */
+static unsigned long long *syscall_counters;
+static unsigned long syscall_counter_index;
+
+#define COUNT_SYSCALL() (syscall_counters ? syscall_counters[syscall_counter_index] += 1 : 0)
+
+ssize_t __wrap_read(int fd, void *buf, size_t count) {
+        COUNT_SYSCALL();
+        return __real_read(fd, buf, count);
+}
+
+ssize_t __wrap_write(int fd, const void *buf, size_t count) {
+        COUNT_SYSCALL();
+        return __real_write(fd, buf, count);
+}
+
+int __wrap_epoll_wait(int epfd, struct epoll_event *events, int maxevents, int timeout) {
+        COUNT_SYSCALL();
+        return __real_epoll_wait(epfd, events, maxevents, timeout);
+}
+
+int __wrap_epoll_ctl(int epfd, int op, int fd, struct epoll_event *event) {
+        COUNT_SYSCALL();
+        return __real_epoll_ctl(epfd, op, fd, event);
+}
+
+int __wrap_accept4(int fd, struct sockaddr *addr, socklen_t *addrlen, int flags) {
+        COUNT_SYSCALL();
+        return __real_accept4(fd, addr, addrlen, flags);
+}
+
+int __wrap_connect(int fd, const struct sockaddr *addr, socklen_t addrlen) {
+        COUNT_SYSCALL();
+        return __real_connect(fd, addr, addrlen);
+}
+
+int __wrap_socket(int domain, int type, int protocol) {
+        COUNT_SYSCALL();
+        return __real_socket(domain, type, protocol);
+}
+
+int __wrap_close(int fd) {
+        COUNT_SYSCALL();
+        return __real_close(fd);
+}
+
+long __wrap_syscall(long number, ...) {
+        va_list ap;
+        long args[6];
+
+        va_start(ap, number);
+        for (unsigned long i = 0; i < ARRAY_SIZE(args); i += 1)
+                args[i] = va_arg(ap, long);
+        va_end(ap);
+
+        COUNT_SYSCALL();
+        return __real_syscall(number, args[0], args[1], args[2], args[3], args[4], args[5]);
+}
+
+static const char *bench_interface =
+        "interface org.varlink.bench\n"
+        "method Ping() -> ()\n"
+        "method Echo(data: string) -> (data: string)\n"
+        "method Stream(n: int) -> (i: int)\n";
+
+typedef struct {
+        const char *name;
+        const char *method;
+        unsigned long n_clients;
+        unsigned long depth;            /* calls in flight per client */
+        unsigned long n_calls;          /* calls in total */
+        unsigned long n_replies;        /* replies per call, for "more" calls */
+        unsigned long payload;          /* bytes of data in each direction */
+        bool reconnect;                 /* use a new connection for every call */
+} Scenario;
+
+static const Scenario scenarios[] = {
+        { "small",     "org.varlink.bench.Echo",   16,  1,  20000,    1,              16, false },
+        { "pipelined", "org.varlink.bench.Echo",   16, 16, 100000,    1,              16, false },
+        { "large",     "org.varlink.bench.Echo",    4,  1,     40,    1, 1024 * 1024, false },
+        { "more",      "org.varlink.bench.Stream",  4,  1,     40, 1000,               0, false },
+        { "connect",   "org.varlink.bench.Ping",    4,  1,   2000,    1,               0, true },
+};
+
+typedef struct Bench Bench;
+
+typedef struct {
+        Bench *bench;
+        VarlinkConnection *connection;
+        uint32_t events;
+        unsigned long n_pending;
+} Client;
+
+struct Bench {
+        const Scenario *scenario;
+        unsigned long scale;
+        const char *address;
+        int epoll_fd;
+
+        /* NULL when the service runs in another process */
+        VarlinkService *service;
+
+        Client *clients;
+        VarlinkObject *parameters;
+        uint64_t call_flags;
+
+        unsigned long n_started;
+        unsigned long n_finished;
+        unsigned long n_replies;
+};
+
+static long service_Ping(VarlinkService *UNUSED(service),
+                         VarlinkCall *call,
+                         VarlinkObject *UNUSED(parameters),
+                         uint64_t UNUSED(flags),
+                         void *UNUSED(userdata)) {
+        return varlink_call_reply(call, NULL, 0);
+}
+
+static long service_Echo(VarlinkService *UNUSED(service),
+                         VarlinkCall *call,
+                         VarlinkObject *parameters,
+                         uint64_t UNUSED(flags),
+                         void *UNUSED(userdata)) {
+        return varlink_call_reply(call, parameters, 0);
+}
+
+static long service_Stream(VarlinkService *UNUSED(service),
+                           VarlinkCall *call,
+                           VarlinkObject *parameters,
+                           uint64_t flags,
+                           void *UNUSED(userdata)) {
+        _cleanup_(varlink_object_unrefp) VarlinkObject *out = NULL;
+        int64_t n;
+        long r;
+
+        if (varlink_object_get_int(parameters, "n", &n) < 0 || !(flags & VARLINK_CALL_MORE))
+                return varlink_call_reply_invalid_parameter(call, "n");
+
+        assert(varlink_object_new(&out) == 0);
+
+        for (int64_t i = 0; i < n; i += 1) {
+                assert(varlink_object_set_int(out, "i", i) == 0);
+
+                r = varlink_call_reply(call, out, i + 1 < n ? VARLINK_REPLY_CONTINUES : 0);
+                if (r < 0)
+                        return r;
+        }
+
+        return 0;
+}
+
+static VarlinkService *service_new(const char *address, int listen_fd, bool io_uring) {
+        VarlinkService *service;
+
+        assert(varlink_service_new(&service,
+                                   "Varlink", "Benchmark Service", VERSION, "https://varlink.org",
+                                   address, listen_fd) == 0);
+        assert(varlink_service_add_interface(service, bench_interface,
+                                             "Ping", service_Ping, NULL,
+                                             "Echo", service_Echo, NULL,
+                                             "Stream", service_Stream, NULL,
+                                             NULL) == 0);
+        assert(varlink_service_set_io_uring(service, io_uring) == 0);
+
+        return service;
+}
+
+__attribute__((noreturn))
+static void service_run(const char *address, int listen_fd, bool io_uring) {
+        VarlinkService *service = service_new(address, listen_fd, io_uring);
+
+        for (;;) {
+                struct pollfd pfd = {
+                        .fd = varlink_service_get_fd(service),
+                        .events = POLLIN
+                };
+
+                if (poll(&pfd, 1, -1) < 0 && errno != EINTR)
+                        _exit(EXIT_FAILURE);
+
+                if (varlink_service_process_events(service) < 0)
+                        _exit(EXIT_FAILURE);
+        }
+}
+
+static long reply_callback(VarlinkConnection *connection,
+                           const char *error,
+                           VarlinkObject *parameters,
+                           uint64_t flags,
+                           void *userdata);
+
+static void client_start_call(Client *client) {
+        Bench *bench = client->bench;
+
+        if (bench->n_started == bench->scenario->n_calls * bench->scale)
+                return;
+
+        assert(varlink_connection_call(client->connection,
+                                       bench->scenario->method,
+                                       bench->parameters,
+                                       bench->call_flags,
+                                       reply_callback, client) == 0);
+
+        bench->n_started += 1;
+        client->n_pending += 1;
+}
+
+static long reply_callback(VarlinkConnection *UNUSED(connection),
+                           const char *error,
+                           VarlinkObject *UNUSED(parameters),
+                           uint64_t flags,
+                           void *userdata) {
+        Client *client = userdata;
+        Bench *bench = client->bench;
+
+        assert(!error);
+
+        bench->n_replies += 1;
+
+        if (flags & VARLINK_REPLY_CONTINUES)
+                return 0;
+
+        client->n_pending -= 1;
+        bench->n_finished += 1;
+
+        /* Reconnecting clients are restarted from the main loop. */
+        if (!bench->scenario->reconnect)
+                client_start_call(client);
+
+        return 0;
+}
+
+static void client_update_events(Client *client) {
+        Bench *bench = client->bench;
+        uint32_t events = varlink_connection_get_events(client->connection);
+
+        if (events == client->events)
+                return;
+
+        assert(epoll_mod(bench->epoll_fd, varlink_connection_get_fd(client->connection), events, client) == 0);
+        client->events = events;
+}
+
+static void client_connect(Client *client) {
+        Bench *bench = client->bench;
+
+        assert(varlink_connection_new(&client->connection, bench->address) == 0);
+        client->events = 0;
+        assert(epoll_add(bench->epoll_fd, varlink_connection_get_fd(client->connection), 0, client) == 0);
+
+        for (unsigned long i = 0; i < bench->scenario->depth; i += 1)
+                client_start_call(client);
+
+        client_update_events(client);
+}
+
+static void bench_run_clients(Bench *bench) {
+        const Scenario *scenario = bench->scenario;
+
+        for (unsigned long i = 0; i < scenario->n_clients; i += 1) {
+                bench->clients[i].bench = bench;
+                client_connect(&bench->clients[i]);
+        }
+
+        while (bench->n_finished < scenario->n_calls * bench->scale) {
+                struct epoll_event events[64];
+                int n;
+
+                n = epoll_wait(bench->epoll_fd, events, ARRAY_SIZE(events), 10000);
+                if (n < 0 && errno == EINTR)
+                        continue;
+                assert(n > 0);
+
+                for (int i = 0; i < n; i += 1) {
+                        if (events[i].data.ptr == bench->service) {
+                                assert(varlink_service_process_events(bench->service) == 0);
+                        } else {
+                                Client *client = events[i].data.ptr;
+
+                                assert(varlink_connection_process_events(client->connection, events[i].events) == 0);
+                        }
+                }
+
+                for (unsigned long i = 0; i < scenario->n_clients; i += 1) {
+                        Client *client = &bench->clients[i];
+
+                        if (scenario->reconnect && client->n_pending == 0 &&
+                            bench->n_started < scenario->n_calls * bench->scale) {
+                                client->connection = varlink_connection_free(client->connection);
+                                client_connect(client);
+                        }
+
+                        client_update_events(client);
+                }
+        }
+
+        for (unsigned long i = 0; i < scenario->n_clients; i += 1)
+                varlink_connection_free(bench->clients[i].connection);
+}
+
+typedef struct {
+        const char *scenario;
+        const char *transport;
+        const char *mode;
+        const char *backend;
+        unsigned long n_clients;
+        unsigned long n_calls;
+        unsigned long n_replies;
+        double seconds;
+        double cpu_user;
+        double cpu_system;
+        long max_rss;
+        unsigned long long n_syscalls;
+        unsigned long long n_bytes;
+} Result;
+
+static double timeval_to_sec(struct timeval *tv) {
+        return (double)tv->tv_sec + (double)tv->tv_usec / 1e6;
+}
+
+static double now_sec(void) {
+        struct timespec ts;
+
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+
+        return (double)ts.tv_sec + (double)ts.tv_nsec / 1e9;
+}
+
+/*
+ * Returns a free address for @transport and a listening socket for it.
+ */
+static int bench_listen(const char *transport, unsigned long id, char **addressp) {
+        _cleanup_(freep) char *address = NULL;
+        int fd;
+
+        if (strcmp(transport, "unix") == 0) {
+                assert(asprintf(&address, "unix:@varlink-bench-%d-%lu", getpid(), id) >= 0);
+                fd = varlink_listen(address, NULL);
+                assert(fd >= 0);
+        } else {
+                struct sockaddr_in sa;
+                socklen_t sa_len = sizeof(sa);
+
+                fd = varlink_listen("tcp:127.0.0.1:0", NULL);
+                assert(fd >= 0);
+                assert(getsockname(fd, (struct sockaddr *)&sa, &sa_len) == 0);
+                assert(asprintf(&address, "tcp:127.0.0.1:%u", ntohs(sa.sin_port)) >= 0);
+        }
+
+        *addressp = address;
+        address = NULL;
+
+        return fd;
+}
+
+static void bench_scenario(const Scenario *scenario,
+                           const char *transport,
+                           bool fork_service,
+                           bool io_uring,
+                           unsigned long scale,
+                           unsigned long id,
+                           Result *result) {
+        _cleanup_(freep) char *address = NULL;
+        _cleanup_(freep) char *data = NULL;
+        struct rusage self_start, self_end, children_start, children_end;
+        Bench bench = {
+                .scenario = scenario,
+                .scale = scale
+        };
+        pid_t pid = 0;
+        int listen_fd;
+        double start;
+
+        listen_fd = bench_listen(transport, id, &address);
+        bench.address = address;
+
+        bench.epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+        assert(bench.epoll_fd >= 0);
+
+        if (fork_service) {
+                pid = fork();
+                assert(pid >= 0);
+
+                if (pid == 0) {
+                        syscall_counter_index = 1;
+                        service_run(address, listen_fd, io_uring);
+                }
+
+                close(listen_fd);
+        } else {
+                bench.service = service_new(address, listen_fd, io_uring);
+                assert(epoll_add(bench.epoll_fd, varlink_service_get_fd(bench.service), EPOLLIN, bench.service) == 0);
+        }
+
+        assert(varlink_object_new(&bench.parameters) == 0);
+        if (scenario->payload > 0) {
+                data = malloc(scenario->payload + 1);
+                assert(data);
+                memset(data, 'x', scenario->payload);
+                data[scenario->payload] = '\0';
+                assert(varlink_object_set_string(bench.parameters, "data", data) == 0);
+        }
+        if (scenario->n_replies > 1) {
+                assert(varlink_object_set_int(bench.parameters, "n", scenario->n_replies) == 0);
+                bench.call_flags = VARLINK_CALL_MORE;
+        }
+
+        bench.clients = calloc(scenario->n_clients, sizeof(Client));
+        assert(bench.clients);
+
+        syscall_counters[0] = 0;
+        syscall_counters[1] = 0;
+        getrusage(RUSAGE_SELF, &self_start);
+        getrusage(RUSAGE_CHILDREN, &children_start);
+        start = now_sec();
+
+        bench_run_clients(&bench);
+
+        result->seconds = now_sec() - start;
+
+        if (pid > 0) {
+                kill(pid, SIGTERM);
+                assert(waitpid(pid, NULL, 0) == pid);
+        }
+
+        getrusage(RUSAGE_SELF, &self_end);
+        getrusage(RUSAGE_CHILDREN, &children_end);
+
+        result->scenario = scenario->name;
+        result->transport = transport;
+        result->mode = fork_service ? "cross-process" : "in-process";
+        result->backend = io_uring ? "io_uring" : "epoll";
+        result->n_clients = scenario->n_clients;
+        result->n_calls = bench.n_finished;
+        result->n_replies = bench.n_replies;
+        result->cpu_user = timeval_to_sec(&self_end.ru_utime) - timeval_to_sec(&self_start.ru_utime) +
+                           timeval_to_sec(&children_end.ru_utime) - timeval_to_sec(&children_start.ru_utime);
+        result->cpu_system = timeval_to_sec(&self_end.ru_stime) - timeval_to_sec(&self_start.ru_stime) +
+                             timeval_to_sec(&children_end.ru_stime) - timeval_to_sec(&children_start.ru_stime);
+        result->max_rss = MAX(self_end.ru_maxrss, children_end.ru_maxrss);
+        result->n_syscalls = syscall_counters[0] + syscall_counters[1];
+        result->n_bytes = 2ULL * scenario->payload * bench.n_finished;
+
+        free(bench.clients);
+        varlink_object_unref(bench.parameters);
+        if (bench.service)
+                varlink_service_free(bench.service);
+        close(bench.epoll_fd);
+}
+
+/*
+ * Runs bench_scenario() in a child process, so the peak RSS it reports
+ * is the one of this scenario and not of all scenarios before it.
+ */
+static void bench_scenario_forked(const Scenario *scenario,
+                                  const char *transport,
+                                  bool fork_service,
+                                  bool io_uring,
+                                  unsigned long scale,
+                                  unsigned long id,
+                                  Result *result) {
+        Result *shared;
+        pid_t pid;
+        int status;
+
+        shared = mmap(NULL, sizeof(Result), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+        assert(shared != MAP_FAILED);
+
+        pid = fork();
+        assert(pid >= 0);
+
+        if (pid == 0) {
+                bench_scenario(scenario, transport, fork_service, io_uring, scale, id, shared);
+                _exit(EXIT_SUCCESS);
+        }
+
+        assert(waitpid(pid, &status, 0) == pid);
+        assert(WIFEXITED(status) && WEXITSTATUS(status) == EXIT_SUCCESS);
+
+        *result = *shared;
+        munmap(shared, sizeof(Result));
+}
+
+static void result_print(Result *result, bool json) {
+        double ops_per_sec = result->n_replies / result->seconds;
+        double cpu_usec_per_op = (result->cpu_user + result->cpu_system) * 1e6 / result->n_replies;
+        double syscalls_per_call = (double)result->n_syscalls / result->n_calls;
+        double mb_per_sec = result->n_bytes / result->seconds / (1024 * 1024);
+
+        if (json) {
+                _cleanup_(varlink_object_unrefp) VarlinkObject *object = NULL;
+                _cleanup_(freep) char *string = NULL;
+
+                assert(varlink_object_new(&object) == 0);
+                varlink_object_set_string(object, "version", VERSION);
+                varlink_object_set_string(object, "scenario", result->scenario);
+                varlink_object_set_string(object, "transport", result->transport);
+                varlink_object_set_string(object, "mode", result->mode);
+                varlink_object_set_string(object, "backend", result->backend);
+                varlink_object_set_int(object, "clients", result->n_clients);
+                varlink_object_set_int(object, "calls", result->n_calls);
+                varlink_object_set_int(object, "replies", result->n_replies);
+                varlink_object_set_float(object, "seconds", result->seconds);
+                varlink_object_set_float(object, "ops_per_sec", ops_per_sec);
+                varlink_object_set_float(object, "mb_per_sec", mb_per_sec);
+                varlink_object_set_float(object, "cpu_user_sec", result->cpu_user);
+                varlink_object_set_float(object, "cpu_system_sec", result->cpu_system);
+                varlink_object_set_float(object, "cpu_usec_per_op", cpu_usec_per_op);
+                varlink_object_set_int(object, "max_rss_kb", result->max_rss);
+                varlink_object_set_float(object, "syscalls_per_call", syscalls_per_call);
+
+                assert(varlink_object_to_json(object, &string) >= 0);
+                printf("%s\n", string);
+        } else
+                printf("%-10s %-5s %-13s %-8s %12.0f %10.2f %12.2f %10ld %12.2f\n",
+                       result->scenario, result->transport, result->mode, result->backend,
+                       ops_per_sec, mb_per_sec, cpu_usec_per_op, result->max_rss, syscalls_per_call);
+
+        fflush(stdout);
+}
+
+int main(int argc, char **argv) {
+        static const char *transports[] = { "unix", "tcp" };
+        unsigned long scale = 1;
+        bool json = false;
+        unsigned long id = 0;
+
+        for (int i = 1; i < argc; i += 1) {
+                if (strcmp(argv[i], "--json") == 0)
+                        json = true;
+                else if (strncmp(argv[i], "--scale=", 8) == 0)
+                        scale = MAX(strtoul(argv[i] + 8, NULL, 10), 1UL);
+                else {
+                        fprintf(stderr, "Usage: %s [--json] [--scale=N]\n", argv[0]);
+                        return EXIT_FAILURE;
+                }
+        }
+
+        signal(SIGPIPE, SIG_IGN);
+
+        syscall_counters = mmap(NULL, 2 * sizeof(unsigned long long), PROT_READ | PROT_WRITE,
+                                MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+        assert(syscall_counters != MAP_FAILED);
+
+        if (!json)
+                printf("%-10s %-5s %-13s %-8s %12s %10s %12s %10s %12s\n",
+                       "scenario", "proto", "mode", "backend", "ops/s", "MB/s", "cpu-us/op", "rss-kb", "syscalls/call");
+
+        for (unsigned long t = 0; t < ARRAY_SIZE(transports); t += 1) {
+                for (int fork_service = 0; fork_service < 2; fork_service += 1) {
+                        for (unsigned long s = 0; s < ARRAY_SIZE(scenarios); s += 1) {
+                                for (int io_uring = 0; io_uring < 2; io_uring += 1) {
+                                        Result result = {};
+
+                                        bench_scenario_forked(&scenarios[s], transports[t], fork_service, io_uring,
+                                                              scale, id++, &result);
+                                        result_print(&result, json);
+                                }
+                        }
+                }
+        }
+
+        return EXIT_SUCCESS;
+}
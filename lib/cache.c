@@ -0,0 +1,329 @@
+// SPDX-License-Identifier: Apache-2.0
+
+#include "alloc.h"
+#include "cache.h"
+#include "util.h"
+
+#include <string.h>
+
+typedef struct {
+        char *method;
+        uint64_t ttl_usec;
+} CacheMethod;
+
+static long method_compare(const void *key, void *value) {
+        CacheMethod *method = value;
+
+        return strcmp(key, method->method);
+}
+
+static void method_freep(void *ptr) {
+        CacheMethod *method = *(void **)ptr;
+
+        varlink_free(method->method);
+        varlink_free(method);
+}
+
+static long entry_compare(const void *key, void *value) {
+        VarlinkCacheEntry *entry = value;
+
+        return strcmp(key, entry->key);
+}
+
+static void entry_freep(void *ptr) {
+        VarlinkCacheEntry *entry = *(void **)ptr;
+
+        if (entry->object)
+                varlink_object_unref(entry->object);
+
+        varlink_free(entry->key);
+        free(entry->json);
+        varlink_free(entry);
+}
+
+static unsigned long entry_get_size(VarlinkCacheEntry *entry) {
+        return sizeof(VarlinkCacheEntry) + strlen(entry->key) + 1 + entry->length + 1;
+}
+
+static bool cache_is_full(VarlinkCache *cache) {
+        if (cache->n_bytes > cache->max_bytes)
+                return true;
+
+        return cache->max_entries > 0 && avl_tree_get_n_elements(cache->entries) > cache->max_entries;
+}
+
+static void cache_remove(VarlinkCache *cache, VarlinkCacheEntry *entry) {
+        TAILQ_REMOVE(&cache->lru, entry, lru);
+        cache->n_bytes -= entry_get_size(entry);
+
+        /* Frees the entry. */
+        avl_tree_remove(cache->entries, entry->key);
+}
+
+long varlink_cache_new(VarlinkCache **cachep, unsigned long max_bytes) {
+        _cleanup_(varlink_cache_freep) VarlinkCache *cache = NULL;
+
+        cache = varlink_calloc(1, sizeof(VarlinkCache));
+        if (!cache)
+                return -VARLINK_ERROR_PANIC;
+
+        TAILQ_INIT(&cache->lru);
+        cache->max_bytes = max_bytes;
+
+        if (avl_tree_new(&cache->methods, method_compare, method_freep) < 0)
+                return -VARLINK_ERROR_PANIC;
+
+        if (avl_tree_new(&cache->entries, entry_compare, entry_freep) < 0)
+                return -VARLINK_ERROR_PANIC;
+
+        *cachep = cache;
+        cache = NULL;
+
+        return 0;
+}
+
+VarlinkCache *varlink_cache_free(VarlinkCache *cache) {
+        if (cache->entries)
+                avl_tree_free(cache->entries);
+
+        if (cache->methods)
+                avl_tree_free(cache->methods);
+
+        varlink_free(cache);
+
+        return NULL;
+}
+
+void varlink_cache_freep(VarlinkCache **cachep) {
+        if (*cachep)
+                varlink_cache_free(*cachep);
+}
+
+void varlink_cache_set_size(VarlinkCache *cache, unsigned long max_bytes) {
+        cache->max_bytes = max_bytes;
+
+        while (cache_is_full(cache)) {
+                cache_remove(cache, TAILQ_LAST(&cache->lru, lru));
+                cache->n_evictions += 1;
+        }
+}
+
+long varlink_cache_set_method(VarlinkCache *cache, const char *name, uint64_t ttl_usec) {
+        CacheMethod *method;
+
+        method = avl_tree_find(cache->methods, name);
+
+        if (ttl_usec == 0) {
+                if (method) {
+                        varlink_cache_invalidate(cache, name, NULL);
+                        avl_tree_remove(cache->methods, name);
+                }
+
+                return 0;
+        }
+
+        if (!method) {
+                method = varlink_calloc(1, sizeof(CacheMethod));
+                if (!method)
+                        return -VARLINK_ERROR_PANIC;
+
+                method->method = varlink_strdup(name);
+                if (!method->method) {
+                        varlink_free(method);
+                        return -VARLINK_ERROR_PANIC;
+                }
+
+                if (avl_tree_insert(cache->methods, method->method, method) < 0) {
+                        method_freep(&method);
+                        return -VARLINK_ERROR_PANIC;
+                }
+        }
+
+        method->ttl_usec = ttl_usec;
+
+        return 0;
+}
+
+uint64_t varlink_cache_get_ttl(VarlinkCache *cache, const char *name) {
+        CacheMethod *method;
+
+        method = avl_tree_find(cache->methods, name);
+        if (!method)
+                return 0;
+
+        return method->ttl_usec;
+}
+
+long varlink_cache_key_new(const char *method, VarlinkObject *parameters, char **keyp) {
+        _cleanup_(freep) char *json = NULL;
+        unsigned long method_length;
+        long length;
+        char *key;
+
+        if (parameters) {
+                length = varlink_object_to_json(parameters, &json);
+                if (length < 0)
+                        return length;
+        } else
+                length = 0;
+
+        method_length = strlen(method);
+
+        key = varlink_malloc(method_length + 1 + (length > 0 ? length : 2) + 1);
+        if (!key)
+                return -VARLINK_ERROR_PANIC;
+
+        /* Omitted parameters are the same as an empty object. */
+        memcpy(key, method, method_length);
+        key[method_length] = ' ';
+        strcpy(key + method_length + 1, length > 0 ? json : "{}");
+
+        *keyp = key;
+
+        return 0;
+}
+
+VarlinkCacheEntry *varlink_cache_lookup(VarlinkCache *cache, const char *key) {
+        VarlinkCacheEntry *entry;
+
+        entry = avl_tree_find(cache->entries, key);
+        if (entry && entry->expires_usec + cache->stale_usec <= now_usec()) {
+                cache_remove(cache, entry);
+                entry = NULL;
+        }
+
+        if (!entry) {
+                cache->n_misses += 1;
+                return NULL;
+        }
+
+        TAILQ_REMOVE(&cache->lru, entry, lru);
+        TAILQ_INSERT_HEAD(&cache->lru, entry, lru);
+        cache->n_hits += 1;
+
+        return entry;
+}
+
+/*
+ * Takes ownership of @entry and inserts it, replacing the one with the
+ * same key.
+ */
+static long cache_insert(VarlinkCache *cache, VarlinkCacheEntry *entry, uint64_t ttl_usec) {
+        VarlinkCacheEntry *old;
+        unsigned long size;
+
+        old = avl_tree_find(cache->entries, entry->key);
+        if (old)
+                cache_remove(cache, old);
+
+        entry->expires_usec = now_usec() + ttl_usec;
+
+        /* Replies which would evict everything else are not worth keeping. */
+        size = entry_get_size(entry);
+        if (size > cache->max_bytes) {
+                entry_freep(&entry);
+                return 0;
+        }
+
+        if (avl_tree_insert(cache->entries, entry->key, entry) < 0) {
+                entry_freep(&entry);
+                return -VARLINK_ERROR_PANIC;
+        }
+
+        TAILQ_INSERT_HEAD(&cache->lru, entry, lru);
+        cache->n_bytes += size;
+
+        while (cache_is_full(cache)) {
+                cache_remove(cache, TAILQ_LAST(&cache->lru, lru));
+                cache->n_evictions += 1;
+        }
+
+        return 0;
+}
+
+static VarlinkCacheEntry *cache_entry_new(const char *key) {
+        VarlinkCacheEntry *entry;
+
+        entry = varlink_calloc(1, sizeof(VarlinkCacheEntry));
+        if (!entry)
+                return NULL;
+
+        entry->key = varlink_strdup(key);
+        if (!entry->key) {
+                varlink_free(entry);
+                return NULL;
+        }
+
+        return entry;
+}
+
+long varlink_cache_store(VarlinkCache *cache,
+                         const char *key,
+                         uint64_t ttl_usec,
+                         uint64_t hint_usec,
+                         char *json,
+                         unsigned long length) {
+        _cleanup_(freep) char *json_owned = json;
+        VarlinkCacheEntry *entry;
+
+        entry = cache_entry_new(key);
+        if (!entry)
+                return -VARLINK_ERROR_PANIC;
+
+        entry->json = json_owned;
+        json_owned = NULL;
+        entry->length = length;
+
+        if (hint_usec > 0)
+                entry->hint_expires_usec = now_usec() + hint_usec;
+
+        return cache_insert(cache, entry, ttl_usec);
+}
+
+long varlink_cache_store_object(VarlinkCache *cache,
+                                const char *key,
+                                uint64_t ttl_usec,
+                                VarlinkObject *object) {
+        VarlinkCacheEntry *entry;
+
+        entry = cache_entry_new(key);
+        if (!entry)
+                return -VARLINK_ERROR_PANIC;
+
+        entry->object = varlink_object_ref(object);
+
+        return cache_insert(cache, entry, ttl_usec);
+}
+
+void varlink_cache_invalidate(VarlinkCache *cache, const char *method, const char *key) {
+        cache->generation += 1;
+
+        if (key) {
+                VarlinkCacheEntry *entry;
+
+                entry = avl_tree_find(cache->entries, key);
+                if (entry)
+                        cache_remove(cache, entry);
+
+                return;
+        }
+
+        if (method) {
+                unsigned long method_length = strlen(method);
+                VarlinkCacheEntry *entry = TAILQ_FIRST(&cache->lru);
+
+                while (entry) {
+                        VarlinkCacheEntry *next = TAILQ_NEXT(entry, lru);
+
+                        if (strncmp(entry->key, method, method_length) == 0 && entry->key[method_length] == ' ')
+                                cache_remove(cache, entry);
+
+                        entry = next;
+                }
+
+                return;
+        }
+
+        while (!TAILQ_EMPTY(&cache->lru))
+                cache_remove(cache, TAILQ_FIRST(&cache->lru));
+}
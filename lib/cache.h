@@ -0,0 +1,126 @@
+// SPDX-License-Identifier: Apache-2.0
+
+#pragma once
+
+#include "avltree.h"
+#include "varlink.h"
+
+#include <sys/queue.h>
+
+/* Used when a service enables its cache without giving a size. */
+#define VARLINK_CACHE_DEFAULT_SIZE (4 * 1024 * 1024)
+
+/* Used when a connection enables its cache without giving a size. */
+#define VARLINK_CACHE_DEFAULT_ENTRIES 1024
+
+typedef struct VarlinkCache VarlinkCache;
+typedef struct VarlinkCacheEntry VarlinkCacheEntry;
+
+/*
+ * A reply, serialized for services and parsed for clients. The key is
+ * the method name and the canonical JSON of the call's parameters,
+ * separated by a space; objects write their fields in sorted order, so
+ * equal parameters always give equal keys.
+ */
+struct VarlinkCacheEntry {
+        char *key;
+        char *json;
+        unsigned long length;
+        VarlinkObject *object;
+        uint64_t expires_usec;
+
+        /*
+         * Until when clients may keep a serialized reply. It is not part
+         * of the JSON, a hit advertises what is left of it.
+         */
+        uint64_t hint_expires_usec;
+
+        /* A client asked the service for a fresh reply. */
+        bool revalidating;
+
+        TAILQ_ENTRY(VarlinkCacheEntry) lru;
+};
+
+/*
+ * Replies of idempotent methods, evicted in least recently used order
+ * when they need more than @max_bytes or there are more than
+ * @max_entries of them. Only touched from the thread running the event
+ * loop of the service or connection.
+ */
+struct VarlinkCache {
+        AVLTree *methods;
+        AVLTree *entries;
+        TAILQ_HEAD(lru, VarlinkCacheEntry) lru;
+
+        unsigned long n_bytes;
+        unsigned long max_bytes;
+        unsigned long max_entries;
+
+        /* How long expired entries are still returned, while they are refreshed. */
+        uint64_t stale_usec;
+
+        /* Bumped on every invalidation, replies of older calls are not stored. */
+        uint64_t generation;
+
+        uint64_t n_hits;
+        uint64_t n_misses;
+        uint64_t n_evictions;
+};
+
+long varlink_cache_new(VarlinkCache **cachep, unsigned long max_bytes);
+VarlinkCache *varlink_cache_free(VarlinkCache *cache);
+void varlink_cache_freep(VarlinkCache **cachep);
+
+/*
+ * Evict entries until the cache fits into @max_bytes.
+ */
+void varlink_cache_set_size(VarlinkCache *cache, unsigned long max_bytes);
+
+/*
+ * Cache replies of @method for @ttl_usec microseconds, or stop caching
+ * them if @ttl_usec is 0.
+ */
+long varlink_cache_set_method(VarlinkCache *cache, const char *method, uint64_t ttl_usec);
+
+/*
+ * Returns how long replies of @method are cached, or 0 if they are not.
+ */
+uint64_t varlink_cache_get_ttl(VarlinkCache *cache, const char *method);
+
+/*
+ * Build the key which identifies a call of @method with @parameters,
+ * for the cache and for coalescing identical calls.
+ */
+long varlink_cache_key_new(const char *method, VarlinkObject *parameters, char **keyp);
+
+/*
+ * Returns the entry for @key, or NULL if there is none or it expired
+ * longer than the stale period ago.
+ */
+VarlinkCacheEntry *varlink_cache_lookup(VarlinkCache *cache, const char *key);
+
+/*
+ * Store the serialized reply @json, which was allocated by
+ * varlink_object_to_json(), for @key. Clients may keep it for
+ * @hint_usec, its "ttl" is not part of @json. Takes ownership of @json.
+ */
+long varlink_cache_store(VarlinkCache *cache,
+                         const char *key,
+                         uint64_t ttl_usec,
+                         uint64_t hint_usec,
+                         char *json,
+                         unsigned long length);
+
+/*
+ * Store the parsed reply @object for @key, taking a reference.
+ */
+long varlink_cache_store_object(VarlinkCache *cache,
+                                const char *key,
+                                uint64_t ttl_usec,
+                                VarlinkObject *object);
+
+/*
+ * Drop the entries for @key, all entries of @method if @key is NULL, or
+ * all entries if both are NULL.
+ */
+void varlink_cache_invalidate(VarlinkCache *cache, const char *method, const char *key);
@@ -1,16 +1,23 @@
 // SPDX-License-Identifier: Apache-2.0
 
+#include "alloc.h"
+#include "cache.h"
 #include "connection.h"
+#include "coroutine.h"
 #include "message.h"
+#include "probe.h"
 #include "stream.h"
+#include "trace.h"
 #include "transport.h"
 #include "uri.h"
 #include "util.h"
 
+#include <limits.h>
 #include <stdbool.h>
 #include <stddef.h>
 #include <stdint.h>
 #include <stdlib.h>
+#include <string.h>
 #include <sys/epoll.h>
 #include <sys/queue.h>
 
@@ -21,6 +28,15 @@ struct ReplyCallback {
         VarlinkReplyFunc func;
         void *userdata;
 
+        /* Called instead of func if the connection goes away before the last reply. */
+        void (*closed)(void *userdata);
+
+        VarlinkSpan span;
+
+        /* Set if the reply goes into the cache; calls which only refresh it have no func. */
+        char *cache_key;
+        uint64_t cache_generation;
+
         STAILQ_ENTRY(ReplyCallback) entry;
 };
 
@@ -29,9 +45,18 @@ struct VarlinkConnection {
         uint32_t events;
 
         STAILQ_HEAD(pending, ReplyCallback) pending;
+        unsigned long n_pending;
+
+        VarlinkCache *cache;
 
         VarlinkConnectionClosedFunc closed_callback;
         void *closed_userdata;
+
+        VarlinkConnectionEventsFunc events_callback;
+        void *events_userdata;
+
+        /* The "ttl" of the reply passed to a reply callback, while it runs. */
+        uint64_t reply_ttl_usec;
 };
 
 long varlink_connection_bridge(int signal_fd, VarlinkStream *client_in, VarlinkStream *client_out,
@@ -44,7 +69,7 @@ long varlink_connection_new_from_fd(VarlinkConnection **connectionp, int fd) {
         _cleanup_(varlink_connection_freep) VarlinkConnection *connection = NULL;
         long r;
 
-        connection = calloc(1, sizeof(VarlinkConnection));
+        connection = varlink_calloc(1, sizeof(VarlinkConnection));
         if (!connection)
                 return -VARLINK_ERROR_PANIC;
 
@@ -54,6 +79,8 @@ long varlink_connection_new_from_fd(VarlinkConnection **connectionp, int fd) {
         if (r < 0)
                 return r;
 
+        VARLINK_PROBE(connection__open, fd);
+
         *connectionp = connection;
         connection = NULL;
 
@@ -91,19 +118,50 @@ _public_ long varlink_connection_new(VarlinkConnection **connectionp, const char
         return 0;
 }
 
+static void connection_notify_events(VarlinkConnection *connection) {
+        if (connection->events_callback)
+                connection->events_callback(connection, connection->events_userdata);
+}
+
+/*
+ * Tells the calls which wait for a reply that it will not come. They stay
+ * in the queue until the connection is freed.
+ */
+static void connection_notify_closed(VarlinkConnection *connection) {
+        ReplyCallback *cb;
+
+        STAILQ_FOREACH(cb, &connection->pending, entry) {
+                void (*closed)(void *userdata) = cb->closed;
+
+                if (!closed)
+                        continue;
+
+                cb->closed = NULL;
+                cb->func = NULL;
+                closed(cb->userdata);
+        }
+}
+
 _public_ VarlinkConnection *varlink_connection_free(VarlinkConnection *connection) {
         if (connection->stream)
                 varlink_connection_close(connection);
 
+        connection_notify_closed(connection);
+
         while (!STAILQ_EMPTY(&connection->pending)) {
                 ReplyCallback *cb;
 
                 cb = STAILQ_FIRST(&connection->pending);
                 STAILQ_REMOVE_HEAD(&connection->pending, entry);
-                free(cb);
+                varlink_span_end(&cb->span, true);
+                varlink_free(cb->cache_key);
+                varlink_free(cb);
         }
 
-        free(connection);
+        if (connection->cache)
+                varlink_cache_free(connection->cache);
+
+        varlink_free(connection);
 
         return NULL;
 }
@@ -113,6 +171,32 @@ _public_ void varlink_connection_freep(VarlinkConnection **connectionp) {
                 varlink_connection_free(*connectionp);
 }
 
+/*
+ * Keeps the reply to a cached call if the service advertised how long it
+ * stays valid, unless the cache was invalidated since the call was made.
+ */
+static void connection_cache_reply(VarlinkConnection *connection,
+                                   ReplyCallback *callback,
+                                   const char *error,
+                                   VarlinkObject *parameters,
+                                   uint64_t ttl_usec) {
+        VarlinkCache *cache = connection->cache;
+        VarlinkCacheEntry *entry;
+
+        if (!cache || callback->cache_generation != cache->generation)
+                return;
+
+        if (!error && ttl_usec > 0) {
+                varlink_cache_store_object(cache, callback->cache_key, ttl_usec, parameters);
+                return;
+        }
+
+        /* The stale entry stays until it is gone for good, or another refresh works. */
+        entry = avl_tree_find(cache->entries, callback->cache_key);
+        if (entry)
+                entry->revalidating = false;
+}
+
 _public_ long varlink_connection_process_events(VarlinkConnection *connection, uint32_t events) {
         long r;
 
@@ -132,9 +216,10 @@ _public_ long varlink_connection_process_events(VarlinkConnection *connection, u
         /* Check if the stream is valid, because a callback might have closed the connection */
         for (;;) {
                 _cleanup_(varlink_object_unrefp) VarlinkObject *message = NULL;
-                _cleanup_(freep) char *error = NULL;
+                _cleanup_(varlink_freep) char *error = NULL;
                 _cleanup_(varlink_object_unrefp) VarlinkObject *parameters = NULL;
                 uint64_t flags = 0;
+                uint64_t ttl_usec = 0;
                 ReplyCallback *callback;
 
                 r = varlink_stream_read(connection->stream, &message);
@@ -143,6 +228,8 @@ _public_ long varlink_connection_process_events(VarlinkConnection *connection, u
 
                 if (connection->stream->hup) {
                         connection->stream = varlink_stream_free(connection->stream);
+                        connection_notify_closed(connection);
+                        connection_notify_events(connection);
                         return -VARLINK_ERROR_CONNECTION_CLOSED;
                 }
 
@@ -153,18 +240,31 @@ _public_ long varlink_connection_process_events(VarlinkConnection *connection, u
                 if (!callback)
                         return -VARLINK_ERROR_INVALID_MESSAGE;
 
-                r = varlink_message_unpack_reply(message, &error, &parameters, &flags);
+                r = varlink_message_unpack_reply(message, &error, &parameters, &flags, &ttl_usec);
                 if (r < 0)
                         return -VARLINK_ERROR_INVALID_MESSAGE;
 
                 if ((flags & VARLINK_REPLY_CONTINUES) && !(callback->call_flags & VARLINK_CALL_MORE))
                         return -VARLINK_ERROR_INVALID_MESSAGE;
 
-                r = callback->func(connection, error, parameters, flags, callback->userdata);
+                VARLINK_PROBE(connection__reply, connection->stream->fd, error, flags);
+
+                if (callback->cache_key)
+                        connection_cache_reply(connection, callback, error, parameters, ttl_usec);
+
+                r = 0;
+                if (callback->func) {
+                        connection->reply_ttl_usec = ttl_usec;
+                        r = callback->func(connection, error, parameters, flags, callback->userdata);
+                        connection->reply_ttl_usec = 0;
+                }
 
                 if (!(flags & VARLINK_REPLY_CONTINUES)) {
                         STAILQ_REMOVE_HEAD(&connection->pending, entry);
-                        free(callback);
+                        connection->n_pending -= 1;
+                        varlink_span_end(&callback->span, error != NULL);
+                        varlink_free(callback->cache_key);
+                        varlink_free(callback);
                 }
 
                 if (r < 0)
@@ -185,8 +285,21 @@ _public_ uint32_t varlink_connection_get_events(VarlinkConnection *connection) {
         return connection->events;
 }
 
+_public_ long varlink_connection_get_stats(VarlinkConnection *connection, VarlinkConnectionStats *stats) {
+        if (!connection->stream)
+                return -VARLINK_ERROR_CONNECTION_CLOSED;
+
+        varlink_stream_get_stats(connection->stream, stats);
+        stats->n_calls_in_flight = connection->n_pending;
+
+        return 0;
+}
+
 _public_ long varlink_connection_close(VarlinkConnection *connection) {
+        VARLINK_PROBE(connection__close, connection->stream->fd);
         connection->stream = varlink_stream_free(connection->stream);
+        connection_notify_closed(connection);
+        connection_notify_events(connection);
 
         if (connection->closed_callback)
                 connection->closed_callback(connection, connection->closed_userdata);
@@ -205,45 +318,293 @@ _public_ int varlink_connection_get_fd(VarlinkConnection *connection) {
         return connection->stream->fd;
 }
 
-_public_ long varlink_connection_call(VarlinkConnection *connection,
-                                      const char *qualified_method,
-                                      VarlinkObject *parameters,
-                                      uint64_t flags,
-                                      VarlinkReplyFunc func,
-                                      void *userdata) {
+/*
+ * Sends the call. Takes ownership of @cache_key, which is set if the
+ * reply should go into the cache.
+ */
+static long connection_send_call(VarlinkConnection *connection,
+                                 const char *qualified_method,
+                                 VarlinkObject *parameters,
+                                 uint64_t flags,
+                                 VarlinkReplyFunc func,
+                                 void (*closed)(void *userdata),
+                                 void *userdata,
+                                 char *cache_key) {
+        _cleanup_(varlink_freep) char *key = cache_key;
         _cleanup_(varlink_object_unrefp) VarlinkObject *call = NULL;
         ReplyCallback *callback;
+        const VarlinkSpan *parent;
+        VarlinkSpan span = {};
+        char traceparent[VARLINK_TRACEPARENT_LENGTH + 1];
         long r;
 
-        if (!connection->stream)
-                return -VARLINK_ERROR_CONNECTION_CLOSED;
-
-        if (flags & VARLINK_CALL_MORE && flags & VARLINK_CALL_ONEWAY)
-                return -VARLINK_ERROR_INVALID_CALL;
+        parent = varlink_trace_get_current();
+        if (parent) {
+                varlink_span_start(&span, parent, true, qualified_method);
+                varlink_trace_format(&span, traceparent);
+        }
 
-        r = varlink_message_pack_call(qualified_method, parameters, flags, &call);
-        if (r < 0)
+        r = varlink_message_pack_call(qualified_method, parameters, flags, parent ? traceparent : NULL, &call);
+        if (r < 0) {
+                varlink_span_end(&span, true);
                 return r;
+        }
+
+        VARLINK_PROBE(connection__call, connection->stream->fd, qualified_method, flags);
 
         if (!(flags & VARLINK_CALL_ONEWAY)) {
-                callback = calloc(1, sizeof(ReplyCallback));
+                callback = varlink_calloc(1, sizeof(ReplyCallback));
                 callback->call_flags = flags;
                 callback->func = func;
+                callback->closed = closed;
                 callback->userdata = userdata;
+                callback->span = span;
+                callback->cache_key = key;
+                key = NULL;
+                if (connection->cache)
+                        callback->cache_generation = connection->cache->generation;
                 STAILQ_INSERT_TAIL(&connection->pending, callback, entry);
+                connection->n_pending += 1;
 
                 /* Subscribe to replies. */
                 connection->events |= EPOLLIN;
         }
 
         r = varlink_stream_write(connection->stream, call);
-        if (r < 0)
+        if (r < 0) {
+                if (flags & VARLINK_CALL_ONEWAY)
+                        varlink_span_end(&span, true);
+                else {
+                        /* Nobody waits for a reply to a call which was never sent. */
+                        STAILQ_REMOVE(&connection->pending, callback, ReplyCallback, entry);
+                        connection->n_pending -= 1;
+                        varlink_span_end(&callback->span, true);
+                        varlink_free(callback->cache_key);
+                        varlink_free(callback);
+                }
+
                 return r;
+        }
+
+        /* Nothing will answer, the span ends with sending the call. */
+        if (flags & VARLINK_CALL_ONEWAY)
+                varlink_span_end(&span, false);
 
         /* We did not write the entire message. */
         if (r == 0)
                 connection->events |= EPOLLOUT;
 
+        connection_notify_events(connection);
+
+        return 0;
+}
+
+static long connection_call(VarlinkConnection *connection,
+                            const char *qualified_method,
+                            VarlinkObject *parameters,
+                            uint64_t flags,
+                            VarlinkReplyFunc func,
+                            void (*closed)(void *userdata),
+                            void *userdata) {
+        _cleanup_(varlink_freep) char *key = NULL;
+        _cleanup_(varlink_object_unrefp) VarlinkObject *reply = NULL;
+        VarlinkCacheEntry *entry;
+        long r;
+
+        if (!connection->stream)
+                return -VARLINK_ERROR_CONNECTION_CLOSED;
+
+        if (flags & VARLINK_CALL_MORE && flags & VARLINK_CALL_ONEWAY)
+                return -VARLINK_ERROR_INVALID_CALL;
+
+        if (!connection->cache || flags != 0)
+                return connection_send_call(connection, qualified_method, parameters, flags,
+                                            func, closed, userdata, NULL);
+
+        r = varlink_cache_key_new(qualified_method, parameters, &key);
+        if (r < 0)
+                return r;
+
+        entry = varlink_cache_lookup(connection->cache, key);
+        if (!entry) {
+                r = connection_send_call(connection, qualified_method, parameters, flags,
+                                         func, closed, userdata, key);
+                key = NULL;
+                return r;
+        }
+
+        /* Answer from the stale entry, while a single call in the background refreshes it. */
+        if (entry->expires_usec <= now_usec() && !entry->revalidating) {
+                entry->revalidating = true;
+
+                r = connection_send_call(connection, qualified_method, parameters, flags, NULL, NULL, NULL, key);
+                key = NULL;
+                if (r < 0)
+                        return r;
+        }
+
+        /* The callback might invalidate the entry. */
+        reply = varlink_object_ref(entry->object);
+
+        VARLINK_PROBE(connection__reply, connection->stream->fd, NULL, 0);
+
+        r = func(connection, NULL, reply, 0, userdata);
+        if (r < 0)
+                return r;
+
+        return 0;
+}
+
+_public_ long varlink_connection_call(VarlinkConnection *connection,
+                                      const char *qualified_method,
+                                      VarlinkObject *parameters,
+                                      uint64_t flags,
+                                      VarlinkReplyFunc func,
+                                      void *userdata) {
+        return connection_call(connection, qualified_method, parameters, flags, func, NULL, userdata);
+}
+
+/*
+ * The reply to a call made from a coroutine. It is owned by the
+ * coroutine while that waits, and by the connection if the coroutine
+ * was freed before the reply arrived.
+ */
+typedef struct {
+        Coroutine *coroutine;
+        bool done;
+        long result;
+        char *error;
+        VarlinkObject *parameters;
+} Awaiter;
+
+static Awaiter *awaiter_free(Awaiter *awaiter) {
+        free(awaiter->error);
+
+        if (awaiter->parameters)
+                varlink_object_unref(awaiter->parameters);
+
+        varlink_free(awaiter);
+
+        return NULL;
+}
+
+static long await_reply(VarlinkConnection *UNUSED(connection),
+                        const char *error,
+                        VarlinkObject *parameters,
+                        uint64_t UNUSED(flags),
+                        void *userdata) {
+        Awaiter *awaiter = userdata;
+
+        if (!awaiter->coroutine) {
+                awaiter_free(awaiter);
+                return 0;
+        }
+
+        if (error) {
+                awaiter->error = strdup(error);
+                if (!awaiter->error)
+                        awaiter->result = -VARLINK_ERROR_PANIC;
+        }
+
+        if (parameters)
+                awaiter->parameters = varlink_object_ref(parameters);
+
+        awaiter->done = true;
+        coroutine_wake(awaiter->coroutine);
+
+        return 0;
+}
+
+static void await_closed(void *userdata) {
+        Awaiter *awaiter = userdata;
+
+        if (!awaiter->coroutine) {
+                awaiter_free(awaiter);
+                return;
+        }
+
+        awaiter->result = -VARLINK_ERROR_CONNECTION_CLOSED;
+        awaiter->done = true;
+        coroutine_wake(awaiter->coroutine);
+}
+
+_public_ long varlink_connection_await(VarlinkConnection *connection,
+                                       const char *qualified_method,
+                                       VarlinkObject *parameters,
+                                       char **errorp,
+                                       VarlinkObject **parametersp) {
+        Awaiter *awaiter;
+        long r;
+
+        if (!coroutine_get_current())
+                return -VARLINK_ERROR_INVALID_CALL;
+
+        awaiter = varlink_calloc(1, sizeof(Awaiter));
+        if (!awaiter)
+                return -VARLINK_ERROR_PANIC;
+
+        awaiter->coroutine = coroutine_get_current();
+
+        r = connection_call(connection, qualified_method, parameters, 0, await_reply, await_closed, awaiter);
+        if (r < 0) {
+                awaiter_free(awaiter);
+                return r;
+        }
+
+        /* Cached replies are there right away. */
+        while (!awaiter->done)
+                coroutine_suspend(&awaiter->coroutine);
+
+        r = awaiter->result;
+        if (r >= 0) {
+                *errorp = awaiter->error;
+                awaiter->error = NULL;
+                *parametersp = awaiter->parameters;
+                awaiter->parameters = NULL;
+        }
+
+        awaiter_free(awaiter);
+
+        return r;
+}
+
+_public_ long varlink_connection_enable_cache(VarlinkConnection *connection,
+                                              unsigned long max_entries,
+                                              uint64_t stale_usec) {
+        long r;
+
+        if (!connection->cache) {
+                r = varlink_cache_new(&connection->cache, ULONG_MAX);
+                if (r < 0)
+                        return r;
+        }
+
+        connection->cache->stale_usec = stale_usec;
+        connection->cache->max_entries = max_entries > 0 ? max_entries : VARLINK_CACHE_DEFAULT_ENTRIES;
+        varlink_cache_set_size(connection->cache, ULONG_MAX);
+
+        return 0;
+}
+
+_public_ long varlink_connection_invalidate_cache(VarlinkConnection *connection, const char *method) {
+        if (connection->cache)
+                varlink_cache_invalidate(connection->cache, method, NULL);
+
+        return 0;
+}
+
+_public_ long varlink_connection_forget_calls(VarlinkConnection *connection, void *userdata) {
+        ReplyCallback *cb;
+
+        /* The replies still arrive and are read, nobody is told anymore. */
+        STAILQ_FOREACH(cb, &connection->pending, entry) {
+                if (cb->userdata != userdata)
+                        continue;
+
+                cb->func = NULL;
+                cb->closed = NULL;
+        }
+
         return 0;
 }
 
@@ -251,6 +612,17 @@ _public_ void *varlink_connection_get_userdata(VarlinkConnection *connection) {
         return connection->closed_userdata;
 }
 
+void varlink_connection_set_events_callback(VarlinkConnection *connection,
+                                            VarlinkConnectionEventsFunc func,
+                                            void *userdata) {
+        connection->events_callback = func;
+        connection->events_userdata = userdata;
+}
+
+uint64_t varlink_connection_get_reply_ttl(VarlinkConnection *connection) {
+        return connection->reply_ttl_usec;
+}
+
 _public_ void varlink_connection_set_closed_callback(VarlinkConnection *connection,
                                                      VarlinkConnectionClosedFunc callback,
                                                      void *userdata) {
@@ -10,3 +10,20 @@ long varlink_connection_new_from_fd(VarlinkConnection **connectionp, int fd);
 long varlink_connection_new_from_uri(VarlinkConnection **connectionp, VarlinkURI *uri);
 long varlink_connection_bridge(int signal_fd, VarlinkStream *client_in, VarlinkStream *client_out,
                                VarlinkConnection *server);
+
+typedef void (*VarlinkConnectionEventsFunc)(VarlinkConnection *connection, void *userdata);
+
+/*
+ * Calls @func whenever a call adds to the events the connection waits
+ * for, and when it is closed; for loops which watch it without calling
+ * varlink_connection_get_events() before every wait.
+ */
+void varlink_connection_set_events_callback(VarlinkConnection *connection,
+                                            VarlinkConnectionEventsFunc func,
+                                            void *userdata);
+
+/*
+ * Returns the "ttl" of the reply which is passed to a reply callback of
+ * @connection, for passing it on; 0 if it has none or outside of one.
+ */
+uint64_t varlink_connection_get_reply_ttl(VarlinkConnection *connection);
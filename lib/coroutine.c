@@ -0,0 +1,119 @@
+// SPDX-License-Identifier: Apache-2.0
+
+#include "alloc.h"
+#include "coroutine.h"
+#include "varlink.h"
+
+#include <stdint.h>
+#include <sys/mman.h>
+#include <ucontext.h>
+#include <unistd.h>
+
+struct Coroutine {
+        ucontext_t context;
+        ucontext_t caller;
+
+        void *stack;
+        size_t stack_size;
+
+        CoroutineFunc func;
+        CoroutineWakeFunc wake;
+        void *userdata;
+
+        Coroutine *previous;
+        Coroutine **waiter;
+        bool done;
+};
+
+static __thread Coroutine *current;
+
+static void coroutine_start(void) {
+        Coroutine *coroutine = current;
+
+        coroutine->func(coroutine->userdata);
+        coroutine->done = true;
+
+        /* Returning continues at the caller of coroutine_resume(), through uc_link. */
+}
+
+long coroutine_new(Coroutine **coroutinep,
+                   CoroutineFunc func,
+                   CoroutineWakeFunc wake,
+                   void *userdata) {
+        Coroutine *coroutine;
+        size_t page_size = sysconf(_SC_PAGESIZE);
+
+        coroutine = varlink_calloc(1, sizeof(Coroutine));
+        if (!coroutine)
+                return -VARLINK_ERROR_PANIC;
+
+        coroutine->func = func;
+        coroutine->wake = wake;
+        coroutine->userdata = userdata;
+
+        /* The lowest page stays inaccessible, to crash on a stack overflow. */
+        coroutine->stack_size = COROUTINE_STACK_SIZE + page_size;
+        coroutine->stack = mmap(NULL, coroutine->stack_size, PROT_READ | PROT_WRITE,
+                                MAP_PRIVATE | MAP_ANONYMOUS | MAP_STACK, -1, 0);
+        if (coroutine->stack == MAP_FAILED) {
+                varlink_free(coroutine);
+                return -VARLINK_ERROR_PANIC;
+        }
+
+        if (mprotect(coroutine->stack, page_size, PROT_NONE) < 0 ||
+            getcontext(&coroutine->context) < 0) {
+                munmap(coroutine->stack, coroutine->stack_size);
+                varlink_free(coroutine);
+                return -VARLINK_ERROR_PANIC;
+        }
+
+        coroutine->context.uc_stack.ss_sp = (uint8_t *)coroutine->stack + page_size;
+        coroutine->context.uc_stack.ss_size = COROUTINE_STACK_SIZE;
+        coroutine->context.uc_link = &coroutine->caller;
+        makecontext(&coroutine->context, coroutine_start, 0);
+
+        *coroutinep = coroutine;
+
+        return 0;
+}
+
+Coroutine *coroutine_free(Coroutine *coroutine) {
+        if (coroutine->waiter)
+                *coroutine->waiter = NULL;
+
+        munmap(coroutine->stack, coroutine->stack_size);
+        varlink_free(coroutine);
+
+        return NULL;
+}
+
+bool coroutine_resume(Coroutine *coroutine) {
+        coroutine->previous = current;
+        coroutine->waiter = NULL;
+        current = coroutine;
+
+        swapcontext(&coroutine->caller, &coroutine->context);
+
+        current = coroutine->previous;
+
+        return coroutine->done;
+}
+
+Coroutine *coroutine_get_current(void) {
+        return current;
+}
+
+void coroutine_suspend(Coroutine **waiter) {
+        Coroutine *coroutine = current;
+
+        coroutine->waiter = waiter;
+        swapcontext(&coroutine->context, &coroutine->caller);
+}
+
+void coroutine_wake(Coroutine *coroutine) {
+        /* Woken up by itself, it finds out without suspending. */
+        if (coroutine == current)
+                return;
+
+        coroutine->wake(coroutine, coroutine->userdata);
+}
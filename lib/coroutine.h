@@ -0,0 +1,57 @@
+// SPDX-License-Identifier: Apache-2.0
+
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+
+/* Stacks are mapped lazily, pages are only allocated when they are touched. */
+#define COROUTINE_STACK_SIZE (256 * 1024)
+
+typedef struct Coroutine Coroutine;
+
+typedef void (*CoroutineFunc)(void *userdata);
+
+/*
+ * Called when something the coroutine waits for happened, to schedule
+ * coroutine_resume() on the thread which owns it.
+ */
+typedef void (*CoroutineWakeFunc)(Coroutine *coroutine, void *userdata);
+
+/*
+ * A stackful coroutine, which runs @func on its own stack until it
+ * returns or suspends itself. It can only be resumed by the thread
+ * which created it.
+ */
+long coroutine_new(Coroutine **coroutinep,
+                   CoroutineFunc func,
+                   CoroutineWakeFunc wake,
+                   void *userdata);
+
+/*
+ * Frees a finished coroutine, or one which is suspended; the latter is
+ * not unwound, so whatever its stack owns is lost. A waiter registered
+ * with coroutine_suspend() is detached.
+ */
+Coroutine *coroutine_free(Coroutine *coroutine);
+
+/*
+ * Runs @coroutine until it suspends itself or returns. Returns true if
+ * it returned.
+ */
+bool coroutine_resume(Coroutine *coroutine);
+
+/*
+ * Returns the coroutine running on this thread, or NULL on the thread's
+ * own stack.
+ */
+Coroutine *coroutine_get_current(void);
+
+/*
+ * Switches back to the caller of coroutine_resume(). @waiter points to
+ * the reference its waker keeps to the coroutine, and is reset to NULL
+ * if it is freed while suspended.
+ */
+void coroutine_suspend(Coroutine **waiter);
+
+void coroutine_wake(Coroutine *coroutine);
@@ -1,5 +1,6 @@
 // SPDX-License-Identifier: Apache-2.0
 
+#include "alloc.h"
 #include "interface.h"
 #include "scanner.h"
 #include "util.h"
@@ -91,7 +92,7 @@ static VarlinkMethod *varlink_method_free(VarlinkMethod *method) {
         if (method->type_out)
                 varlink_type_unref(method->type_out);
 
-        free(method);
+        varlink_free(method);
 
         return NULL;
 }
@@ -100,7 +101,7 @@ VarlinkInterface *varlink_interface_free(VarlinkInterface *interface) {
         for (unsigned long i = 0; i < interface->n_members; i += 1) {
                 VarlinkInterfaceMember *member = interface->members[i];
 
-                free(member->name);
+                varlink_free(member->name);
                 free(member->description);
 
                 switch (member->type) {
@@ -120,14 +121,14 @@ VarlinkInterface *varlink_interface_free(VarlinkInterface *interface) {
                                 break;
                 }
 
-                free(member);
+                varlink_free(member);
         }
 
-        free(interface->members);
+        varlink_free(interface->members);
         avl_tree_free(interface->member_tree);
-        free(interface->name);
+        varlink_free(interface->name);
         free(interface->description);
-        free(interface);
+        varlink_free(interface);
 
         return NULL;
 }
@@ -148,7 +149,7 @@ static long varlink_interface_new_from_scanner(VarlinkInterface **interfacep, Sc
         unsigned long n_allocated = 0;
         long r;
 
-        interface = calloc(1, sizeof(VarlinkInterface));
+        interface = varlink_calloc(1, sizeof(VarlinkInterface));
         if (!interface)
                 return -VARLINK_ERROR_PANIC;
 
@@ -176,12 +177,12 @@ static long varlink_interface_new_from_scanner(VarlinkInterface **interfacep, Sc
 
                 if (n_allocated == interface->n_members) {
                         n_allocated = MAX(2 * n_allocated, 16);
-                        interface->members = realloc(interface->members, n_allocated * sizeof(VarlinkInterfaceMember *));
+                        interface->members = varlink_realloc(interface->members, n_allocated * sizeof(VarlinkInterfaceMember *));
                         if (!interface->members)
                                 return -VARLINK_ERROR_PANIC;
                 }
 
-                member = calloc(1, sizeof(VarlinkInterfaceMember));
+                member = varlink_calloc(1, sizeof(VarlinkInterfaceMember));
                 if (!member)
                         return -VARLINK_ERROR_PANIC;
 
@@ -214,7 +215,7 @@ static long varlink_interface_new_from_scanner(VarlinkInterface **interfacep, Sc
 
                 } else if (scanner_read_keyword(scanner, "method")) {
                         member->type = VARLINK_MEMBER_METHOD;
-                        member->method = calloc(1, sizeof(VarlinkMethod));
+                        member->method = varlink_calloc(1, sizeof(VarlinkMethod));
                         r = scanner_get_last_docstring(scanner, &member->description);
                         if (r < 0)
                                 return r;
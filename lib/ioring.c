@@ -0,0 +1,440 @@
+// SPDX-License-Identifier: Apache-2.0
+
+#include "alloc.h"
+#include "ioring.h"
+#include "util.h"
+#include "varlink.h"
+
+#if HAVE_LINUX_IO_URING_H
+
+#include <errno.h>
+#include <linux/io_uring.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+/* Provided buffers for receives, shared by all connections. */
+#define IO_RING_N_BUFFERS 256
+#define IO_RING_BUFFER_SIZE (16 * 1024)
+
+/* Requests whose completions are not passed on, the cancellations. */
+#define IO_RING_USERDATA_NONE 0
+
+struct IoRing {
+        int fd;
+
+        /* The queues shared with the kernel, in a single mapping. */
+        void *rings;
+        size_t rings_size;
+
+        unsigned *sq_head;
+        unsigned *sq_tail;
+        unsigned *sq_flags;
+        unsigned sq_mask;
+        unsigned sq_entries;
+        unsigned *sq_array;
+        struct io_uring_sqe *sqes;
+        size_t sqes_size;
+
+        /* The tail including the requests which are not submitted yet. */
+        unsigned sq_queued;
+
+        unsigned *cq_head;
+        unsigned *cq_tail;
+        unsigned cq_mask;
+        struct io_uring_cqe *cqes;
+
+        struct io_uring_buf_ring *buffers;
+        size_t buffers_size;
+        uint8_t *buffer_data;
+        unsigned short buffer_tail;
+};
+
+static long io_uring_setup(unsigned entries, struct io_uring_params *params) {
+        return syscall(__NR_io_uring_setup, entries, params);
+}
+
+static long io_uring_enter(int fd, unsigned to_submit, unsigned min_complete, unsigned flags) {
+        return syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, NULL, 0);
+}
+
+static long io_uring_register(int fd, unsigned opcode, void *arg, unsigned n_args) {
+        return syscall(__NR_io_uring_register, fd, opcode, arg, n_args);
+}
+
+/*
+ * Multishot receives came with the same kernel release as zero-copy
+ * sends, which can be probed for.
+ */
+static bool io_ring_probe(IoRing *ring) {
+        _cleanup_(varlink_freep) struct io_uring_probe *probe = NULL;
+
+        probe = varlink_calloc(1, sizeof(struct io_uring_probe) + 256 * sizeof(struct io_uring_probe_op));
+        if (!probe)
+                return false;
+
+        if (io_uring_register(ring->fd, IORING_REGISTER_PROBE, probe, 256) < 0)
+                return false;
+
+        return probe->last_op >= IORING_OP_SEND_ZC &&
+               probe->ops[IORING_OP_SEND_ZC].flags & IO_URING_OP_SUPPORTED;
+}
+
+static long io_ring_setup_buffers(IoRing *ring) {
+        struct io_uring_buf_reg reg = {};
+
+        ring->buffers_size = IO_RING_N_BUFFERS * sizeof(struct io_uring_buf);
+        ring->buffers = mmap(NULL, ring->buffers_size, PROT_READ | PROT_WRITE,
+                             MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (ring->buffers == MAP_FAILED) {
+                ring->buffers = NULL;
+                return -VARLINK_ERROR_PANIC;
+        }
+
+        ring->buffer_data = mmap(NULL, IO_RING_N_BUFFERS * IO_RING_BUFFER_SIZE, PROT_READ | PROT_WRITE,
+                                 MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (ring->buffer_data == MAP_FAILED) {
+                ring->buffer_data = NULL;
+                return -VARLINK_ERROR_PANIC;
+        }
+
+        reg.ring_addr = (uintptr_t)ring->buffers;
+        reg.ring_entries = IO_RING_N_BUFFERS;
+        reg.bgid = 0;
+        if (io_uring_register(ring->fd, IORING_REGISTER_PBUF_RING, &reg, 1) < 0)
+                return -VARLINK_ERROR_PANIC;
+
+        for (long i = 0; i < IO_RING_N_BUFFERS; i += 1)
+                io_ring_release(ring, i);
+
+        return 0;
+}
+
+long io_ring_new(IoRing **ringp, unsigned long n_entries) {
+        IoRing *ring;
+        struct io_uring_params params = {
+                .flags = IORING_SETUP_CLAMP
+        };
+        uint8_t *rings;
+
+        ring = varlink_calloc(1, sizeof(IoRing));
+        if (!ring)
+                return -VARLINK_ERROR_PANIC;
+
+        ring->fd = io_uring_setup(n_entries, &params);
+        if (ring->fd < 0) {
+                varlink_free(ring);
+                return -VARLINK_ERROR_PANIC;
+        }
+
+        if (!(params.features & IORING_FEAT_SINGLE_MMAP) ||
+            !(params.features & IORING_FEAT_NODROP) ||
+            !io_ring_probe(ring)) {
+                io_ring_free(ring);
+                return -VARLINK_ERROR_PANIC;
+        }
+
+        ring->rings_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+        if (ring->rings_size < params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe))
+                ring->rings_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+
+        ring->rings = mmap(NULL, ring->rings_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                           ring->fd, IORING_OFF_SQ_RING);
+        if (ring->rings == MAP_FAILED) {
+                ring->rings = NULL;
+                io_ring_free(ring);
+                return -VARLINK_ERROR_PANIC;
+        }
+
+        ring->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+        ring->sqes = mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                          ring->fd, IORING_OFF_SQES);
+        if (ring->sqes == MAP_FAILED) {
+                ring->sqes = NULL;
+                io_ring_free(ring);
+                return -VARLINK_ERROR_PANIC;
+        }
+
+        rings = ring->rings;
+        ring->sq_head = (unsigned *)(rings + params.sq_off.head);
+        ring->sq_tail = (unsigned *)(rings + params.sq_off.tail);
+        ring->sq_flags = (unsigned *)(rings + params.sq_off.flags);
+        ring->sq_mask = *(unsigned *)(rings + params.sq_off.ring_mask);
+        ring->sq_entries = params.sq_entries;
+        ring->sq_array = (unsigned *)(rings + params.sq_off.array);
+        ring->sq_queued = *ring->sq_tail;
+
+        ring->cq_head = (unsigned *)(rings + params.cq_off.head);
+        ring->cq_tail = (unsigned *)(rings + params.cq_off.tail);
+        ring->cq_mask = *(unsigned *)(rings + params.cq_off.ring_mask);
+        ring->cqes = (struct io_uring_cqe *)(rings + params.cq_off.cqes);
+
+        if (io_ring_setup_buffers(ring) < 0) {
+                io_ring_free(ring);
+                return -VARLINK_ERROR_PANIC;
+        }
+
+        *ringp = ring;
+
+        return 0;
+}
+
+IoRing *io_ring_free(IoRing *ring) {
+        /* Closing the ring cancels what is still in flight. */
+        if (ring->fd >= 0)
+                close(ring->fd);
+
+        if (ring->rings)
+                munmap(ring->rings, ring->rings_size);
+
+        if (ring->sqes)
+                munmap(ring->sqes, ring->sqes_size);
+
+        if (ring->buffers)
+                munmap(ring->buffers, ring->buffers_size);
+
+        if (ring->buffer_data)
+                munmap(ring->buffer_data, IO_RING_N_BUFFERS * IO_RING_BUFFER_SIZE);
+
+        varlink_free(ring);
+
+        return NULL;
+}
+
+int io_ring_get_fd(IoRing *ring) {
+        return ring->fd;
+}
+
+static struct io_uring_sqe *io_ring_get_sqe(IoRing *ring) {
+        struct io_uring_sqe *sqe;
+        unsigned index;
+
+        if (ring->sq_queued - __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE) == ring->sq_entries) {
+                if (io_ring_submit(ring, 0) < 0)
+                        return NULL;
+
+                if (ring->sq_queued - __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE) == ring->sq_entries)
+                        return NULL;
+        }
+
+        index = ring->sq_queued & ring->sq_mask;
+        sqe = &ring->sqes[index];
+        memset(sqe, 0, sizeof(struct io_uring_sqe));
+        ring->sq_array[index] = index;
+        ring->sq_queued += 1;
+
+        return sqe;
+}
+
+long io_ring_accept_multishot(IoRing *ring, int fd, uint64_t userdata) {
+        struct io_uring_sqe *sqe;
+
+        sqe = io_ring_get_sqe(ring);
+        if (!sqe)
+                return -VARLINK_ERROR_PANIC;
+
+        sqe->opcode = IORING_OP_ACCEPT;
+        sqe->fd = fd;
+        sqe->accept_flags = SOCK_NONBLOCK | SOCK_CLOEXEC;
+        sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+        sqe->user_data = userdata;
+
+        return 0;
+}
+
+long io_ring_recv_multishot(IoRing *ring, int fd, uint64_t userdata) {
+        struct io_uring_sqe *sqe;
+
+        sqe = io_ring_get_sqe(ring);
+        if (!sqe)
+                return -VARLINK_ERROR_PANIC;
+
+        sqe->opcode = IORING_OP_RECV;
+        sqe->fd = fd;
+        sqe->flags = IOSQE_BUFFER_SELECT;
+        sqe->buf_group = 0;
+        sqe->ioprio = IORING_RECV_MULTISHOT;
+        sqe->user_data = userdata;
+
+        return 0;
+}
+
+long io_ring_send(IoRing *ring, int fd, const void *data, unsigned long length, uint64_t userdata) {
+        struct io_uring_sqe *sqe;
+
+        sqe = io_ring_get_sqe(ring);
+        if (!sqe)
+                return -VARLINK_ERROR_PANIC;
+
+        sqe->opcode = IORING_OP_SEND;
+        sqe->fd = fd;
+        sqe->addr = (uintptr_t)data;
+        sqe->len = length;
+        sqe->msg_flags = MSG_NOSIGNAL;
+        sqe->user_data = userdata;
+
+        return 0;
+}
+
+long io_ring_cancel(IoRing *ring, uint64_t userdata) {
+        struct io_uring_sqe *sqe;
+
+        sqe = io_ring_get_sqe(ring);
+        if (!sqe)
+                return -VARLINK_ERROR_PANIC;
+
+        sqe->opcode = IORING_OP_ASYNC_CANCEL;
+        sqe->addr = userdata;
+        sqe->user_data = IO_RING_USERDATA_NONE;
+
+        return 0;
+}
+
+long io_ring_cancel_fd(IoRing *ring, int fd) {
+        struct io_uring_sqe *sqe;
+
+        sqe = io_ring_get_sqe(ring);
+        if (!sqe)
+                return -VARLINK_ERROR_PANIC;
+
+        sqe->opcode = IORING_OP_ASYNC_CANCEL;
+        sqe->fd = fd;
+        sqe->cancel_flags = IORING_ASYNC_CANCEL_FD | IORING_ASYNC_CANCEL_ALL;
+        sqe->user_data = IO_RING_USERDATA_NONE;
+
+        return 0;
+}
+
+long io_ring_submit(IoRing *ring, unsigned long n_wait) {
+        unsigned to_submit;
+        unsigned flags = 0;
+
+        to_submit = ring->sq_queued - __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+        __atomic_store_n(ring->sq_tail, ring->sq_queued, __ATOMIC_RELEASE);
+
+        /* Completions which did not fit into the queue are only moved over when asked for. */
+        if (n_wait > 0 || __atomic_load_n(ring->sq_flags, __ATOMIC_RELAXED) & IORING_SQ_CQ_OVERFLOW)
+                flags |= IORING_ENTER_GETEVENTS;
+
+        if (to_submit == 0 && flags == 0)
+                return 0;
+
+        while (io_uring_enter(ring->fd, to_submit, n_wait, flags) < 0) {
+                switch (errno) {
+                        case EINTR:
+                                continue;
+
+                        /* Out of memory for completions; the requests stay queued for the next time. */
+                        case EAGAIN:
+                        case EBUSY:
+                                return 0;
+
+                        default:
+                                return -VARLINK_ERROR_PANIC;
+                }
+        }
+
+        return 0;
+}
+
+bool io_ring_next(IoRing *ring, IoRingCompletion *completion) {
+        for (;;) {
+                unsigned head = *ring->cq_head;
+                struct io_uring_cqe *cqe;
+
+                if (head == __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE)) {
+                        if (!(__atomic_load_n(ring->sq_flags, __ATOMIC_RELAXED) & IORING_SQ_CQ_OVERFLOW))
+                                return false;
+
+                        if (io_ring_submit(ring, 0) < 0)
+                                return false;
+
+                        if (head == __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE))
+                                return false;
+                }
+
+                cqe = &ring->cqes[head & ring->cq_mask];
+
+                *completion = (IoRingCompletion){
+                        .userdata = cqe->user_data,
+                        .result = cqe->res,
+                        .more = cqe->flags & IORING_CQE_F_MORE,
+                        .buffer = -1
+                };
+
+                if (cqe->flags & IORING_CQE_F_BUFFER) {
+                        completion->buffer = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+                        completion->data = ring->buffer_data + completion->buffer * IO_RING_BUFFER_SIZE;
+                }
+
+                __atomic_store_n(ring->cq_head, head + 1, __ATOMIC_RELEASE);
+
+                if (completion->userdata != IO_RING_USERDATA_NONE)
+                        return true;
+        }
+}
+
+void io_ring_release(IoRing *ring, long buffer) {
+        struct io_uring_buf *buf;
+
+        buf = &ring->buffers->bufs[ring->buffer_tail & (IO_RING_N_BUFFERS - 1)];
+        buf->addr = (uintptr_t)(ring->buffer_data + buffer * IO_RING_BUFFER_SIZE);
+        buf->len = IO_RING_BUFFER_SIZE;
+        buf->bid = buffer;
+
+        ring->buffer_tail += 1;
+        __atomic_store_n(&ring->buffers->tail, ring->buffer_tail, __ATOMIC_RELEASE);
+}
+
+#else
+
+long io_ring_new(IoRing **UNUSED(ringp), unsigned long UNUSED(n_entries)) {
+        return -VARLINK_ERROR_PANIC;
+}
+
+IoRing *io_ring_free(IoRing *UNUSED(ring)) {
+        return NULL;
+}
+
+int io_ring_get_fd(IoRing *UNUSED(ring)) {
+        return -1;
+}
+
+long io_ring_accept_multishot(IoRing *UNUSED(ring), int UNUSED(fd), uint64_t UNUSED(userdata)) {
+        return -VARLINK_ERROR_PANIC;
+}
+
+long io_ring_recv_multishot(IoRing *UNUSED(ring), int UNUSED(fd), uint64_t UNUSED(userdata)) {
+        return -VARLINK_ERROR_PANIC;
+}
+
+long io_ring_send(IoRing *UNUSED(ring),
+                  int UNUSED(fd),
+                  const void *UNUSED(data),
+                  unsigned long UNUSED(length),
+                  uint64_t UNUSED(userdata)) {
+        return -VARLINK_ERROR_PANIC;
+}
+
+long io_ring_cancel(IoRing *UNUSED(ring), uint64_t UNUSED(userdata)) {
+        return -VARLINK_ERROR_PANIC;
+}
+
+long io_ring_cancel_fd(IoRing *UNUSED(ring), int UNUSED(fd)) {
+        return -VARLINK_ERROR_PANIC;
+}
+
+long io_ring_submit(IoRing *UNUSED(ring), unsigned long UNUSED(n_wait)) {
+        return -VARLINK_ERROR_PANIC;
+}
+
+bool io_ring_next(IoRing *UNUSED(ring), IoRingCompletion *UNUSED(completion)) {
+        return false;
+}
+
+void io_ring_release(IoRing *UNUSED(ring), long UNUSED(buffer)) {
+}
+
+#endif
@@ -0,0 +1,61 @@
+// SPDX-License-Identifier: Apache-2.0
+
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+typedef struct IoRing IoRing;
+
+/* A completed request, with the data of a receive in one of the ring's buffers. */
+typedef struct {
+        uint64_t userdata;
+        long result;
+
+        /* A multishot request posts more completions. */
+        bool more;
+
+        /* The buffer holding the received data, or -1; it goes back with io_ring_release(). */
+        long buffer;
+        const uint8_t *data;
+} IoRingCompletion;
+
+/*
+ * Sets up an io_uring with @n_entries submission slots and a ring of
+ * provided buffers for multishot receives. Fails on kernels without
+ * multishot receive, or when io_uring is not available at all; the
+ * caller stays with epoll then.
+ */
+long io_ring_new(IoRing **ringp, unsigned long n_entries);
+
+/*
+ * Frees the ring. Requests which are still in flight are cancelled by
+ * the kernel, their memory has to outlive them.
+ */
+IoRing *io_ring_free(IoRing *ring);
+
+/* The fd becomes readable when completions are waiting, to put it into an epoll set. */
+int io_ring_get_fd(IoRing *ring);
+
+/*
+ * Queue a request; it is passed to the kernel with the next
+ * io_ring_submit(), or right away when the submission queue is full.
+ */
+long io_ring_accept_multishot(IoRing *ring, int fd, uint64_t userdata);
+long io_ring_recv_multishot(IoRing *ring, int fd, uint64_t userdata);
+long io_ring_send(IoRing *ring, int fd, const void *data, unsigned long length, uint64_t userdata);
+
+/* Cancels the request with @userdata, or all requests for @fd; they complete with -ECANCELED. */
+long io_ring_cancel(IoRing *ring, uint64_t userdata);
+long io_ring_cancel_fd(IoRing *ring, int fd);
+
+/*
+ * Passes all queued requests to the kernel, and waits until at least
+ * @n_wait requests completed.
+ */
+long io_ring_submit(IoRing *ring, unsigned long n_wait);
+
+/* Takes the next completion. Returns false when there is none. */
+bool io_ring_next(IoRing *ring, IoRingCompletion *completion);
+
+void io_ring_release(IoRing *ring, long buffer);
@@ -1,5 +1,6 @@
 // SPDX-License-Identifier: Apache-2.0
 
+#include "alloc.h"
 #include "message.h"
 #include "util.h"
 
@@ -8,6 +9,7 @@
 long varlink_message_pack_call(const char *method,
                                VarlinkObject *parameters,
                                uint64_t flags,
+                               const char *traceparent,
                                VarlinkObject **callp) {
         _cleanup_(varlink_object_unrefp) VarlinkObject *call = NULL;
         long r;
@@ -41,6 +43,12 @@ long varlink_message_pack_call(const char *method,
                         return r;
         }
 
+        if (traceparent) {
+                r = varlink_object_set_string(call, "traceparent", traceparent);
+                if (r < 0)
+                        return r;
+        }
+
         *callp = call;
         call = NULL;
 
@@ -50,10 +58,12 @@ long varlink_message_pack_call(const char *method,
 long varlink_message_unpack_call(VarlinkObject *call,
                                  char **methodp,
                                  VarlinkObject **parametersp,
-                                 uint64_t *flagsp) {
+                                 uint64_t *flagsp,
+                                 const char **traceparentp) {
         const char *method;
+        const char *traceparent = NULL;
         VarlinkObject *parameters = NULL;
-        _cleanup_(freep) char *m = NULL;
+        _cleanup_(varlink_freep) char *m = NULL;
         _cleanup_(varlink_object_unrefp) VarlinkObject *p = NULL;
         bool more = false;
         bool oneway = false;
@@ -75,7 +85,11 @@ long varlink_message_unpack_call(VarlinkObject *call,
         if (r < 0 && r != -VARLINK_ERROR_UNKNOWN_FIELD)
                 return -VARLINK_ERROR_INVALID_MESSAGE;
 
-        m = strdup(method);
+        /* A broken trace context must not fail the call, it is ignored. */
+        if (varlink_object_get_string(call, "traceparent", &traceparent) < 0)
+                traceparent = NULL;
+
+        m = varlink_strdup(method);
         if (!m)
                 return -VARLINK_ERROR_PANIC;
 
@@ -99,12 +113,16 @@ long varlink_message_unpack_call(VarlinkObject *call,
         if (oneway)
                 *flagsp |= VARLINK_CALL_ONEWAY;
 
+        if (traceparentp)
+                *traceparentp = traceparent;
+
         return 0;
 }
 
 long varlink_message_pack_reply(const char *error,
                                 VarlinkObject *parameters,
                                 uint64_t flags,
+                                uint64_t ttl_usec,
                                 VarlinkObject **replyp) {
         _cleanup_(varlink_object_unrefp) VarlinkObject *reply = NULL;
         long r;
@@ -131,6 +149,12 @@ long varlink_message_pack_reply(const char *error,
                         return r;
         }
 
+        if (ttl_usec > 0) {
+                r = varlink_object_set_int(reply, "ttl", ttl_usec);
+                if (r < 0)
+                        return r;
+        }
+
         *replyp = reply;
         reply = NULL;
 
@@ -140,12 +164,14 @@ long varlink_message_pack_reply(const char *error,
 long varlink_message_unpack_reply(VarlinkObject *reply,
                                   char **errorp,
                                   VarlinkObject **parametersp,
-                                  uint64_t *flagsp) {
+                                  uint64_t *flagsp,
+                                  uint64_t *ttl_usecp) {
         const char *error = NULL;
         VarlinkObject *parameters = NULL;
-        _cleanup_(freep) char *e = NULL;
+        _cleanup_(varlink_freep) char *e = NULL;
         _cleanup_(varlink_object_unrefp) VarlinkObject *p = NULL;
         bool continues = false;
+        int64_t ttl = 0;
         long r;
 
         r = varlink_object_get_string(reply, "error", &error);
@@ -160,8 +186,13 @@ long varlink_message_unpack_reply(VarlinkObject *reply,
         if (r < 0 && r != -VARLINK_ERROR_UNKNOWN_FIELD)
                 return -VARLINK_ERROR_INVALID_MESSAGE;
 
+        /* Only a hint, a client which does not cache ignores it. */
+        r = varlink_object_get_int(reply, "ttl", &ttl);
+        if (r < 0 && r != -VARLINK_ERROR_UNKNOWN_FIELD)
+                return -VARLINK_ERROR_INVALID_MESSAGE;
+
         if (error) {
-                e = strdup(error);
+                e = varlink_strdup(error);
                 if (!e)
                         return -VARLINK_ERROR_PANIC;
         }
@@ -184,5 +215,8 @@ long varlink_message_unpack_reply(VarlinkObject *reply,
         if (continues)
                 *flagsp |= VARLINK_REPLY_CONTINUES;
 
+        if (ttl_usecp)
+                *ttl_usecp = ttl > 0 ? ttl : 0;
+
         return 0;
 }
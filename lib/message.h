@@ -4,22 +4,37 @@
 
 #include "varlink.h"
 
+/*
+ * @traceparent is optional. The one returned by unpack is owned by @call
+ * and NULL if the call carries none.
+ */
 long varlink_message_pack_call(const char *method,
                                VarlinkObject *parameters,
                                uint64_t flags,
+                               const char *traceparent,
                                VarlinkObject **callp);
 
 long varlink_message_unpack_call(VarlinkObject *call,
                                  char **methodp,
                                  VarlinkObject **parametersp,
-                                 uint64_t *flagsp);
+                                 uint64_t *flagsp,
+                                 const char **traceparentp);
 
+/*
+ * @ttl_usec is how long the client may cache the reply, 0 if it should
+ * not. It is sent in the "ttl" field, which is not part of the varlink
+ * protocol but a libvarlink extension; it is left out when it is 0, and
+ * other implementations ignore it like any unknown field. The one
+ * returned by unpack is optional.
+ */
 long varlink_message_pack_reply(const char *error,
                                 VarlinkObject *parameters,
                                 uint64_t flags,
+                                uint64_t ttl_usec,
                                 VarlinkObject **replyp);
 
 long varlink_message_unpack_reply(VarlinkObject *reply,
                                   char **errorp,
                                   VarlinkObject **parametersp,
-                                  uint64_t *flagsp);
+                                  uint64_t *flagsp,
+                                  uint64_t *ttl_usecp);
@@ -0,0 +1,180 @@
+// SPDX-License-Identifier: Apache-2.0
+
+#include "alloc.h"
+#include "metrics.h"
+#include "util.h"
+
+#include <string.h>
+
+static long method_compare(const void *key, void *value) {
+        VarlinkMethodMetrics *method = value;
+
+        return strcmp(key, method->method);
+}
+
+static void method_freep(void *ptr) {
+        VarlinkMethodMetrics *method = *(void **)ptr;
+
+        varlink_free(method->method);
+        varlink_free(method);
+}
+
+long varlink_metrics_new(VarlinkMetrics **metricsp) {
+        _cleanup_(varlink_metrics_freep) VarlinkMetrics *metrics = NULL;
+
+        metrics = varlink_calloc(1, sizeof(VarlinkMetrics));
+        if (!metrics)
+                return -VARLINK_ERROR_PANIC;
+
+        if (avl_tree_new(&metrics->methods, method_compare, method_freep) < 0)
+                return -VARLINK_ERROR_PANIC;
+
+        *metricsp = metrics;
+        metrics = NULL;
+
+        return 0;
+}
+
+VarlinkMetrics *varlink_metrics_free(VarlinkMetrics *metrics) {
+        if (metrics->methods)
+                avl_tree_free(metrics->methods);
+
+        varlink_free(metrics);
+
+        return NULL;
+}
+
+void varlink_metrics_freep(VarlinkMetrics **metricsp) {
+        if (*metricsp)
+                varlink_metrics_free(*metricsp);
+}
+
+VarlinkMethodMetrics *varlink_metrics_call_start(VarlinkMetrics *metrics, const char *name) {
+        VarlinkMethodMetrics *method;
+
+        method = avl_tree_find(metrics->methods, name);
+        if (!method) {
+                /* Do not let clients grow the tree with made-up method names. */
+                if (avl_tree_get_n_elements(metrics->methods) >= VARLINK_METRICS_MAX_METHODS) {
+                        name = "*";
+                        method = avl_tree_find(metrics->methods, name);
+                }
+        }
+
+        if (!method) {
+                method = varlink_calloc(1, sizeof(VarlinkMethodMetrics));
+                if (!method)
+                        return NULL;
+
+                method->method = varlink_strdup(name);
+                if (!method->method) {
+                        varlink_free(method);
+                        return NULL;
+                }
+
+                if (avl_tree_insert(metrics->methods, method->method, method) < 0) {
+                        method_freep(&method);
+                        return NULL;
+                }
+        }
+
+        method->n_calls += 1;
+        metrics->n_calls_in_flight += 1;
+
+        return method;
+}
+
+void varlink_metrics_call_finish(VarlinkMetrics *metrics,
+                                 VarlinkMethodMetrics *method,
+                                 uint64_t usec,
+                                 bool error) {
+        unsigned long bucket = 0;
+
+        /* The smallest power of two not less than usec. */
+        if (usec > 1)
+                bucket = 64 - __builtin_clzll(usec - 1);
+
+        method->latency[MIN(bucket, VARLINK_METRICS_N_BUCKETS - 1)] += 1;
+        method->duration_usec += usec;
+
+        if (error)
+                method->n_errors += 1;
+
+        metrics->n_calls_in_flight -= 1;
+}
+
+void varlink_metrics_handler_finish(VarlinkMetrics *metrics,
+                                    VarlinkMethodMetrics *method,
+                                    uint64_t usec,
+                                    bool slow) {
+        method->handler_usec += usec;
+        method->handler_max_usec = MAX(method->handler_max_usec, usec);
+
+        if (slow) {
+                method->n_slow += 1;
+                metrics->n_slow_calls += 1;
+        }
+}
+
+long varlink_metrics_write(VarlinkMetrics *metrics, VarlinkObject *object) {
+        _cleanup_(varlink_array_unrefp) VarlinkArray *buckets = NULL;
+        _cleanup_(varlink_array_unrefp) VarlinkArray *methods = NULL;
+        long r;
+
+        r = varlink_array_new(&buckets);
+        if (r < 0)
+                return r;
+
+        for (unsigned long i = 0; i < VARLINK_METRICS_N_BUCKETS - 1; i += 1) {
+                r = varlink_array_append_int(buckets, 1LL << i);
+                if (r < 0)
+                        return r;
+        }
+
+        r = varlink_array_new(&methods);
+        if (r < 0)
+                return r;
+
+        for (AVLTreeNode *node = avl_tree_first(metrics->methods); node; node = avl_tree_node_next(node)) {
+                VarlinkMethodMetrics *method = avl_tree_node_get(node);
+                _cleanup_(varlink_object_unrefp) VarlinkObject *m = NULL;
+                _cleanup_(varlink_array_unrefp) VarlinkArray *latency = NULL;
+
+                r = varlink_array_new(&latency);
+                if (r < 0)
+                        return r;
+
+                for (unsigned long i = 0; i < VARLINK_METRICS_N_BUCKETS; i += 1) {
+                        r = varlink_array_append_int(latency, method->latency[i]);
+                        if (r < 0)
+                                return r;
+                }
+
+                r = varlink_object_new(&m);
+                if (r < 0)
+                        return r;
+
+                varlink_object_set_string(m, "method", method->method);
+                varlink_object_set_int(m, "calls", method->n_calls);
+                varlink_object_set_int(m, "errors", method->n_errors);
+                varlink_object_set_int(m, "duration", method->duration_usec);
+                varlink_object_set_int(m, "handler_time", method->handler_usec);
+                varlink_object_set_int(m, "handler_time_max", method->handler_max_usec);
+                varlink_object_set_int(m, "slow", method->n_slow);
+                varlink_object_set_array(m, "latency", latency);
+
+                r = varlink_array_append_object(methods, m);
+                if (r < 0)
+                        return r;
+        }
+
+        varlink_object_set_array(object, "latency_buckets", buckets);
+        varlink_object_set_array(object, "methods", methods);
+        varlink_object_set_int(object, "calls_in_flight", metrics->n_calls_in_flight);
+        varlink_object_set_int(object, "connections_total", metrics->n_connections_total);
+        varlink_object_set_int(object, "loop_lag_max", metrics->loop_lag_max_usec);
+        varlink_object_set_int(object, "dispatch_delay_max", metrics->dispatch_delay_max_usec);
+        varlink_object_set_int(object, "slow_calls", metrics->n_slow_calls);
+
+        return 0;
+}
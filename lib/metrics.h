@@ -0,0 +1,86 @@
+// SPDX-License-Identifier: Apache-2.0
+
+#pragma once
+
+#include "avltree.h"
+#include "varlink.h"
+
+/*
+ * Latency buckets have upper bounds of 1, 2, 4, ... 2^19 microseconds,
+ * the last bucket counts everything longer.
+ */
+#define VARLINK_METRICS_N_BUCKETS 21
+
+/* Calls to more distinct method names are counted under "*". */
+#define VARLINK_METRICS_MAX_METHODS 1024
+
+typedef struct VarlinkMetrics VarlinkMetrics;
+typedef struct VarlinkMethodMetrics VarlinkMethodMetrics;
+
+struct VarlinkMethodMetrics {
+        char *method;
+
+        uint64_t n_calls;
+        uint64_t n_errors;
+        uint64_t duration_usec;
+        uint64_t latency[VARLINK_METRICS_N_BUCKETS];
+
+        /* Time spent inside the handler, while the event loop was blocked. */
+        uint64_t handler_usec;
+        uint64_t handler_max_usec;
+        uint64_t n_slow;
+};
+
+/*
+ * Counters of a service. They are only touched from the thread running
+ * the service's event loop, so updating them needs no synchronization;
+ * values which can be derived from the connections are summed up only
+ * when the metrics are read.
+ */
+struct VarlinkMetrics {
+        AVLTree *methods;
+
+        uint64_t n_calls_in_flight;
+        uint64_t n_connections_total;
+
+        /* Traffic of connections which are already closed. */
+        uint64_t n_bytes_in;
+        uint64_t n_bytes_out;
+
+        uint64_t loop_lag_max_usec;
+
+        /* Longest time from waking up to dispatching a ready connection. */
+        uint64_t dispatch_delay_max_usec;
+
+        uint64_t n_slow_calls;
+};
+
+long varlink_metrics_new(VarlinkMetrics **metricsp);
+VarlinkMetrics *varlink_metrics_free(VarlinkMetrics *metrics);
+void varlink_metrics_freep(VarlinkMetrics **metricsp);
+
+/*
+ * Account for a new call to @method. Returns the counters which have to
+ * be passed to varlink_metrics_call_finish(), or NULL on allocation
+ * failure.
+ */
+VarlinkMethodMetrics *varlink_metrics_call_start(VarlinkMetrics *metrics, const char *method);
+void varlink_metrics_call_finish(VarlinkMetrics *metrics,
+                                 VarlinkMethodMetrics *method,
+                                 uint64_t usec,
+                                 bool error);
+
+/*
+ * Account for a handler of @method which returned after @usec, @slow
+ * if it exceeded the threshold of the service.
+ */
+void varlink_metrics_handler_finish(VarlinkMetrics *metrics,
+                                    VarlinkMethodMetrics *method,
+                                    uint64_t usec,
+                                    bool slow);
+
+/*
+ * Write the counters to @object in the format of the
+ * org.varlink.metrics.GetMetrics() reply.
+ */
+long varlink_metrics_write(VarlinkMetrics *metrics, VarlinkObject *object);
@@ -1,5 +1,6 @@
 // SPDX-License-Identifier: Apache-2.0
 
+#include "alloc.h"
 #include "array.h"
 #include "avltree.h"
 #include "object.h"
@@ -14,13 +15,23 @@ typedef struct Field Field;
 
 struct VarlinkObject {
         unsigned long refcount;
+        const VarlinkAllocator *allocator;
         AVLTree *fields;
         bool writable;
+
+        /* Frozen objects are shared between threads and counted atomically. */
+        bool frozen;
+
+        /* The cached JSON of a frozen object, allocated by libc. */
+        char *json;
+        long json_length;
 };
 
+/* The name is stored inline, a field is a single allocation. */
 struct Field {
-        char *name;
+        const VarlinkAllocator *allocator;
         VarlinkValue value;
+        char name[];
 };
 
 static long field_compare(const void *key, void *value) {
@@ -32,29 +43,29 @@ static long field_compare(const void *key, void *value) {
 static void field_freep(void *ptr) {
         Field *field = *(void **)ptr;
 
-        free(field->name);
-        varlink_value_clear(&field->value);
-        free(field);
+        varlink_value_clear(&field->value, field->allocator);
+        varlink_allocator_free(field->allocator, field);
 }
 
 static long object_add_field(VarlinkObject *object, const char *name, Field **fieldp) {
-        _cleanup_(freep) Field *field = NULL;
+        size_t length = strlen(name);
+        Field *field;
         long r;
 
-        field = calloc(1, sizeof(Field));
+        field = varlink_allocator_calloc(object->allocator, 1, sizeof(Field) + length + 1);
         if (!field)
                 return -VARLINK_ERROR_PANIC;
 
-        field->name = strdup(name);
-        if (!field->name)
-                return -VARLINK_ERROR_PANIC;
+        field->allocator = object->allocator;
+        memcpy(field->name, name, length + 1);
 
         r = avl_tree_insert(object->fields, field->name, field);
-        if (r < 0)
+        if (r < 0) {
+                varlink_allocator_free(object->allocator, field);
                 return -VARLINK_ERROR_PANIC;
+        }
 
         *fieldp = field;
-        field = NULL;
 
         return 0;
 }
@@ -65,15 +76,18 @@ static void object_remove_field(VarlinkObject *object, const char *name) {
 
 _public_ long varlink_object_new(VarlinkObject **objectp) {
         _cleanup_(varlink_object_unrefp) VarlinkObject *object = NULL;
+        const VarlinkAllocator *allocator;
         long r;
 
-        object = calloc(1, sizeof(VarlinkObject));
+        allocator = varlink_get_thread_allocator();
+        object = varlink_allocator_calloc(allocator, 1, sizeof(VarlinkObject));
         if (!object)
                 return -VARLINK_ERROR_PANIC;
 
         object->refcount = 1;
+        object->allocator = allocator;
         object->writable = true;
-        r = avl_tree_new(&object->fields, field_compare, field_freep);
+        r = avl_tree_new_with_allocator(&object->fields, field_compare, field_freep, allocator);
         if (r < 0)
                 return -VARLINK_ERROR_PANIC;
 
@@ -97,7 +111,7 @@ long varlink_object_new_from_scanner(VarlinkObject **objectp, Scanner *scanner,
                 return r;
 
         while (scanner_peek(scanner) != '}') {
-                _cleanup_(freep) char *name = NULL;
+                char *name;
                 Field *field;
 
                 if (!first) {
@@ -105,23 +119,26 @@ long varlink_object_new_from_scanner(VarlinkObject **objectp, Scanner *scanner,
                                 return -VARLINK_ERROR_INVALID_JSON;
                 }
 
-                r = scanner_expect_string(scanner, &name);
+                /* The name is copied into the field, it comes from the same allocator. */
+                r = scanner_expect_string(scanner, object->allocator, &name);
                 if (r < 0)
                         return r;
 
                 if (scanner_expect_operator(scanner, ":") < 0)
-                        return -VARLINK_ERROR_INVALID_JSON;
+                        r = -VARLINK_ERROR_INVALID_JSON;
+                else
+                        r = object_add_field(object, name, &field);
 
-                r = object_add_field(object, name, &field);
+                varlink_allocator_free(object->allocator, name);
                 if (r < 0)
                         return r;
 
-                if (!varlink_value_read_from_scanner(&field->value, scanner, locale, depth_cnt))
+                if (!varlink_value_read_from_scanner(&field->value, scanner, object->allocator, locale, depth_cnt))
                         return -VARLINK_ERROR_INVALID_JSON;
 
                 /* Treat `null` the same as non-existent keys */
                 if (field->value.kind == VARLINK_VALUE_NULL)
-                        object_remove_field(object, name);
+                        object_remove_field(object, field->name);
 
                 first = false;
         }
@@ -167,21 +184,65 @@ _public_ long varlink_object_new_from_json(VarlinkObject **objectp, const char *
 }
 
 _public_ VarlinkObject *varlink_object_ref(VarlinkObject *object) {
-        object->refcount += 1;
+        if (object->frozen)
+                __atomic_add_fetch(&object->refcount, 1, __ATOMIC_RELAXED);
+        else
+                object->refcount += 1;
+
         return object;
 }
 
 _public_ VarlinkObject *varlink_object_unref(VarlinkObject *object) {
-        object->refcount -= 1;
+        unsigned long refcount;
 
-        if (object->refcount == 0) {
-                avl_tree_free(object->fields);
-                free(object);
+        if (object->frozen)
+                refcount = __atomic_sub_fetch(&object->refcount, 1, __ATOMIC_ACQ_REL);
+        else
+                refcount = --object->refcount;
+
+        if (refcount == 0) {
+                if (object->fields)
+                        avl_tree_free(object->fields);
+                free(object->json);
+                varlink_allocator_free(object->allocator, object);
         }
 
         return NULL;
 }
 
+_public_ long varlink_object_freeze(VarlinkObject *object, uint64_t flags) {
+        long r;
+
+        /* A frozen object might be shared already, the cache cannot be added anymore. */
+        if (object->frozen) {
+                if ((flags & VARLINK_FREEZE_CACHE_JSON) && !object->json)
+                        return -VARLINK_ERROR_READ_ONLY;
+
+                return 0;
+        }
+
+        for (AVLTreeNode *node = avl_tree_first(object->fields); node; node = avl_tree_node_next(node)) {
+                Field *field = avl_tree_node_get(node);
+
+                r = varlink_value_freeze(&field->value);
+                if (r < 0)
+                        return r;
+        }
+
+        if (flags & VARLINK_FREEZE_CACHE_JSON) {
+                r = varlink_object_to_json(object, &object->json);
+                if (r < 0)
+                        return r;
+
+                object->json_length = r;
+        }
+
+        object->writable = false;
+        object->frozen = true;
+
+        return 0;
+}
+
 _public_ void varlink_object_unrefp(VarlinkObject **objectp) {
         if (*objectp)
                 varlink_object_unref(*objectp);
@@ -385,7 +446,7 @@ _public_ long varlink_object_set_string(VarlinkObject *object, const char *field
                 return r;
 
         field->value.kind = VARLINK_VALUE_STRING;
-        field->value.s = strdup(string);
+        field->value.s = varlink_allocator_strdup(object->allocator, string);
         if (!field->value.s)
                 return -VARLINK_ERROR_PANIC;
 
@@ -456,6 +517,14 @@ long varlink_object_write_json(VarlinkObject *object,
         _cleanup_(freep) const char **field_names = NULL;
         long r;
 
+        /* The cached JSON is the compact form. */
+        if (object->json && indent < 0 && !*key_pre && !*key_post && !*value_pre && !*value_post) {
+                if (fwrite(object->json, 1, object->json_length, stream) != (size_t)object->json_length)
+                        return -VARLINK_ERROR_PANIC;
+
+                return 0;
+        }
+
         n_fields = varlink_object_get_field_names(object, &field_names);
         if (n_fields < 0)
                 return n_fields;
@@ -0,0 +1,35 @@
+// SPDX-License-Identifier: Apache-2.0
+
+#pragma once
+
+/*
+ * Static tracepoints in the "libvarlink" provider. With <sys/sdt.h>
+ * available at build time, every probe compiles to a single nop and a
+ * note in the ELF file, which bpftrace, perf or SystemTap can attach to,
+ * e.g. usdt:/usr/lib64/libvarlink.so.0:libvarlink:dispatch__start.
+ * Without it, probes compile to nothing and their arguments are not
+ * evaluated.
+ *
+ *   message__read      (int fd, unsigned long size)
+ *   message__parsed    (int fd, unsigned long size, long result)
+ *   message__queued    (int fd, unsigned long size, unsigned long buffered)
+ *   flush__partial     (int fd, long written, unsigned long remaining)
+ *   flush__complete    (int fd, long written)
+ *   service__accept    (int listen_fd, int fd)
+ *   service__close     (int fd)
+ *   dispatch__start    (int fd, const char *method, uint64_t flags)
+ *   dispatch__end      (int fd, const char *method, long result)
+ *   reply__queued      (int fd, const char *method, const char *error, uint64_t flags)
+ *   connection__open   (int fd)
+ *   connection__close  (int fd)
+ *   connection__call   (int fd, const char *method, uint64_t flags)
+ *   connection__reply  (int fd, const char *error, uint64_t flags)
+ */
+
+#if HAVE_SYS_SDT_H
+#include <sys/sdt.h>
+
+#define VARLINK_PROBE(_name, ...) STAP_PROBEV(libvarlink, _name, ##__VA_ARGS__)
+#else
+#define VARLINK_PROBE(_name, ...) do {} while (0)
+#endif
@@ -0,0 +1,58 @@
+// SPDX-License-Identifier: Apache-2.0
+
+#pragma once
+
+#include "varlink.h"
+
+/*
+ * A token bucket which refills with @rate tokens per second, up to
+ * @burst tokens. Tokens are kept in millionths, so a refill needs no
+ * division and the state fits into two integers.
+ */
+typedef struct {
+        int64_t tokens;
+        uint64_t updated_usec;
+} TokenBucket;
+
+static inline void token_bucket_init(TokenBucket *bucket, uint64_t burst, uint64_t now) {
+        bucket->tokens = (int64_t)(burst * 1000000);
+        bucket->updated_usec = now;
+}
+
+/*
+ * Takes @n tokens from @bucket. Requests larger than the burst are
+ * granted on a full bucket and leave it in debt, so they are paid back
+ * before the next one.
+ *
+ * Returns 0 if they were taken, or the microseconds to wait until they
+ * are available.
+ */
+static inline uint64_t token_bucket_take(TokenBucket *bucket,
+                                         uint64_t rate,
+                                         uint64_t burst,
+                                         uint64_t n,
+                                         uint64_t now) {
+        int64_t full = (int64_t)(burst * 1000000);
+        int64_t need = (int64_t)((n < burst ? n : burst) * 1000000);
+        uint64_t elapsed = now - bucket->updated_usec;
+
+        bucket->updated_usec = now;
+
+        /* Do not overflow on long idle periods, the bucket is full anyway. */
+        if (elapsed >= (uint64_t)(full - bucket->tokens) / rate + 1)
+                bucket->tokens = full;
+        else
+                bucket->tokens += (int64_t)(elapsed * rate);
+
+        if (bucket->tokens < need)
+                return (uint64_t)(need - bucket->tokens + rate - 1) / rate;
+
+        bucket->tokens -= (int64_t)(n * 1000000);
+
+        return 0;
+}
+
+/* Returns @n tokens which were taken for something which did not happen. */
+static inline void token_bucket_give(TokenBucket *bucket, uint64_t n) {
+        bucket->tokens += (int64_t)(n * 1000000);
+}
@@ -1,5 +1,6 @@
 // SPDX-License-Identifier: Apache-2.0
 
+#include "alloc.h"
 #include "scanner.h"
 #include "util.h"
 #include "varlink.h"
@@ -50,7 +51,7 @@ void scanner_error(Scanner *scanner, long error) {
 long scanner_new(Scanner **scannerp, const char *string, bool comments) {
         Scanner *scanner;
 
-        scanner = calloc(1, sizeof(Scanner));
+        scanner = varlink_calloc(1, sizeof(Scanner));
         if (!scanner)
                 return -VARLINK_ERROR_PANIC;
 
@@ -65,7 +66,7 @@ long scanner_new(Scanner **scannerp, const char *string, bool comments) {
 }
 
 Scanner *scanner_free(Scanner *scanner) {
-        free(scanner);
+        varlink_free(scanner);
         return NULL;
 }
 
@@ -269,7 +270,7 @@ long scanner_expect_interface_name(Scanner *scanner, char **namep) {
                 return -VARLINK_ERROR_INVALID_INTERFACE;
         }
 
-        name = strndup(scanner->p, len);
+        name = varlink_strndup(scanner->p, len);
         if (!name)
                 return -VARLINK_ERROR_PANIC;
 
@@ -324,7 +325,7 @@ long scanner_expect_field_name(Scanner *scanner, char **namep) {
                         return -VARLINK_ERROR_INVALID_TYPE;
         }
 
-        name = strndup(scanner->p, len);
+        name = varlink_strndup(scanner->p, len);
         if (!name)
                 return -VARLINK_ERROR_PANIC;
 
@@ -367,7 +368,7 @@ long scanner_expect_member_name(Scanner *scanner, char **namep) {
                 return -VARLINK_ERROR_INVALID_IDENTIFIER;
         }
 
-        name = strndup(scanner->p, len);
+        name = varlink_strndup(scanner->p, len);
         if (!name)
                 return -VARLINK_ERROR_PANIC;
 
@@ -385,7 +386,7 @@ long scanner_expect_type_name(Scanner *scanner, char **namep) {
         char *name;
 
         if (member_name_valid(scanner->p, len)) {
-                name = strndup(scanner->p, len);
+                name = varlink_strndup(scanner->p, len);
                 if (!name)
                         return -VARLINK_ERROR_PANIC;
 
@@ -424,7 +425,7 @@ long scanner_expect_type_name(Scanner *scanner, char **namep) {
                 return -VARLINK_ERROR_INVALID_IDENTIFIER;
         }
 
-        name = strndup(scanner->p, len);
+        name = varlink_strndup(scanner->p, len);
         if (!name)
                 return -VARLINK_ERROR_PANIC;
 
@@ -453,7 +454,13 @@ static bool unhex(char d, uint8_t *valuep) {
         }
 }
 
-static size_t read_unicode_char(const char *p, FILE *stream) {
+/*
+ * Decodes the \u escape sequence at @p (after the "\u") and writes it as
+ * UTF-8 to *@outp. At most four bytes are written, which is never more
+ * than the escape sequence itself.
+ */
+static size_t read_unicode_char(const char *p, char **outp) {
+        char *out = *outp;
         uint8_t digits[4];
         uint32_t cp;
         uint16_t cu;
@@ -494,48 +501,38 @@ static size_t read_unicode_char(const char *p, FILE *stream) {
         }
 
         if (cp <= 0x007f) {
-                fprintf(stream, "%c", (char)cp);
+                *out++ = (char)cp;
 
         } else if (cp <= 0x07ff) {
-                fprintf(stream, "%c", (char)(0xc0 | (cp >> 6)));
-                fprintf(stream, "%c", (char)(0x80 | (cp & 0x3f)));
+                *out++ = (char)(0xc0 | (cp >> 6));
+                *out++ = (char)(0x80 | (cp & 0x3f));
         }
 
         else if (cp >= 0x0800 && cp <= 0xFFFF) {
-                fprintf(stream, "%c", (char)(0xe0 | (cp >> 12)));
-                fprintf(stream, "%c", (char)(0x80 | ((cp >> 6) & 0x3f)));
-                fprintf(stream, "%c", (char)(0x80 | (cp & 0x3f)));
+                *out++ = (char)(0xe0 | (cp >> 12));
+                *out++ = (char)(0x80 | ((cp >> 6) & 0x3f));
+                *out++ = (char)(0x80 | (cp & 0x3f));
         }
 
         else if (cp >= 0x10000 && cp <= 0x10FFFF) {
-                fprintf(stream, "%c", (char)(0xf0 | (cp >> 18)));
-                fprintf(stream, "%c", (char)(0x80 | ((cp >> 12) & 0x3f)));
-                fprintf(stream, "%c", (char)(0x80 | ((cp >> 6) & 0x3f)));
-                fprintf(stream, "%c", (char)(0x80 | (cp & 0x3f)));
+                *out++ = (char)(0xf0 | (cp >> 18));
+                *out++ = (char)(0x80 | ((cp >> 12) & 0x3f));
+                *out++ = (char)(0x80 | ((cp >> 6) & 0x3f));
+                *out++ = (char)(0x80 | (cp & 0x3f));
         }
 
+        *outp = out;
         return size;
 }
 
 
-long scanner_expect_string(Scanner *scanner, char **stringp) {
-        _cleanup_(freep) char *string = NULL;
-        _cleanup_(fclosep) FILE *stream = NULL;
+/* Unescapes the string at *@pp into @string and moves *@pp past its closing quote. */
+static long scanner_unescape_string(Scanner *scanner, const char **pp, char *string) {
+        const char *p = *pp;
+        char *out = string;
         size_t size, utf8_len;
-        const char *p;
         const char *utf8_str;
 
-        p = scanner_advance(scanner);
-
-        if (*p != '"')
-                return -VARLINK_ERROR_INVALID_JSON;
-
-        p += 1;
-
-        stream = open_memstream(&string, &size);
-        if (!stream)
-                return -VARLINK_ERROR_PANIC;
-
         for (;;) {
                 if (*p == '\0')
                         return -VARLINK_ERROR_INVALID_JSON;
@@ -555,48 +552,40 @@ long scanner_expect_string(Scanner *scanner, char **stringp) {
                         p += 1;
                         switch (*p) {
                                 case '"':
-                                        if (fprintf(stream, "\"") < 0)
-                                                return -VARLINK_ERROR_PANIC;
+                                        *out++ = '"';
                                         break;
 
                                 case '\\':
-                                        if (fprintf(stream, "\\") < 0)
-                                                return -VARLINK_ERROR_PANIC;
+                                        *out++ = '\\';
                                         break;
 
                                 case '/':
-                                        if (fprintf(stream, "/") < 0)
-                                                return -VARLINK_ERROR_PANIC;
+                                        *out++ = '/';
                                         break;
 
                                 case 'b':
-                                        if (fprintf(stream, "\b") < 0)
-                                                return -VARLINK_ERROR_PANIC;
+                                        *out++ = '\b';
                                         break;
 
                                 case 'f':
-                                        if (fprintf(stream, "\f") < 0)
-                                                return -VARLINK_ERROR_PANIC;
+                                        *out++ = '\f';
                                         break;
 
                                 case 'n':
-                                        if (fprintf(stream, "\n") < 0)
-                                                return -VARLINK_ERROR_PANIC;
+                                        *out++ = '\n';
                                         break;
 
                                 case 'r':
-                                        if (fprintf(stream, "\r") < 0)
-                                                return -VARLINK_ERROR_PANIC;
+                                        *out++ = '\r';
                                         break;
 
                                 case 't':
-                                        if (fprintf(stream, "\t") < 0)
-                                                return -VARLINK_ERROR_PANIC;
+                                        *out++ = '\t';
                                         break;
 
                                 case 'u':
-                                        size =read_unicode_char(p + 1, stream);
-                                        if ( size == 0) {
+                                        size = read_unicode_char(p + 1, &out);
+                                        if (size == 0) {
                                                 scanner_error(scanner, SCANNER_ERROR_INVALID_CHARACTER);
                                                 return -VARLINK_ERROR_INVALID_JSON;
                                         }
@@ -609,14 +598,14 @@ long scanner_expect_string(Scanner *scanner, char **stringp) {
                                         return -VARLINK_ERROR_INVALID_JSON;
                         }
 
-                } else if (fprintf(stream, "%c", *p) < 0)
-                        return -VARLINK_ERROR_PANIC;
+                } else
+                        *out++ = *p;
 
                 p += 1;
         }
 
-        fclose(stream);
-        stream = NULL;
+        *out = '\0';
+        size = out - string;
 
         utf8_str = string;
         utf8_len = size;
@@ -627,11 +616,50 @@ long scanner_expect_string(Scanner *scanner, char **stringp) {
                 return -VARLINK_ERROR_INVALID_JSON;
         }
 
-        if (stringp) {
-                *stringp = string;
-                string = NULL;
+        *pp = p;
+        return 0;
+}
+
+long scanner_expect_string(Scanner *scanner, const VarlinkAllocator *allocator, char **stringp) {
+        char *string;
+        const char *p;
+        const char *end;
+        long r;
+
+        p = scanner_advance(scanner);
+
+        if (*p != '"')
+                return -VARLINK_ERROR_INVALID_JSON;
+
+        p += 1;
+
+        /*
+         * Unescaping never makes the string longer, the raw length is enough
+         * for a single allocation.
+         */
+        end = p;
+        while (*end != '\0' && *end != '"') {
+                if (*end == '\\' && end[1] != '\0')
+                        end += 1;
+
+                end += 1;
+        }
+
+        string = varlink_allocator_malloc(allocator, end - p + 1);
+        if (!string)
+                return -VARLINK_ERROR_PANIC;
+
+        r = scanner_unescape_string(scanner, &p, string);
+        if (r < 0) {
+                varlink_allocator_free(allocator, string);
+                return r;
         }
 
+        if (stringp)
+                *stringp = string;
+        else
+                varlink_allocator_free(allocator, string);
+
         scanner->p = p;
         return 0;
 }
@@ -2,6 +2,8 @@
 
 #pragma once
 
+#include "varlink.h"
+
 #include <stdbool.h>
 #include <stdint.h>
 #include <locale.h>
@@ -79,7 +81,8 @@ char scanner_peek(Scanner *scanner);
  */
 long scanner_expect_interface_name(Scanner *scanner, char **namep);
 long scanner_expect_field_name(Scanner *scanner, char **namep);
-long scanner_expect_string(Scanner *scanner, char **stringp);
+/* The string is allocated with @allocator, see varlink_allocator_malloc(). */
+long scanner_expect_string(Scanner *scanner, const VarlinkAllocator *allocator, char **stringp);
 long scanner_expect_member_name(Scanner *scanner, char **namep);
 long scanner_expect_operator(Scanner *scanner, const char *op);
 long scanner_expect_type_name(Scanner *scanner, char **namep);
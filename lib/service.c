@@ -1,31 +1,143 @@
 // SPDX-License-Identifier: Apache-2.0
 
+#include "alloc.h"
+#include "cache.h"
+#include "connection.h"
+#include "coroutine.h"
 #include "interface.h"
+#include "ioring.h"
 #include "message.h"
+#include "metrics.h"
 #include "object.h"
+#include "probe.h"
+#include "ratelimit.h"
 #include "service.h"
 #include "stream.h"
+#include "threadpool.h"
+#include "trace.h"
 #include "transport.h"
 #include "uri.h"
 #include "util.h"
 
+#include <errno.h>
+#include <inttypes.h>
+#include <pthread.h>
 #include <stdarg.h>
 #include <stdbool.h>
 #include <stddef.h>
 #include <stdint.h>
+#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/queue.h>
+#include <sys/socket.h>
+#include <sys/timerfd.h>
 #include <unistd.h>
 
 #include "org.varlink.service.varlink.c.inc"
+#include "org.varlink.metrics.varlink.c.inc"
+#include "org.varlink.ratelimit.varlink.c.inc"
+
+/* Messages a connection may dispatch in a row, before the others get their turn. */
+#define SERVICE_DISPATCH_BUDGET 32
+
+/* Submission slots of the io_uring; a full queue is submitted right away. */
+#define SERVICE_RING_ENTRIES 256
+
+/* Requests of the io_uring carry their connection, or the service, with their kind in the low bits. */
+#define SERVICE_RING_RECEIVE 1
+#define SERVICE_RING_SEND 2
+#define SERVICE_RING_ACCEPT 3
+#define SERVICE_RING_MASK 3
+
+/* Sent to calls over the rate limit, which are not parsed beyond their envelope. */
+static const char rate_limit_reply[] = "{\"error\":\"org.varlink.ratelimit.LimitExceeded\"}";
 
 typedef struct {
+        uid_t uid;
+        TokenBucket calls;
+        TokenBucket bytes;
+} RateBuckets;
+
+typedef struct ServiceConnection ServiceConnection;
+
+/* A client connection whose events are dispatched by the service. */
+typedef struct {
+        VarlinkService *service;
+        VarlinkConnection *connection;
+        int fd;
+        uint32_t events_mask;
+        bool edge_triggered;
+} AttachedConnection;
+
+/* A reply made by a handler on a worker thread, serialized for the event loop to send. */
+typedef struct OffloadReply OffloadReply;
+
+struct OffloadReply {
+        char *json;
+        unsigned long length;
+        char *error;
+        uint64_t flags;
+
+        STAILQ_ENTRY(OffloadReply) entry;
+};
+
+struct ServiceConnection {
         VarlinkStream *stream;
         uint32_t events_mask;
         uint32_t current_events_mask;
         VarlinkCall *call;
-} ServiceConnection;
+
+        /* Credentials of UNIX domain socket peers. */
+        bool has_uid;
+        uid_t uid;
+
+        /* Multiplies the dispatch budget, given by the peer's UID. */
+        unsigned long weight;
+
+        /* The connection's own buckets, or the shared ones of its UID. */
+        RateBuckets own_buckets;
+        RateBuckets *buckets;
+
+        /* Over its rate limit, does not read until the resume time. */
+        bool paused;
+        uint64_t resume_usec;
+        TAILQ_ENTRY(ServiceConnection) paused_entry;
+
+        /* Used up its budget with messages left in the buffer. */
+        bool ready;
+        TAILQ_ENTRY(ServiceConnection) ready_entry;
+
+        /*
+         * Registered once for all events; the socket's readiness is kept
+         * here until reading or writing runs into EAGAIN.
+         */
+        bool edge_triggered;
+        bool readable;
+        bool writable;
+
+        /*
+         * Read and written through the service's io_uring, with a
+         * multishot receive and at most one send in flight. Received data
+         * which does not fit into the stream waits in the overflow, with
+         * the receive cancelled. A closed connection is freed when its
+         * last request completed.
+         */
+        bool ring;
+        bool receiving;
+        bool sending;
+        bool cancelled;
+        bool closed;
+        uint8_t *overflow;
+        unsigned long overflow_size;
+};
+
+typedef struct {
+        uid_t uid;
+        unsigned long weight;
+} PeerWeight;
 
 struct VarlinkService {
         char *vendor;
@@ -43,9 +155,80 @@ struct VarlinkService {
         AVLTree *connections;
         VarlinkMethodCallback method_callback;
         void *method_callback_userdata;
+
+        VarlinkMetrics *metrics;
+        VarlinkCache *cache;
+
+        /* Methods whose identical calls share a reply, and their calls in progress. */
+        AVLTree *coalesced_methods;
+        AVLTree *flights;
+
+        /* The connection whose events are being dispatched. */
+        ServiceConnection *dispatching;
+
+        unsigned long dispatch_budget;
+        AVLTree *peer_weights;
+        TAILQ_HEAD(ready, ServiceConnection) ready;
+
+        /*
+         * New connections are registered edge-triggered. Connections which
+         * get ready outside of varlink_service_process_events() wake up
+         * the event loop with the eventfd.
+         */
+        bool edge_triggered;
+        bool processing;
+        int ready_fd;
+
+        /*
+         * New connections are accepted through the io_uring, which is in
+         * the epoll set, while the listening socket is not. The listening
+         * socket and closed connections wait for their requests in flight.
+         */
+        IoRing *ring;
+        bool ring_accepting;
+        bool ring_accept_in_flight;
+        unsigned long n_ring_closing;
+
+        bool rate_limited;
+        VarlinkRateLimit rate_limit;
+        AVLTree *uid_buckets;
+        TAILQ_HEAD(paused, ServiceConnection) paused;
+
+        /* Wakes up the event loop when the first paused connection may resume. */
+        int timer_fd;
+
+        /*
+         * Methods whose handlers run on the worker threads of the pool. The
+         * lock protects the calls with news for the event loop, which is
+         * woken up by the eventfd.
+         */
+        AVLTree *offloaded_methods;
+        ThreadPool *pool;
+        pthread_mutex_t offload_lock;
+        STAILQ_HEAD(completed, VarlinkCall) completed;
+        int offload_fd;
+
+        /*
+         * Methods whose handlers run as coroutines, the ones which are alive
+         * and the ones which may continue. Replies to the calls they await
+         * might be read outside of the service's event loop, so it is woken
+         * up by the eventfd.
+         */
+        AVLTree *coroutine_methods;
+        LIST_HEAD(coroutines, VarlinkCall) coroutines;
+        STAILQ_HEAD(runnable, VarlinkCall) runnable;
+        int resume_fd;
+
+        /* Client connections in the epoll set, keyed by their address which is also their epoll data. */
+        AVLTree *attached;
+
+        VarlinkSlowCallFunc slow_call_callback;
+        void *slow_call_userdata;
+        uint64_t slow_call_threshold_usec;
 };
 
 struct VarlinkCall {
+        /* Counted atomically, offloaded handlers take references on worker threads. */
         long refcount;
 
         VarlinkService *service;
@@ -55,29 +238,142 @@ struct VarlinkCall {
         VarlinkObject *parameters;
         uint64_t flags;
 
+        VarlinkMethodMetrics *method_metrics;
+        uint64_t start_usec;
+
+        /* The metrics of a handler which returns after its call was dispatched. */
+        VarlinkMethodMetrics *handler_metrics;
+
+        /* The span of this service, only active if the caller sent a trace context. */
+        VarlinkSpan span;
+        char traceparent[VARLINK_TRACEPARENT_LENGTH + 1];
+
+        /* How long the client may keep the reply, advertised in its envelope. */
+        uint64_t reply_ttl_usec;
+
+        /* Identifies the call, set if its reply can be cached or shared. */
+        char *key;
+        uint64_t cache_ttl_usec;
+        uint64_t cache_generation;
+
+        /*
+         * Identical calls which arrive while this one is in progress wait
+         * for its reply instead of running the handler again.
+         */
+        bool coalesce;
+        bool in_flight;
+        VarlinkCall *leader;
+        STAILQ_HEAD(waiters, VarlinkCall) waiters;
+        STAILQ_ENTRY(VarlinkCall) waiter_entry;
+
+        /*
+         * The handler runs on a worker thread. Until the event loop picked
+         * up its result, replies are queued for the loop to send.
+         */
+        bool offload;
+        bool offloaded;
+        bool offload_done;
+        bool offload_queued;
+        long offload_result;
+        uint64_t offload_usec;
+        ThreadPoolJob job;
+        STAILQ_HEAD(offload_replies, OffloadReply) offload_replies;
+        STAILQ_ENTRY(VarlinkCall) completed_entry;
+
+        /*
+         * The handler runs as a coroutine, which is suspended while it
+         * awaits replies from other services and made runnable again by
+         * their arrival.
+         */
+        bool suspendable;
+        Coroutine *coroutine;
+        long coroutine_result;
+        uint64_t coroutine_usec;
+        bool runnable;
+        STAILQ_ENTRY(VarlinkCall) runnable_entry;
+        LIST_ENTRY(VarlinkCall) coroutine_entry;
+
+        /* Detached from its connection, which might be gone. */
+        bool finished;
+
+        /*
+         * The connection closed while the handler ran on a worker. The
+         * event loop finishes the call when the handler returned.
+         */
+        bool closed;
+
         VarlinkCallConnectionClosed closed_callback;
         void *closed_callback_userdata;
 };
 
+static OffloadReply *offload_reply_free(OffloadReply *reply) {
+        /* Serialized by varlink_object_to_json(), with libc. */
+        free(reply->json);
+        varlink_free(reply->error);
+        varlink_free(reply);
+
+        return NULL;
+}
+
 static long varlink_call_new(VarlinkCall **callp,
                              VarlinkService *service,
                              ServiceConnection *connection,
                              VarlinkObject *message) {
         _cleanup_(varlink_call_unrefp) VarlinkCall *call = NULL;
+        const char *traceparent;
+        VarlinkSpan remote;
         long r;
 
-        call = calloc(1, sizeof(VarlinkCall));
+        call = varlink_calloc(1, sizeof(VarlinkCall));
         if (!call)
                 return -VARLINK_ERROR_PANIC;
 
         call->refcount = 1;
         call->service = service;
         call->connection = connection;
+        STAILQ_INIT(&call->waiters);
+        STAILQ_INIT(&call->offload_replies);
 
-        r = varlink_message_unpack_call(message, &call->method, &call->parameters, &call->flags);
+        r = varlink_message_unpack_call(message, &call->method, &call->parameters, &call->flags, &traceparent);
         if (r < 0)
                 return r;
 
+        /* Only plain calls, a reply to "more" or "oneway" is not the same for everyone. */
+        if (call->flags == 0) {
+                if (service->cache)
+                        call->cache_ttl_usec = varlink_cache_get_ttl(service->cache, call->method);
+
+                call->coalesce = service->coalesced_methods &&
+                                 avl_tree_find(service->coalesced_methods, call->method);
+
+                if (call->cache_ttl_usec > 0 || call->coalesce) {
+                        r = varlink_cache_key_new(call->method, call->parameters, &call->key);
+                        if (r < 0)
+                                return r;
+                }
+
+                if (service->cache)
+                        call->cache_generation = service->cache->generation;
+        }
+
+        call->offload = service->offloaded_methods &&
+                        avl_tree_find(service->offloaded_methods, call->method);
+
+        /* Replies to awaited calls arrive on the event loop, not on worker threads. */
+        call->suspendable = !call->offload && service->coroutine_methods &&
+                            avl_tree_find(service->coroutine_methods, call->method);
+
+        if (traceparent && varlink_trace_parse(traceparent, &remote)) {
+                varlink_span_start(&call->span, &remote, false, call->method);
+                varlink_trace_format(&call->span, call->traceparent);
+        }
+
+        /* Last, a call which could not be set up is not counted as in flight. */
+        if (service->metrics) {
+                call->method_metrics = varlink_metrics_call_start(service->metrics, call->method);
+                call->start_usec = now_usec();
+        }
+
         *callp = call;
         call = NULL;
 
@@ -85,20 +381,26 @@ static long varlink_call_new(VarlinkCall **callp,
 }
 
 _public_ VarlinkCall *varlink_call_ref(VarlinkCall *call) {
-        call->refcount += 1;
+        __atomic_add_fetch(&call->refcount, 1, __ATOMIC_RELAXED);
 
         return call;
 }
 
 _public_ VarlinkCall *varlink_call_unref(VarlinkCall *call) {
-        call->refcount -= 1;
-
-        if (call->refcount == 0) {
+        if (__atomic_sub_fetch(&call->refcount, 1, __ATOMIC_ACQ_REL) == 0) {
                 if (call->parameters)
                         varlink_object_unref(call->parameters);
 
-                free(call->method);
-                free(call);
+                while (!STAILQ_EMPTY(&call->offload_replies)) {
+                        OffloadReply *reply = STAILQ_FIRST(&call->offload_replies);
+
+                        STAILQ_REMOVE_HEAD(&call->offload_replies, entry);
+                        offload_reply_free(reply);
+                }
+
+                varlink_free(call->key);
+                varlink_free(call->method);
+                varlink_free(call);
         }
 
         return NULL;
@@ -113,6 +415,74 @@ _public_ const char *varlink_call_get_method(VarlinkCall *call) {
         return call->method;
 }
 
+_public_ long varlink_call_set_cache_ttl(VarlinkCall *call, uint64_t ttl_usec) {
+        call->reply_ttl_usec = ttl_usec;
+
+        return 0;
+}
+
+_public_ const char *varlink_call_get_traceparent(VarlinkCall *call) {
+        if (!varlink_span_is_active(&call->span))
+                return NULL;
+
+        return call->traceparent;
+}
+
+static void varlink_service_restart_flight(VarlinkService *service, VarlinkCall *call);
+static long varlink_service_drain_offloaded(VarlinkService *service);
+static void varlink_service_drain_ring(VarlinkService *service);
+
+/*
+ * Detaches @call from its connection after the last reply, or when the
+ * connection goes away before the call was answered.
+ */
+static VarlinkCall *varlink_call_finish(VarlinkCall *call, bool error) {
+        VarlinkService *service = call->service;
+
+        if (call->leader) {
+                STAILQ_REMOVE(&call->leader->waiters, call, VarlinkCall, waiter_entry);
+                call->leader = NULL;
+        }
+
+        if (call->in_flight) {
+                call->in_flight = false;
+
+                if (service->flights)
+                        avl_tree_remove(service->flights, call->key);
+        }
+
+        /* Went away without a reply, somebody else needs to ask again. */
+        if (!STAILQ_EMPTY(&call->waiters))
+                varlink_service_restart_flight(service, call);
+
+        if (call->method_metrics) {
+                varlink_metrics_call_finish(call->service->metrics,
+                                            call->method_metrics,
+                                            now_usec() - call->start_usec,
+                                            error);
+                call->method_metrics = NULL;
+        }
+
+        varlink_span_end(&call->span, error);
+
+        /* A closed connection is gone already. */
+        if (!call->closed)
+                call->connection->call = NULL;
+        call->finished = true;
+
+        return varlink_call_unref(call);
+}
+
+/*
+ * Finishes @call, whose connection was closed before it was answered.
+ */
+static VarlinkCall *varlink_call_close(VarlinkCall *call) {
+        if (call->closed_callback)
+                call->closed_callback(call, call->closed_callback_userdata);
+
+        return varlink_call_finish(call, true);
+}
+
 static long interface_compare(const void *key, void *value) {
         VarlinkInterface *interface = value;
 
@@ -129,17 +499,35 @@ static long connection_compare(const void *key, void *value) {
 static ServiceConnection *service_connection_free(ServiceConnection *connection) {
         if (connection->call) {
                 VarlinkCall *call = connection->call;
+                bool running = false;
+
+                /* Without a pool, the handlers returned already. */
+                if (call->offloaded && call->service->pool) {
+                        pthread_mutex_lock(&call->service->offload_lock);
+                        running = !call->offload_done;
+                        pthread_mutex_unlock(&call->service->offload_lock);
+                }
 
-                if (call->closed_callback)
-                        call->closed_callback(call, call->closed_callback_userdata);
+                /* The worker still uses the call, varlink_call_drain() finishes it. */
+                if (running)
+                        call->closed = true;
+                else
+                        varlink_call_close(call);
 
-                varlink_call_unref(call);
+                connection->call = NULL;
+        }
+
+        /* The kernel still uses the buffers, the last completion frees the connection. */
+        if (connection->receiving || connection->sending) {
+                connection->closed = true;
+                return NULL;
         }
 
         if (connection->stream)
                 varlink_stream_free(connection->stream);
 
-        free(connection);
+        varlink_free(connection->overflow);
+        varlink_free(connection);
         return NULL;
 }
 
@@ -150,8 +538,31 @@ static void service_connection_freep(ServiceConnection **connectionp) {
 
 static long service_connection_close(VarlinkService *service,
                                      ServiceConnection *connection) {
+        if (connection->ready) {
+                TAILQ_REMOVE(&service->ready, connection, ready_entry);
+                connection->ready = false;
+        }
+
+        if (connection->paused) {
+                TAILQ_REMOVE(&service->paused, connection, paused_entry);
+                connection->paused = false;
+        }
+
         if (connection->stream) {
-                epoll_ctl(service->epoll_fd, EPOLL_CTL_DEL, connection->stream->fd, NULL);
+                VARLINK_PROBE(service__close, connection->stream->fd);
+
+                if (service->metrics) {
+                        service->metrics->n_bytes_in += connection->stream->n_bytes_read;
+                        service->metrics->n_bytes_out += connection->stream->n_bytes_written;
+                }
+
+                if (!connection->ring)
+                        epoll_ctl(service->epoll_fd, EPOLL_CTL_DEL, connection->stream->fd, NULL);
+                else if (connection->receiving || connection->sending) {
+                        io_ring_cancel_fd(service->ring, connection->stream->fd);
+                        service->n_ring_closing += 1;
+                }
+
                 avl_tree_remove(service->connections, (void *)(unsigned long)connection->stream->fd);
         }
 
@@ -197,6 +608,21 @@ static long org_varlink_service_GetInfo(VarlinkService *service,
         return varlink_call_reply(call, info, 0);
 }
 
+static long org_varlink_metrics_GetMetrics(VarlinkService *service,
+                                           VarlinkCall *call,
+                                           VarlinkObject *UNUSED(parameters),
+                                           uint64_t UNUSED(flags),
+                                           void *UNUSED(userdata)) {
+        _cleanup_(varlink_object_unrefp) VarlinkObject *metrics = NULL;
+        long r;
+
+        r = varlink_service_get_metrics(service, &metrics);
+        if (r < 0)
+                return r;
+
+        return varlink_call_reply(call, metrics, 0);
+}
+
 static long varlink_call_reply_interface_not_found(VarlinkCall *call, const char *interface) {
         _cleanup_(varlink_object_unrefp) VarlinkObject *parameters = NULL;
 
@@ -290,12 +716,23 @@ _public_ long varlink_service_new_raw(VarlinkService **servicep,
         _cleanup_(varlink_service_freep) VarlinkService *service = NULL;
         long r;
 
-        service = calloc(1, sizeof(VarlinkService));
+        service = varlink_calloc(1, sizeof(VarlinkService));
         if (!service)
                 return -VARLINK_ERROR_PANIC;
 
         service->listen_fd = -1;
         service->epoll_fd = -1;
+        service->timer_fd = -1;
+        service->offload_fd = -1;
+        pthread_mutex_init(&service->offload_lock, NULL);
+        STAILQ_INIT(&service->completed);
+        service->resume_fd = -1;
+        service->ready_fd = -1;
+        LIST_INIT(&service->coroutines);
+        STAILQ_INIT(&service->runnable);
+        service->dispatch_budget = SERVICE_DISPATCH_BUDGET;
+        TAILQ_INIT(&service->ready);
+        TAILQ_INIT(&service->paused);
 
         r = varlink_uri_new(&service->uri, address, false);
         if (r < 0)
@@ -349,25 +786,25 @@ _public_ long varlink_service_new(VarlinkService **servicep,
                 return r;
 
         if (vendor) {
-                service->vendor = strdup(vendor);
+                service->vendor = varlink_strdup(vendor);
                 if (!service->vendor)
                         return -VARLINK_ERROR_PANIC;
         }
 
         if (product) {
-                service->product = strdup(product);
+                service->product = varlink_strdup(product);
                 if (!service->product)
                         return -VARLINK_ERROR_PANIC;
         }
 
         if (version) {
-                service->version = strdup(version);
+                service->version = varlink_strdup(version);
                 if (!service->version)
                         return -VARLINK_ERROR_PANIC;
         }
 
         if (url) {
-                service->url = strdup(url);
+                service->url = varlink_strdup(url);
                 if (!service->url)
                         return -VARLINK_ERROR_PANIC;
         }
@@ -390,31 +827,129 @@ _public_ long varlink_service_new(VarlinkService **servicep,
 }
 
 _public_ VarlinkService *varlink_service_free(VarlinkService *service) {
+        STAILQ_HEAD(closed, VarlinkCall) closed = STAILQ_HEAD_INITIALIZER(closed);
+
+        /* Runs the handlers which are still queued, their replies go nowhere. */
+        if (service->pool) {
+                service->pool = thread_pool_free(service->pool);
+
+                while (!STAILQ_EMPTY(&service->completed)) {
+                        VarlinkCall *call = STAILQ_FIRST(&service->completed);
+
+                        STAILQ_REMOVE_HEAD(&service->completed, completed_entry);
+                        call->offload_queued = false;
+
+                        /* Finished below, when they cannot restart anything anymore. */
+                        if (call->closed && !call->finished) {
+                                STAILQ_INSERT_TAIL(&closed, call, completed_entry);
+                                continue;
+                        }
+
+                        varlink_call_unref(call);
+                }
+        }
+
+        if (service->offload_fd >= 0)
+                close(service->offload_fd);
+
+        /* Suspended coroutines are not unwound, the replies they await go nowhere. */
+        while (!LIST_EMPTY(&service->coroutines)) {
+                VarlinkCall *call = LIST_FIRST(&service->coroutines);
+
+                LIST_REMOVE(call, coroutine_entry);
+                call->coroutine = coroutine_free(call->coroutine);
+                varlink_call_unref(call);
+        }
+
+        if (service->resume_fd >= 0)
+                close(service->resume_fd);
+
+        if (service->ready_fd >= 0)
+                close(service->ready_fd);
+
+        /* The connections stay with their owner. */
+        if (service->attached) {
+                while (avl_tree_first(service->attached)) {
+                        AttachedConnection *attached = avl_tree_node_get(avl_tree_first(service->attached));
+
+                        varlink_service_detach_connection(service, attached->connection);
+                }
+
+                avl_tree_free(service->attached);
+        }
+
+        pthread_mutex_destroy(&service->offload_lock);
+
         if (service->epoll_fd >= 0)
                 close(service->epoll_fd);
 
         if (service->listen_fd >= 0)
                 close(service->listen_fd);
 
+        if (service->timer_fd >= 0)
+                close(service->timer_fd);
+
         if (service->path_to_unlink) {
                 unlink(service->path_to_unlink);
                 free(service->path_to_unlink);
         }
 
+        /* Calls which are closed with their connections do not restart anything. */
+        if (service->flights)
+                service->flights = avl_tree_free(service->flights);
+
+        /* Calls of connections which closed while their handler ran. */
+        while (!STAILQ_EMPTY(&closed)) {
+                VarlinkCall *call = STAILQ_FIRST(&closed);
+
+                STAILQ_REMOVE_HEAD(&closed, completed_entry);
+                varlink_call_close(call);
+                varlink_call_unref(call);
+        }
+
+        if (service->ring) {
+                while (avl_tree_first(service->connections))
+                        service_connection_close(service, avl_tree_node_get(avl_tree_first(service->connections)));
+
+                varlink_service_drain_ring(service);
+                service->ring = io_ring_free(service->ring);
+        }
+
         if (service->connections)
                 avl_tree_free(service->connections);
 
+        if (service->coalesced_methods)
+                avl_tree_free(service->coalesced_methods);
+
+        if (service->offloaded_methods)
+                avl_tree_free(service->offloaded_methods);
+
+        if (service->coroutine_methods)
+                avl_tree_free(service->coroutine_methods);
+
+        if (service->peer_weights)
+                avl_tree_free(service->peer_weights);
+
+        if (service->uid_buckets)
+                avl_tree_free(service->uid_buckets);
+
+        if (service->metrics)
+                varlink_metrics_free(service->metrics);
+
+        if (service->cache)
+                varlink_cache_free(service->cache);
+
         if (service->interfaces)
                 avl_tree_free(service->interfaces);
 
         if (service->uri)
                 varlink_uri_free(service->uri);
 
-        free(service->vendor);
-        free(service->product);
-        free(service->version);
-        free(service->url);
-        free(service);
+        varlink_free(service->vendor);
+        varlink_free(service->product);
+        varlink_free(service->version);
+        varlink_free(service->url);
+        varlink_free(service);
 
         return NULL;
 }
@@ -472,194 +1007,2137 @@ _public_ long varlink_service_add_interface(VarlinkService *service,
         return 0;
 }
 
-_public_ int varlink_service_get_fd(VarlinkService *service) {
-        return service->epoll_fd;
+_public_ long varlink_service_enable_metrics(VarlinkService *service) {
+        long r;
+
+        if (service->metrics)
+                return 0;
+
+        r = varlink_metrics_new(&service->metrics);
+        if (r < 0)
+                return r;
+
+        /* Raw services dispatch all calls themselves and only read the metrics. */
+        if (!service->interfaces)
+                return 0;
+
+        r = varlink_service_add_interface(service, org_varlink_metrics_varlink,
+                                          "GetMetrics", org_varlink_metrics_GetMetrics, NULL,
+                                          NULL);
+        if (r < 0) {
+                service->metrics = varlink_metrics_free(service->metrics);
+                return r;
+        }
+
+        return 0;
 }
 
-static long varlink_service_accept(VarlinkService *service) {
-        _cleanup_(service_connection_freep) ServiceConnection *connection = NULL;
+_public_ long varlink_service_get_metrics(VarlinkService *service, VarlinkObject **metricsp) {
+        _cleanup_(varlink_object_unrefp) VarlinkObject *metrics = NULL;
+        uint64_t n_bytes_in, n_bytes_out;
+        uint64_t n_buffered = 0;
         long r;
 
-        connection = calloc(1, sizeof(ServiceConnection));
-        if (!connection)
+        if (!service->metrics)
                 return -VARLINK_ERROR_PANIC;
 
-        connection->current_events_mask = EPOLLIN;
-
-        r = varlink_transport_accept(service->uri, service->listen_fd);
+        r = varlink_object_new(&metrics);
         if (r < 0)
-                return r; /* CannotAccept */
-
-        varlink_stream_new(&connection->stream, (int)r);
+                return r;
 
-        r = epoll_add(service->epoll_fd, connection->stream->fd, connection->current_events_mask, connection);
+        r = varlink_metrics_write(service->metrics, metrics);
         if (r < 0)
-                return -VARLINK_ERROR_PANIC;
+                return r;
 
-        avl_tree_insert(service->connections, (void *)(unsigned long)connection->stream->fd, connection);
+        /* Live connections are not accounted for until they are closed. */
+        n_bytes_in = service->metrics->n_bytes_in;
+        n_bytes_out = service->metrics->n_bytes_out;
 
-        connection = NULL;
-        return 0;
-}
+        for (AVLTreeNode *node = avl_tree_first(service->connections); node; node = avl_tree_node_next(node)) {
+                ServiceConnection *connection = avl_tree_node_get(node);
+                VarlinkStream *stream = connection->stream;
 
-static long service_connection_set_events_mask(VarlinkService *service,
-                                               ServiceConnection *connection,
-                                               uint32_t events_mask) {
-        if (events_mask == connection->current_events_mask)
-                return 0;
+                n_bytes_in += stream->n_bytes_read;
+                n_bytes_out += stream->n_bytes_written;
+                n_buffered += (stream->in_end - stream->in_start) + (stream->out_end - stream->out_start);
+        }
 
-        connection->current_events_mask = events_mask;
+        varlink_object_set_int(metrics, "connections", avl_tree_get_n_elements(service->connections));
+        varlink_object_set_int(metrics, "bytes_in", n_bytes_in);
+        varlink_object_set_int(metrics, "bytes_out", n_bytes_out);
+        varlink_object_set_int(metrics, "buffered_bytes", n_buffered);
 
-        if (epoll_mod(service->epoll_fd,
-                      connection->stream->fd,
-                      connection->current_events_mask,
-                      connection) < 0)
-                return -VARLINK_ERROR_PANIC;
+        *metricsp = metrics;
+        metrics = NULL;
 
         return 0;
 }
 
-static long varlink_service_dispatch_connection(VarlinkService *service,
-                                                ServiceConnection *connection,
-                                                uint32_t events) {
-        long r;
+_public_ long varlink_service_set_slow_call_callback(VarlinkService *service,
+                                                     uint64_t threshold_usec,
+                                                     VarlinkSlowCallFunc callback,
+                                                     void *userdata) {
+        service->slow_call_callback = callback;
+        service->slow_call_userdata = userdata;
+        service->slow_call_threshold_usec = threshold_usec;
 
-        connection->events_mask = 0;
+        return 0;
+}
 
-        if (events & EPOLLOUT) {
-                r = varlink_stream_flush(connection->stream);
-                if (r < 0)
-                        return r;
+_public_ long varlink_service_enable_cache(VarlinkService *service, unsigned long max_bytes) {
+        if (max_bytes == 0)
+                max_bytes = VARLINK_CACHE_DEFAULT_SIZE;
 
-                /* We did not write all data, wake up when we can write to the socket. */
-                if (r > 0)
-                        connection->events_mask |= EPOLLOUT;
+        if (service->cache) {
+                varlink_cache_set_size(service->cache, max_bytes);
+                return 0;
         }
 
-        if (events & EPOLLIN) {
-                while (!connection->call) {
-                        _cleanup_(varlink_object_unrefp) VarlinkObject *message = NULL;
+        return varlink_cache_new(&service->cache, max_bytes);
+}
 
-                        r = varlink_stream_read(connection->stream, &message);
-                        if (r < 0)
-                                return service_connection_close(service, connection);
+/*
+ * Checks that the fully-qualified @method is implemented by the service.
+ */
+static long varlink_service_check_method(VarlinkService *service, const char *method) {
+        _cleanup_(varlink_uri_freep) VarlinkURI *uri = NULL;
+        long r;
 
-                        /* We did not receive a full message. */
-                        if (r == 0)
-                                break;
+        r = varlink_uri_new(&uri, method, true);
+        if (r < 0)
+                return r;
 
-                        r = varlink_call_new(&connection->call, service, connection, message);
-                        if (r < 0)
-                                return r;
+        if (!uri->member)
+                return -VARLINK_ERROR_INVALID_IDENTIFIER;
 
-                        r = service->method_callback(service,
-                                                     connection->call,
-                                                     connection->call->parameters,
-                                                     connection->call->flags,
-                                                     service->method_callback_userdata);
-                        if (r < 0)
-                                return service_connection_close(service, connection);
-                }
-        }
+        /* Raw services dispatch all calls themselves, there is nothing to check against. */
+        if (service->interfaces) {
+                VarlinkInterface *interface;
 
-        /* Catch POLLHUP, we never try to read the EOF from a busy connection. */
-        if (events & EPOLLHUP || connection->stream->hup)
-                return service_connection_close(service, connection);
+                interface = avl_tree_find(service->interfaces, uri->interface);
+                if (!interface)
+                        return -VARLINK_ERROR_INTERFACE_NOT_FOUND;
 
-        /* Listen for incoming data whenever the connection is idle. */
-        if (!connection->call)
-                connection->events_mask |= EPOLLIN;
+                if (!varlink_interface_get_method(interface, uri->member))
+                        return -VARLINK_ERROR_METHOD_NOT_FOUND;
+        }
 
-        return service_connection_set_events_mask(service, connection, connection->events_mask);
+        return 0;
 }
 
-_public_ long varlink_service_process_events(VarlinkService *service) {
-        for(;;) {
-                int n;
-                struct epoll_event ev;
-                long r;
+_public_ long varlink_service_cache_method(VarlinkService *service, const char *method, uint64_t ttl_usec) {
+        long r;
 
-                n = epoll_wait(service->epoll_fd, &ev, 1, 0);
-                if (n < 0)
-                        return -VARLINK_ERROR_PANIC;
+        if (!service->cache)
+                return -VARLINK_ERROR_INVALID_CALL;
 
-                if (n == 0)
-                        return 0;
+        r = varlink_service_check_method(service, method);
+        if (r < 0)
+                return r;
 
-                if (ev.data.ptr == service) {
-                        if ((ev.events & EPOLLIN) == 0)
-                                return -VARLINK_ERROR_PANIC;
+        return varlink_cache_set_method(service->cache, method, ttl_usec);
+}
 
-                        r = varlink_service_accept(service);
-                        switch (r) {
-                                case -VARLINK_ERROR_ACCESS_DENIED:
-                                        break;
+_public_ long varlink_service_invalidate_cache(VarlinkService *service,
+                                               const char *method,
+                                               VarlinkObject *parameters) {
+        _cleanup_(varlink_freep) char *key = NULL;
+        long r;
 
-                                default:
-                                        return r;
-                        }
-                } else {
-                        ServiceConnection *connection = ev.data.ptr;
+        if (!service->cache)
+                return 0;
 
-                        r = varlink_service_dispatch_connection(service, connection, ev.events);
-                        if (r < 0)
-                                return r;
-                }
+        if (method && parameters) {
+                r = varlink_cache_key_new(method, parameters, &key);
+                if (r < 0)
+                        return r;
         }
 
-        return 0;
-}
-
-_public_ long varlink_call_set_connection_closed_callback(VarlinkCall *call,
-                                                          VarlinkCallConnectionClosed callback,
-                                                          void *userdata) {
-        call->closed_callback = callback;
-        call->closed_callback_userdata = userdata;
+        varlink_cache_invalidate(service->cache, method, key);
 
         return 0;
 }
 
-_public_ void *varlink_call_get_connection_userdata(VarlinkCall *call) {
-        return call->closed_callback_userdata;
+static long method_name_compare(const void *key, void *value) {
+        return strcmp(key, value);
 }
 
-_public_ int varlink_call_get_connection_fd(VarlinkCall *call) {
-        return call->connection->stream->fd;
+static long flight_compare(const void *key, void *value) {
+        VarlinkCall *call = value;
+
+        return strcmp(key, call->key);
 }
 
-_public_ long varlink_call_reply(VarlinkCall *call,
-                                 VarlinkObject *parameters,
+_public_ long varlink_service_coalesce_method(VarlinkService *service, const char *method, bool enable) {
+        _cleanup_(varlink_freep) char *name = NULL;
+        long r;
+
+        r = varlink_service_check_method(service, method);
+        if (r < 0)
+                return r;
+
+        if (!enable) {
+                /* Calls which already wait keep waiting for their first call. */
+                if (service->coalesced_methods)
+                        avl_tree_remove(service->coalesced_methods, method);
+
+                return 0;
+        }
+
+        if (!service->coalesced_methods) {
+                if (avl_tree_new(&service->coalesced_methods, method_name_compare, varlink_freep) < 0)
+                        return -VARLINK_ERROR_PANIC;
+        }
+
+        if (!service->flights) {
+                if (avl_tree_new(&service->flights, flight_compare, NULL) < 0)
+                        return -VARLINK_ERROR_PANIC;
+        }
+
+        if (avl_tree_find(service->coalesced_methods, method))
+                return 0;
+
+        name = varlink_strdup(method);
+        if (!name)
+                return -VARLINK_ERROR_PANIC;
+
+        if (avl_tree_insert(service->coalesced_methods, name, name) < 0)
+                return -VARLINK_ERROR_PANIC;
+
+        name = NULL;
+
+        return 0;
+}
+
+_public_ long varlink_service_offload_method(VarlinkService *service, const char *method, bool enable) {
+        _cleanup_(varlink_freep) char *name = NULL;
+        long r;
+
+        r = varlink_service_check_method(service, method);
+        if (r < 0)
+                return r;
+
+        if (!enable) {
+                /* Calls which are already running finish on their worker thread. */
+                if (service->offloaded_methods)
+                        avl_tree_remove(service->offloaded_methods, method);
+
+                return 0;
+        }
+
+        if (!service->offloaded_methods) {
+                if (avl_tree_new(&service->offloaded_methods, method_name_compare, varlink_freep) < 0)
+                        return -VARLINK_ERROR_PANIC;
+        }
+
+        if (service->offload_fd < 0) {
+                service->offload_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+                if (service->offload_fd < 0)
+                        return -VARLINK_ERROR_PANIC;
+
+                if (epoll_add(service->epoll_fd, service->offload_fd, EPOLLIN, &service->offload_fd) < 0) {
+                        close(service->offload_fd);
+                        service->offload_fd = -1;
+                        return -VARLINK_ERROR_PANIC;
+                }
+        }
+
+        /* One worker for every CPU, the event loop mostly waits for I/O. */
+        if (!service->pool) {
+                long n_cpus = sysconf(_SC_NPROCESSORS_ONLN);
+
+                r = thread_pool_new(&service->pool, n_cpus > 0 ? n_cpus : 1);
+                if (r < 0)
+                        return r;
+        }
+
+        if (avl_tree_find(service->offloaded_methods, method))
+                return 0;
+
+        name = varlink_strdup(method);
+        if (!name)
+                return -VARLINK_ERROR_PANIC;
+
+        if (avl_tree_insert(service->offloaded_methods, name, name) < 0)
+                return -VARLINK_ERROR_PANIC;
+
+        name = NULL;
+
+        return 0;
+}
+
+_public_ long varlink_service_coroutine_method(VarlinkService *service, const char *method, bool enable) {
+        _cleanup_(varlink_freep) char *name = NULL;
+        long r;
+
+        r = varlink_service_check_method(service, method);
+        if (r < 0)
+                return r;
+
+        if (!enable) {
+                /* Calls which are suspended continue as coroutines. */
+                if (service->coroutine_methods)
+                        avl_tree_remove(service->coroutine_methods, method);
+
+                return 0;
+        }
+
+        if (!service->coroutine_methods) {
+                if (avl_tree_new(&service->coroutine_methods, method_name_compare, varlink_freep) < 0)
+                        return -VARLINK_ERROR_PANIC;
+        }
+
+        if (service->resume_fd < 0) {
+                service->resume_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+                if (service->resume_fd < 0)
+                        return -VARLINK_ERROR_PANIC;
+
+                if (epoll_add(service->epoll_fd, service->resume_fd, EPOLLIN, &service->resume_fd) < 0) {
+                        close(service->resume_fd);
+                        service->resume_fd = -1;
+                        return -VARLINK_ERROR_PANIC;
+                }
+        }
+
+        if (avl_tree_find(service->coroutine_methods, method))
+                return 0;
+
+        name = varlink_strdup(method);
+        if (!name)
+                return -VARLINK_ERROR_PANIC;
+
+        if (avl_tree_insert(service->coroutine_methods, name, name) < 0)
+                return -VARLINK_ERROR_PANIC;
+
+        name = NULL;
+
+        return 0;
+}
+
+_public_ long varlink_service_get_connections(VarlinkService *service, int **fdsp) {
+        _cleanup_(freep) int *fds = NULL;
+        unsigned long n = 0;
+
+        /* Handed to the caller, so not from the library allocator. */
+        fds = calloc(avl_tree_get_n_elements(service->connections) + 1, sizeof(int));
+        if (!fds)
+                return -VARLINK_ERROR_PANIC;
+
+        for (AVLTreeNode *node = avl_tree_first(service->connections); node; node = avl_tree_node_next(node)) {
+                ServiceConnection *connection = avl_tree_node_get(node);
+
+                fds[n] = connection->stream->fd;
+                n += 1;
+        }
+
+        *fdsp = fds;
+        fds = NULL;
+
+        return n;
+}
+
+_public_ long varlink_service_get_connection_stats(VarlinkService *service, int fd, VarlinkConnectionStats *stats) {
+        ServiceConnection *connection;
+
+        connection = avl_tree_find(service->connections, (void *)(unsigned long)fd);
+        if (!connection)
+                return -VARLINK_ERROR_CONNECTION_CLOSED;
+
+        varlink_stream_get_stats(connection->stream, stats);
+        stats->n_calls_in_flight = connection->call ? 1 : 0;
+
+        return 0;
+}
+
+_public_ int varlink_service_get_fd(VarlinkService *service) {
+        return service->epoll_fd;
+}
+
+static long varlink_service_add_connection(VarlinkService *service, int fd) {
+        _cleanup_(service_connection_freep) ServiceConnection *connection = NULL;
+        struct ucred ucred;
+        socklen_t len = sizeof(ucred);
+        long r;
+
+        connection = varlink_calloc(1, sizeof(ServiceConnection));
+        if (!connection) {
+                close(fd);
+                return -VARLINK_ERROR_PANIC;
+        }
+
+        connection->current_events_mask = EPOLLIN;
+        connection->weight = 1;
+
+        if (service->edge_triggered) {
+                connection->current_events_mask = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+                connection->edge_triggered = true;
+        }
+
+        r = varlink_stream_new(&connection->stream, fd);
+        if (r < 0) {
+                close(fd);
+                return r;
+        }
+
+        VARLINK_PROBE(service__accept, service->listen_fd, connection->stream->fd);
+
+        /* Only UNIX domain sockets carry credentials, other peers keep the defaults. */
+        if (getsockopt(connection->stream->fd, SOL_SOCKET, SO_PEERCRED, &ucred, &len) == 0) {
+                connection->has_uid = true;
+                connection->uid = ucred.uid;
+        }
+
+        if (service->peer_weights && connection->has_uid) {
+                PeerWeight *peer;
+
+                peer = avl_tree_find(service->peer_weights, (void *)(unsigned long)connection->uid);
+                if (peer)
+                        connection->weight = peer->weight;
+        }
+
+        if (service->metrics)
+                service->metrics->n_connections_total += 1;
+
+        /* Connections accepted through the io_uring keep using it. */
+        if (service->ring_accepting) {
+                connection->ring = true;
+                connection->edge_triggered = false;
+                connection->stream->io_ring = true;
+
+                r = io_ring_recv_multishot(service->ring, connection->stream->fd,
+                                           (uintptr_t)connection | SERVICE_RING_RECEIVE);
+                if (r < 0)
+                        return r;
+
+                connection->receiving = true;
+        } else {
+                r = epoll_add(service->epoll_fd, connection->stream->fd, connection->current_events_mask, connection);
+                if (r < 0)
+                        return -VARLINK_ERROR_PANIC;
+        }
+
+        avl_tree_insert(service->connections, (void *)(unsigned long)connection->stream->fd, connection);
+
+        connection = NULL;
+        return 0;
+}
+
+static long varlink_service_accept(VarlinkService *service) {
+        long r;
+
+        r = varlink_transport_accept(service->uri, service->listen_fd);
+        if (r < 0)
+                return r; /* CannotAccept */
+
+        return varlink_service_add_connection(service, (int)r);
+}
+
+static long service_connection_set_events_mask(VarlinkService *service,
+                                               ServiceConnection *connection,
+                                               uint32_t events_mask) {
+        /* Edge-triggered connections are registered for everything, io_uring ones not at all. */
+        if (connection->edge_triggered || connection->ring || events_mask == connection->current_events_mask)
+                return 0;
+
+        connection->current_events_mask = events_mask;
+
+        if (epoll_mod(service->epoll_fd,
+                      connection->stream->fd,
+                      connection->current_events_mask,
+                      connection) < 0)
+                return -VARLINK_ERROR_PANIC;
+
+        return 0;
+}
+
+/*
+ * The metrics of the method are passed separately, the call has already
+ * dropped them if the handler replied.
+ */
+static void varlink_service_handler_finish(VarlinkService *service,
+                                           VarlinkCall *call,
+                                           VarlinkMethodMetrics *method_metrics,
+                                           uint64_t usec) {
+        bool slow = service->slow_call_callback && usec >= service->slow_call_threshold_usec;
+
+        if (method_metrics)
+                varlink_metrics_handler_finish(service->metrics, method_metrics, usec, slow);
+
+        if (slow)
+                service->slow_call_callback(service, call->method, call->parameters, usec,
+                                            service->slow_call_userdata);
+}
+
+/*
+ * Cuts the "ttl" field of @ttl_usec, which is the last one of a reply,
+ * from @json. Returns the new length.
+ */
+static unsigned long reply_cut_ttl(char *json, unsigned long length, uint64_t ttl_usec) {
+        char suffix[32];
+        unsigned long n;
+
+        n = snprintf(suffix, sizeof(suffix), "\"ttl\":%" PRIu64 "}", ttl_usec);
+        if (length <= n || memcmp(json + length - n, suffix, n) != 0)
+                return length;
+
+        length -= n;
+        if (json[length - 1] == ',')
+                length -= 1;
+
+        json[length++] = '}';
+        json[length] = '\0';
+
+        return length;
+}
+
+/*
+ * Answers @call from the cache of the service, without running the
+ * handler. Returns 1 if it was answered, 0 if there was no entry.
+ */
+static long varlink_call_reply_cached(VarlinkCall *call) {
+        _cleanup_(freep) char *json = NULL;
+        VarlinkCacheEntry *entry;
+        uint64_t now, hint_expires;
+        long r;
+
+        entry = varlink_cache_lookup(call->service->cache, call->key);
+        if (!entry)
+                return 0;
+
+        /* Clients may keep it for what is left of its lifetime, not longer than the cache does. */
+        now = now_usec();
+        hint_expires = MIN(entry->hint_expires_usec, entry->expires_usec);
+
+        if (hint_expires > now) {
+                int length;
+
+                /* Cached replies are objects and end with their closing brace. */
+                length = asprintf(&json, "%.*s%s\"ttl\":%" PRIu64 "}",
+                                  (int)entry->length - 1, entry->json,
+                                  entry->length > 2 ? "," : "",
+                                  hint_expires - now);
+                if (length < 0)
+                        return -VARLINK_ERROR_PANIC;
+
+                r = varlink_stream_write_json(call->connection->stream, json, length);
+        } else
+                r = varlink_stream_write_json(call->connection->stream, entry->json, entry->length);
+        if (r < 0)
+                return r;
+
+        VARLINK_PROBE(reply__queued, call->connection->stream->fd, call->method, NULL, 0);
+
+        /* We did not write all data, wake up when we can write to the socket. */
+        if (r == 0)
+                call->connection->events_mask |= EPOLLOUT;
+
+        varlink_call_finish(call, false);
+
+        return 1;
+}
+
+/*
+ * Hands @call over to the event loop. Called with the offload lock held,
+ * whenever its handler queued a reply or returned.
+ */
+static void varlink_service_complete_locked(VarlinkService *service, VarlinkCall *call) {
+        uint64_t one = 1;
+
+        if (call->offload_queued)
+                return;
+
+        call->offload_queued = true;
+        STAILQ_INSERT_TAIL(&service->completed, call, completed_entry);
+
+        /* Only fails when the counter would overflow, the loop wakes up anyway. */
+        if (write(service->offload_fd, &one, sizeof(one)) < 0)
+                return;
+}
+
+/*
+ * Runs on a worker thread. The handler gets the same arguments as on
+ * the event loop, its replies are queued by varlink_call_queue_reply().
+ */
+static void varlink_call_run_offloaded(void *userdata) {
+        VarlinkCall *call = userdata;
+        VarlinkService *service = call->service;
+        const VarlinkSpan *previous_span;
+        uint64_t start;
+        long r;
+
+        start = now_usec();
+        previous_span = varlink_trace_push(varlink_span_is_active(&call->span) ? &call->span : NULL);
+
+        r = service->method_callback(service,
+                                     call,
+                                     call->parameters,
+                                     call->flags,
+                                     service->method_callback_userdata);
+
+        varlink_trace_pop(previous_span);
+
+        pthread_mutex_lock(&service->offload_lock);
+        call->offload_result = r;
+        call->offload_usec = now_usec() - start;
+        call->offload_done = true;
+        varlink_service_complete_locked(service, call);
+        pthread_mutex_unlock(&service->offload_lock);
+}
+
+/*
+ * Serializes a reply on the worker thread running the handler of
+ * @call, which keeps the objects it passed to itself. The reply is
+ * sent when the event loop drains the completed calls.
+ */
+static long varlink_call_queue_reply(VarlinkCall *call,
+                                     VarlinkObject *message,
+                                     const char *error,
+                                     uint64_t flags) {
+        VarlinkService *service = call->service;
+        OffloadReply *reply;
+        long length;
+
+        reply = varlink_calloc(1, sizeof(OffloadReply));
+        if (!reply)
+                return -VARLINK_ERROR_PANIC;
+
+        /* Replies to oneway calls are not sent, they only finish the call. */
+        if (message) {
+                length = varlink_object_to_json(message, &reply->json);
+                if (length < 0) {
+                        offload_reply_free(reply);
+                        return length;
+                }
+
+                reply->length = length;
+        }
+
+        if (error) {
+                reply->error = varlink_strdup(error);
+                if (!reply->error) {
+                        offload_reply_free(reply);
+                        return -VARLINK_ERROR_PANIC;
+                }
+        }
+
+        reply->flags = flags;
+
+        pthread_mutex_lock(&service->offload_lock);
+        STAILQ_INSERT_TAIL(&call->offload_replies, reply, entry);
+        varlink_service_complete_locked(service, call);
+        pthread_mutex_unlock(&service->offload_lock);
+
+        return 0;
+}
+
+/*
+ * Submits the handler of @call to the pool; the connection waits for
+ * its reply like for any asynchronous handler.
+ */
+static long varlink_service_offload(VarlinkService *service, VarlinkCall *call) {
+        VARLINK_PROBE(dispatch__start, call->connection->stream->fd, call->method, call->flags);
+
+        call->handler_metrics = call->method_metrics;
+        call->offloaded = true;
+        call->offload_done = false;
+        call->job.func = varlink_call_run_offloaded;
+        call->job.userdata = varlink_call_ref(call);
+
+        thread_pool_submit(service->pool, &call->job);
+
+        return 0;
+}
+
+/*
+ * Makes the coroutine of @call runnable, a reply it awaits arrived.
+ */
+static void varlink_call_wake(Coroutine *UNUSED(coroutine), void *userdata) {
+        VarlinkCall *call = userdata;
+        VarlinkService *service = call->service;
+        uint64_t one = 1;
+
+        if (call->runnable)
+                return;
+
+        call->runnable = true;
+        STAILQ_INSERT_TAIL(&service->runnable, call, runnable_entry);
+
+        /* Only fails when the counter would overflow, the loop wakes up anyway. */
+        if (write(service->resume_fd, &one, sizeof(one)) < 0)
+                return;
+}
+
+static void varlink_call_run_coroutine(void *userdata) {
+        VarlinkCall *call = userdata;
+        VarlinkService *service = call->service;
+
+        call->coroutine_result = service->method_callback(service,
+                                                          call,
+                                                          call->parameters,
+                                                          call->flags,
+                                                          service->method_callback_userdata);
+}
+
+/*
+ * Runs the coroutine of @call until it returns or awaits a reply; only
+ * the time it runs counts for the handler. Returns the result of the
+ * handler once it returned, 0 before.
+ */
+static long varlink_call_step(VarlinkService *service, VarlinkCall *call) {
+        _cleanup_(varlink_call_unrefp) VarlinkCall *ref = NULL;
+        const VarlinkSpan *previous_span;
+        uint64_t start;
+        bool done;
+
+        start = now_usec();
+        previous_span = varlink_trace_push(varlink_span_is_active(&call->span) ? &call->span : NULL);
+
+        done = coroutine_resume(call->coroutine);
+
+        varlink_trace_pop(previous_span);
+        call->coroutine_usec += now_usec() - start;
+
+        if (!done)
+                return 0;
+
+        /* Drop the reference of the coroutine. */
+        ref = call;
+
+        call->coroutine = coroutine_free(call->coroutine);
+        LIST_REMOVE(call, coroutine_entry);
+
+        if (call->runnable) {
+                STAILQ_REMOVE(&service->runnable, call, VarlinkCall, runnable_entry);
+                call->runnable = false;
+        }
+
+        VARLINK_PROBE(dispatch__end, call->finished ? -1 : call->connection->stream->fd, call->method,
+                      call->coroutine_result);
+
+        if (call->handler_metrics || service->slow_call_callback)
+                varlink_service_handler_finish(service, call, call->handler_metrics, call->coroutine_usec);
+
+        return call->coroutine_result;
+}
+
+static long varlink_service_start_coroutine(VarlinkService *service, VarlinkCall *call) {
+        long r;
+
+        r = coroutine_new(&call->coroutine, varlink_call_run_coroutine, varlink_call_wake, call);
+        if (r < 0)
+                return r;
+
+        VARLINK_PROBE(dispatch__start, call->connection->stream->fd, call->method, call->flags);
+
+        call->handler_metrics = call->method_metrics;
+        varlink_call_ref(call);
+        LIST_INSERT_HEAD(&service->coroutines, call, coroutine_entry);
+
+        return varlink_call_step(service, call);
+}
+
+/*
+ * Runs the handler for @call, which is the current call of its
+ * connection.
+ */
+static long varlink_service_run_handler(VarlinkService *service, VarlinkCall *call) {
+        _cleanup_(varlink_call_unrefp) VarlinkCall *ref = varlink_call_ref(call);
+        VarlinkMethodMetrics *method_metrics;
+        const VarlinkSpan *previous_span;
+        uint64_t start = 0;
+        long r;
+
+        if (call->offload)
+                return varlink_service_offload(service, call);
+
+        if (call->suspendable)
+                return varlink_service_start_coroutine(service, call);
+
+        method_metrics = call->method_metrics;
+        if (method_metrics || service->slow_call_callback)
+                start = now_usec();
+
+        /* Calls made by the handler become children of its span. */
+        previous_span = varlink_trace_push(varlink_span_is_active(&call->span) ? &call->span : NULL);
+
+        VARLINK_PROBE(dispatch__start, call->connection->stream->fd, call->method, call->flags);
+        r = service->method_callback(service,
+                                     call,
+                                     call->parameters,
+                                     call->flags,
+                                     service->method_callback_userdata);
+        VARLINK_PROBE(dispatch__end, call->connection->stream->fd, call->method, r);
+
+        varlink_trace_pop(previous_span);
+
+        if (method_metrics || service->slow_call_callback)
+                varlink_service_handler_finish(service, call, method_metrics, now_usec() - start);
+
+        return r;
+}
+
+/*
+ * Makes @call wait for an identical call which is already in progress.
+ * Returns 1 if it does, 0 if @call is the first one and needs to run
+ * the handler.
+ */
+static long varlink_service_join_flight(VarlinkService *service, VarlinkCall *call) {
+        VarlinkCall *leader;
+
+        leader = avl_tree_find(service->flights, call->key);
+        if (leader) {
+                call->leader = leader;
+                STAILQ_INSERT_TAIL(&leader->waiters, call, waiter_entry);
+                return 1;
+        }
+
+        if (avl_tree_insert(service->flights, call->key, call) < 0)
+                return -VARLINK_ERROR_PANIC;
+
+        call->in_flight = true;
+
+        return 0;
+}
+
+/*
+ * Queues @connection to be dispatched again without an event, when it
+ * has more to read than its budget allowed, or when it became idle with
+ * an edge-triggered socket which is still readable.
+ */
+static long service_connection_set_ready(VarlinkService *service, ServiceConnection *connection) {
+        uint64_t one = 1;
+
+        if (connection->ready)
+                return 0;
+
+        TAILQ_INSERT_TAIL(&service->ready, connection, ready_entry);
+        connection->ready = true;
+
+        /* The event loop only looks at the queue when it is woken up. */
+        if (!service->processing && write(service->ready_fd, &one, sizeof(one)) < 0)
+                return -VARLINK_ERROR_PANIC;
+
+        return 0;
+}
+
+/*
+ * Sends everything in the write buffer of @connection, unless a send is
+ * already in flight; its completion sends what was added meanwhile.
+ */
+static long service_connection_send(VarlinkService *service, ServiceConnection *connection) {
+        VarlinkStream *stream = connection->stream;
+        long r;
+
+        if (connection->sending || stream->out_end == stream->out_start)
+                return 0;
+
+        r = io_ring_send(service->ring, stream->fd,
+                         stream->out + stream->out_start, stream->out_end - stream->out_start,
+                         (uintptr_t)connection | SERVICE_RING_SEND);
+        if (r < 0)
+                return r;
+
+        connection->sending = true;
+
+        return 0;
+}
+
+/*
+ * Moves received data into the stream of @connection, or into its
+ * overflow when the stream is full, which stops the receive until the
+ * messages are read.
+ */
+static long service_connection_receive(VarlinkService *service,
+                                       ServiceConnection *connection,
+                                       const uint8_t *data,
+                                       unsigned long size) {
+        uint8_t *overflow;
+        unsigned long n;
+
+        if (connection->overflow_size == 0) {
+                n = varlink_stream_received(connection->stream, data, size);
+                data += n;
+                size -= n;
+
+                if (size == 0)
+                        return 0;
+        }
+
+        overflow = varlink_realloc(connection->overflow, connection->overflow_size + size);
+        if (!overflow)
+                return -VARLINK_ERROR_PANIC;
+
+        memcpy(overflow + connection->overflow_size, data, size);
+        connection->overflow = overflow;
+        connection->overflow_size += size;
+
+        if (connection->receiving && !connection->cancelled) {
+                if (io_ring_cancel(service->ring, (uintptr_t)connection | SERVICE_RING_RECEIVE) < 0)
+                        return -VARLINK_ERROR_PANIC;
+
+                connection->cancelled = true;
+        }
+
+        return 0;
+}
+
+/*
+ * Takes what fits from the overflow, receives again when it is empty,
+ * and sends the replies which were written. Outside of the event loop,
+ * the requests are submitted right away.
+ */
+static long service_connection_update_ring(VarlinkService *service, ServiceConnection *connection) {
+        VarlinkStream *stream = connection->stream;
+        long r;
+
+        if (connection->overflow_size > 0) {
+                unsigned long n;
+
+                n = varlink_stream_received(stream, connection->overflow, connection->overflow_size);
+                connection->overflow_size -= n;
+                memmove(connection->overflow, connection->overflow + n, connection->overflow_size);
+
+                if (n > 0) {
+                        r = service_connection_set_ready(service, connection);
+                        if (r < 0)
+                                return r;
+                }
+        }
+
+        if (!connection->receiving && connection->overflow_size == 0 && !stream->hup) {
+                r = io_ring_recv_multishot(service->ring, stream->fd, (uintptr_t)connection | SERVICE_RING_RECEIVE);
+                if (r < 0)
+                        return r;
+
+                connection->receiving = true;
+                connection->cancelled = false;
+        }
+
+        r = service_connection_send(service, connection);
+        if (r < 0)
+                return r;
+
+        if (!service->processing)
+                return io_ring_submit(service->ring, 0);
+
+        return 0;
+}
+
+/*
+ * Replies which are not sent while their connection is dispatched, by
+ * asynchronous handlers or to coalesced calls, have to update the events
+ * the connection waits for themselves.
+ */
+static long service_connection_update_events(VarlinkService *service, ServiceConnection *connection) {
+        uint32_t events_mask = connection->events_mask;
+        long r;
+
+        if (connection == service->dispatching)
+                return 0;
+
+        if (connection->ring) {
+                r = service_connection_update_ring(service, connection);
+                if (r < 0)
+                        return r;
+        }
+
+        /* No new edge reports what the socket or the buffer already has. */
+        if (connection->edge_triggered || connection->ring) {
+                if (connection->call || connection->paused)
+                        return 0;
+
+                if (!connection->readable && connection->stream->in_end == connection->stream->in_start)
+                        return 0;
+
+                return service_connection_set_ready(service, connection);
+        }
+
+        if (!connection->call && !connection->paused) {
+                events_mask |= EPOLLIN;
+
+                /* Messages which arrived behind the call are already buffered. */
+                if (connection->stream->in_end > connection->stream->in_start)
+                        events_mask |= EPOLLOUT;
+        }
+
+        return service_connection_set_events_mask(service, connection, events_mask);
+}
+
+/*
+ * The first call of a flight went away without a reply; the next one in
+ * line runs the handler for the remaining ones.
+ */
+static void varlink_service_restart_flight(VarlinkService *service, VarlinkCall *call) {
+        VarlinkCall *leader;
+
+        leader = STAILQ_FIRST(&call->waiters);
+        STAILQ_REMOVE_HEAD(&call->waiters, waiter_entry);
+        leader->leader = NULL;
+
+        STAILQ_CONCAT(&leader->waiters, &call->waiters);
+        STAILQ_FOREACH(call, &leader->waiters, waiter_entry)
+                call->leader = leader;
+
+        /* The service is going away, nobody is waiting for replies anymore. */
+        if (!service->flights) {
+                while (!STAILQ_EMPTY(&leader->waiters)) {
+                        STAILQ_FIRST(&leader->waiters)->leader = NULL;
+                        STAILQ_REMOVE_HEAD(&leader->waiters, waiter_entry);
+                }
+
+                return;
+        }
+
+        if (avl_tree_insert(service->flights, leader->key, leader) == 0)
+                leader->in_flight = true;
+
+        if (varlink_service_run_handler(service, leader) < 0 ||
+            service_connection_update_events(service, leader->connection) < 0)
+                service_connection_close(service, leader->connection);
+}
+
+static long uid_buckets_compare(const void *key, void *value) {
+        uid_t uid = (uid_t)(unsigned long)key;
+        RateBuckets *buckets = value;
+
+        if (uid < buckets->uid)
+                return -1;
+
+        return uid > buckets->uid;
+}
+
+/*
+ * Returns the buckets @connection is charged to, starting out full. Peers
+ * without credentials are limited per connection.
+ */
+static RateBuckets *service_connection_get_buckets(VarlinkService *service, ServiceConnection *connection) {
+        RateBuckets *buckets;
+        uint64_t now;
+
+        if (connection->buckets)
+                return connection->buckets;
+
+        buckets = &connection->own_buckets;
+
+        if (service->uid_buckets && connection->has_uid) {
+                RateBuckets *shared;
+
+                shared = avl_tree_find(service->uid_buckets, (void *)(unsigned long)connection->uid);
+                if (shared) {
+                        connection->buckets = shared;
+                        return shared;
+                }
+
+                /* Without memory, the connection keeps to its own limit. */
+                shared = varlink_calloc(1, sizeof(RateBuckets));
+                if (shared) {
+                        shared->uid = connection->uid;
+
+                        if (avl_tree_insert(service->uid_buckets, (void *)(unsigned long)shared->uid, shared) == 0)
+                                buckets = shared;
+                        else
+                                varlink_free(shared);
+                }
+        }
+
+        now = now_usec();
+        token_bucket_init(&buckets->calls, service->rate_limit.calls_burst, now);
+        token_bucket_init(&buckets->bytes, service->rate_limit.bytes_burst, now);
+        connection->buckets = buckets;
+
+        return buckets;
+}
+
+/*
+ * Charges a message of @size bytes to @connection. Returns 0 if it may
+ * be dispatched, or the microseconds until it may.
+ */
+static uint64_t service_connection_charge(VarlinkService *service,
+                                          ServiceConnection *connection,
+                                          unsigned long size) {
+        VarlinkRateLimit *limit = &service->rate_limit;
+        RateBuckets *buckets;
+        uint64_t now;
+        uint64_t wait;
+
+        buckets = service_connection_get_buckets(service, connection);
+        now = now_usec();
+
+        if (limit->calls_per_sec > 0) {
+                wait = token_bucket_take(&buckets->calls, limit->calls_per_sec, limit->calls_burst, 1, now);
+                if (wait > 0)
+                        return wait;
+        }
+
+        if (limit->bytes_per_sec > 0) {
+                /* Count the terminating NUL byte of the message. */
+                wait = token_bucket_take(&buckets->bytes, limit->bytes_per_sec, limit->bytes_burst, size + 1, now);
+                if (wait > 0) {
+                        if (limit->calls_per_sec > 0)
+                                token_bucket_give(&buckets->calls, 1);
+
+                        return wait;
+                }
+        }
+
+        return 0;
+}
+
+/*
+ * Arms the timer for the first paused connection to resume, or disarms
+ * it if there is none.
+ */
+static long varlink_service_arm_timer(VarlinkService *service) {
+        struct itimerspec its = {};
+        ServiceConnection *connection;
+        uint64_t first = UINT64_MAX;
+
+        if (service->timer_fd < 0)
+                return 0;
+
+        TAILQ_FOREACH(connection, &service->paused, paused_entry)
+                first = MIN(first, connection->resume_usec);
+
+        if (first != UINT64_MAX) {
+                its.it_value.tv_sec = first / 1000000;
+                its.it_value.tv_nsec = (first % 1000000) * 1000;
+        }
+
+        if (timerfd_settime(service->timer_fd, TFD_TIMER_ABSTIME, &its, NULL) < 0)
+                return -VARLINK_ERROR_PANIC;
+
+        return 0;
+}
+
+static long service_connection_pause(VarlinkService *service, ServiceConnection *connection, uint64_t wait) {
+        connection->resume_usec = now_usec() + wait;
+        connection->paused = true;
+        TAILQ_INSERT_TAIL(&service->paused, connection, paused_entry);
+
+        return varlink_service_arm_timer(service);
+}
+
+static long service_connection_resume(VarlinkService *service, ServiceConnection *connection) {
+        TAILQ_REMOVE(&service->paused, connection, paused_entry);
+        connection->paused = false;
+
+        return service_connection_update_events(service, connection);
+}
+
+/*
+ * Looks for "oneway": true among the keys of the @size bytes of the
+ * message in @json, without parsing it. Keys of nested objects and
+ * strings are skipped.
+ */
+static bool message_is_oneway(const char *json, unsigned long size) {
+        unsigned long depth = 0;
+
+        for (unsigned long i = 0; i < size; i += 1) {
+                switch (json[i]) {
+                        case '{':
+                        case '[':
+                                depth += 1;
+                                break;
+
+                        case '}':
+                        case ']':
+                                depth -= 1;
+                                break;
+
+                        case '"':
+                                if (depth == 1 && strncmp(&json[i], "\"oneway\"", 8) == 0) {
+                                        const char *p = &json[i + 8];
+
+                                        p += strspn(p, " \t\r\n");
+                                        if (*p == ':') {
+                                                p += 1;
+                                                p += strspn(p, " \t\r\n");
+                                                return strncmp(p, "true", 4) == 0;
+                                        }
+                                }
+
+                                for (i += 1; i < size && json[i] != '"'; i += 1)
+                                        if (json[i] == '\\')
+                                                i += 1;
+                                break;
+                }
+        }
+
+        return false;
+}
+
+/*
+ * Answers the next message of @connection, of @size bytes, with
+ * LimitExceeded, unless it is a oneway call.
+ */
+static long service_connection_reject(VarlinkService *service, ServiceConnection *connection, unsigned long size) {
+        bool oneway;
+        long r;
+
+        oneway = message_is_oneway((const char *)&connection->stream->in[connection->stream->in_start], size);
+        varlink_stream_skip(connection->stream, size);
+        if (oneway)
+                return 0;
+
+        r = varlink_stream_write_json(connection->stream, rate_limit_reply, sizeof(rate_limit_reply) - 1);
+        if (r < 0)
+                return r;
+
+        if (r == 0)
+                connection->events_mask |= EPOLLOUT;
+
+        return 0;
+}
+
+static long varlink_service_dispatch_connection(VarlinkService *service,
+                                                ServiceConnection *connection,
+                                                uint32_t events) {
+        unsigned long n_messages = 0;
+        long r;
+
+        connection->events_mask = 0;
+
+        if (connection->edge_triggered) {
+                if (events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP))
+                        connection->readable = true;
+
+                if (events & EPOLLOUT)
+                        connection->writable = true;
+
+                events &= EPOLLHUP;
+                if (connection->readable)
+                        events |= EPOLLIN;
+
+                /* Replies are written right away, only a partial one is left to flush. */
+                if (connection->writable && connection->stream->out_end > connection->stream->out_start)
+                        events |= EPOLLOUT;
+        }
+
+        if (events & EPOLLOUT) {
+                r = varlink_stream_flush(connection->stream);
+                if (r < 0)
+                        return r;
+
+                /* We did not write all data, wake up when we can write to the socket. */
+                if (r > 0) {
+                        connection->events_mask |= EPOLLOUT;
+                        connection->writable = false;
+                }
+        }
+
+        /* Messages can be left in the buffer by a call which was answered later. */
+        if (events & EPOLLIN || connection->stream->in_end > connection->stream->in_start) {
+                while (!connection->call) {
+                        _cleanup_(varlink_object_unrefp) VarlinkObject *message = NULL;
+                        _cleanup_(varlink_call_unrefp) VarlinkCall *call = NULL;
+
+                        /*
+                         * Data still waiting in a level-triggered socket wakes us up
+                         * again, already buffered messages and edge-triggered sockets
+                         * which did not run dry need to be queued to get another turn.
+                         */
+                        if (service->dispatch_budget > 0 &&
+                            n_messages == service->dispatch_budget * connection->weight) {
+                                if (connection->stream->in_end > connection->stream->in_start ||
+                                    connection->readable) {
+                                        r = service_connection_set_ready(service, connection);
+                                        if (r < 0)
+                                                return r;
+                                }
+
+                                break;
+                        }
+
+                        n_messages += 1;
+
+                        if (service->rate_limited) {
+                                unsigned long size;
+                                uint64_t wait;
+
+                                /* Paused connections are only read again by the timer. */
+                                if (connection->paused)
+                                        break;
+
+                                r = varlink_stream_peek(connection->stream, &size);
+                                if (r < 0)
+                                        return service_connection_close(service, connection);
+
+                                if (r == 0) {
+                                        connection->readable = false;
+                                        break;
+                                }
+
+                                wait = service_connection_charge(service, connection, size);
+                                if (wait > 0 && service->rate_limit.reject) {
+                                        r = service_connection_reject(service, connection, size);
+                                        if (r < 0)
+                                                return service_connection_close(service, connection);
+
+                                        continue;
+                                }
+
+                                if (wait > 0) {
+                                        r = service_connection_pause(service, connection, wait);
+                                        if (r < 0)
+                                                return r;
+
+                                        break;
+                                }
+                        }
+
+                        r = varlink_stream_read(connection->stream, &message);
+                        if (r < 0)
+                                return service_connection_close(service, connection);
+
+                        /* We did not receive a full message, reading ran into EAGAIN. */
+                        if (r == 0) {
+                                connection->readable = false;
+                                break;
+                        }
+
+                        r = varlink_call_new(&connection->call, service, connection, message);
+                        if (r < 0)
+                                return r;
+
+                        /* The parameters belong to the call now, an offloaded handler uses them on its worker. */
+                        message = varlink_object_unref(message);
+
+                        call = varlink_call_ref(connection->call);
+
+                        if (call->cache_ttl_usec > 0) {
+                                r = varlink_call_reply_cached(call);
+                                if (r < 0)
+                                        return service_connection_close(service, connection);
+
+                                if (r > 0)
+                                        continue;
+                        }
+
+                        if (call->coalesce) {
+                                r = varlink_service_join_flight(service, call);
+                                if (r < 0)
+                                        return r;
+
+                                /* Nothing to do until the first call is answered. */
+                                if (r > 0)
+                                        continue;
+                        }
+
+                        r = varlink_service_run_handler(service, call);
+                        if (r < 0)
+                                return service_connection_close(service, connection);
+                }
+        }
+
+        /* Catch POLLHUP, we never try to read the EOF from a busy connection. */
+        if (events & EPOLLHUP || connection->stream->hup)
+                return service_connection_close(service, connection);
+
+        if (connection->ring)
+                return service_connection_update_ring(service, connection);
+
+        /* Listen for incoming data whenever the connection is idle. */
+        if (!connection->call && !connection->paused)
+                connection->events_mask |= EPOLLIN;
+
+        return service_connection_set_events_mask(service, connection, connection->events_mask);
+}
+
+/*
+ * Dispatches @connection, accounting for the time the rest of the
+ * service waits for it.
+ */
+static long varlink_service_dispatch(VarlinkService *service,
+                                     ServiceConnection *connection,
+                                     uint32_t events,
+                                     uint64_t wakeup) {
+        uint64_t start = 0;
+        long r;
+
+        if (service->metrics) {
+                start = now_usec();
+                service->metrics->dispatch_delay_max_usec = MAX(service->metrics->dispatch_delay_max_usec,
+                                                                start - wakeup);
+        }
+
+        service->dispatching = connection;
+        r = varlink_service_dispatch_connection(service, connection, events);
+        service->dispatching = NULL;
+        if (r < 0)
+                return r;
+
+        /* Everything else waits while a single connection is dispatched. */
+        if (service->metrics)
+                service->metrics->loop_lag_max_usec = MAX(service->metrics->loop_lag_max_usec,
+                                                          now_usec() - start);
+
+        return 0;
+}
+
+/*
+ * Continues the coroutines whose awaited replies arrived.
+ */
+static long varlink_service_resume_coroutines(VarlinkService *service) {
+        uint64_t n;
+
+        if (read(service->resume_fd, &n, sizeof(n)) < 0 && errno != EAGAIN)
+                return -VARLINK_ERROR_PANIC;
+
+        while (!STAILQ_EMPTY(&service->runnable)) {
+                VarlinkCall *call = STAILQ_FIRST(&service->runnable);
+                ServiceConnection *connection = call->finished ? NULL : call->connection;
+                long r;
+
+                STAILQ_REMOVE_HEAD(&service->runnable, runnable_entry);
+                call->runnable = false;
+
+                r = varlink_call_step(service, call);
+
+                if (connection) {
+                        if (r < 0 || service_connection_update_events(service, connection) < 0)
+                                service_connection_close(service, connection);
+                }
+        }
+
+        return 0;
+}
+
+/*
+ * Resumes the paused connections whose time has come, their buffered
+ * messages wake them up like new data does.
+ */
+static long varlink_service_resume(VarlinkService *service) {
+        ServiceConnection *connection, *next;
+        uint64_t expirations;
+        uint64_t now;
+
+        /* The timer might have been armed again after it expired. */
+        if (read(service->timer_fd, &expirations, sizeof(expirations)) < 0 && errno != EAGAIN)
+                return -VARLINK_ERROR_PANIC;
+
+        now = now_usec();
+
+        for (connection = TAILQ_FIRST(&service->paused); connection; connection = next) {
+                next = TAILQ_NEXT(connection, paused_entry);
+
+                if (connection->resume_usec > now)
+                        continue;
+
+                if (service_connection_resume(service, connection) < 0)
+                        service_connection_close(service, connection);
+        }
+
+        return varlink_service_arm_timer(service);
+}
+
+static void attached_connection_update_events(VarlinkConnection *connection, void *userdata) {
+        AttachedConnection *attached = userdata;
+        VarlinkService *service = attached->service;
+        uint32_t events_mask;
+
+        /* Nothing comes from a closed connection anymore. */
+        if (varlink_connection_is_closed(connection)) {
+                varlink_service_detach_connection(service, connection);
+                return;
+        }
+
+        events_mask = varlink_connection_get_events(connection);
+        if (attached->edge_triggered || events_mask == attached->events_mask)
+                return;
+
+        /* The fd stays registered with the old mask, the owner finds out with the next call. */
+        if (epoll_mod(service->epoll_fd, attached->fd, events_mask, connection) < 0)
+                return;
+
+        attached->events_mask = events_mask;
+}
+
+/*
+ * Errors of an attached connection belong to its owner, who is told by
+ * the closed callback of the connection. They do not stop the service.
+ */
+static void varlink_service_dispatch_attached(VarlinkService *service,
+                                              VarlinkConnection *connection,
+                                              uint32_t events) {
+        AttachedConnection *attached;
+        long r;
+
+        r = varlink_connection_process_events(connection, events);
+        if (r < 0 && !varlink_connection_is_closed(connection))
+                varlink_connection_close(connection);
+
+        /* A callback might have detached or freed it. */
+        attached = avl_tree_find(service->attached, connection);
+        if (attached)
+                attached_connection_update_events(connection, attached);
+}
+
+/*
+ * Handles a completed receive or send of @connection. Closed connections
+ * only give back their buffers, and are freed with their last request.
+ */
+static long service_connection_complete(VarlinkService *service,
+                                        ServiceConnection *connection,
+                                        unsigned long request,
+                                        IoRingCompletion *completion) {
+        long r = 0;
+
+        if (request == SERVICE_RING_RECEIVE)
+                connection->receiving = completion->more;
+        else
+                connection->sending = false;
+
+        if (completion->buffer >= 0) {
+                if (!connection->closed)
+                        r = service_connection_receive(service, connection, completion->data, completion->result);
+
+                io_ring_release(service->ring, completion->buffer);
+        }
+
+        if (connection->closed) {
+                if (!connection->receiving && !connection->sending) {
+                        service->n_ring_closing -= 1;
+                        service_connection_free(connection);
+                }
+
+                return 0;
+        }
+
+        if (r < 0)
+                return service_connection_close(service, connection);
+
+        if (request == SERVICE_RING_SEND) {
+                if (completion->result < 0)
+                        return service_connection_close(service, connection);
+
+                varlink_stream_sent(connection->stream, completion->result);
+
+                return service_connection_send(service, connection);
+        }
+
+        /* Running out of buffers or making room for the overflow ends the receive, but not the stream. */
+        if (completion->result == 0 ||
+            (completion->result < 0 && completion->result != -ENOBUFS && completion->result != -ECANCELED))
+                connection->stream->hup = true;
+
+        return service_connection_set_ready(service, connection);
+}
+
+static long varlink_service_ring_accept(VarlinkService *service) {
+        long r;
+
+        r = io_ring_accept_multishot(service->ring, service->listen_fd, (uintptr_t)service | SERVICE_RING_ACCEPT);
+        if (r < 0)
+                return r;
+
+        service->ring_accept_in_flight = true;
+
+        return 0;
+}
+
+static long varlink_service_ring_accepted(VarlinkService *service, IoRingCompletion *completion) {
+        long r;
+
+        service->ring_accept_in_flight = completion->more;
+
+        if (!completion->more && service->ring_accepting) {
+                r = varlink_service_ring_accept(service);
+                if (r < 0)
+                        return r;
+        }
+
+        if (completion->result == -ECANCELED)
+                return 0;
+
+        if (completion->result < 0)
+                return -VARLINK_ERROR_CANNOT_ACCEPT;
+
+        return varlink_service_add_connection(service, completion->result);
+}
+
+/*
+ * Takes all completions of the io_uring, and dispatches every connection
+ * which received something once; the ones which have more wait in the
+ * ready queue for their next turn.
+ */
+static long varlink_service_process_ring(VarlinkService *service, uint64_t wakeup) {
+        IoRingCompletion completion;
+        ServiceConnection *connection;
+        unsigned long n_ready = 0;
+        long r;
+
+        while (io_ring_next(service->ring, &completion)) {
+                unsigned long request = completion.userdata & SERVICE_RING_MASK;
+                void *ptr = (void *)(uintptr_t)(completion.userdata & ~(uint64_t)SERVICE_RING_MASK);
+
+                if (request == SERVICE_RING_ACCEPT) {
+                        r = varlink_service_ring_accepted(service, &completion);
+                        switch (r) {
+                                case 0:
+                                case -VARLINK_ERROR_ACCESS_DENIED:
+                                        break;
+
+                                default:
+                                        return r;
+                        }
+
+                        continue;
+                }
+
+                r = service_connection_complete(service, ptr, request, &completion);
+                if (r < 0)
+                        return r;
+        }
+
+        TAILQ_FOREACH(connection, &service->ready, ready_entry)
+                n_ready += 1;
+
+        while (n_ready > 0 && !TAILQ_EMPTY(&service->ready)) {
+                connection = TAILQ_FIRST(&service->ready);
+                TAILQ_REMOVE(&service->ready, connection, ready_entry);
+                connection->ready = false;
+                n_ready -= 1;
+
+                r = varlink_service_dispatch(service, connection,
+                                             connection->edge_triggered || connection->ring ? 0 : EPOLLIN,
+                                             wakeup);
+                if (r < 0)
+                        return r;
+        }
+
+        return 0;
+}
+
+/*
+ * Waits for the requests of the closed connections, the kernel might
+ * still use their buffers, and for the listening socket to be released.
+ * Connections accepted meanwhile are dropped.
+ */
+static void varlink_service_drain_ring(VarlinkService *service) {
+        service->ring_accepting = false;
+        if (service->ring_accept_in_flight)
+                io_ring_cancel(service->ring, (uintptr_t)service | SERVICE_RING_ACCEPT);
+
+        while (service->n_ring_closing > 0 || service->ring_accept_in_flight) {
+                IoRingCompletion completion;
+
+                if (io_ring_submit(service->ring, 1) < 0)
+                        return;
+
+                while (io_ring_next(service->ring, &completion)) {
+                        unsigned long request = completion.userdata & SERVICE_RING_MASK;
+                        void *ptr = (void *)(uintptr_t)(completion.userdata & ~(uint64_t)SERVICE_RING_MASK);
+
+                        if (request == SERVICE_RING_ACCEPT) {
+                                service->ring_accept_in_flight = completion.more;
+                                if (completion.result >= 0)
+                                        close(completion.result);
+
+                                continue;
+                        }
+
+                        service_connection_complete(service, ptr, request, &completion);
+                }
+        }
+}
+
+static long varlink_service_process(VarlinkService *service) {
+        uint64_t wakeup = 0;
+
+        if (service->metrics)
+                wakeup = now_usec();
+
+        for(;;) {
+                int n;
+                struct epoll_event ev;
+                ServiceConnection *connection;
+                long r;
+
+                n = epoll_wait(service->epoll_fd, &ev, 1, 0);
+                if (n < 0)
+                        return -VARLINK_ERROR_PANIC;
+
+                /* Connections in the ready queue have buffered messages, which do not wake us up. */
+                if (n == 0 && TAILQ_EMPTY(&service->ready))
+                        return 0;
+
+                if (n > 0 && ev.data.ptr == service) {
+                        if ((ev.events & EPOLLIN) == 0)
+                                return -VARLINK_ERROR_PANIC;
+
+                        r = varlink_service_accept(service);
+                        switch (r) {
+                                case 0:
+                                case -VARLINK_ERROR_ACCESS_DENIED:
+                                        break;
+
+                                default:
+                                        return r;
+                        }
+                } else if (n > 0 && service->attached && avl_tree_find(service->attached, ev.data.ptr)) {
+                        varlink_service_dispatch_attached(service, ev.data.ptr, ev.events);
+                } else if (n > 0 && service->ring && ev.data.ptr == service->ring) {
+                        r = varlink_service_process_ring(service, wakeup);
+                        if (r < 0)
+                                return r;
+                } else if (n > 0 && ev.data.ptr == &service->ready_fd) {
+                        uint64_t value;
+
+                        /* The queue is taken care of below. */
+                        if (read(service->ready_fd, &value, sizeof(value)) < 0 && errno != EAGAIN)
+                                return -VARLINK_ERROR_PANIC;
+                } else if (n > 0 && ev.data.ptr == &service->resume_fd) {
+                        r = varlink_service_resume_coroutines(service);
+                        if (r < 0)
+                                return r;
+                } else if (n > 0 && ev.data.ptr == &service->offload_fd) {
+                        r = varlink_service_drain_offloaded(service);
+                        if (r < 0)
+                                return r;
+                } else if (n > 0 && ev.data.ptr == &service->timer_fd) {
+                        r = varlink_service_resume(service);
+                        if (r < 0)
+                                return r;
+                } else if (n > 0) {
+                        r = varlink_service_dispatch(service, ev.data.ptr, ev.events, wakeup);
+                        if (r < 0)
+                                return r;
+                }
+
+                /* Take turns between new events and connections which used up their budget. */
+                connection = TAILQ_FIRST(&service->ready);
+                if (connection) {
+                        TAILQ_REMOVE(&service->ready, connection, ready_entry);
+                        connection->ready = false;
+
+                        /* Edge-triggered connections remember whether they can read, io_uring ones have it all. */
+                        r = varlink_service_dispatch(service, connection,
+                                                     connection->edge_triggered || connection->ring ? 0 : EPOLLIN,
+                                                     wakeup);
+                        if (r < 0)
+                                return r;
+                }
+        }
+
+        return 0;
+}
+
+_public_ long varlink_service_process_events(VarlinkService *service) {
+        long r;
+
+        service->processing = true;
+        r = varlink_service_process(service);
+        service->processing = false;
+
+        /* Everything the dispatched connections want from the io_uring goes out at once. */
+        if (service->ring && io_ring_submit(service->ring, 0) < 0 && r == 0)
+                r = -VARLINK_ERROR_PANIC;
+
+        return r;
+}
+
+static long attached_compare(const void *key, void *value) {
+        AttachedConnection *attached = value;
+
+        if ((uintptr_t)key < (uintptr_t)attached->connection)
+                return -1;
+
+        return (uintptr_t)key > (uintptr_t)attached->connection;
+}
+
+_public_ long varlink_service_attach_connection(VarlinkService *service, VarlinkConnection *connection) {
+        AttachedConnection *attached;
+        int fd;
+
+        fd = varlink_connection_get_fd(connection);
+        if (fd < 0)
+                return fd;
+
+        if (!service->attached) {
+                if (avl_tree_new(&service->attached, attached_compare, varlink_freep) < 0)
+                        return -VARLINK_ERROR_PANIC;
+        }
+
+        if (avl_tree_find(service->attached, connection))
+                return 0;
+
+        attached = varlink_calloc(1, sizeof(AttachedConnection));
+        if (!attached)
+                return -VARLINK_ERROR_PANIC;
+
+        attached->service = service;
+        attached->connection = connection;
+        attached->fd = fd;
+        attached->events_mask = varlink_connection_get_events(connection);
+
+        /* Client connections read until EAGAIN and flush on EPOLLOUT, they need no mask of their own. */
+        if (service->edge_triggered) {
+                attached->events_mask = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+                attached->edge_triggered = true;
+        }
+
+        if (avl_tree_insert(service->attached, connection, attached) < 0) {
+                varlink_free(attached);
+                return -VARLINK_ERROR_PANIC;
+        }
+
+        if (epoll_add(service->epoll_fd, fd, attached->events_mask, connection) < 0) {
+                avl_tree_remove(service->attached, connection);
+                return -VARLINK_ERROR_PANIC;
+        }
+
+        varlink_connection_set_events_callback(connection, attached_connection_update_events, attached);
+
+        return 0;
+}
+
+_public_ long varlink_service_detach_connection(VarlinkService *service, VarlinkConnection *connection) {
+        AttachedConnection *attached;
+
+        if (!service->attached)
+                return -VARLINK_ERROR_INVALID_CALL;
+
+        attached = avl_tree_find(service->attached, connection);
+        if (!attached)
+                return -VARLINK_ERROR_INVALID_CALL;
+
+        varlink_connection_set_events_callback(connection, NULL, NULL);
+
+        /* Closed connections already left the epoll set with their fd. */
+        if (!varlink_connection_is_closed(connection))
+                epoll_del(service->epoll_fd, attached->fd);
+
+        avl_tree_remove(service->attached, connection);
+
+        return 0;
+}
+
+static long peer_weight_compare(const void *key, void *value) {
+        uid_t uid = (uid_t)(unsigned long)key;
+        PeerWeight *peer = value;
+
+        if (uid < peer->uid)
+                return -1;
+
+        return uid > peer->uid;
+}
+
+static long varlink_service_add_ready_fd(VarlinkService *service) {
+        if (service->ready_fd >= 0)
+                return 0;
+
+        service->ready_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        if (service->ready_fd < 0)
+                return -VARLINK_ERROR_PANIC;
+
+        if (epoll_add(service->epoll_fd, service->ready_fd, EPOLLIN, &service->ready_fd) < 0) {
+                close(service->ready_fd);
+                service->ready_fd = -1;
+                return -VARLINK_ERROR_PANIC;
+        }
+
+        return 0;
+}
+
+_public_ long varlink_service_set_edge_triggered(VarlinkService *service, bool enable) {
+        long r;
+
+        if (enable) {
+                r = varlink_service_add_ready_fd(service);
+                if (r < 0)
+                        return r;
+        }
+
+        service->edge_triggered = enable;
+
+        return 0;
+}
+
+_public_ long varlink_service_set_io_uring(VarlinkService *service, bool enable) {
+        long r;
+
+        if (enable == service->ring_accepting)
+                return 0;
+
+        if (!enable) {
+                if (io_ring_cancel(service->ring, (uintptr_t)service | SERVICE_RING_ACCEPT) < 0 ||
+                    io_ring_submit(service->ring, 0) < 0)
+                        return -VARLINK_ERROR_PANIC;
+
+                if (epoll_add(service->epoll_fd, service->listen_fd, EPOLLIN, service) < 0)
+                        return -VARLINK_ERROR_PANIC;
+
+                service->ring_accepting = false;
+
+                return 0;
+        }
+
+        r = varlink_service_add_ready_fd(service);
+        if (r < 0)
+                return r;
+
+        if (!service->ring) {
+                /* Without io_uring, the service stays with epoll. */
+                if (io_ring_new(&service->ring, SERVICE_RING_ENTRIES) < 0)
+                        return 0;
+
+                if (epoll_add(service->epoll_fd, io_ring_get_fd(service->ring), EPOLLIN, service->ring) < 0) {
+                        service->ring = io_ring_free(service->ring);
+                        return -VARLINK_ERROR_PANIC;
+                }
+        }
+
+        r = varlink_service_ring_accept(service);
+        if (r < 0)
+                return r;
+
+        r = io_ring_submit(service->ring, 0);
+        if (r < 0)
+                return r;
+
+        if (epoll_del(service->epoll_fd, service->listen_fd) < 0)
+                return -VARLINK_ERROR_PANIC;
+
+        service->ring_accepting = true;
+
+        return 0;
+}
+
+bool varlink_service_get_io_uring(VarlinkService *service) {
+        return service->ring_accepting;
+}
+
+_public_ long varlink_service_set_dispatch_budget(VarlinkService *service, unsigned long n_messages) {
+        service->dispatch_budget = n_messages;
+
+        return 0;
+}
+
+_public_ long varlink_service_set_peer_weight(VarlinkService *service, uid_t uid, unsigned long weight) {
+        PeerWeight *peer;
+
+        if (weight == 0)
+                return -VARLINK_ERROR_INVALID_CALL;
+
+        if (!service->peer_weights) {
+                if (avl_tree_new(&service->peer_weights, peer_weight_compare, varlink_freep) < 0)
+                        return -VARLINK_ERROR_PANIC;
+        }
+
+        peer = avl_tree_find(service->peer_weights, (void *)(unsigned long)uid);
+        if (!peer) {
+                peer = varlink_calloc(1, sizeof(PeerWeight));
+                if (!peer)
+                        return -VARLINK_ERROR_PANIC;
+
+                peer->uid = uid;
+
+                if (avl_tree_insert(service->peer_weights, (void *)(unsigned long)uid, peer) < 0) {
+                        varlink_free(peer);
+                        return -VARLINK_ERROR_PANIC;
+                }
+        }
+
+        peer->weight = weight;
+
+        return 0;
+}
+
+_public_ long varlink_service_set_rate_limit(VarlinkService *service, const VarlinkRateLimit *limit) {
+        long r;
+
+        /* Limits start out with full buckets, nobody waits for the old ones. */
+        for (AVLTreeNode *node = avl_tree_first(service->connections); node; node = avl_tree_node_next(node)) {
+                ServiceConnection *connection = avl_tree_node_get(node);
+
+                connection->buckets = NULL;
+        }
+
+        while (!TAILQ_EMPTY(&service->paused)) {
+                ServiceConnection *connection = TAILQ_FIRST(&service->paused);
+
+                if (service_connection_resume(service, connection) < 0)
+                        service_connection_close(service, connection);
+        }
+
+        if (service->uid_buckets)
+                service->uid_buckets = avl_tree_free(service->uid_buckets);
+
+        service->rate_limited = false;
+
+        if (!limit)
+                return varlink_service_arm_timer(service);
+
+        service->rate_limit = *limit;
+        if (service->rate_limit.calls_burst == 0)
+                service->rate_limit.calls_burst = MAX(limit->calls_per_sec, 1);
+        if (service->rate_limit.bytes_burst == 0)
+                service->rate_limit.bytes_burst = MAX(limit->bytes_per_sec, 1);
+
+        if (limit->per_uid) {
+                if (avl_tree_new(&service->uid_buckets, uid_buckets_compare, varlink_freep) < 0)
+                        return -VARLINK_ERROR_PANIC;
+        }
+
+        if (service->timer_fd < 0) {
+                service->timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+                if (service->timer_fd < 0)
+                        return -VARLINK_ERROR_PANIC;
+
+                if (epoll_add(service->epoll_fd, service->timer_fd, EPOLLIN, &service->timer_fd) < 0) {
+                        close(service->timer_fd);
+                        service->timer_fd = -1;
+                        return -VARLINK_ERROR_PANIC;
+                }
+        }
+
+        /* Raw services reply to calls themselves, they only get the error name. */
+        if (limit->reject && service->interfaces &&
+            !avl_tree_find(service->interfaces, "org.varlink.ratelimit")) {
+                r = varlink_service_add_interface(service, org_varlink_ratelimit_varlink, NULL);
+                if (r < 0)
+                        return r;
+        }
+
+        service->rate_limited = true;
+
+        return 0;
+}
+
+_public_ long varlink_call_set_connection_closed_callback(VarlinkCall *call,
+                                                          VarlinkCallConnectionClosed callback,
+                                                          void *userdata) {
+        call->closed_callback = callback;
+        call->closed_callback_userdata = userdata;
+
+        return 0;
+}
+
+_public_ void *varlink_call_get_connection_userdata(VarlinkCall *call) {
+        return call->closed_callback_userdata;
+}
+
+_public_ int varlink_call_get_connection_fd(VarlinkCall *call) {
+        return call->connection->stream->fd;
+}
+
+/*
+ * Writes the last reply @json for @call, and for all identical calls
+ * waiting for it, from a single serialization. Successful replies are
+ * kept in the cache, unless it was invalidated since the call arrived.
+ * Takes ownership of @json.
+ */
+static long varlink_call_write_final_json(VarlinkCall *call, char *json_owned, long length, const char *error) {
+        VarlinkService *service = call->service;
+        VarlinkCache *cache = service->cache;
+        _cleanup_(freep) char *json = json_owned;
+        long r;
+
+        r = varlink_stream_write_json(call->connection->stream, json, length);
+        if (r < 0)
+                return r;
+
+        while (!STAILQ_EMPTY(&call->waiters)) {
+                VarlinkCall *waiter = STAILQ_FIRST(&call->waiters);
+                ServiceConnection *connection = waiter->connection;
+                long k;
+
+                STAILQ_REMOVE_HEAD(&call->waiters, waiter_entry);
+                waiter->leader = NULL;
+
+                k = varlink_stream_write_json(connection->stream, json, length);
+                if (k < 0) {
+                        service_connection_close(service, connection);
+                        continue;
+                }
+
+                VARLINK_PROBE(reply__queued, connection->stream->fd, waiter->method, error, 0);
+
+                /* We did not write all data, wake up when we can write to the socket. */
+                if (k == 0)
+                        connection->events_mask |= EPOLLOUT;
+
+                varlink_call_finish(waiter, error != NULL);
+
+                if (service_connection_update_events(service, connection) < 0)
+                        service_connection_close(service, connection);
+        }
+
+        /* Caching is best-effort, the reply is already on its way. */
+        if (cache && call->cache_ttl_usec > 0 && !error && call->cache_generation == cache->generation) {
+                length = reply_cut_ttl(json, length, call->reply_ttl_usec);
+                varlink_cache_store(cache, call->key, call->cache_ttl_usec, call->reply_ttl_usec, json, length);
+                json = NULL;
+        }
+
+        return r;
+}
+
+static long varlink_call_write_final(VarlinkCall *call, VarlinkObject *message, const char *error) {
+        char *json;
+        long length;
+
+        length = varlink_object_to_json(message, &json);
+        if (length < 0)
+                return length;
+
+        return varlink_call_write_final_json(call, json, length, error);
+}
+
+_public_ long varlink_call_reply(VarlinkCall *call,
+                                 VarlinkObject *parameters,
                                  uint64_t flags) {
         _cleanup_(varlink_object_unrefp) VarlinkObject *message = NULL;
+        VarlinkService *service = call->service;
+        ServiceConnection *connection = call->connection;
+        uint64_t mark;
         long r;
 
-        if (call != call->connection->call)
+        /* The event loop might be closing the connection, it checks when it sends the reply. */
+        if (!call->offloaded && (call->finished || call != call->connection->call))
                 return -VARLINK_ERROR_INVALID_CALL;
 
         if (call->flags & VARLINK_CALL_ONEWAY && flags & VARLINK_REPLY_CONTINUES)
                 return -VARLINK_ERROR_INVALID_CALL;
 
+        if (call->offloaded && call->flags & VARLINK_CALL_ONEWAY)
+                return varlink_call_queue_reply(call, NULL, NULL, 0);
+
         if (call->flags & VARLINK_CALL_ONEWAY) {
-                call->connection->call = varlink_call_unref(call);
-                return 0;
+                varlink_call_finish(call, false);
+                return service_connection_update_events(service, connection);
         }
 
-        r = varlink_message_pack_reply(NULL, parameters, flags, &message);
+        mark = varlink_allocation_mark();
+
+        r = varlink_message_pack_reply(NULL, parameters, flags,
+                                       flags & VARLINK_REPLY_CONTINUES ? 0 : call->reply_ttl_usec,
+                                       &message);
         if (r < 0)
                 return r;
 
-        r = varlink_stream_write(call->connection->stream, message);
+        if (call->offloaded)
+                return varlink_call_queue_reply(call, message, NULL, flags);
+
+        if (call->key && !(flags & VARLINK_REPLY_CONTINUES))
+                r = varlink_call_write_final(call, message, NULL);
+        else
+                r = varlink_stream_write(call->connection->stream, message);
         if (r < 0)
                 return r;
 
+        varlink_allocation_count_reply(mark);
+
+        VARLINK_PROBE(reply__queued, call->connection->stream->fd, call->method, NULL, flags);
+
         /* We did not write all data, wake up when we can write to the socket. */
         if (r == 0)
                 call->connection->events_mask |= EPOLLOUT;
 
         if (!(flags & VARLINK_REPLY_CONTINUES))
-                call->connection->call = varlink_call_unref(call);
+                varlink_call_finish(call, false);
 
-        return 0;
+        return service_connection_update_events(service, connection);
 }
 
 _public_ long varlink_call_reply_error(VarlinkCall *call,
@@ -668,11 +3146,14 @@ _public_ long varlink_call_reply_error(VarlinkCall *call,
         _cleanup_(varlink_object_unrefp) VarlinkObject *message = NULL;
         _cleanup_(varlink_uri_freep) VarlinkURI *uri_error = NULL;
         _cleanup_(varlink_uri_freep) VarlinkURI *uri_method = NULL;
+        VarlinkService *service = call->service;
+        ServiceConnection *connection = call->connection;
         VarlinkInterface *interface;
         VarlinkInterfaceMember *member;
+        uint64_t mark;
         long r;
 
-        if (call != call->connection->call)
+        if (!call->offloaded && (call->finished || call != call->connection->call))
                 return -VARLINK_ERROR_INVALID_CALL;
 
         r = varlink_uri_new(&uri_error, error, true);
@@ -698,19 +3179,138 @@ _public_ long varlink_call_reply_error(VarlinkCall *call,
             strcmp(uri_error->interface, uri_method->interface) != 0)
                 return -VARLINK_ERROR_INVALID_IDENTIFIER;
 
-        r = varlink_message_pack_reply(error, parameters, 0, &message);
+        mark = varlink_allocation_mark();
+
+        r = varlink_message_pack_reply(error, parameters, 0, 0, &message);
         if (r < 0)
                 return r;
 
-        r = varlink_stream_write(call->connection->stream, message);
+        if (call->offloaded)
+                return varlink_call_queue_reply(call, message, error, 0);
+
+        if (call->key)
+                r = varlink_call_write_final(call, message, error);
+        else
+                r = varlink_stream_write(call->connection->stream, message);
         if (r < 0)
                 return r;
 
+        varlink_allocation_count_reply(mark);
+
+        VARLINK_PROBE(reply__queued, call->connection->stream->fd, call->method, error, 0);
+
         /* We did not write all data, wake up when we can write to the socket. */
         if (r == 0)
                 call->connection->events_mask |= EPOLLOUT;
 
-        call->connection->call = varlink_call_unref(call);
+        varlink_call_finish(call, true);
+
+        return service_connection_update_events(service, connection);
+}
+
+/*
+ * Sends a reply queued by the handler of @call, which still belongs to
+ * its connection.
+ */
+static long varlink_call_send_queued(VarlinkCall *call, OffloadReply *reply) {
+        ServiceConnection *connection = call->connection;
+        bool last = !(reply->flags & VARLINK_REPLY_CONTINUES);
+        long r;
+
+        if (reply->json) {
+                if (call->key && last) {
+                        r = varlink_call_write_final_json(call, reply->json, reply->length, reply->error);
+                        reply->json = NULL;
+                } else
+                        r = varlink_stream_write_json(connection->stream, reply->json, reply->length);
+                if (r < 0)
+                        return r;
+
+                VARLINK_PROBE(reply__queued, connection->stream->fd, call->method, reply->error, reply->flags);
+
+                /* We did not write all data, wake up when we can write to the socket. */
+                if (r == 0)
+                        connection->events_mask |= EPOLLOUT;
+        }
+
+        if (last)
+                varlink_call_finish(call, reply->error != NULL);
+
+        return 0;
+}
+
+/*
+ * Sends the replies the handler of @call queued so far, and finishes
+ * its handling like on the event loop when the handler returned.
+ */
+static void varlink_call_drain(VarlinkService *service, VarlinkCall *call) {
+        STAILQ_HEAD(replies, OffloadReply) replies = STAILQ_HEAD_INITIALIZER(replies);
+        ServiceConnection *connection = call->finished || call->closed ? NULL : call->connection;
+        bool done;
+        long r = 0;
+
+        pthread_mutex_lock(&service->offload_lock);
+        STAILQ_CONCAT(&replies, &call->offload_replies);
+        call->offload_queued = false;
+        done = call->offload_done;
+        pthread_mutex_unlock(&service->offload_lock);
+
+        while (!STAILQ_EMPTY(&replies)) {
+                OffloadReply *reply = STAILQ_FIRST(&replies);
+
+                STAILQ_REMOVE_HEAD(&replies, entry);
+
+                /* Replies after the last one, or to a closed connection, go nowhere. */
+                if (r >= 0 && !call->finished && !call->closed)
+                        r = varlink_call_send_queued(call, reply);
+
+                offload_reply_free(reply);
+        }
+
+        if (done) {
+                call->offloaded = false;
+
+                VARLINK_PROBE(dispatch__end, connection ? connection->stream->fd : -1, call->method,
+                              call->offload_result);
+
+                if (call->handler_metrics || service->slow_call_callback)
+                        varlink_service_handler_finish(service, call, call->handler_metrics, call->offload_usec);
+
+                if (call->offload_result < 0)
+                        r = call->offload_result;
+
+                if (call->closed && !call->finished)
+                        varlink_call_close(call);
+        }
+
+        if (connection) {
+                if (r < 0 || service_connection_update_events(service, connection) < 0)
+                        service_connection_close(service, connection);
+        }
+
+        /* Drop the reference of the worker. */
+        if (done)
+                varlink_call_unref(call);
+}
+
+static long varlink_service_drain_offloaded(VarlinkService *service) {
+        STAILQ_HEAD(completed, VarlinkCall) completed = STAILQ_HEAD_INITIALIZER(completed);
+        uint64_t n;
+
+        if (read(service->offload_fd, &n, sizeof(n)) < 0 && errno != EAGAIN)
+                return -VARLINK_ERROR_PANIC;
+
+        pthread_mutex_lock(&service->offload_lock);
+        STAILQ_CONCAT(&completed, &service->completed);
+        pthread_mutex_unlock(&service->offload_lock);
+
+        while (!STAILQ_EMPTY(&completed)) {
+                VarlinkCall *call = STAILQ_FIRST(&completed);
+
+                STAILQ_REMOVE_HEAD(&completed, completed_entry);
+                varlink_call_drain(service, call);
+        }
+
         return 0;
 }
 
@@ -6,3 +6,10 @@
 #include "varlink.h"
 
 VarlinkInterface *varlink_service_get_interface_by_name(VarlinkService *service, const char *name);
+
+/*
+ * Returns whether new connections are accepted through the io_uring,
+ * which varlink_service_set_io_uring() quietly skips without kernel
+ * support.
+ */
+bool varlink_service_get_io_uring(VarlinkService *service);
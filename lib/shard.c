@@ -0,0 +1,171 @@
+// SPDX-License-Identifier: Apache-2.0
+
+#include "alloc.h"
+#include "shard.h"
+#include "util.h"
+#include "varlink.h"
+
+#include <pthread.h>
+
+/*
+ * The threads wait until all of them were created, a running shard
+ * cannot be stopped anymore.
+ */
+typedef struct {
+        pthread_mutex_t lock;
+        pthread_cond_t cond;
+        bool released;
+        bool run;
+} ShardStart;
+
+typedef struct {
+        pthread_t thread;
+        bool started;
+        ShardStart *start;
+
+        unsigned long index;
+        int listen_fd;
+        VarlinkShardFunc func;
+        void *userdata;
+
+        long result;
+} Shard;
+
+static void *shard_run(void *userdata) {
+        Shard *shard = userdata;
+        ShardStart *start = shard->start;
+        bool run;
+
+        pthread_mutex_lock(&start->lock);
+        while (!start->released)
+                pthread_cond_wait(&start->cond, &start->lock);
+        run = start->run;
+        pthread_mutex_unlock(&start->lock);
+
+        if (!run) {
+                close(shard->listen_fd);
+                return NULL;
+        }
+
+        shard->result = shard->func(shard->index, shard->listen_fd, shard->userdata);
+
+        return NULL;
+}
+
+static void shard_start_release(ShardStart *start, bool run) {
+        pthread_mutex_lock(&start->lock);
+        start->released = true;
+        start->run = run;
+        pthread_cond_broadcast(&start->cond);
+        pthread_mutex_unlock(&start->lock);
+}
+
+static long shard_start(Shard *shard, int cpu) {
+        pthread_attr_t attr;
+        cpu_set_t cpus;
+        int r = 0;
+
+        if (pthread_attr_init(&attr) != 0)
+                return -VARLINK_ERROR_PANIC;
+
+        /*
+         * The thread stays on the CPU whose connections its listener
+         * gets, their packets are processed there already.
+         */
+        if (cpu >= 0) {
+                CPU_ZERO(&cpus);
+                CPU_SET(cpu, &cpus);
+                r = pthread_attr_setaffinity_np(&attr, sizeof(cpus), &cpus);
+        }
+
+        if (r == 0)
+                r = pthread_create(&shard->thread, &attr, shard_run, shard);
+        pthread_attr_destroy(&attr);
+        if (r != 0)
+                return -VARLINK_ERROR_PANIC;
+
+        shard->started = true;
+
+        return 0;
+}
+
+unsigned long varlink_shard_cpus(int *cpus) {
+        cpu_set_t allowed;
+        unsigned long n_cpus = 0;
+
+        if (sched_getaffinity(0, sizeof(allowed), &allowed) < 0)
+                return 0;
+
+        for (int cpu = 0; cpu < CPU_SETSIZE; cpu += 1)
+                if (CPU_ISSET(cpu, &allowed))
+                        cpus[n_cpus++] = cpu;
+
+        return n_cpus;
+}
+
+_public_ long varlink_run_shards(const char *address,
+                                 unsigned long n_shards,
+                                 VarlinkShardFunc func,
+                                 void *userdata) {
+        _cleanup_(varlink_freep) Shard *shards = NULL;
+        _cleanup_(varlink_freep) int *fds = NULL;
+        _cleanup_(varlink_freep) int *cpus = NULL;
+        ShardStart start = {
+                .lock = PTHREAD_MUTEX_INITIALIZER,
+                .cond = PTHREAD_COND_INITIALIZER
+        };
+        unsigned long n_cpus;
+        long r;
+
+        cpus = varlink_calloc(CPU_SETSIZE, sizeof(int));
+        if (!cpus)
+                return -VARLINK_ERROR_PANIC;
+
+        n_cpus = varlink_shard_cpus(cpus);
+
+        if (n_shards == 0)
+                n_shards = MAX(n_cpus, 1UL);
+
+        shards = varlink_calloc(n_shards, sizeof(Shard));
+        fds = varlink_calloc(n_shards, sizeof(int));
+        if (!shards || !fds)
+                return -VARLINK_ERROR_PANIC;
+
+        r = varlink_listen_shards(address, n_shards, fds);
+        if (r < 0)
+                return r;
+
+        for (unsigned long i = 0; i < n_shards; i += 1) {
+                Shard *shard = &shards[i];
+
+                shard->start = &start;
+                shard->index = i;
+                shard->listen_fd = fds[i];
+                shard->func = func;
+                shard->userdata = userdata;
+
+                /* Once one failed to start, the others are not started anymore. */
+                if (r < 0) {
+                        close(fds[i]);
+                        continue;
+                }
+
+                r = shard_start(shard, n_cpus > 0 ? cpus[i % n_cpus] : -1);
+                if (r < 0)
+                        close(fds[i]);
+        }
+
+        /* The shards only run when all threads could be started, otherwise they close their listener. */
+        shard_start_release(&start, r == 0);
+
+        for (unsigned long i = 0; i < n_shards; i += 1) {
+                if (!shards[i].started)
+                        continue;
+
+                pthread_join(shards[i].thread, NULL);
+                if (r == 0 && shards[i].result < 0)
+                        r = shards[i].result;
+        }
+
+        return r;
+}
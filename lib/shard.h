@@ -0,0 +1,13 @@
+// SPDX-License-Identifier: Apache-2.0
+
+#pragma once
+
+#include <sched.h>
+
+/*
+ * Store the CPUs the process may run on in @cpus, which has room for
+ * CPU_SETSIZE of them, and return their number. Shard i runs on
+ * cpus[i % n], the listener of a shard gets the connections received
+ * on its CPU.
+ */
+unsigned long varlink_shard_cpus(int *cpus);
@@ -1,5 +1,7 @@
 // SPDX-License-Identifier: Apache-2.0
 
+#include "alloc.h"
+#include "probe.h"
 #include "stream.h"
 #include "util.h"
 
@@ -12,19 +14,21 @@
 #define CONNECTION_BUFFER_SIZE (16 * 1024 * 1024)
 
 long varlink_stream_new(VarlinkStream **streamp, int fd) {
-        _cleanup_(freep) VarlinkStream *stream = NULL;
+        _cleanup_(varlink_freep) VarlinkStream *stream = NULL;
 
-        stream = calloc(1, sizeof(VarlinkStream));
+        stream = varlink_calloc(1, sizeof(VarlinkStream));
         if (!stream)
                 return -VARLINK_ERROR_PANIC;
 
         stream->fd = fd;
+        stream->created_usec = now_usec();
+        stream->activity_usec = stream->created_usec;
 
-        stream->in = malloc(CONNECTION_BUFFER_SIZE);
+        stream->in = varlink_malloc(CONNECTION_BUFFER_SIZE);
         if (!stream->in)
                 return -VARLINK_ERROR_PANIC;
 
-        stream->out = malloc(CONNECTION_BUFFER_SIZE);
+        stream->out = varlink_malloc(CONNECTION_BUFFER_SIZE);
         if (!stream->out)
                 return -VARLINK_ERROR_PANIC;
 
@@ -38,10 +42,10 @@ VarlinkStream *varlink_stream_free(VarlinkStream *stream) {
         if (stream->fd >= 0)
                 close(stream->fd);
 
-        free(stream->in);
-        free(stream->out);
+        varlink_free(stream->in);
+        varlink_free(stream->out);
 
-        free(stream);
+        varlink_free(stream);
         return NULL;
 }
 
@@ -64,6 +68,10 @@ static void move_rest(uint8_t **bufferp, unsigned long *startp, unsigned long *e
 size_t varlink_stream_flush(VarlinkStream *stream) {
         long n;
 
+        /* The owner sends the buffer when the previous send completed. */
+        if (stream->io_ring)
+                return stream->out_end - stream->out_start;
+
 write_again:
         n = write(stream->fd,
                   stream->out + stream->out_start,
@@ -90,10 +98,19 @@ write_again:
 
                 default:
                         stream->out_start += n;
+                        stream->n_bytes_written += n;
+                        if (n > 0)
+                                stream->activity_usec = now_usec();
                         break;
         }
 
         move_rest(&stream->out, &stream->out_start, &stream->out_end);
+
+        if (stream->out_end > 0)
+                VARLINK_PROBE(flush__partial, stream->fd, MAX(n, 0), stream->out_end);
+        else
+                VARLINK_PROBE(flush__complete, stream->fd, MAX(n, 0));
+
         return stream->out_end - stream->out_start;
 }
 
@@ -218,17 +235,44 @@ bridge_out:
 }
 
 long varlink_stream_read(VarlinkStream *stream, VarlinkObject **messagep) {
+        unsigned long size;
+        uint64_t mark;
+        long r;
+
+        r = varlink_stream_peek(stream, &size);
+        if (r <= 0) {
+                *messagep = NULL;
+                return r;
+        }
+
+        mark = varlink_allocation_mark();
+
+        VARLINK_PROBE(message__read, stream->fd, size);
+        r = varlink_object_new_from_json(messagep, (const char *) &stream->in[stream->in_start]);
+        VARLINK_PROBE(message__parsed, stream->fd, size, r);
+        varlink_allocation_count_parse(mark);
+        if (r < 0)
+                return r;
+
+        stream->in_start += size + 1;
+        stream->n_messages_read += 1;
+
+        return 1;
+}
+
+void varlink_stream_skip(VarlinkStream *stream, unsigned long size) {
+        stream->in_start += size + 1;
+        stream->n_messages_read += 1;
+}
+
+long varlink_stream_peek(VarlinkStream *stream, unsigned long *sizep) {
         for (;;) {
                 uint8_t *nul;
-                long r, n;
+                long n;
 
                 nul = memchr(&stream->in[stream->in_start], 0, stream->in_end - stream->in_start);
                 if (nul) {
-                        r = varlink_object_new_from_json(messagep, (const char *) &stream->in[stream->in_start]);
-                        if (r < 0)
-                                return r;
-
-                        stream->in_start = (nul + 1) - stream->in;
+                        *sizep = nul - &stream->in[stream->in_start];
                         return 1;
                 }
 
@@ -236,6 +280,10 @@ long varlink_stream_read(VarlinkStream *stream, VarlinkObject **messagep) {
 
                 if (stream->in_end == CONNECTION_BUFFER_SIZE)
                         return -VARLINK_ERROR_INVALID_MESSAGE;
+
+                /* Everything received so far is already in the buffer. */
+                if (stream->io_ring)
+                        return 0;
 again:
                 n = read(stream->fd,
                          stream->in + stream->in_end,
@@ -248,12 +296,10 @@ again:
                                                 goto again;
 
                                         case EAGAIN:
-                                                *messagep = NULL;
                                                 return 0;
 
                                         case ECONNRESET:
                                                 stream->hup = true;
-                                                *messagep = NULL;
                                                 return 0;
 
                                         default:
@@ -267,11 +313,12 @@ again:
 
                         case 0:
                                 stream->hup = true;
-                                *messagep = NULL;
                                 return 0;
 
                         default:
                                 stream->in_end += n;
+                                stream->n_bytes_read += n;
+                                stream->activity_usec = now_usec();
                                 break;
                 }
         }
@@ -286,14 +333,16 @@ again:
 long varlink_stream_write(VarlinkStream *stream, VarlinkObject *message) {
         _cleanup_(freep) char *json = NULL;
         long length;
-        unsigned long ulength;
-        size_t r;
 
         length = varlink_object_to_json(message, &json);
         if (length < 0)
                 return length;
 
-        ulength = (unsigned long) length;
+        return varlink_stream_write_json(stream, json, length);
+}
+
+long varlink_stream_write_json(VarlinkStream *stream, const char *json, unsigned long ulength) {
+        size_t r;
 
         if (ulength >= CONNECTION_BUFFER_SIZE - 1)
                 return -VARLINK_ERROR_INVALID_MESSAGE;
@@ -303,6 +352,9 @@ long varlink_stream_write(VarlinkStream *stream, VarlinkObject *message) {
 
         memcpy(stream->out + stream->out_end, json, ulength + 1);
         stream->out_end += ulength + 1;
+        stream->n_messages_written += 1;
+        stream->out_max = MAX(stream->out_max, stream->out_end - stream->out_start);
+        VARLINK_PROBE(message__queued, stream->fd, ulength, stream->out_end - stream->out_start);
 
         r = varlink_stream_flush(stream);
         if (r < 0)
@@ -311,3 +363,46 @@ long varlink_stream_write(VarlinkStream *stream, VarlinkObject *message) {
         /* return 1 when flush() wrote the whole message */
         return r == 0 ? 1 : 0;
 }
+
+unsigned long varlink_stream_received(VarlinkStream *stream, const uint8_t *data, unsigned long size) {
+        move_rest(&stream->in, &stream->in_start, &stream->in_end);
+
+        size = MIN(size, CONNECTION_BUFFER_SIZE - stream->in_end);
+        if (size == 0)
+                return 0;
+
+        memcpy(stream->in + stream->in_end, data, size);
+        stream->in_end += size;
+        stream->n_bytes_read += size;
+        stream->activity_usec = now_usec();
+
+        return size;
+}
+
+void varlink_stream_sent(VarlinkStream *stream, unsigned long size) {
+        stream->out_start += size;
+        stream->n_bytes_written += size;
+        if (size > 0)
+                stream->activity_usec = now_usec();
+
+        move_rest(&stream->out, &stream->out_start, &stream->out_end);
+
+        if (stream->out_end > 0)
+                VARLINK_PROBE(flush__partial, stream->fd, size, stream->out_end);
+        else
+                VARLINK_PROBE(flush__complete, stream->fd, size);
+}
+
+void varlink_stream_get_stats(VarlinkStream *stream, VarlinkConnectionStats *stats) {
+        *stats = (VarlinkConnectionStats){
+                .n_messages_in = stream->n_messages_read,
+                .n_messages_out = stream->n_messages_written,
+                .n_bytes_in = stream->n_bytes_read,
+                .n_bytes_out = stream->n_bytes_written,
+                .in_buffered = stream->in_end - stream->in_start,
+                .out_buffered = stream->out_end - stream->out_start,
+                .out_buffered_max = stream->out_max,
+                .connect_usec = stream->created_usec,
+                .last_activity_usec = stream->activity_usec
+        };
+}
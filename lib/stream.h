@@ -18,6 +18,23 @@ struct VarlinkStream {
         unsigned long out_end;
 
         bool hup;
+
+        /*
+         * The fd is read and written through an io_uring by the owner of
+         * the stream, which only buffers the data.
+         */
+        bool io_ring;
+
+        /* Bytes transferred over the fd during the lifetime of the stream. */
+        uint64_t n_bytes_read;
+        uint64_t n_bytes_written;
+
+        uint64_t n_messages_read;
+        uint64_t n_messages_written;
+        unsigned long out_max;
+
+        uint64_t created_usec;
+        uint64_t activity_usec;
 };
 
 long varlink_stream_new(VarlinkStream **streamp, int fd);
@@ -29,6 +46,18 @@ VarlinkStream *varlink_stream_free(VarlinkStream *stream);
  */
 long varlink_stream_read(VarlinkStream *stream, VarlinkObject **messagep);
 
+/*
+ * Reads until a full message is buffered, without parsing it. Returns 1
+ * and stores its size in sizep, or 0 if there is none yet.
+ */
+long varlink_stream_peek(VarlinkStream *stream, unsigned long *sizep);
+
+/*
+ * Drops the message of @size bytes returned by varlink_stream_peek(),
+ * without parsing it.
+ */
+void varlink_stream_skip(VarlinkStream *stream, unsigned long size);
+
 /*
  * Writes message to the stream. Returns 1 if the whole message was
  * written. Otherwise, returns 0. Use varlink_stream_flush() to write
@@ -36,10 +65,34 @@ long varlink_stream_read(VarlinkStream *stream, VarlinkObject **messagep);
  */
 long varlink_stream_write(VarlinkStream *stream, VarlinkObject *message);
 
+/*
+ * Like varlink_stream_write(), for a message which is already
+ * serialized to @length bytes of @json.
+ */
+long varlink_stream_write_json(VarlinkStream *stream, const char *json, unsigned long length);
+
 /*
  * Flushes the write buffer. Returns the amount of bytes that are still
  * in the buffer.
  */
 size_t varlink_stream_flush(VarlinkStream *stream);
 
+/*
+ * Appends data received through an io_uring to the read buffer. Returns
+ * the number of bytes which fit.
+ */
+unsigned long varlink_stream_received(VarlinkStream *stream, const uint8_t *data, unsigned long size);
+
+/*
+ * Drops @size bytes sent through an io_uring from the write buffer. The
+ * data which is left moves to the front, it must not be in flight.
+ */
+void varlink_stream_sent(VarlinkStream *stream, unsigned long size);
+
+/*
+ * Fills in all counters of @stats except the calls in flight, which are
+ * tracked by the owner of the stream.
+ */
+void varlink_stream_get_stats(VarlinkStream *stream, VarlinkConnectionStats *stats);
+
 long varlink_stream_bridge(int signal_fd, VarlinkStream *client_in, VarlinkStream *client_out, VarlinkStream *server);
@@ -0,0 +1,297 @@
+// SPDX-License-Identifier: Apache-2.0
+
+#include "varlink.h"
+#include "util.h"
+
+#include <assert.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+
+/*
+ * Every block carries a header with a magic value, so memory released
+ * by the wrong allocator is detected.
+ */
+#define MAGIC 0x766c6e6b616c6c63ULL
+
+typedef struct {
+        uint64_t magic;
+        uint64_t size;
+} Header;
+
+typedef struct {
+        unsigned long n_outstanding;
+        unsigned long n_allocations;
+} Counter;
+
+static void *test_malloc(size_t size, void *userdata) {
+        Counter *counter = userdata;
+        Header *header;
+
+        header = malloc(sizeof(Header) + size);
+        if (!header)
+                return NULL;
+
+        header->magic = MAGIC;
+        header->size = size;
+
+        /* Offloaded handlers allocate on worker threads. */
+        __atomic_add_fetch(&counter->n_outstanding, 1, __ATOMIC_RELAXED);
+        __atomic_add_fetch(&counter->n_allocations, 1, __ATOMIC_RELAXED);
+
+        return header + 1;
+}
+
+static void *test_calloc(size_t n, size_t size, void *userdata) {
+        void *p;
+
+        p = test_malloc(n * size, userdata);
+        if (p)
+                memset(p, 0, n * size);
+
+        return p;
+}
+
+static void test_free(void *ptr, void *userdata) {
+        Counter *counter = userdata;
+        Header *header;
+
+        if (!ptr)
+                return;
+
+        header = (Header *)ptr - 1;
+        assert(header->magic == MAGIC);
+        header->magic = 0;
+
+        __atomic_sub_fetch(&counter->n_outstanding, 1, __ATOMIC_RELAXED);
+        free(header);
+}
+
+static void *test_realloc(void *ptr, size_t size, void *userdata) {
+        void *p;
+
+        p = test_malloc(size, userdata);
+        if (!p)
+                return NULL;
+
+        if (ptr) {
+                Header *header = (Header *)ptr - 1;
+
+                assert(header->magic == MAGIC);
+                memcpy(p, ptr, MIN(header->size, size));
+                test_free(ptr, userdata);
+        }
+
+        return p;
+}
+
+static long reply_callback(VarlinkConnection *UNUSED(connection),
+                           const char *error,
+                           VarlinkObject *UNUSED(parameters),
+                           uint64_t UNUSED(flags),
+                           void *userdata) {
+        bool *done = userdata;
+
+        assert(error == NULL);
+        *done = true;
+
+        return 0;
+}
+
+static long org_example_alloc_Echo(VarlinkService *UNUSED(service),
+                                   VarlinkCall *call,
+                                   VarlinkObject *parameters,
+                                   uint64_t UNUSED(flags),
+                                   void *UNUSED(userdata)) {
+        return varlink_call_reply(call, parameters, 0);
+}
+
+static void run_until_done(VarlinkService *service, VarlinkConnection *connection, bool *done) {
+        int epoll_fd;
+
+        epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+        assert(epoll_fd >= 0);
+        assert(epoll_add(epoll_fd, varlink_service_get_fd(service), EPOLLIN, service) == 0);
+        assert(epoll_add(epoll_fd, varlink_connection_get_fd(connection),
+                         varlink_connection_get_events(connection), connection) == 0);
+
+        for (long i = 0; !*done && i < 10; i += 1) {
+                struct epoll_event events[2];
+                long n;
+
+                assert(epoll_mod(epoll_fd, varlink_connection_get_fd(connection),
+                                 varlink_connection_get_events(connection), connection) == 0);
+
+                n = epoll_wait(epoll_fd, events, ARRAY_SIZE(events), 1000);
+                assert(n > 0);
+
+                for (long k = 0; k < n; k += 1) {
+                        if (events[k].data.ptr == service)
+                                assert(varlink_service_process_events(service) == 0);
+                        else
+                                assert(varlink_connection_process_events(connection, events[k].events) == 0);
+                }
+        }
+
+        close(epoll_fd);
+        assert(*done);
+}
+
+/* Replies of offloaded handlers are serialized on the worker and released by the event loop. */
+static void test_offload(void) {
+        Counter counter = {};
+        VarlinkAllocator allocator = {
+                .malloc = test_malloc,
+                .calloc = test_calloc,
+                .realloc = test_realloc,
+                .free = test_free,
+                .userdata = &counter
+        };
+        VarlinkService *service;
+        VarlinkConnection *connection;
+        VarlinkObject *parameters;
+        bool done = false;
+
+        assert(varlink_set_allocator(&allocator) == 0);
+
+        assert(varlink_service_new(&service, "Varlink", "Test", "1", "http://example.com",
+                                   "unix:@test-alloc-offload.socket", -1) == 0);
+        assert(varlink_service_add_interface(service,
+                                             "interface org.example.alloc\n"
+                                             "method Echo(s: string) -> (s: string)\n",
+                                             "Echo", org_example_alloc_Echo, NULL,
+                                             NULL) == 0);
+        assert(varlink_service_offload_method(service, "org.example.alloc.Echo", true) == 0);
+        assert(varlink_connection_new(&connection, "unix:@test-alloc-offload.socket") == 0);
+
+        assert(varlink_object_new_from_json(&parameters, "{\"s\":\"offloaded\"}") == 0);
+        assert(varlink_connection_call(connection, "org.example.alloc.Echo", parameters, 0,
+                                       reply_callback, &done) == 0);
+        varlink_object_unref(parameters);
+
+        run_until_done(service, connection, &done);
+
+        assert(varlink_connection_free(connection) == NULL);
+        assert(varlink_service_free(service) == NULL);
+        assert(counter.n_allocations > 0);
+        assert(counter.n_outstanding == 0);
+
+        assert(varlink_set_allocator(NULL) == 0);
+}
+
+/* Objects and arrays keep the allocator of the thread they were created with. */
+static void test_thread_allocator(void) {
+        Counter counter = {};
+        VarlinkAllocator allocator = {
+                .malloc = test_malloc,
+                .calloc = test_calloc,
+                .realloc = test_realloc,
+                .free = test_free,
+                .userdata = &counter
+        };
+        VarlinkAllocator incomplete = {
+                .malloc = test_malloc
+        };
+        const VarlinkAllocator *previous = &allocator;
+        VarlinkObject *parsed, *built, *heap;
+        VarlinkArray *array;
+        unsigned long n;
+        const char *s;
+
+        assert(varlink_set_thread_allocator(&incomplete, NULL) == -VARLINK_ERROR_PANIC);
+        assert(varlink_set_thread_allocator(&allocator, &previous) == 0);
+        assert(previous == NULL);
+
+        assert(varlink_object_new_from_json(&parsed, "{\"a\":[\"x\",\"y\"],\"o\":{\"s\":\"nested\"}}") == 0);
+        assert(varlink_object_new(&built) == 0);
+        assert(varlink_array_new(&array) == 0);
+        assert(varlink_array_append_string(array, "element") == 0);
+        assert(varlink_object_set_array(built, "array", array) == 0);
+        assert(varlink_object_set_string(built, "s", "string") == 0);
+        varlink_array_unref(array);
+
+        n = counter.n_allocations;
+        assert(n > 0);
+
+        assert(varlink_set_thread_allocator(NULL, &previous) == 0);
+        assert(previous == &allocator);
+
+        /* Later changes still use the allocator of the object. */
+        assert(varlink_object_set_string(built, "s", "replaced") == 0);
+        assert(counter.n_allocations > n);
+
+        assert(varlink_object_new(&heap) == 0);
+        assert(varlink_object_set_object(heap, "parsed", parsed) == 0);
+        varlink_object_unref(parsed);
+        assert(varlink_object_get_object(heap, "parsed", &parsed) == 0);
+        assert(varlink_object_get_object(parsed, "o", &parsed) == 0);
+        assert(varlink_object_get_string(parsed, "s", &s) == 0);
+        assert(strcmp(s, "nested") == 0);
+
+        varlink_object_unref(heap);
+        varlink_object_unref(built);
+        assert(counter.n_outstanding == 0);
+}
+
+int main(void) {
+        Counter counter = {};
+        VarlinkAllocator allocator = {
+                .malloc = test_malloc,
+                .calloc = test_calloc,
+                .realloc = test_realloc,
+                .free = test_free,
+                .userdata = &counter
+        };
+        VarlinkAllocator incomplete = {
+                .malloc = test_malloc
+        };
+        VarlinkAllocationStats stats;
+        VarlinkService *service;
+        VarlinkConnection *connection;
+        VarlinkObject *object;
+        char *json;
+        bool done = false;
+
+        assert(varlink_set_allocator(&incomplete) == -VARLINK_ERROR_PANIC);
+        assert(varlink_set_allocator(&allocator) == 0);
+        varlink_set_allocation_counting(true);
+
+        assert(varlink_object_new_from_json(&object, "{\"a\":[1,2],\"o\":{\"b\":null},\"s\":\"\\u00e4\\\"\"}") == 0);
+        assert(varlink_object_to_json(object, &json) > 0);
+        assert(strcmp(json, "{\"a\":[1,2],\"o\":{},\"s\":\"ä\\\"\"}") == 0);
+        free(json);
+        assert(varlink_object_unref(object) == NULL);
+        assert(counter.n_allocations > 0);
+        assert(counter.n_outstanding == 0);
+
+        assert(varlink_service_new(&service, "Varlink", "Test", "1", "http://example.com",
+                                   "unix:@test-alloc.socket", -1) == 0);
+        assert(varlink_connection_new(&connection, "unix:@test-alloc.socket") == 0);
+
+        assert(varlink_connection_call(connection, "org.varlink.service.GetInfo", NULL, 0,
+                                       reply_callback, &done) == 0);
+
+        run_until_done(service, connection, &done);
+
+        assert(varlink_connection_free(connection) == NULL);
+        assert(varlink_service_free(service) == NULL);
+
+        assert(counter.n_outstanding == 0);
+
+        varlink_get_allocation_stats(&stats);
+        assert(stats.n_allocations > 0);
+        assert(stats.n_messages_parsed == 2);
+        assert(stats.n_parse_allocations > 0);
+        assert(stats.n_replies == 1);
+        assert(stats.n_reply_allocations > 0);
+
+        varlink_set_allocation_counting(false);
+        assert(varlink_set_allocator(NULL) == 0);
+
+        test_thread_allocator();
+        test_offload();
+
+        return EXIT_SUCCESS;
+}
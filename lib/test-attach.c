@@ -0,0 +1,117 @@
+// SPDX-License-Identifier: Apache-2.0
+
+#include "varlink.h"
+#include "util.h"
+
+#include <assert.h>
+#include <poll.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+typedef struct {
+        VarlinkConnection *backend;
+        unsigned long n_replies;
+        int64_t result;
+} Test;
+
+static long org_example_attach_Double(VarlinkService *UNUSED(service),
+                                      VarlinkCall *call,
+                                      VarlinkObject *parameters,
+                                      uint64_t UNUSED(flags),
+                                      void *UNUSED(userdata)) {
+        _cleanup_(varlink_object_unrefp) VarlinkObject *out = NULL;
+        int64_t n;
+
+        assert(varlink_object_get_int(parameters, "n", &n) == 0);
+        assert(varlink_object_new(&out) == 0);
+        assert(varlink_object_set_int(out, "n", n * 2) == 0);
+
+        return varlink_call_reply(call, out, 0);
+}
+
+/* Forwards to Double on the same service, through an attached connection. */
+static long org_example_attach_Forward(VarlinkService *UNUSED(service),
+                                       VarlinkCall *call,
+                                       VarlinkObject *parameters,
+                                       uint64_t UNUSED(flags),
+                                       void *userdata) {
+        _cleanup_(varlink_object_unrefp) VarlinkObject *out = NULL;
+        _cleanup_(freep) char *error = NULL;
+        Test *test = userdata;
+        long r;
+
+        r = varlink_connection_await(test->backend, "org.example.attach.Double", parameters, &error, &out);
+        if (r < 0)
+                return r;
+
+        return varlink_call_reply(call, out, 0);
+}
+
+static long reply_callback(VarlinkConnection *UNUSED(connection),
+                           const char *error,
+                           VarlinkObject *parameters,
+                           uint64_t UNUSED(flags),
+                           void *userdata) {
+        Test *test = userdata;
+
+        assert(error == NULL);
+        assert(varlink_object_get_int(parameters, "n", &test->result) == 0);
+        test->n_replies += 1;
+
+        return 0;
+}
+
+int main(void) {
+        _cleanup_(varlink_object_unrefp) VarlinkObject *parameters = NULL;
+        VarlinkService *service;
+        VarlinkConnection *client;
+        Test test = {};
+        struct pollfd pfd;
+
+        assert(varlink_service_new(&service, "Varlink", "Test", "1", "http://example.com",
+                                   "unix:@test-attach.socket", -1) == 0);
+        assert(varlink_service_add_interface(service,
+                                             "interface org.example.attach\n"
+                                             "method Double(n: int) -> (n: int)\n"
+                                             "method Forward(n: int) -> (n: int)\n",
+                                             "Double", org_example_attach_Double, &test,
+                                             "Forward", org_example_attach_Forward, &test,
+                                             NULL) == 0);
+        assert(varlink_service_coroutine_method(service, "org.example.attach.Forward", true) == 0);
+
+        assert(varlink_connection_new(&test.backend, "unix:@test-attach.socket") == 0);
+        assert(varlink_connection_new(&client, "unix:@test-attach.socket") == 0);
+        assert(varlink_service_attach_connection(service, test.backend) == 0);
+        assert(varlink_service_attach_connection(service, client) == 0);
+        assert(varlink_service_attach_connection(service, client) == 0);
+
+        assert(varlink_object_new(&parameters) == 0);
+        assert(varlink_object_set_int(parameters, "n", 21) == 0);
+        assert(varlink_connection_call(client, "org.example.attach.Forward", parameters, 0,
+                                       reply_callback, &test) == 0);
+
+        /* A single fd carries the service, its caller and the connection it calls. */
+        pfd.fd = varlink_service_get_fd(service);
+        pfd.events = POLLIN;
+        while (test.n_replies < 1) {
+                assert(poll(&pfd, 1, 2000) == 1);
+                assert(varlink_service_process_events(service) == 0);
+        }
+
+        assert(test.result == 42);
+
+        assert(varlink_service_detach_connection(service, client) == 0);
+        assert(varlink_service_detach_connection(service, client) == -VARLINK_ERROR_INVALID_CALL);
+        assert(varlink_connection_free(client) == NULL);
+
+        /* Closing detaches it. */
+        assert(varlink_connection_close(test.backend) == 0);
+        assert(varlink_service_detach_connection(service, test.backend) == -VARLINK_ERROR_INVALID_CALL);
+        assert(varlink_connection_free(test.backend) == NULL);
+
+        assert(varlink_service_free(service) == NULL);
+
+        return EXIT_SUCCESS;
+}
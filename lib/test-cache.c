@@ -0,0 +1,212 @@
+// SPDX-License-Identifier: Apache-2.0
+
+#include "varlink.h"
+#include "util.h"
+
+#include <assert.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <unistd.h>
+
+typedef struct {
+        VarlinkService *service;
+        VarlinkConnection *connection;
+        int epoll_fd;
+        unsigned long n_handled;
+
+        /* A client which caches replies for as long as the service says. */
+        VarlinkConnection *client;
+        uint64_t ttl_usec;
+} Test;
+
+typedef struct {
+        bool done;
+        int64_t value;
+} Reply;
+
+static long org_example_cache_Get(VarlinkService *UNUSED(service),
+                                  VarlinkCall *call,
+                                  VarlinkObject *parameters,
+                                  uint64_t UNUSED(flags),
+                                  void *userdata) {
+        _cleanup_(varlink_object_unrefp) VarlinkObject *out = NULL;
+        Test *test = userdata;
+        const char *key;
+
+        assert(varlink_object_get_string(parameters, "key", &key) == 0);
+
+        test->n_handled += 1;
+
+        if (test->ttl_usec > 0)
+                assert(varlink_call_set_cache_ttl(call, test->ttl_usec) == 0);
+
+        assert(varlink_object_new(&out) == 0);
+        assert(varlink_object_set_int(out, "value", (int64_t)test->n_handled * 100 + key[0]) == 0);
+
+        return varlink_call_reply(call, out, 0);
+}
+
+static long reply_callback(VarlinkConnection *UNUSED(connection),
+                           const char *error,
+                           VarlinkObject *parameters,
+                           uint64_t UNUSED(flags),
+                           void *userdata) {
+        Reply *reply = userdata;
+
+        assert(error == NULL);
+        assert(varlink_object_get_int(parameters, "value", &reply->value) == 0);
+        reply->done = true;
+
+        return 0;
+}
+
+static int64_t get(Test *test, VarlinkConnection *connection, const char *key) {
+        _cleanup_(varlink_object_unrefp) VarlinkObject *parameters = NULL;
+        Reply reply = {};
+
+        assert(varlink_object_new(&parameters) == 0);
+        assert(varlink_object_set_string(parameters, "key", key) == 0);
+        assert(varlink_connection_call(connection, "org.example.cache.Get", parameters, 0,
+                                       reply_callback, &reply) == 0);
+
+        for (long i = 0; !reply.done && i < 20; i += 1) {
+                struct epoll_event events[3];
+                long n;
+
+                assert(epoll_mod(test->epoll_fd, varlink_connection_get_fd(test->connection),
+                                 varlink_connection_get_events(test->connection), test->connection) == 0);
+                assert(epoll_mod(test->epoll_fd, varlink_connection_get_fd(test->client),
+                                 varlink_connection_get_events(test->client), test->client) == 0);
+
+                n = epoll_wait(test->epoll_fd, events, ARRAY_SIZE(events), 1000);
+                assert(n > 0);
+
+                for (long k = 0; k < n; k += 1) {
+                        if (events[k].data.ptr == test->service)
+                                assert(varlink_service_process_events(test->service) == 0);
+                        else
+                                assert(varlink_connection_process_events(events[k].data.ptr, events[k].events) == 0);
+                }
+        }
+
+        assert(reply.done);
+
+        return reply.value;
+}
+
+int main(void) {
+        _cleanup_(varlink_object_unrefp) VarlinkObject *parameters = NULL;
+        Test test = {};
+        int64_t a, b;
+
+        assert(varlink_service_new(&test.service, "Varlink", "Test", "1", "http://example.com",
+                                   "unix:@test-cache.socket", -1) == 0);
+        assert(varlink_service_add_interface(test.service,
+                                             "interface org.example.cache\n"
+                                             "method Get(key: string) -> (value: int)\n",
+                                             "Get", org_example_cache_Get, &test,
+                                             NULL) == 0);
+
+        assert(varlink_service_cache_method(test.service, "org.example.cache.Get", 3600ULL * 1000000) ==
+               -VARLINK_ERROR_INVALID_CALL);
+        assert(varlink_service_enable_cache(test.service, 0) == 0);
+        assert(varlink_service_cache_method(test.service, "org.example.cache.Unknown", 1) ==
+               -VARLINK_ERROR_METHOD_NOT_FOUND);
+        assert(varlink_service_cache_method(test.service, "org.example.unknown.Get", 1) ==
+               -VARLINK_ERROR_INTERFACE_NOT_FOUND);
+        assert(varlink_service_cache_method(test.service, "org.example.cache.Get", 3600ULL * 1000000) == 0);
+
+        assert(varlink_connection_new(&test.connection, "unix:@test-cache.socket") == 0);
+        assert(varlink_connection_new(&test.client, "unix:@test-cache.socket") == 0);
+
+        test.epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+        assert(test.epoll_fd >= 0);
+        assert(epoll_add(test.epoll_fd, varlink_service_get_fd(test.service), EPOLLIN, test.service) == 0);
+        assert(epoll_add(test.epoll_fd, varlink_connection_get_fd(test.connection),
+                         varlink_connection_get_events(test.connection), test.connection) == 0);
+        assert(epoll_add(test.epoll_fd, varlink_connection_get_fd(test.client),
+                         varlink_connection_get_events(test.client), test.client) == 0);
+
+        /* The second call is answered from the cache. */
+        a = get(&test, test.connection, "a");
+        assert(get(&test, test.connection, "a") == a);
+        assert(test.n_handled == 1);
+
+        b = get(&test, test.connection, "b");
+        assert(b != a);
+        assert(test.n_handled == 2);
+
+        /* Only the entry for these parameters is dropped. */
+        assert(varlink_object_new(&parameters) == 0);
+        assert(varlink_object_set_string(parameters, "key", "a") == 0);
+        assert(varlink_service_invalidate_cache(test.service, "org.example.cache.Get", parameters) == 0);
+
+        assert(get(&test, test.connection, "a") != a);
+        assert(get(&test, test.connection, "b") == b);
+        assert(test.n_handled == 3);
+
+        assert(varlink_service_invalidate_cache(test.service, "org.example.cache.Get", NULL) == 0);
+        assert(get(&test, test.connection, "b") != b);
+        assert(test.n_handled == 4);
+
+        /* Too small for any reply, nothing is kept. */
+        assert(varlink_service_enable_cache(test.service, 16) == 0);
+        get(&test, test.connection, "c");
+        get(&test, test.connection, "c");
+        assert(test.n_handled == 6);
+
+        /* A ttl of 0 turns it off again. */
+        assert(varlink_service_enable_cache(test.service, 0) == 0);
+        assert(varlink_service_cache_method(test.service, "org.example.cache.Get", 0) == 0);
+        get(&test, test.connection, "d");
+        get(&test, test.connection, "d");
+        assert(test.n_handled == 8);
+
+        /* Replies without a ttl are not cached by the client. */
+        assert(varlink_connection_enable_cache(test.client, 0, 3600ULL * 1000000) == 0);
+        a = get(&test, test.client, "x");
+        assert(get(&test, test.client, "x") != a);
+        assert(test.n_handled == 10);
+
+        /* The second call is answered before varlink_connection_call() returns. */
+        test.ttl_usec = 3600ULL * 1000000;
+        a = get(&test, test.client, "y");
+        assert(test.n_handled == 11);
+        assert(get(&test, test.client, "y") == a);
+        assert(test.n_handled == 11);
+
+        assert(varlink_connection_invalidate_cache(test.client, "org.example.cache.Get") == 0);
+        assert(get(&test, test.client, "y") != a);
+        assert(test.n_handled == 12);
+
+        /* An expired reply is still used, while it is refreshed once in the background. */
+        test.ttl_usec = 1;
+        a = get(&test, test.client, "z");
+        assert(test.n_handled == 13);
+        assert(get(&test, test.client, "z") == a);
+        assert(get(&test, test.client, "z") == a);
+        get(&test, test.connection, "flush");
+        assert(test.n_handled == 15);
+
+        /* A hit of the service's cache lets the client keep it only for what is left of its lifetime. */
+        test.ttl_usec = 3600ULL * 1000000;
+        assert(varlink_service_cache_method(test.service, "org.example.cache.Get", 100 * 1000) == 0);
+        a = get(&test, test.connection, "w");
+        assert(get(&test, test.client, "w") == a);
+        assert(test.n_handled == 16);
+
+        usleep(150 * 1000);
+        assert(get(&test, test.client, "w") == a);
+        get(&test, test.connection, "flush");
+        assert(test.n_handled == 18);
+
+        assert(varlink_connection_free(test.client) == NULL);
+        assert(varlink_connection_free(test.connection) == NULL);
+        assert(varlink_service_free(test.service) == NULL);
+        close(test.epoll_fd);
+
+        return EXIT_SUCCESS;
+}
@@ -0,0 +1,173 @@
+// SPDX-License-Identifier: Apache-2.0
+
+#include "varlink.h"
+#include "util.h"
+
+#include <assert.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+
+#define N_CLIENTS 4
+
+typedef struct {
+        VarlinkService *service;
+        int epoll_fd;
+
+        VarlinkConnection *clients[N_CLIENTS];
+        int64_t values[N_CLIENTS];
+        unsigned long n_replies;
+
+        /* Calls whose handler ran, answered later from the main loop. */
+        VarlinkCall *calls[N_CLIENTS];
+        unsigned long n_calls;
+} Test;
+
+static long org_example_coalesce_Get(VarlinkService *UNUSED(service),
+                                     VarlinkCall *call,
+                                     VarlinkObject *UNUSED(parameters),
+                                     uint64_t UNUSED(flags),
+                                     void *userdata) {
+        Test *test = userdata;
+
+        assert(test->n_calls < N_CLIENTS);
+        test->calls[test->n_calls++] = varlink_call_ref(call);
+
+        return 0;
+}
+
+static long reply_callback(VarlinkConnection *connection,
+                           const char *error,
+                           VarlinkObject *parameters,
+                           uint64_t UNUSED(flags),
+                           void *userdata) {
+        Test *test = userdata;
+
+        assert(error == NULL);
+
+        for (long i = 0; i < N_CLIENTS; i += 1) {
+                if (test->clients[i] == connection)
+                        assert(varlink_object_get_int(parameters, "value", &test->values[i]) == 0);
+        }
+
+        test->n_replies += 1;
+
+        return 0;
+}
+
+static void call(Test *test, long i, const char *key) {
+        _cleanup_(varlink_object_unrefp) VarlinkObject *parameters = NULL;
+
+        assert(varlink_object_new(&parameters) == 0);
+        assert(varlink_object_set_string(parameters, "key", key) == 0);
+        assert(varlink_connection_call(test->clients[i], "org.example.coalesce.Get", parameters, 0,
+                                       reply_callback, test) == 0);
+}
+
+static void reply(Test *test, long i, int64_t value) {
+        _cleanup_(varlink_object_unrefp) VarlinkObject *out = NULL;
+
+        assert(varlink_object_new(&out) == 0);
+        assert(varlink_object_set_int(out, "value", value) == 0);
+        assert(varlink_call_reply(test->calls[i], out, 0) == 0);
+        test->calls[i] = varlink_call_unref(test->calls[i]);
+}
+
+/* Run the loop until nothing happens for a while. */
+static void dispatch(Test *test) {
+        for (;;) {
+                struct epoll_event events[N_CLIENTS + 1];
+                long n;
+
+                for (long i = 0; i < N_CLIENTS; i += 1) {
+                        if (!test->clients[i])
+                                continue;
+
+                        assert(epoll_mod(test->epoll_fd, varlink_connection_get_fd(test->clients[i]),
+                                         varlink_connection_get_events(test->clients[i]), test->clients[i]) == 0);
+                }
+
+                n = epoll_wait(test->epoll_fd, events, ARRAY_SIZE(events), 100);
+                assert(n >= 0);
+                if (n == 0)
+                        break;
+
+                for (long k = 0; k < n; k += 1) {
+                        if (events[k].data.ptr == test->service)
+                                assert(varlink_service_process_events(test->service) == 0);
+                        else
+                                assert(varlink_connection_process_events(events[k].data.ptr, events[k].events) == 0);
+                }
+        }
+}
+
+int main(void) {
+        Test test = {};
+
+        assert(varlink_service_new(&test.service, "Varlink", "Test", "1", "http://example.com",
+                                   "unix:@test-coalesce.socket", -1) == 0);
+        assert(varlink_service_add_interface(test.service,
+                                             "interface org.example.coalesce\n"
+                                             "method Get(key: string) -> (value: int)\n",
+                                             "Get", org_example_coalesce_Get, &test,
+                                             NULL) == 0);
+        assert(varlink_service_coalesce_method(test.service, "org.example.coalesce.Unknown", true) ==
+               -VARLINK_ERROR_METHOD_NOT_FOUND);
+        assert(varlink_service_coalesce_method(test.service, "org.example.coalesce.Get", true) == 0);
+
+        test.epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+        assert(test.epoll_fd >= 0);
+        assert(epoll_add(test.epoll_fd, varlink_service_get_fd(test.service), EPOLLIN, test.service) == 0);
+
+        for (long i = 0; i < N_CLIENTS; i += 1) {
+                assert(varlink_connection_new(&test.clients[i], "unix:@test-coalesce.socket") == 0);
+                assert(epoll_add(test.epoll_fd, varlink_connection_get_fd(test.clients[i]),
+                                 varlink_connection_get_events(test.clients[i]), test.clients[i]) == 0);
+        }
+
+        /* Three identical calls and a different one run the handler twice. */
+        call(&test, 0, "a");
+        call(&test, 1, "a");
+        call(&test, 2, "b");
+        call(&test, 3, "a");
+        dispatch(&test);
+        assert(test.n_calls == 2);
+        assert(test.n_replies == 0);
+
+        reply(&test, 0, 42);
+        reply(&test, 1, 7);
+        dispatch(&test);
+        assert(test.n_replies == 4);
+        assert(test.values[0] == 42 && test.values[1] == 42 && test.values[3] == 42);
+        assert(test.values[2] == 7);
+
+        /* The connections take new calls after an asynchronous reply. */
+        test.n_calls = 0;
+        test.n_replies = 0;
+        call(&test, 0, "c");
+        call(&test, 1, "c");
+        dispatch(&test);
+        assert(test.n_calls == 1);
+
+        /* The first caller goes away, the waiting one runs the handler again. */
+        epoll_ctl(test.epoll_fd, EPOLL_CTL_DEL, varlink_connection_get_fd(test.clients[0]), NULL);
+        test.clients[0] = varlink_connection_free(test.clients[0]);
+        dispatch(&test);
+        assert(test.n_calls == 2);
+
+        reply(&test, 1, 9);
+        test.calls[0] = varlink_call_unref(test.calls[0]);
+        dispatch(&test);
+        assert(test.n_replies == 1);
+        assert(test.values[1] == 9);
+
+        for (long i = 1; i < N_CLIENTS; i += 1)
+                assert(varlink_connection_free(test.clients[i]) == NULL);
+
+        assert(varlink_service_free(test.service) == NULL);
+        close(test.epoll_fd);
+
+        return EXIT_SUCCESS;
+}
@@ -0,0 +1,212 @@
+// SPDX-License-Identifier: Apache-2.0
+
+#include "varlink.h"
+#include "util.h"
+
+#include <assert.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <unistd.h>
+
+typedef struct {
+        VarlinkConnection *backends[2];
+
+        /* Order in which the replies arrived. */
+        char replies[4];
+        unsigned long n_replies;
+        int64_t sum;
+} Test;
+
+static long org_example_backend_Double(VarlinkService *UNUSED(service),
+                                       VarlinkCall *call,
+                                       VarlinkObject *parameters,
+                                       uint64_t UNUSED(flags),
+                                       void *UNUSED(userdata)) {
+        _cleanup_(varlink_object_unrefp) VarlinkObject *out = NULL;
+        int64_t n;
+
+        assert(varlink_object_get_int(parameters, "n", &n) == 0);
+        assert(varlink_object_new(&out) == 0);
+        assert(varlink_object_set_int(out, "n", n * 2) == 0);
+
+        return varlink_call_reply(call, out, 0);
+}
+
+static long await_double(VarlinkConnection *backend, int64_t n, int64_t *resultp) {
+        _cleanup_(varlink_object_unrefp) VarlinkObject *in = NULL;
+        _cleanup_(varlink_object_unrefp) VarlinkObject *out = NULL;
+        _cleanup_(freep) char *error = NULL;
+        long r;
+
+        assert(varlink_object_new(&in) == 0);
+        assert(varlink_object_set_int(in, "n", n) == 0);
+
+        r = varlink_connection_await(backend, "org.example.backend.Double", in, &error, &out);
+        if (r < 0)
+                return r;
+
+        assert(error == NULL);
+
+        return varlink_object_get_int(out, "n", resultp);
+}
+
+static long org_example_front_Sum(VarlinkService *UNUSED(service),
+                                  VarlinkCall *call,
+                                  VarlinkObject *parameters,
+                                  uint64_t UNUSED(flags),
+                                  void *userdata) {
+        _cleanup_(varlink_object_unrefp) VarlinkObject *out = NULL;
+        Test *test = userdata;
+        int64_t a, b;
+        long r;
+
+        assert(varlink_object_get_int(parameters, "a", &a) == 0);
+        assert(varlink_object_get_int(parameters, "b", &b) == 0);
+
+        r = await_double(test->backends[0], a, &a);
+        if (r < 0)
+                return r;
+
+        r = await_double(test->backends[1], b, &b);
+        if (r < 0)
+                return r;
+
+        assert(varlink_object_new(&out) == 0);
+        assert(varlink_object_set_int(out, "sum", a + b) == 0);
+
+        return varlink_call_reply(call, out, 0);
+}
+
+static long org_example_front_Ping(VarlinkService *UNUSED(service),
+                                   VarlinkCall *call,
+                                   VarlinkObject *UNUSED(parameters),
+                                   uint64_t UNUSED(flags),
+                                   void *userdata) {
+        Test *test = userdata;
+        char *error;
+        VarlinkObject *out;
+
+        /* Only coroutines can wait. */
+        assert(varlink_connection_await(test->backends[0], "org.example.backend.Double", NULL, &error, &out) ==
+               -VARLINK_ERROR_INVALID_CALL);
+
+        return varlink_call_reply(call, NULL, 0);
+}
+
+static long sum_callback(VarlinkConnection *UNUSED(connection),
+                         const char *error,
+                         VarlinkObject *parameters,
+                         uint64_t UNUSED(flags),
+                         void *userdata) {
+        Test *test = userdata;
+
+        assert(error == NULL);
+        assert(varlink_object_get_int(parameters, "sum", &test->sum) == 0);
+        test->replies[test->n_replies++] = 's';
+
+        return 0;
+}
+
+static long ping_callback(VarlinkConnection *UNUSED(connection),
+                          const char *error,
+                          VarlinkObject *UNUSED(parameters),
+                          uint64_t UNUSED(flags),
+                          void *userdata) {
+        Test *test = userdata;
+
+        assert(error == NULL);
+        test->replies[test->n_replies++] = 'p';
+
+        return 0;
+}
+
+int main(void) {
+        VarlinkService *front;
+        VarlinkService *backend;
+        VarlinkConnection *connections[4];
+        Test test = {};
+        int epoll_fd;
+
+        assert(varlink_service_new(&backend, "Varlink", "Test", "1", "http://example.com",
+                                   "unix:@test-coroutine-backend.socket", -1) == 0);
+        assert(varlink_service_add_interface(backend,
+                                             "interface org.example.backend\n"
+                                             "method Double(n: int) -> (n: int)\n",
+                                             "Double", org_example_backend_Double, NULL,
+                                             NULL) == 0);
+
+        assert(varlink_service_new(&front, "Varlink", "Test", "1", "http://example.com",
+                                   "unix:@test-coroutine.socket", -1) == 0);
+        assert(varlink_service_add_interface(front,
+                                             "interface org.example.front\n"
+                                             "method Sum(a: int, b: int) -> (sum: int)\n"
+                                             "method Ping() -> ()\n",
+                                             "Sum", org_example_front_Sum, &test,
+                                             "Ping", org_example_front_Ping, &test,
+                                             NULL) == 0);
+        assert(varlink_service_coroutine_method(front, "org.example.front.Sum", true) == 0);
+
+        assert(varlink_connection_new(&test.backends[0], "unix:@test-coroutine-backend.socket") == 0);
+        assert(varlink_connection_new(&test.backends[1], "unix:@test-coroutine-backend.socket") == 0);
+        assert(varlink_connection_new(&connections[2], "unix:@test-coroutine.socket") == 0);
+        assert(varlink_connection_new(&connections[3], "unix:@test-coroutine.socket") == 0);
+        connections[0] = test.backends[0];
+        connections[1] = test.backends[1];
+
+        epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+        assert(epoll_fd >= 0);
+        assert(epoll_add(epoll_fd, varlink_service_get_fd(front), EPOLLIN, front) == 0);
+        assert(epoll_add(epoll_fd, varlink_service_get_fd(backend), EPOLLIN, backend) == 0);
+        for (unsigned long i = 0; i < ARRAY_SIZE(connections); i += 1)
+                assert(epoll_add(epoll_fd, varlink_connection_get_fd(connections[i]),
+                                 varlink_connection_get_events(connections[i]), connections[i]) == 0);
+
+        {
+                _cleanup_(varlink_object_unrefp) VarlinkObject *parameters = NULL;
+
+                assert(varlink_object_new(&parameters) == 0);
+                assert(varlink_object_set_int(parameters, "a", 3) == 0);
+                assert(varlink_object_set_int(parameters, "b", 4) == 0);
+                assert(varlink_connection_call(connections[2], "org.example.front.Sum", parameters, 0,
+                                               sum_callback, &test) == 0);
+        }
+
+        /* Answered while the first call waits for the backend. */
+        assert(varlink_connection_call(connections[3], "org.example.front.Ping", NULL, 0,
+                                       ping_callback, &test) == 0);
+
+        while (test.n_replies < 2) {
+                struct epoll_event events[6];
+                int n;
+
+                for (unsigned long i = 0; i < ARRAY_SIZE(connections); i += 1)
+                        assert(epoll_mod(epoll_fd, varlink_connection_get_fd(connections[i]),
+                                         varlink_connection_get_events(connections[i]), connections[i]) == 0);
+
+                n = epoll_wait(epoll_fd, events, ARRAY_SIZE(events), 2000);
+                assert(n > 0);
+
+                for (int k = 0; k < n; k += 1) {
+                        if (events[k].data.ptr == front)
+                                assert(varlink_service_process_events(front) == 0);
+                        else if (events[k].data.ptr == backend)
+                                assert(varlink_service_process_events(backend) == 0);
+                        else
+                                assert(varlink_connection_process_events(events[k].data.ptr, events[k].events) == 0);
+                }
+        }
+
+        assert(memcmp(test.replies, "ps", 2) == 0);
+        assert(test.sum == 14);
+
+        close(epoll_fd);
+        for (unsigned long i = 0; i < ARRAY_SIZE(connections); i += 1)
+                assert(varlink_connection_free(connections[i]) == NULL);
+        assert(varlink_service_free(front) == NULL);
+        assert(varlink_service_free(backend) == NULL);
+
+        return EXIT_SUCCESS;
+}
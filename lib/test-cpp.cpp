@@ -0,0 +1,210 @@
+// SPDX-License-Identifier: Apache-2.0
+
+#include "varlink.hpp"
+
+#include <cassert>
+#include <cstring>
+#include <poll.h>
+
+/* The handles are the C pointers, nothing else. */
+static_assert(sizeof(varlink::Object) == sizeof(VarlinkObject *));
+static_assert(sizeof(varlink::Connection) == sizeof(VarlinkConnection *));
+static_assert(!std::is_copy_constructible_v<varlink::Object>);
+static_assert(std::is_nothrow_move_constructible_v<varlink::Service>);
+
+struct Test {
+        unsigned long n_replies = 0;
+        int64_t sum = 0;
+        std::string error;
+};
+
+static void org_example_cpp_Sum(varlink::Call call, varlink::ObjectView parameters, uint64_t, void *) {
+        varlink::ArrayView numbers = parameters.get<varlink::ArrayView>("numbers");
+        varlink::Object out;
+        int64_t sum = 0;
+
+        for (unsigned long i = 0; i < numbers.size(); i += 1)
+                sum += numbers.get<int64_t>(i);
+
+        out.set("sum", sum);
+        call.reply(out);
+}
+
+static long org_example_cpp_Fail(varlink::Call call, varlink::ObjectView parameters, uint64_t, void *) {
+        if (!parameters.find<std::string_view>("missing"))
+                call.reply_invalid_parameter("missing");
+
+        return 0;
+}
+
+static void test_object() {
+        varlink::Object object("{\"name\":\"varlink\",\"nested\":{\"n\":7},\"list\":[1,2]}");
+        varlink::Object other;
+
+        assert(object.get<std::string_view>("name") == "varlink");
+        assert(object.get<varlink::ObjectView>("nested").get<int64_t>("n") == 7);
+        assert(object.get<varlink::ArrayView>("list").size() == 2);
+        assert(!object.find<bool>("flag"));
+
+        try {
+                object.get<int64_t>("name");
+                assert(false);
+        } catch (const varlink::Error &e) {
+                assert(e.code() == VARLINK_ERROR_INVALID_TYPE);
+                assert(strcmp(e.what(), "InvalidType") == 0);
+        }
+
+        other.set("b", true);
+        other.set("i", 42);
+        other.set("f", 0.5);
+        other.set("s", std::string_view("view", 2));
+        other.set("c", "literal");
+        other.set("o", object);
+        {
+                varlink::Array array;
+
+                array.append(std::string("one"));
+                array.append(nullptr);
+                other.set("a", array);
+        }
+        other.set("c", nullptr);
+
+        assert(other.get<bool>("b"));
+        assert(other.get<int64_t>("i") == 42);
+        assert(other.get<double>("f") == 0.5);
+        assert(other.get<std::string_view>("s") == "vi");
+        assert(other.get<varlink::ArrayView>("a").get<std::string_view>(0) == "one");
+        assert(other.field_names().size() == 6);
+        assert(varlink::Object(other.to_json()).get<varlink::ObjectView>("o").get<std::string_view>("name") ==
+               "varlink");
+
+        object.freeze(VARLINK_FREEZE_CACHE_JSON);
+        try {
+                object.set("name", "changed");
+                assert(false);
+        } catch (const varlink::Error &e) {
+                assert(e.code() == VARLINK_ERROR_READ_ONLY);
+        }
+        assert(varlink::Object(object.to_json()).get<std::string_view>("name") == "varlink");
+
+        /* Moving hands over the reference. */
+        varlink::Object moved = std::move(other);
+        assert(!other);
+        assert(moved.get<int64_t>("i") == 42);
+}
+
+/* Checks that every block is returned, with the size it was allocated with. */
+class CountingResource : public std::pmr::memory_resource {
+public:
+        size_t n_outstanding = 0;
+        size_t n_bytes = 0;
+        size_t n_allocations = 0;
+
+private:
+        void *do_allocate(size_t bytes, size_t alignment) override {
+                n_outstanding += 1;
+                n_bytes += bytes;
+                n_allocations += 1;
+                return std::pmr::new_delete_resource()->allocate(bytes, alignment);
+        }
+
+        void do_deallocate(void *p, size_t bytes, size_t alignment) override {
+                assert(n_outstanding > 0 && n_bytes >= bytes);
+                n_outstanding -= 1;
+                n_bytes -= bytes;
+                std::pmr::new_delete_resource()->deallocate(p, bytes, alignment);
+        }
+
+        bool do_is_equal(const std::pmr::memory_resource &other) const noexcept override { return this == &other; }
+};
+
+static void test_memory_resource() {
+        CountingResource counting;
+        varlink::MemoryResource resource(&counting);
+        std::optional<varlink::Object> parsed, built;
+
+        {
+                varlink::AllocatorScope scope(resource);
+                varlink::Array list;
+
+                parsed.emplace("{\"name\":\"varlink\",\"list\":[\"a\",\"b\"],\"nested\":{\"n\":7}}");
+                built.emplace();
+                list.append(std::string_view("grown by realloc"));
+                for (int i = 0; i < 20; i += 1)
+                        list.append(std::string_view("element"));
+                built->set("list", list);
+        }
+
+        assert(counting.n_allocations > 0);
+
+        /* Outside of the scope, the objects still use the resource. */
+        built->set("name", "replaced");
+        assert(built->get<varlink::ArrayView>("list").get<std::string_view>(0) == "grown by realloc");
+        assert(parsed->get<varlink::ObjectView>("nested").get<int64_t>("n") == 7);
+
+        parsed.reset();
+        built.reset();
+        assert(counting.n_outstanding == 0 && counting.n_bytes == 0);
+}
+
+int main() {
+        varlink::Service service("Varlink", "Test", "1", "http://example.com", "unix:@test-cpp.socket");
+        varlink::Connection connection("unix:@test-cpp.socket");
+        varlink::Object parameters;
+        varlink::Array numbers;
+        Test test;
+        struct pollfd pfds[2];
+        std::pmr::monotonic_buffer_resource arena;
+        varlink::MemoryResource resource(&arena);
+
+        test_object();
+        test_memory_resource();
+
+        service.add_interface("interface org.example.cpp\n"
+                              "method Sum(numbers: []int) -> (sum: int)\n"
+                              "method Fail() -> ()\n",
+                              "Sum", varlink::method<org_example_cpp_Sum>, nullptr,
+                              "Fail", varlink::method<org_example_cpp_Fail>, nullptr);
+
+        for (int64_t i = 1; i <= 4; i += 1)
+                numbers.append(i);
+        parameters.set("numbers", numbers);
+
+        auto on_sum = [&test](const char *error, varlink::ObjectView out, uint64_t) {
+                assert(!error);
+                test.sum = out.get<int64_t>("sum");
+                test.n_replies += 1;
+        };
+        auto on_fail = [&test](const char *error, varlink::ObjectView, uint64_t) {
+                test.error = error;
+                test.n_replies += 1;
+        };
+
+        connection.call("org.example.cpp.Sum", parameters, 0, on_sum);
+        connection.call("org.example.cpp.Fail", varlink::Object(), 0, on_fail);
+
+        pfds[0].fd = service.fd();
+        pfds[0].events = POLLIN;
+        pfds[1].fd = connection.fd();
+
+        while (test.n_replies < 2) {
+                pfds[1].events = connection.events();
+                assert(poll(pfds, 2, 2000) > 0);
+
+                /* The handlers reply right away, each round of the service is one arena. */
+                if (pfds[0].revents) {
+                        {
+                                varlink::AllocatorScope scope(resource);
+                                service.process_events();
+                        }
+                        arena.release();
+                }
+                if (pfds[1].revents)
+                        connection.process_events(pfds[1].revents);
+        }
+
+        assert(test.sum == 10);
+        assert(test.error == "org.varlink.service.InvalidParameter");
+
+        return EXIT_SUCCESS;
+}
@@ -0,0 +1,116 @@
+// SPDX-License-Identifier: Apache-2.0
+
+#include "varlink.hpp"
+
+#include <cassert>
+#include <poll.h>
+
+struct Test {
+        varlink::Connection *backend;
+
+        int64_t sum = 0;
+        std::vector<int64_t> counted;
+        std::string error;
+        bool done = false;
+};
+
+static void org_example_cpp_Double(varlink::Call call, varlink::ObjectView parameters, uint64_t, void *) {
+        varlink::Object out;
+
+        out.set("n", parameters.get<int64_t>("n") * 2);
+        call.reply(out);
+}
+
+static void org_example_cpp_Count(varlink::Call call, varlink::ObjectView parameters, uint64_t flags, void *) {
+        int64_t n = parameters.get<int64_t>("n");
+
+        assert(flags & VARLINK_CALL_MORE);
+
+        for (int64_t i = 0; i < n; i += 1) {
+                varlink::Object out;
+
+                out.set("i", i);
+                call.reply(out, i + 1 < n ? VARLINK_REPLY_CONTINUES : 0);
+        }
+}
+
+static varlink::Task org_example_cpp_Sum(varlink::CallRef call, varlink::Object parameters, uint64_t, void *userdata) {
+        Test *test = static_cast<Test *>(userdata);
+        varlink::Object a, b, out;
+
+        a.set("n", parameters.get<int64_t>("a"));
+        b.set("n", parameters.get<int64_t>("b"));
+
+        /* Other calls are dispatched while the handler waits. */
+        varlink::Object da = co_await test->backend->call("org.example.cpp.Double", a);
+        varlink::Object db = co_await test->backend->call("org.example.cpp.Double", b);
+
+        out.set("sum", da.get<int64_t>("n") + db.get<int64_t>("n"));
+        call.reply(out);
+}
+
+static varlink::Task run(Test &test, const varlink::Connection &client) {
+        varlink::Object parameters;
+
+        parameters.set("a", 3);
+        parameters.set("b", 4);
+        test.sum = (co_await client.call("org.example.cpp.Sum", parameters)).get<int64_t>("sum");
+
+        {
+                varlink::Object count;
+
+                count.set("n", 3);
+
+                varlink::ReplyStream stream = client.stream("org.example.cpp.Count", count);
+                while (std::optional<varlink::Object> reply = co_await stream.next())
+                        test.counted.push_back(reply->get<int64_t>("i"));
+        }
+
+        try {
+                co_await client.call("org.example.cpp.Missing");
+        } catch (const varlink::ReplyError &e) {
+                test.error = e.what();
+        }
+
+        test.done = true;
+}
+
+int main() {
+        varlink::Service service("Varlink", "Test", "1", "http://example.com", "unix:@test-cpp20.socket");
+        varlink::Connection backend("unix:@test-cpp20.socket");
+        varlink::Connection client("unix:@test-cpp20.socket");
+        Test test;
+        struct pollfd pfd;
+
+        test.backend = &backend;
+
+        service.add_interface("interface org.example.cpp\n"
+                              "method Double(n: int) -> (n: int)\n"
+                              "method Count(n: int) -> (i: int)\n"
+                              "method Sum(a: int, b: int) -> (sum: int)\n",
+                              "Double", varlink::method<org_example_cpp_Double>, nullptr,
+                              "Count", varlink::method<org_example_cpp_Count>, nullptr,
+                              "Sum", varlink::task_method<org_example_cpp_Sum>, &test);
+
+        /* The service's loop runs the handlers, and the calls of both connections. */
+        service.attach(backend);
+        service.attach(client);
+
+        run(test, client);
+
+        pfd.fd = service.fd();
+        pfd.events = POLLIN;
+        while (!test.done) {
+                assert(poll(&pfd, 1, 2000) == 1);
+                service.process_events();
+        }
+
+        assert(test.sum == 14);
+        assert((test.counted == std::vector<int64_t>{ 0, 1, 2 }));
+        assert(test.error == "org.varlink.service.MethodNotFound");
+
+        service.detach(client);
+        service.detach(backend);
+
+        return EXIT_SUCCESS;
+}
@@ -0,0 +1,64 @@
+// SPDX-License-Identifier: Apache-2.0
+
+#include "test-edge.h"
+#include "varlink.h"
+#include "util.h"
+
+#include <assert.h>
+#include <poll.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+int main(void) {
+        VarlinkService *service;
+        VarlinkConnection *busy;
+        VarlinkConnection *other;
+        Test test = {};
+        struct pollfd pfd;
+
+        assert(varlink_service_new(&service, "Varlink", "Test", "1", "http://example.com",
+                                   "unix:@test-edge.socket", -1) == 0);
+        assert(test_edge_add_interface(service, &test) == 0);
+        assert(varlink_service_set_edge_triggered(service, true) == 0);
+
+        /* Every message takes its own turn, with more of them left to read. */
+        assert(varlink_service_set_dispatch_budget(service, 1) == 0);
+
+        assert(varlink_connection_new(&busy, "unix:@test-edge.socket") == 0);
+        assert(varlink_connection_new(&other, "unix:@test-edge.socket") == 0);
+        assert(varlink_service_attach_connection(service, busy) == 0);
+        assert(varlink_service_attach_connection(service, other) == 0);
+
+        /* The calls behind the first one arrive while the connection is busy. */
+        call(busy, "org.example.edge.Later", "l", &test);
+        call(busy, "org.example.edge.Echo", "1", &test);
+        call(busy, "org.example.edge.Echo", "2", &test);
+        call(busy, "org.example.edge.Echo", "3", &test);
+        call(other, "org.example.edge.Echo", "o", &test);
+
+        pfd.fd = varlink_service_get_fd(service);
+        pfd.events = POLLIN;
+        while (test.n_replies < 5) {
+                /* No new data arrives for the buffered calls, the reply wakes up the loop. */
+                if (test.later && test.n_replies == 1) {
+                        _cleanup_(varlink_object_unrefp) VarlinkObject *out = NULL;
+
+                        assert(varlink_object_new(&out) == 0);
+                        assert(varlink_object_set_string(out, "tag", "l") == 0);
+                        assert(varlink_call_reply(test.later, out, 0) == 0);
+                        test.later = varlink_call_unref(test.later);
+                }
+
+                assert(poll(&pfd, 1, 2000) == 1);
+                assert(varlink_service_process_events(service) == 0);
+        }
+
+        assert(memcmp(test.replies, "ol123", 5) == 0);
+
+        assert(varlink_connection_free(busy) == NULL);
+        assert(varlink_connection_free(other) == NULL);
+        assert(varlink_service_free(service) == NULL);
+
+        return EXIT_SUCCESS;
+}
@@ -0,0 +1,83 @@
+// SPDX-License-Identifier: Apache-2.0
+
+#pragma once
+
+#include "varlink.h"
+#include "util.h"
+
+#include <assert.h>
+#include <stdint.h>
+#include <string.h>
+
+/*
+ * Methods and replies shared by the tests of the connection backends:
+ * Echo answers right away, the test answers Later itself, outside of the
+ * event loop.
+ */
+#define TEST_EDGE_INTERFACE                                     \
+        "interface org.example.edge\n"                          \
+        "method Echo(tag: string) -> (tag: string)\n"           \
+        "method Later(tag: string) -> (tag: string)\n"
+
+typedef struct {
+        VarlinkCall *later;
+
+        /* Order in which the replies arrived. */
+        char replies[8];
+        unsigned long n_replies;
+
+        /* Length of the last tag longer than one character. */
+        unsigned long long_size;
+} Test;
+
+static long org_example_edge_Echo(VarlinkService *UNUSED(service),
+                                  VarlinkCall *call,
+                                  VarlinkObject *parameters,
+                                  uint64_t UNUSED(flags),
+                                  void *UNUSED(userdata)) {
+        return varlink_call_reply(call, parameters, 0);
+}
+
+static long org_example_edge_Later(VarlinkService *UNUSED(service),
+                                   VarlinkCall *call,
+                                   VarlinkObject *UNUSED(parameters),
+                                   uint64_t UNUSED(flags),
+                                   void *userdata) {
+        Test *test = userdata;
+
+        test->later = varlink_call_ref(call);
+
+        return 0;
+}
+
+static long reply_callback(VarlinkConnection *UNUSED(connection),
+                           const char *error,
+                           VarlinkObject *parameters,
+                           uint64_t UNUSED(flags),
+                           void *userdata) {
+        Test *test = userdata;
+        const char *tag;
+
+        assert(error == NULL);
+        assert(varlink_object_get_string(parameters, "tag", &tag) == 0);
+        test->replies[test->n_replies++] = tag[0];
+        if (strlen(tag) > 1)
+                test->long_size = strlen(tag);
+
+        return 0;
+}
+
+static long test_edge_add_interface(VarlinkService *service, Test *test) {
+        return varlink_service_add_interface(service, TEST_EDGE_INTERFACE,
+                                             "Echo", org_example_edge_Echo, test,
+                                             "Later", org_example_edge_Later, test,
+                                             NULL);
+}
+
+static void call(VarlinkConnection *connection, const char *method, const char *tag, Test *test) {
+        _cleanup_(varlink_object_unrefp) VarlinkObject *parameters = NULL;
+
+        assert(varlink_object_new(&parameters) == 0);
+        assert(varlink_object_set_string(parameters, "tag", tag) == 0);
+        assert(varlink_connection_call(connection, method, parameters, 0, reply_callback, test) == 0);
+}
@@ -0,0 +1,95 @@
+// SPDX-License-Identifier: Apache-2.0
+
+#include "varlink.h"
+#include "util.h"
+
+#include <assert.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define N_THREADS 4
+#define N_ITERATIONS 100000
+
+static const char config_json[] = "{\"list\":[1,2,3],\"name\":\"config\",\"nested\":{\"s\":\"value\"},"
+                                  "\"servers\":[{\"port\":80},{\"port\":443}]}";
+
+/* Every thread replies with the shared object, as many connections would. */
+static void *worker(void *userdata) {
+        VarlinkObject *config = userdata;
+
+        for (unsigned long i = 0; i < N_ITERATIONS; i += 1) {
+                _cleanup_(varlink_object_unrefp) VarlinkObject *reply = NULL;
+                VarlinkObject *nested;
+                VarlinkArray *servers;
+                const char *s;
+
+                assert(varlink_object_new(&reply) == 0);
+                assert(varlink_object_set_object(reply, "parameters", config) == 0);
+
+                assert(varlink_object_get_object(config, "nested", &nested) == 0);
+                assert(varlink_object_get_string(nested, "s", &s) == 0);
+                assert(strcmp(s, "value") == 0);
+
+                assert(varlink_object_get_array(config, "servers", &servers) == 0);
+                varlink_array_unref(varlink_array_ref(servers));
+
+                if (i % 1000 == 0) {
+                        _cleanup_(freep) char *json = NULL;
+
+                        assert(varlink_object_to_json(reply, &json) > 0);
+                        assert(strncmp(json, "{\"parameters\":", 14) == 0);
+                        assert(strncmp(json + 14, config_json, sizeof(config_json) - 1) == 0);
+                }
+        }
+
+        return NULL;
+}
+
+int main(void) {
+        _cleanup_(varlink_object_unrefp) VarlinkObject *config = NULL;
+        _cleanup_(varlink_object_unrefp) VarlinkObject *uncached = NULL;
+        _cleanup_(varlink_object_unrefp) VarlinkObject *message = NULL;
+        _cleanup_(freep) char *json = NULL;
+        VarlinkObject *nested;
+        VarlinkArray *list;
+        pthread_t threads[N_THREADS];
+
+        assert(varlink_object_new_from_json(&config, config_json) == 0);
+        assert(varlink_object_freeze(config, VARLINK_FREEZE_CACHE_JSON) == 0);
+        assert(varlink_object_freeze(config, VARLINK_FREEZE_CACHE_JSON) == 0);
+        assert(varlink_object_freeze(config, 0) == 0);
+
+        /* Nested objects and arrays are frozen too. */
+        assert(varlink_object_set_int(config, "n", 1) == -VARLINK_ERROR_READ_ONLY);
+        assert(varlink_object_get_object(config, "nested", &nested) == 0);
+        assert(varlink_object_set_string(nested, "s", "changed") == -VARLINK_ERROR_READ_ONLY);
+        assert(varlink_object_get_array(config, "list", &list) == 0);
+        assert(varlink_array_append_int(list, 4) == -VARLINK_ERROR_READ_ONLY);
+
+        /* The cache is only created by the first freeze, the object might be shared after it. */
+        assert(varlink_object_new_from_json(&uncached, config_json) == 0);
+        assert(varlink_object_freeze(uncached, 0) == 0);
+        assert(varlink_object_freeze(uncached, VARLINK_FREEZE_CACHE_JSON) == -VARLINK_ERROR_READ_ONLY);
+
+        /* Objects which contain the cached one copy its JSON. */
+        assert(varlink_object_to_json(config, &json) == sizeof(config_json) - 1);
+        assert(strcmp(json, config_json) == 0);
+        free(json);
+
+        assert(varlink_object_new(&message) == 0);
+        assert(varlink_object_set_object(message, "parameters", config) == 0);
+        assert(varlink_object_set_bool(message, "continues", true) == 0);
+        assert(varlink_object_to_json(message, &json) > 0);
+        assert(strcmp(json, "{\"continues\":true,\"parameters\":{\"list\":[1,2,3],\"name\":\"config\","
+                            "\"nested\":{\"s\":\"value\"},\"servers\":[{\"port\":80},{\"port\":443}]}}") == 0);
+
+        for (unsigned long i = 0; i < N_THREADS; i += 1)
+                assert(pthread_create(&threads[i], NULL, worker, config) == 0);
+
+        for (unsigned long i = 0; i < N_THREADS; i += 1)
+                assert(pthread_join(threads[i], NULL) == 0);
+
+        return EXIT_SUCCESS;
+}
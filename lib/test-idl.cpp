@@ -0,0 +1,154 @@
+// SPDX-License-Identifier: Apache-2.0
+
+#include "varlink-idl.hpp"
+
+#include <cassert>
+#include <poll.h>
+
+using Calc = varlink::idl::Interface<
+        "# Calculations\n"
+        "interface org.example.calc\n"
+        "\n"
+        "type Mode (exact, rounded)\n"
+        "type Options (mode: Mode, digits: ?int)\n"
+        "\n"
+        "method Sum(numbers: []int, options: ?Options) -> (sum: int, mode: Mode)\n"
+        "method Describe(names: [string]string, scale: float) -> (text: string, valid: bool)\n"
+        "method Unused() -> ()\n"
+        "\n"
+        "error Overflow (limit: int)\n">;
+
+static_assert(Calc::name == "org.example.calc");
+static_assert(Calc::n_members == 6);
+static_assert(Calc::tables.members[Calc::method("Sum")].kind == varlink::idl::MemberKind::Method);
+static_assert(Calc::find_method("Describe") == Calc::method("Describe"));
+static_assert(!Calc::find_method("Overflow") && !Calc::find_method("Missing"));
+
+static_assert(Calc::In<"Sum">::n_fields == 2 && Calc::Out<"Sum">::index("mode") == 1);
+static_assert(std::is_same_v<decltype(std::declval<Calc::In<"Sum">>().get<"numbers">()), varlink::ArrayView>);
+static_assert(std::is_same_v<decltype(std::declval<Calc::In<"Sum">>().get<"options">()),
+                             std::optional<varlink::ObjectView>>);
+static_assert(std::is_same_v<decltype(std::declval<Calc::Out<"Sum">>().get<"mode">()), std::string_view>);
+static_assert(std::is_same_v<decltype(std::declval<Calc::TypeRecord<"Options">>().get<"digits">()),
+                             std::optional<int64_t>>);
+static_assert(std::is_same_v<decltype(std::declval<Calc::In<"Describe">>().get<"scale">()), double>);
+
+/* The parser accepts what varlink_service_add_interface() accepts. */
+static void test_grammar() {
+        static const struct {
+                const char *description;
+                bool valid;
+        } tests[] = {
+                { "interface org.example.t1\nmethod A() -> ()\n", true },
+                { "interface org.example.t2\ntype T (a: ?[]?T, b: [string]object)\nmethod A(t: T) -> ()\n", true },
+                { "interface org.example.t11\nmethod A(t: ?org.example.b.T) -> ()\n", true },
+                { "interface org.example.t12\nmethod A(t: []Unknown) -> ()\n", false },
+                { "interface org.example.t3\ntype E (one, two)\nmethod A(e: E) -> (f: (x, y))\n", true },
+                { "interface org.example.t4\nmethod A(a: ??int) -> ()\n", false },
+                { "interface org.example.t5\nmethod A(a: int, a: int) -> ()\n", false },
+                { "interface org.example.t6\nmethod A() -> ()\nmethod A() -> ()\n", false },
+                { "interface org.example.t7\ntype T int\n", false },
+                { "interface org.example.t8\nmethod A(a_: int) -> ()\n", false },
+                { "interface org.example.t9\nmethod a() -> ()\n", false },
+                { "interface org.example.t10\nmethod A() -> []int\n", false },
+                { "interface org..example\nmethod A() -> ()\n", false },
+                { "interface org\nmethod A() -> ()\n", false },
+        };
+        varlink::Service service("Varlink", "Test", "1", "http://example.com", "unix:@test-idl-grammar.socket");
+
+        for (auto &test : tests) {
+                bool valid = true;
+
+                try {
+                        varlink::idl::detail::Parser<256, 2048, 2048>(test.description).parse();
+                } catch (const varlink::Error &e) {
+                        assert(e.code() == VARLINK_ERROR_INVALID_INTERFACE);
+                        valid = false;
+                }
+                assert(valid == test.valid);
+
+                try {
+                        service.add_interface(test.description);
+                        valid = true;
+                } catch (const varlink::Error &) {
+                        valid = false;
+                }
+                assert(valid == test.valid);
+        }
+}
+
+static long org_example_calc_Sum(varlink::Call call, varlink::ObjectView parameters, uint64_t, void *) {
+        Calc::In<"Sum"> in(parameters);
+        Calc::Out<"Sum"> out;
+        varlink::ArrayView numbers = in.get<"numbers">();
+        int64_t sum = 0;
+
+        for (unsigned long i = 0; i < numbers.size(); i += 1)
+                sum += numbers.get<int64_t>(i);
+
+        out.set<"sum">(sum);
+        out.set<"mode">("exact");
+        if (auto options = in.get<"options">()) {
+                Calc::TypeRecord<"Options"> o(*options);
+
+                assert(o.get<"mode">() == "rounded");
+                assert(!o.get<"digits">());
+                out.set<"mode">(o.get<"mode">());
+        }
+
+        call.reply(out.object());
+
+        return 0;
+}
+
+int main() {
+        varlink::Service service("Varlink", "Test", "1", "http://example.com", "unix:@test-idl.socket");
+        varlink::Connection connection("unix:@test-idl.socket");
+        Calc::Dispatcher dispatcher;
+        varlink::Object parameters("{\"numbers\":[1,2,3],\"options\":{\"mode\":\"rounded\",\"digits\":null}}");
+        int64_t sum = 0;
+        std::string mode, error;
+        unsigned long n_replies = 0;
+        struct pollfd pfds[2];
+
+        test_grammar();
+
+        dispatcher.on<"Sum">(org_example_calc_Sum);
+        dispatcher.add_to(service);
+
+        auto on_sum = [&](const char *e, varlink::ObjectView out, uint64_t) {
+                Calc::Out<"Sum"> reply(out);
+
+                assert(!e);
+                sum = reply.get<"sum">();
+                mode = reply.get<"mode">();
+                n_replies += 1;
+        };
+        auto on_unused = [&](const char *e, varlink::ObjectView, uint64_t) {
+                error = e;
+                n_replies += 1;
+        };
+
+        connection.call("org.example.calc.Sum", parameters, 0, on_sum);
+        connection.call("org.example.calc.Unused", varlink::Object(), 0, on_unused);
+
+        pfds[0].fd = service.fd();
+        pfds[0].events = POLLIN;
+        pfds[1].fd = connection.fd();
+
+        while (n_replies < 2) {
+                pfds[1].events = connection.events();
+                assert(poll(pfds, 2, 2000) > 0);
+
+                if (pfds[0].revents)
+                        service.process_events();
+                if (pfds[1].revents)
+                        connection.process_events(pfds[1].revents);
+        }
+
+        assert(sum == 6);
+        assert(mode == "rounded");
+        assert(error == "org.varlink.service.MethodNotImplemented");
+
+        return EXIT_SUCCESS;
+}
@@ -0,0 +1,275 @@
+// SPDX-License-Identifier: Apache-2.0
+
+#include "varlink.h"
+#include "util.h"
+
+#include <assert.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <unistd.h>
+
+typedef struct {
+        pthread_t loop_thread;
+
+        /* Order in which the replies arrived. */
+        char replies[8];
+        unsigned long n_replies;
+
+        /* Set by the handler of Hold on the worker, and when its client closed. */
+        bool holding;
+        bool held;
+        bool hold_closed;
+} Test;
+
+static void hold_closed(VarlinkCall *UNUSED(call), void *userdata) {
+        Test *test = userdata;
+
+        /* Not while the handler still uses the call. */
+        assert(pthread_equal(pthread_self(), test->loop_thread));
+        assert(__atomic_load_n(&test->held, __ATOMIC_ACQUIRE));
+        assert(!test->hold_closed);
+        test->hold_closed = true;
+}
+
+/* Keeps running on the worker after its client went away. */
+static long org_example_offload_Hold(VarlinkService *UNUSED(service),
+                                     VarlinkCall *call,
+                                     VarlinkObject *UNUSED(parameters),
+                                     uint64_t UNUSED(flags),
+                                     void *userdata) {
+        Test *test = userdata;
+        long r;
+
+        assert(varlink_call_set_connection_closed_callback(call, hold_closed, test) == 0);
+        __atomic_store_n(&test->holding, true, __ATOMIC_RELEASE);
+
+        for (long i = 0; i < 20; i += 1) {
+                varlink_call_unref(varlink_call_ref(call));
+                varlink_call_get_traceparent(call);
+                usleep(10 * 1000);
+        }
+
+        r = varlink_call_reply(call, NULL, 0);
+        __atomic_store_n(&test->held, true, __ATOMIC_RELEASE);
+
+        return r;
+}
+
+static long org_example_offload_Spin(VarlinkService *UNUSED(service),
+                                     VarlinkCall *call,
+                                     VarlinkObject *UNUSED(parameters),
+                                     uint64_t UNUSED(flags),
+                                     void *userdata) {
+        Test *test = userdata;
+
+        assert(!pthread_equal(pthread_self(), test->loop_thread));
+        usleep(200 * 1000);
+
+        return varlink_call_reply(call, NULL, 0);
+}
+
+static long org_example_offload_Count(VarlinkService *UNUSED(service),
+                                      VarlinkCall *call,
+                                      VarlinkObject *UNUSED(parameters),
+                                      uint64_t flags,
+                                      void *userdata) {
+        Test *test = userdata;
+
+        assert(!pthread_equal(pthread_self(), test->loop_thread));
+        assert(flags & VARLINK_CALL_MORE);
+
+        for (long i = 0; i < 3; i += 1) {
+                _cleanup_(varlink_object_unrefp) VarlinkObject *out = NULL;
+
+                assert(varlink_object_new(&out) == 0);
+                assert(varlink_object_set_int(out, "n", i) == 0);
+                assert(varlink_call_reply(call, out, i < 2 ? VARLINK_REPLY_CONTINUES : 0) == 0);
+        }
+
+        return 0;
+}
+
+static long org_example_offload_Fail(VarlinkService *UNUSED(service),
+                                     VarlinkCall *call,
+                                     VarlinkObject *UNUSED(parameters),
+                                     uint64_t UNUSED(flags),
+                                     void *UNUSED(userdata)) {
+        return varlink_call_reply_error(call, "org.example.offload.Failed", NULL);
+}
+
+static long org_example_offload_Ping(VarlinkService *UNUSED(service),
+                                     VarlinkCall *call,
+                                     VarlinkObject *UNUSED(parameters),
+                                     uint64_t UNUSED(flags),
+                                     void *userdata) {
+        Test *test = userdata;
+
+        assert(pthread_equal(pthread_self(), test->loop_thread));
+
+        return varlink_call_reply(call, NULL, 0);
+}
+
+/* Waits up to @timeout milliseconds for events and dispatches them. */
+static int dispatch(int epoll_fd, VarlinkService *service, int timeout) {
+        struct epoll_event events[3];
+        int n;
+
+        n = epoll_wait(epoll_fd, events, ARRAY_SIZE(events), timeout);
+        assert(n >= 0);
+
+        for (int k = 0; k < n; k += 1) {
+                if (events[k].data.ptr == service)
+                        assert(varlink_service_process_events(service) == 0);
+                else
+                        assert(varlink_connection_process_events(events[k].data.ptr, events[k].events) == 0);
+        }
+
+        return n;
+}
+
+static long spin_callback(VarlinkConnection *UNUSED(connection),
+                          const char *error,
+                          VarlinkObject *UNUSED(parameters),
+                          uint64_t UNUSED(flags),
+                          void *userdata) {
+        Test *test = userdata;
+
+        assert(error == NULL);
+        test->replies[test->n_replies++] = 's';
+
+        return 0;
+}
+
+static long ping_callback(VarlinkConnection *UNUSED(connection),
+                          const char *error,
+                          VarlinkObject *UNUSED(parameters),
+                          uint64_t UNUSED(flags),
+                          void *userdata) {
+        Test *test = userdata;
+
+        assert(error == NULL);
+        test->replies[test->n_replies++] = 'p';
+
+        return 0;
+}
+
+static long count_callback(VarlinkConnection *UNUSED(connection),
+                           const char *error,
+                           VarlinkObject *parameters,
+                           uint64_t flags,
+                           void *userdata) {
+        Test *test = userdata;
+        int64_t n;
+
+        assert(error == NULL);
+        assert(varlink_object_get_int(parameters, "n", &n) == 0);
+        assert(n == (int64_t)test->n_replies - 2);
+        assert(!(flags & VARLINK_REPLY_CONTINUES) == (n == 2));
+        test->replies[test->n_replies++] = 'c';
+
+        return 0;
+}
+
+static long fail_callback(VarlinkConnection *UNUSED(connection),
+                          const char *error,
+                          VarlinkObject *UNUSED(parameters),
+                          uint64_t UNUSED(flags),
+                          void *userdata) {
+        Test *test = userdata;
+
+        assert(strcmp(error, "org.example.offload.Failed") == 0);
+        test->replies[test->n_replies++] = 'f';
+
+        return 0;
+}
+
+int main(void) {
+        VarlinkService *service;
+        VarlinkConnection *spin;
+        VarlinkConnection *ping;
+        VarlinkConnection *hold;
+        VarlinkConnection *connections[2];
+        Test test = {};
+        int epoll_fd;
+
+        test.loop_thread = pthread_self();
+
+        assert(varlink_service_new(&service, "Varlink", "Test", "1", "http://example.com",
+                                   "unix:@test-offload.socket", -1) == 0);
+        assert(varlink_service_add_interface(service,
+                                             "interface org.example.offload\n"
+                                             "method Spin() -> ()\n"
+                                             "method Count() -> (n: int)\n"
+                                             "method Fail() -> ()\n"
+                                             "method Ping() -> ()\n"
+                                             "method Hold() -> ()\n"
+                                             "error Failed ()\n",
+                                             "Spin", org_example_offload_Spin, &test,
+                                             "Count", org_example_offload_Count, &test,
+                                             "Fail", org_example_offload_Fail, &test,
+                                             "Ping", org_example_offload_Ping, &test,
+                                             "Hold", org_example_offload_Hold, &test,
+                                             NULL) == 0);
+        assert(varlink_service_offload_method(service, "org.example.offload.Spin", true) == 0);
+        assert(varlink_service_offload_method(service, "org.example.offload.Count", true) == 0);
+        assert(varlink_service_offload_method(service, "org.example.offload.Fail", true) == 0);
+        assert(varlink_service_offload_method(service, "org.example.offload.Hold", true) == 0);
+        assert(varlink_service_offload_method(service, "org.example.offload.Missing", true) ==
+               -VARLINK_ERROR_METHOD_NOT_FOUND);
+
+        assert(varlink_connection_new(&spin, "unix:@test-offload.socket") == 0);
+        assert(varlink_connection_new(&ping, "unix:@test-offload.socket") == 0);
+        connections[0] = spin;
+        connections[1] = ping;
+
+        epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+        assert(epoll_fd >= 0);
+        assert(epoll_add(epoll_fd, varlink_service_get_fd(service), EPOLLIN, service) == 0);
+        for (unsigned long i = 0; i < ARRAY_SIZE(connections); i += 1)
+                assert(epoll_add(epoll_fd, varlink_connection_get_fd(connections[i]),
+                                 varlink_connection_get_events(connections[i]), connections[i]) == 0);
+
+        /* The slow call does not hold up the other connection. */
+        assert(varlink_connection_call(spin, "org.example.offload.Spin", NULL, 0, spin_callback, &test) == 0);
+        assert(varlink_connection_call(ping, "org.example.offload.Ping", NULL, 0, ping_callback, &test) == 0);
+
+        /* Queued replies keep their order, behind the slow call on the same connection. */
+        assert(varlink_connection_call(spin, "org.example.offload.Count", NULL, VARLINK_CALL_MORE,
+                                       count_callback, &test) == 0);
+        assert(varlink_connection_call(spin, "org.example.offload.Fail", NULL, 0, fail_callback, &test) == 0);
+
+        while (test.n_replies < 6) {
+                for (unsigned long i = 0; i < ARRAY_SIZE(connections); i += 1)
+                        assert(epoll_mod(epoll_fd, varlink_connection_get_fd(connections[i]),
+                                         varlink_connection_get_events(connections[i]), connections[i]) == 0);
+
+                assert(dispatch(epoll_fd, service, 2000) > 0);
+        }
+
+        assert(memcmp(test.replies, "pscccf", 6) == 0);
+
+        /* The client goes away while the handler runs, the loop finishes the call after it returned. */
+        assert(varlink_connection_new(&hold, "unix:@test-offload.socket") == 0);
+        assert(varlink_connection_call(hold, "org.example.offload.Hold", NULL, 0, spin_callback, &test) == 0);
+
+        while (!__atomic_load_n(&test.holding, __ATOMIC_ACQUIRE))
+                dispatch(epoll_fd, service, 10);
+
+        assert(varlink_connection_free(hold) == NULL);
+
+        while (!test.hold_closed)
+                assert(dispatch(epoll_fd, service, 2000) > 0);
+
+        assert(test.n_replies == 6);
+
+        close(epoll_fd);
+        assert(varlink_connection_free(ping) == NULL);
+        assert(varlink_connection_free(spin) == NULL);
+        assert(varlink_service_free(service) == NULL);
+
+        return EXIT_SUCCESS;
+}
@@ -0,0 +1,135 @@
+// SPDX-License-Identifier: Apache-2.0
+
+#include "varlink.h"
+#include "util.h"
+
+#include <assert.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <unistd.h>
+
+#define N_CALLS 5
+
+typedef struct {
+        unsigned long n_ok;
+        unsigned long n_exceeded;
+} Test;
+
+static long org_example_ratelimit_Ping(VarlinkService *UNUSED(service),
+                                       VarlinkCall *call,
+                                       VarlinkObject *UNUSED(parameters),
+                                       uint64_t UNUSED(flags),
+                                       void *UNUSED(userdata)) {
+        return varlink_call_reply(call, NULL, 0);
+}
+
+static long reply_callback(VarlinkConnection *UNUSED(connection),
+                           const char *error,
+                           VarlinkObject *UNUSED(parameters),
+                           uint64_t UNUSED(flags),
+                           void *userdata) {
+        Test *test = userdata;
+
+        if (!error)
+                test->n_ok += 1;
+        else if (strcmp(error, "org.varlink.ratelimit.LimitExceeded") == 0)
+                test->n_exceeded += 1;
+        else
+                assert(false);
+
+        return 0;
+}
+
+/*
+ * Sends a burst of calls with the given limit, with @n_oneway oneway
+ * calls before the last one, and returns the microseconds until all of
+ * them were answered.
+ */
+static uint64_t run(const VarlinkRateLimit *limit, unsigned long n_oneway, Test *test) {
+        VarlinkService *service;
+        VarlinkConnection *connection;
+        int epoll_fd;
+        uint64_t start;
+
+        assert(varlink_service_new(&service, "Varlink", "Test", "1", "http://example.com",
+                                   "unix:@test-ratelimit.socket", -1) == 0);
+        assert(varlink_service_add_interface(service,
+                                             "interface org.example.ratelimit\n"
+                                             "method Ping() -> ()\n",
+                                             "Ping", org_example_ratelimit_Ping, NULL,
+                                             NULL) == 0);
+        assert(varlink_service_set_rate_limit(service, limit) == 0);
+
+        assert(varlink_connection_new(&connection, "unix:@test-ratelimit.socket") == 0);
+
+        epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+        assert(epoll_fd >= 0);
+        assert(epoll_add(epoll_fd, varlink_service_get_fd(service), EPOLLIN, service) == 0);
+        assert(epoll_add(epoll_fd, varlink_connection_get_fd(connection),
+                         varlink_connection_get_events(connection), connection) == 0);
+
+        start = now_usec();
+
+        for (long i = 0; i < N_CALLS; i += 1) {
+                if (i == N_CALLS - 1)
+                        for (unsigned long k = 0; k < n_oneway; k += 1)
+                                assert(varlink_connection_call(connection, "org.example.ratelimit.Ping", NULL,
+                                                               VARLINK_CALL_ONEWAY, NULL, NULL) == 0);
+
+                assert(varlink_connection_call(connection, "org.example.ratelimit.Ping", NULL, 0,
+                                               reply_callback, test) == 0);
+        }
+
+        while (test->n_ok + test->n_exceeded < N_CALLS) {
+                struct epoll_event events[2];
+                int n;
+
+                assert(epoll_mod(epoll_fd, varlink_connection_get_fd(connection),
+                                 varlink_connection_get_events(connection), connection) == 0);
+
+                n = epoll_wait(epoll_fd, events, ARRAY_SIZE(events), 2000);
+                assert(n > 0);
+
+                for (int k = 0; k < n; k += 1) {
+                        if (events[k].data.ptr == service)
+                                assert(varlink_service_process_events(service) == 0);
+                        else
+                                assert(varlink_connection_process_events(connection, events[k].events) == 0);
+                }
+        }
+
+        close(epoll_fd);
+        assert(varlink_connection_free(connection) == NULL);
+        assert(varlink_service_free(service) == NULL);
+
+        return now_usec() - start;
+}
+
+int main(void) {
+        VarlinkRateLimit limit = {
+                .calls_per_sec = 10,
+                .calls_burst = 2,
+        };
+        Test test = {};
+
+        /* Calls beyond the burst wait for their token, 100ms each. */
+        assert(run(&limit, 0, &test) >= 250 * 1000);
+        assert(test.n_ok == N_CALLS);
+
+        limit.reject = true;
+        memset(&test, 0, sizeof(test));
+        assert(run(&limit, 0, &test) < 250 * 1000);
+        assert(test.n_ok == 2);
+        assert(test.n_exceeded == N_CALLS - 2);
+
+        /* Rejected oneway calls get no reply, it would not match any call. */
+        memset(&test, 0, sizeof(test));
+        assert(run(&limit, 3, &test) < 250 * 1000);
+        assert(test.n_ok == 2);
+        assert(test.n_exceeded == N_CALLS - 2);
+
+        return EXIT_SUCCESS;
+}
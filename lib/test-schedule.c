@@ -0,0 +1,110 @@
+// SPDX-License-Identifier: Apache-2.0
+
+#include "varlink.h"
+#include "util.h"
+
+#include <assert.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <unistd.h>
+
+#define N_FLOOD 200
+
+typedef struct {
+        unsigned long n_flood;
+        long ping_after;
+} Test;
+
+static long org_example_schedule_Flood(VarlinkService *UNUSED(service),
+                                       VarlinkCall *call,
+                                       VarlinkObject *UNUSED(parameters),
+                                       uint64_t UNUSED(flags),
+                                       void *userdata) {
+        Test *test = userdata;
+
+        test->n_flood += 1;
+
+        return varlink_call_reply(call, NULL, 0);
+}
+
+static long org_example_schedule_Ping(VarlinkService *UNUSED(service),
+                                      VarlinkCall *call,
+                                      VarlinkObject *UNUSED(parameters),
+                                      uint64_t UNUSED(flags),
+                                      void *userdata) {
+        Test *test = userdata;
+
+        test->ping_after = test->n_flood;
+
+        return varlink_call_reply(call, NULL, 0);
+}
+
+static long reply_callback(VarlinkConnection *UNUSED(connection),
+                           const char *error,
+                           VarlinkObject *UNUSED(parameters),
+                           uint64_t UNUSED(flags),
+                           void *UNUSED(userdata)) {
+        assert(error == NULL);
+
+        return 0;
+}
+
+/*
+ * Queues a flood of oneway calls before a single call from another
+ * client, and returns how many of the flood were handled before it.
+ */
+static long run(unsigned long budget) {
+        VarlinkService *service;
+        VarlinkConnection *flood;
+        VarlinkConnection *ping;
+        Test test = { .ping_after = -1 };
+
+        assert(varlink_service_new(&service, "Varlink", "Test", "1", "http://example.com",
+                                   "unix:@test-schedule.socket", -1) == 0);
+        assert(varlink_service_add_interface(service,
+                                             "interface org.example.schedule\n"
+                                             "method Flood() -> ()\n"
+                                             "method Ping() -> ()\n",
+                                             "Flood", org_example_schedule_Flood, &test,
+                                             "Ping", org_example_schedule_Ping, &test,
+                                             NULL) == 0);
+        assert(varlink_service_set_dispatch_budget(service, budget) == 0);
+        assert(varlink_service_set_peer_weight(service, getuid(), 0) == -VARLINK_ERROR_INVALID_CALL);
+
+        assert(varlink_connection_new(&flood, "unix:@test-schedule.socket") == 0);
+        assert(varlink_connection_new(&ping, "unix:@test-schedule.socket") == 0);
+
+        /* Accept both connections. */
+        assert(varlink_service_process_events(service) == 0);
+        assert(varlink_service_process_events(service) == 0);
+
+        for (long i = 0; i < N_FLOOD; i += 1)
+                assert(varlink_connection_call(flood, "org.example.schedule.Flood", NULL,
+                                               VARLINK_CALL_ONEWAY, NULL, NULL) == 0);
+
+        assert(varlink_connection_call(ping, "org.example.schedule.Ping", NULL, 0,
+                                       reply_callback, NULL) == 0);
+
+        /* Returns only when all buffered messages were dispatched. */
+        assert(varlink_service_process_events(service) == 0);
+        assert(test.n_flood == N_FLOOD);
+        assert(test.ping_after >= 0);
+
+        assert(varlink_connection_free(ping) == NULL);
+        assert(varlink_connection_free(flood) == NULL);
+        assert(varlink_service_free(service) == NULL);
+
+        return test.ping_after;
+}
+
+int main(void) {
+        /* Without a budget, the flood is dispatched in one go. */
+        assert(run(0) == N_FLOOD);
+
+        assert(run(4) < N_FLOOD / 2);
+
+        return EXIT_SUCCESS;
+}
@@ -49,6 +49,20 @@ static long org_varlink_example_Later(VarlinkService *UNUSED(service),
         return 0;
 }
 
+static void slow_call_callback(VarlinkService *UNUSED(service),
+                               const char *method,
+                               VarlinkObject *parameters,
+                               uint64_t UNUSED(usec),
+                               void *userdata) {
+        unsigned long *n_slow_calls = userdata;
+        const char *word;
+
+        if (strcmp(method, "org.varlink.example.Echo") == 0)
+                assert(varlink_object_get_string(parameters, "word", &word) == 0);
+
+        *n_slow_calls += 1;
+}
+
 static long test_process_events(Test *test) {
         struct epoll_event events[2];
         long n;
@@ -112,6 +126,7 @@ int main(void) {
 
         Test test = {};
         VarlinkCall *later_call = NULL;
+        unsigned long n_slow_calls = 0;
 
         assert(varlink_service_new(&test.service,
                                    "Varlink", "Test Service", "1", "http://example.com",
@@ -121,6 +136,8 @@ int main(void) {
                                              "Echo", org_varlink_example_Echo, NULL,
                                              "Later", org_varlink_example_Later, &later_call,
                                              NULL) == 0);
+        assert(varlink_service_enable_metrics(test.service) == 0);
+        assert(varlink_service_set_slow_call_callback(test.service, 0, slow_call_callback, &n_slow_calls) == 0);
 
         assert(varlink_connection_new(&test.connection, "unix:@test.socket") == 0);
 
@@ -178,6 +195,62 @@ int main(void) {
                 assert(call.n_received == 0);
         }
 
+        {
+                VarlinkObject *out = NULL;
+                VarlinkArray *methods;
+                int64_t n;
+                bool found = false;
+
+                assert(varlink_connection_call(test.connection, "org.varlink.metrics.GetMetrics", NULL, 0,
+                                               later_callback, &out) == 0);
+                for (long i = 0; out == NULL && i < 10; i += 1)
+                        assert(test_process_events(&test) == 0);
+
+                assert(out != NULL);
+                assert(varlink_object_get_int(out, "connections", &n) == 0 && n == 1);
+                assert(varlink_object_get_int(out, "calls_in_flight", &n) == 0 && n == 1);
+                assert(varlink_object_get_int(out, "bytes_in", &n) == 0 && n > 0);
+                assert(varlink_object_get_array(out, "methods", &methods) == 0);
+
+                for (unsigned long i = 0; i < varlink_array_get_n_elements(methods); i += 1) {
+                        VarlinkObject *method;
+                        const char *name;
+
+                        assert(varlink_array_get_object(methods, i, &method) == 0);
+                        assert(varlink_object_get_string(method, "method", &name) == 0);
+                        if (strcmp(name, "org.varlink.example.Echo") != 0)
+                                continue;
+
+                        assert(varlink_object_get_int(method, "calls", &n) == 0 && n >= 5);
+                        assert(varlink_object_get_int(method, "errors", &n) == 0 && n == 0);
+                        assert(varlink_object_get_int(method, "slow", &n) == 0 && n >= 5);
+                        found = true;
+                }
+
+                assert(found);
+                assert(n_slow_calls >= 5);
+                assert(varlink_object_unref(out) == NULL);
+        }
+
+        {
+                VarlinkConnectionStats stats;
+                _cleanup_(freep) int *fds = NULL;
+
+                assert(varlink_connection_get_stats(test.connection, &stats) == 0);
+                assert(stats.n_messages_out == 2 * ARRAY_SIZE(words) + 1);
+                assert(stats.n_messages_in == ARRAY_SIZE(words) + 1);
+                assert(stats.n_calls_in_flight == 0);
+                assert(stats.out_buffered == 0);
+                assert(stats.last_activity_usec >= stats.connect_usec);
+
+                assert(varlink_service_get_connections(test.service, &fds) == 1);
+                assert(varlink_service_get_connection_stats(test.service, fds[0], &stats) == 0);
+                assert(stats.n_messages_in == 2 * ARRAY_SIZE(words) + 1);
+                assert(stats.n_bytes_out > 0);
+                assert(stats.n_calls_in_flight == 0);
+                assert(varlink_service_get_connection_stats(test.service, -1, &stats) == -VARLINK_ERROR_CONNECTION_CLOSED);
+        }
+
         {
                 VarlinkObject *out = NULL;
 
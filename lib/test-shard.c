@@ -0,0 +1,157 @@
+// SPDX-License-Identifier: Apache-2.0
+
+#include "varlink.h"
+#include "util.h"
+
+#include <arpa/inet.h>
+#include <assert.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#define N_SHARDS 2
+#define N_CLIENTS 8
+
+typedef struct {
+        int stop_fd;
+        unsigned int port;
+        long result;
+
+        unsigned long n_replies;
+        unsigned long n_per_shard[N_SHARDS];
+} Test;
+
+static long org_example_shard_Get(VarlinkService *UNUSED(service),
+                                  VarlinkCall *call,
+                                  VarlinkObject *UNUSED(parameters),
+                                  uint64_t UNUSED(flags),
+                                  void *userdata) {
+        _cleanup_(varlink_object_unrefp) VarlinkObject *out = NULL;
+
+        assert(varlink_object_new(&out) == 0);
+        assert(varlink_object_set_int(out, "shard", (uintptr_t)userdata) == 0);
+
+        return varlink_call_reply(call, out, 0);
+}
+
+static long shard_run(unsigned long shard, int listen_fd, void *userdata) {
+        Test *test = userdata;
+        VarlinkService *service;
+        struct pollfd pfds[2];
+
+        if (shard == 0) {
+                struct sockaddr_in sa;
+                socklen_t sa_len = sizeof(sa);
+
+                assert(getsockname(listen_fd, (struct sockaddr *)&sa, &sa_len) == 0);
+                __atomic_store_n(&test->port, ntohs(sa.sin_port), __ATOMIC_RELEASE);
+        }
+
+        assert(varlink_service_new(&service, "Varlink", "Test", "1", "http://example.com",
+                                   "tcp:127.0.0.1:0", listen_fd) == 0);
+        assert(varlink_service_add_interface(service,
+                                             "interface org.example.shard\n"
+                                             "method Get() -> (shard: int)\n",
+                                             "Get", org_example_shard_Get, (void *)(uintptr_t)shard,
+                                             NULL) == 0);
+
+        pfds[0].fd = varlink_service_get_fd(service);
+        pfds[0].events = POLLIN;
+        pfds[1].fd = test->stop_fd;
+        pfds[1].events = POLLIN;
+
+        for (;;) {
+                assert(poll(pfds, ARRAY_SIZE(pfds), -1) > 0);
+                if (pfds[1].revents)
+                        break;
+
+                assert(varlink_service_process_events(service) == 0);
+        }
+
+        assert(varlink_service_free(service) == NULL);
+
+        return 0;
+}
+
+static void *run(void *userdata) {
+        Test *test = userdata;
+
+        test->result = varlink_run_shards("tcp:127.0.0.1:0", N_SHARDS, shard_run, test);
+
+        return NULL;
+}
+
+static long reply_callback(VarlinkConnection *UNUSED(connection),
+                           const char *error,
+                           VarlinkObject *parameters,
+                           uint64_t UNUSED(flags),
+                           void *userdata) {
+        Test *test = userdata;
+        int64_t shard;
+
+        assert(error == NULL);
+        assert(varlink_object_get_int(parameters, "shard", &shard) == 0);
+        assert(shard >= 0 && shard < N_SHARDS);
+        test->n_per_shard[shard] += 1;
+        test->n_replies += 1;
+
+        return 0;
+}
+
+int main(void) {
+        Test test = {};
+        pthread_t thread;
+        VarlinkConnection *clients[N_CLIENTS];
+        struct pollfd pfds[N_CLIENTS];
+        _cleanup_(freep) char *address = NULL;
+        int fds[N_SHARDS];
+
+        /* Only TCP addresses can be shared. */
+        assert(varlink_listen_shards("unix:@test-shard.socket", N_SHARDS, fds) == -VARLINK_ERROR_INVALID_ADDRESS);
+
+        test.stop_fd = eventfd(0, EFD_CLOEXEC);
+        assert(test.stop_fd >= 0);
+        assert(pthread_create(&thread, NULL, run, &test) == 0);
+
+        while (__atomic_load_n(&test.port, __ATOMIC_ACQUIRE) == 0)
+                usleep(1000);
+
+        assert(asprintf(&address, "tcp:127.0.0.1:%u", test.port) >= 0);
+        for (unsigned long i = 0; i < N_CLIENTS; i += 1) {
+                assert(varlink_connection_new(&clients[i], address) == 0);
+                assert(varlink_connection_call(clients[i], "org.example.shard.Get", NULL, 0,
+                                               reply_callback, &test) == 0);
+        }
+
+        while (test.n_replies < N_CLIENTS) {
+                for (unsigned long i = 0; i < N_CLIENTS; i += 1) {
+                        pfds[i].fd = varlink_connection_get_fd(clients[i]);
+                        pfds[i].events = varlink_connection_get_events(clients[i]);
+                }
+
+                assert(poll(pfds, N_CLIENTS, 2000) > 0);
+
+                for (unsigned long i = 0; i < N_CLIENTS; i += 1)
+                        if (pfds[i].revents)
+                                assert(varlink_connection_process_events(clients[i], pfds[i].revents) == 0);
+        }
+
+        assert(test.n_per_shard[0] + test.n_per_shard[1] == N_CLIENTS);
+
+        for (unsigned long i = 0; i < N_CLIENTS; i += 1)
+                assert(varlink_connection_free(clients[i]) == NULL);
+
+        assert(eventfd_write(test.stop_fd, 1) == 0);
+        assert(pthread_join(thread, NULL) == 0);
+        assert(test.result == 0);
+        close(test.stop_fd);
+
+        return EXIT_SUCCESS;
+}
@@ -0,0 +1,172 @@
+// SPDX-License-Identifier: Apache-2.0
+
+#include "varlink.h"
+#include "util.h"
+
+#include <assert.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+
+#define TRACE_ID "0af7651916cd43dd8448eb211c80319c"
+
+typedef struct {
+        VarlinkConnection *forward;
+        char first[56];
+        char second[56];
+        unsigned long n_started;
+        unsigned long n_ended;
+        unsigned long n_errors;
+} Test;
+
+static void span_start(const VarlinkSpan *span, const char *method, void *userdata) {
+        Test *test = userdata;
+
+        assert(strcmp(span->trace_id, TRACE_ID) == 0);
+        assert(strlen(span->span_id) == 16);
+        assert(strlen(span->parent_id) == 16);
+        assert(strcmp(span->span_id, span->parent_id) != 0);
+        assert(method);
+
+        test->n_started += 1;
+}
+
+static void span_end(const VarlinkSpan *span, bool error, void *userdata) {
+        Test *test = userdata;
+
+        assert(strcmp(span->trace_id, TRACE_ID) == 0);
+
+        test->n_ended += 1;
+        if (error)
+                test->n_errors += 1;
+}
+
+static long org_example_trace_First(VarlinkService *UNUSED(service),
+                                    VarlinkCall *call,
+                                    VarlinkObject *UNUSED(parameters),
+                                    uint64_t UNUSED(flags),
+                                    void *userdata) {
+        Test *test = userdata;
+        const char *traceparent;
+
+        traceparent = varlink_call_get_traceparent(call);
+        assert(traceparent);
+        assert(strncmp(traceparent, "00-" TRACE_ID "-", 36) == 0);
+        strcpy(test->first, traceparent);
+
+        /* Outside of a handler, the root context of the thread would be used. */
+        assert(varlink_connection_call(test->forward, "org.example.trace.Second", NULL,
+                                       VARLINK_CALL_ONEWAY, NULL, NULL) == 0);
+
+        return varlink_call_reply(call, NULL, 0);
+}
+
+static long org_example_trace_Second(VarlinkService *UNUSED(service),
+                                     VarlinkCall *call,
+                                     VarlinkObject *UNUSED(parameters),
+                                     uint64_t UNUSED(flags),
+                                     void *userdata) {
+        Test *test = userdata;
+        const char *traceparent;
+
+        traceparent = varlink_call_get_traceparent(call);
+        assert(traceparent);
+        strcpy(test->second, traceparent);
+
+        return varlink_call_reply(call, NULL, 0);
+}
+
+static long reply_callback(VarlinkConnection *UNUSED(connection),
+                           const char *error,
+                           VarlinkObject *UNUSED(parameters),
+                           uint64_t UNUSED(flags),
+                           void *userdata) {
+        bool *done = userdata;
+
+        assert(error == NULL);
+        *done = true;
+
+        return 0;
+}
+
+int main(void) {
+        VarlinkTraceHooks hooks = {
+                .span_start = span_start,
+                .span_end = span_end
+        };
+        Test test = {};
+        VarlinkService *service;
+        VarlinkConnection *connection;
+        bool done = false;
+        int epoll_fd;
+
+        hooks.userdata = &test;
+        varlink_set_trace_hooks(&hooks);
+
+        assert(varlink_set_traceparent("00-" TRACE_ID "-b7ad6b716920333-01") < 0);
+        assert(varlink_set_traceparent("00-00000000000000000000000000000000-b7ad6b7169203331-01") < 0);
+        assert(varlink_set_traceparent("00-" TRACE_ID "-b7ad6b7169203331-01") == 0);
+
+        assert(varlink_service_new(&service, "Varlink", "Test", "1", "http://example.com",
+                                   "unix:@test-trace.socket", -1) == 0);
+        assert(varlink_service_add_interface(service,
+                                             "interface org.example.trace\n"
+                                             "method First() -> ()\n"
+                                             "method Second() -> ()\n",
+                                             "First", org_example_trace_First, &test,
+                                             "Second", org_example_trace_Second, &test,
+                                             NULL) == 0);
+
+        assert(varlink_connection_new(&connection, "unix:@test-trace.socket") == 0);
+        assert(varlink_connection_new(&test.forward, "unix:@test-trace.socket") == 0);
+
+        epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+        assert(epoll_fd >= 0);
+        assert(epoll_add(epoll_fd, varlink_service_get_fd(service), EPOLLIN, service) == 0);
+        assert(epoll_add(epoll_fd, varlink_connection_get_fd(connection),
+                         varlink_connection_get_events(connection), connection) == 0);
+
+        assert(varlink_connection_call(connection, "org.example.trace.First", NULL, 0,
+                                       reply_callback, &done) == 0);
+
+        for (long i = 0; !(done && test.second[0]) && i < 20; i += 1) {
+                struct epoll_event events[2];
+                long n;
+
+                assert(epoll_mod(epoll_fd, varlink_connection_get_fd(connection),
+                                 varlink_connection_get_events(connection), connection) == 0);
+
+                n = epoll_wait(epoll_fd, events, ARRAY_SIZE(events), 1000);
+                assert(n > 0);
+
+                for (long k = 0; k < n; k += 1) {
+                        if (events[k].data.ptr == service)
+                                assert(varlink_service_process_events(service) == 0);
+                        else
+                                assert(varlink_connection_process_events(connection, events[k].events) == 0);
+                }
+        }
+
+        assert(done);
+
+        /* Same trace, but the second call is a descendant of the first span. */
+        assert(strncmp(test.second, "00-" TRACE_ID "-", 36) == 0);
+        assert(strcmp(test.first, test.second) != 0);
+
+        /* Client and service span of both calls. */
+        assert(test.n_started == 4);
+        assert(test.n_ended == 4);
+        assert(test.n_errors == 0);
+
+        assert(varlink_connection_free(test.forward) == NULL);
+        assert(varlink_connection_free(connection) == NULL);
+        assert(varlink_service_free(service) == NULL);
+        close(epoll_fd);
+
+        assert(varlink_set_traceparent(NULL) == 0);
+        varlink_set_trace_hooks(NULL);
+
+        return EXIT_SUCCESS;
+}
@@ -0,0 +1,103 @@
+// SPDX-License-Identifier: Apache-2.0
+
+#include "service.h"
+#include "test-edge.h"
+#include "varlink.h"
+#include "util.h"
+
+#include <assert.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <unistd.h>
+
+int main(void) {
+        VarlinkService *service;
+        VarlinkConnection *connections[2];
+        Test test = {};
+        _cleanup_(freep) char *tag = NULL;
+        int epoll_fd;
+
+        assert(varlink_service_new(&service, "Varlink", "Test", "1", "http://example.com",
+                                   "unix:@test-uring.socket", -1) == 0);
+        assert(test_edge_add_interface(service, &test) == 0);
+
+        /* Without io_uring in the kernel, the service stays with epoll; there is nothing to test then. */
+        assert(varlink_service_set_io_uring(service, true) == 0);
+        if (!varlink_service_get_io_uring(service)) {
+                fprintf(stderr, "io_uring is not available, skipping\n");
+                assert(varlink_service_free(service) == NULL);
+                return 77;
+        }
+        fprintf(stderr, "Accepting and dispatching through io_uring\n");
+
+        assert(varlink_connection_new(&connections[0], "unix:@test-uring.socket") == 0);
+        assert(varlink_connection_new(&connections[1], "unix:@test-uring.socket") == 0);
+
+        /* Larger than a receive buffer, the message arrives in pieces. */
+        tag = malloc(40000);
+        assert(tag);
+        memset(tag, '2', 39999);
+        tag[39999] = '\0';
+
+        /* The calls behind the first one arrive while the connection is busy. */
+        call(connections[0], "org.example.edge.Later", "l", &test);
+        call(connections[0], "org.example.edge.Echo", "1", &test);
+        call(connections[0], "org.example.edge.Echo", tag, &test);
+        call(connections[1], "org.example.edge.Echo", "o", &test);
+
+        epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+        assert(epoll_fd >= 0);
+        assert(epoll_add(epoll_fd, varlink_service_get_fd(service), EPOLLIN, service) == 0);
+        for (unsigned long i = 0; i < ARRAY_SIZE(connections); i += 1)
+                assert(epoll_add(epoll_fd, varlink_connection_get_fd(connections[i]),
+                                 varlink_connection_get_events(connections[i]), connections[i]) == 0);
+
+        while (test.n_replies < 4) {
+                struct epoll_event events[3];
+                int n;
+
+                if (test.later && test.n_replies == 1) {
+                        _cleanup_(varlink_object_unrefp) VarlinkObject *out = NULL;
+
+                        assert(varlink_object_new(&out) == 0);
+                        assert(varlink_object_set_string(out, "tag", "l") == 0);
+                        assert(varlink_call_reply(test.later, out, 0) == 0);
+                        test.later = varlink_call_unref(test.later);
+                }
+
+                for (unsigned long i = 0; i < ARRAY_SIZE(connections); i += 1)
+                        assert(epoll_mod(epoll_fd, varlink_connection_get_fd(connections[i]),
+                                         varlink_connection_get_events(connections[i]), connections[i]) == 0);
+
+                n = epoll_wait(epoll_fd, events, ARRAY_SIZE(events), 2000);
+                assert(n > 0);
+
+                for (int k = 0; k < n; k += 1) {
+                        if (events[k].data.ptr == service)
+                                assert(varlink_service_process_events(service) == 0);
+                        else
+                                assert(varlink_connection_process_events(events[k].data.ptr, events[k].events) == 0);
+                }
+        }
+
+        assert(memcmp(test.replies, "ol12", 4) == 0);
+        assert(test.long_size == 39999);
+
+        /* The service notices the closed connection, and frees it with its requests in flight. */
+        assert(varlink_connection_free(connections[1]) == NULL);
+        for (unsigned long i = 0; i < 4; i += 1)
+                assert(varlink_service_process_events(service) == 0);
+
+        /* Switching back hands the listening socket to epoll again. */
+        assert(varlink_service_set_io_uring(service, false) == 0);
+
+        close(epoll_fd);
+        assert(varlink_connection_free(connections[0]) == NULL);
+        assert(varlink_service_free(service) == NULL);
+
+        return EXIT_SUCCESS;
+}
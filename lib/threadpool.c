@@ -0,0 +1,177 @@
+// SPDX-License-Identifier: Apache-2.0
+
+#include "alloc.h"
+#include "threadpool.h"
+#include "varlink.h"
+
+typedef struct {
+        ThreadPool *pool;
+        pthread_t thread;
+        bool started;
+
+        pthread_mutex_t lock;
+        TAILQ_HEAD(jobs, ThreadPoolJob) jobs;
+} ThreadPoolWorker;
+
+struct ThreadPool {
+        ThreadPoolWorker *workers;
+        unsigned long n_workers;
+
+        /* The queue the next job is pushed to, only used by the submitting thread. */
+        unsigned long next;
+
+        /* Idle workers sleep until jobs are queued or the pool stops. */
+        pthread_mutex_t lock;
+        pthread_cond_t wakeup;
+        unsigned long n_queued;
+        bool stop;
+};
+
+static ThreadPoolJob *worker_pop(ThreadPoolWorker *worker, bool steal) {
+        ThreadPoolJob *job;
+
+        pthread_mutex_lock(&worker->lock);
+
+        /* Workers take from the front of their own queue and steal from the back. */
+        if (steal)
+                job = TAILQ_LAST(&worker->jobs, jobs);
+        else
+                job = TAILQ_FIRST(&worker->jobs);
+
+        if (job)
+                TAILQ_REMOVE(&worker->jobs, job, entry);
+
+        pthread_mutex_unlock(&worker->lock);
+
+        return job;
+}
+
+static ThreadPoolJob *worker_next_job(ThreadPoolWorker *worker) {
+        ThreadPool *pool = worker->pool;
+        unsigned long index = worker - pool->workers;
+        ThreadPoolJob *job;
+
+        job = worker_pop(worker, false);
+
+        for (unsigned long i = 1; !job && i < pool->n_workers; i += 1)
+                job = worker_pop(&pool->workers[(index + i) % pool->n_workers], true);
+
+        return job;
+}
+
+static void *worker_run(void *userdata) {
+        ThreadPoolWorker *worker = userdata;
+        ThreadPool *pool = worker->pool;
+
+        for (;;) {
+                ThreadPoolJob *job;
+
+                job = worker_next_job(worker);
+                if (job) {
+                        pthread_mutex_lock(&pool->lock);
+                        pool->n_queued -= 1;
+                        pthread_mutex_unlock(&pool->lock);
+
+                        job->func(job->userdata);
+                        continue;
+                }
+
+                /* The count includes jobs another worker is about to take, look again. */
+                pthread_mutex_lock(&pool->lock);
+                while (pool->n_queued == 0 && !pool->stop)
+                        pthread_cond_wait(&pool->wakeup, &pool->lock);
+
+                if (pool->n_queued == 0 && pool->stop) {
+                        pthread_mutex_unlock(&pool->lock);
+                        break;
+                }
+                pthread_mutex_unlock(&pool->lock);
+        }
+
+        return NULL;
+}
+
+long thread_pool_new(ThreadPool **poolp, unsigned long n_threads) {
+        ThreadPool *pool;
+
+        if (n_threads == 0)
+                n_threads = 1;
+
+        pool = varlink_calloc(1, sizeof(ThreadPool));
+        if (!pool)
+                return -VARLINK_ERROR_PANIC;
+
+        pthread_mutex_init(&pool->lock, NULL);
+        pthread_cond_init(&pool->wakeup, NULL);
+
+        pool->workers = varlink_calloc(n_threads, sizeof(ThreadPoolWorker));
+        if (!pool->workers) {
+                thread_pool_free(pool);
+                return -VARLINK_ERROR_PANIC;
+        }
+
+        pool->n_workers = n_threads;
+
+        for (unsigned long i = 0; i < n_threads; i += 1) {
+                ThreadPoolWorker *worker = &pool->workers[i];
+
+                worker->pool = pool;
+                pthread_mutex_init(&worker->lock, NULL);
+                TAILQ_INIT(&worker->jobs);
+        }
+
+        for (unsigned long i = 0; i < n_threads; i += 1) {
+                ThreadPoolWorker *worker = &pool->workers[i];
+
+                if (pthread_create(&worker->thread, NULL, worker_run, worker) != 0) {
+                        thread_pool_free(pool);
+                        return -VARLINK_ERROR_PANIC;
+                }
+
+                worker->started = true;
+        }
+
+        *poolp = pool;
+
+        return 0;
+}
+
+ThreadPool *thread_pool_free(ThreadPool *pool) {
+        pthread_mutex_lock(&pool->lock);
+        pool->stop = true;
+        pthread_cond_broadcast(&pool->wakeup);
+        pthread_mutex_unlock(&pool->lock);
+
+        for (unsigned long i = 0; i < pool->n_workers; i += 1) {
+                ThreadPoolWorker *worker = &pool->workers[i];
+
+                if (worker->started)
+                        pthread_join(worker->thread, NULL);
+
+                pthread_mutex_destroy(&worker->lock);
+        }
+
+        pthread_cond_destroy(&pool->wakeup);
+        pthread_mutex_destroy(&pool->lock);
+        varlink_free(pool->workers);
+        varlink_free(pool);
+
+        return NULL;
+}
+
+void thread_pool_submit(ThreadPool *pool, ThreadPoolJob *job) {
+        ThreadPoolWorker *worker = &pool->workers[pool->next];
+
+        pool->next = (pool->next + 1) % pool->n_workers;
+
+        /* Counted before a worker can take it and count it down. */
+        pthread_mutex_lock(&pool->lock);
+
+        pthread_mutex_lock(&worker->lock);
+        TAILQ_INSERT_TAIL(&worker->jobs, job, entry);
+        pthread_mutex_unlock(&worker->lock);
+
+        pool->n_queued += 1;
+        pthread_cond_signal(&pool->wakeup);
+        pthread_mutex_unlock(&pool->lock);
+}
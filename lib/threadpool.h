@@ -0,0 +1,36 @@
+// SPDX-License-Identifier: Apache-2.0
+
+#pragma once
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <sys/queue.h>
+
+typedef struct ThreadPool ThreadPool;
+typedef struct ThreadPoolJob ThreadPoolJob;
+
+/*
+ * A unit of work, embedded into the object it works on. It is not
+ * touched by the pool anymore once its function runs.
+ */
+struct ThreadPoolJob {
+        void (*func)(void *userdata);
+        void *userdata;
+
+        TAILQ_ENTRY(ThreadPoolJob) entry;
+};
+
+/*
+ * Creates @n_threads worker threads, each with its own queue of jobs.
+ * Submitted jobs are spread over the queues; a worker whose queue runs
+ * dry steals from the back of the others, so long jobs do not hold up
+ * the ones queued behind them while other workers are idle.
+ */
+long thread_pool_new(ThreadPool **poolp, unsigned long n_threads);
+
+/*
+ * Runs all jobs which are still queued and stops the workers.
+ */
+ThreadPool *thread_pool_free(ThreadPool *pool);
+
+void thread_pool_submit(ThreadPool *pool, ThreadPoolJob *job);
@@ -0,0 +1,160 @@
+// SPDX-License-Identifier: Apache-2.0
+
+#include "trace.h"
+#include "util.h"
+
+#include <string.h>
+#include <sys/random.h>
+
+static VarlinkTraceHooks hooks;
+
+static __thread const VarlinkSpan *current;
+static __thread VarlinkSpan root;
+static __thread uint64_t random_state;
+
+/* xorshift64*, ids only need to be unique, not unpredictable. */
+static uint64_t random_u64(void) {
+        uint64_t x;
+
+        if (random_state == 0) {
+                if (getrandom(&random_state, sizeof(random_state), GRND_NONBLOCK) != sizeof(random_state))
+                        random_state = now_usec() ^ ((uint64_t)getpid() << 32);
+
+                random_state |= 1;
+        }
+
+        x = random_state;
+        x ^= x >> 12;
+        x ^= x << 25;
+        x ^= x >> 27;
+        random_state = x;
+
+        return x * 0x2545F4914F6CDD1DULL;
+}
+
+static void format_hex(char *out, uint64_t value) {
+        static const char digits[] = "0123456789abcdef";
+
+        for (int i = 15; i >= 0; i -= 1) {
+                out[i] = digits[value & 0xf];
+                value >>= 4;
+        }
+}
+
+static bool parse_hex(const char *p, size_t n, char *out) {
+        bool zero = true;
+
+        for (size_t i = 0; i < n; i += 1) {
+                if (!((p[i] >= '0' && p[i] <= '9') || (p[i] >= 'a' && p[i] <= 'f')))
+                        return false;
+
+                if (p[i] != '0')
+                        zero = false;
+
+                out[i] = p[i];
+        }
+
+        out[n] = '\0';
+
+        /* All-zero ids are invalid. */
+        return !zero;
+}
+
+bool varlink_trace_parse(const char *traceparent, VarlinkSpan *span) {
+        VarlinkSpan s = {};
+        char flags[3];
+
+        if (strlen(traceparent) != VARLINK_TRACEPARENT_LENGTH)
+                return false;
+
+        if (strncmp(traceparent, "00-", 3) != 0 || traceparent[35] != '-' || traceparent[52] != '-')
+                return false;
+
+        if (!parse_hex(traceparent + 3, 32, s.trace_id) ||
+            !parse_hex(traceparent + 36, 16, s.span_id))
+                return false;
+
+        flags[0] = traceparent[53];
+        flags[1] = traceparent[54];
+        flags[2] = '\0';
+        if (strspn(flags, "0123456789abcdef") != 2)
+                return false;
+
+        s.flags = strtoul(flags, NULL, 16);
+
+        *span = s;
+        return true;
+}
+
+void varlink_trace_format(const VarlinkSpan *span, char traceparent[VARLINK_TRACEPARENT_LENGTH + 1]) {
+        snprintf(traceparent, VARLINK_TRACEPARENT_LENGTH + 1, "00-%s-%s-%02x",
+                 span->trace_id, span->span_id, span->flags);
+}
+
+void varlink_span_start(VarlinkSpan *span, const VarlinkSpan *parent, bool client, const char *method) {
+        uint64_t id;
+
+        memcpy(span->trace_id, parent->trace_id, sizeof(span->trace_id));
+        memcpy(span->parent_id, parent->span_id, sizeof(span->parent_id));
+        span->flags = parent->flags;
+        span->client = client;
+
+        do
+                id = random_u64();
+        while (id == 0);
+
+        format_hex(span->span_id, id);
+        span->span_id[16] = '\0';
+
+        if (hooks.span_start)
+                hooks.span_start(span, method, hooks.userdata);
+}
+
+void varlink_span_end(VarlinkSpan *span, bool error) {
+        if (!varlink_span_is_active(span))
+                return;
+
+        if (hooks.span_end)
+                hooks.span_end(span, error, hooks.userdata);
+}
+
+const VarlinkSpan *varlink_trace_get_current(void) {
+        if (current)
+                return current;
+
+        if (varlink_span_is_active(&root))
+                return &root;
+
+        return NULL;
+}
+
+const VarlinkSpan *varlink_trace_push(const VarlinkSpan *span) {
+        const VarlinkSpan *previous = current;
+
+        current = span;
+
+        return previous;
+}
+
+void varlink_trace_pop(const VarlinkSpan *previous) {
+        current = previous;
+}
+
+_public_ void varlink_set_trace_hooks(const VarlinkTraceHooks *h) {
+        if (h)
+                hooks = *h;
+        else
+                hooks = (VarlinkTraceHooks){};
+}
+
+_public_ long varlink_set_traceparent(const char *traceparent) {
+        if (!traceparent) {
+                root = (VarlinkSpan){};
+                return 0;
+        }
+
+        if (!varlink_trace_parse(traceparent, &root))
+                return -VARLINK_ERROR_INVALID_IDENTIFIER;
+
+        return 0;
+}
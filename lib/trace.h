@@ -0,0 +1,51 @@
+// SPDX-License-Identifier: Apache-2.0
+
+#pragma once
+
+#include "varlink.h"
+
+/* "00-" TRACE_ID "-" SPAN_ID "-" FLAGS */
+#define VARLINK_TRACEPARENT_LENGTH 55
+
+/*
+ * Parses a traceparent value into the trace and span id of @span, the
+ * remote parent of a span started with varlink_span_start().
+ *
+ * Returns false if @traceparent is not valid.
+ */
+bool varlink_trace_parse(const char *traceparent, VarlinkSpan *span);
+
+/*
+ * Formats the traceparent value for children of @span.
+ */
+void varlink_trace_format(const VarlinkSpan *span, char traceparent[VARLINK_TRACEPARENT_LENGTH + 1]);
+
+/*
+ * Starts @span as a child of @parent with a new span id and calls the
+ * span_start hook.
+ */
+void varlink_span_start(VarlinkSpan *span, const VarlinkSpan *parent, bool client, const char *method);
+
+/*
+ * Calls the span_end hook, exactly once per started span. Does nothing
+ * for untraced spans.
+ */
+void varlink_span_end(VarlinkSpan *span, bool error);
+
+static inline bool varlink_span_is_active(const VarlinkSpan *span) {
+        return span->trace_id[0] != '\0';
+}
+
+/*
+ * The span new outgoing calls of the calling thread become children of:
+ * the span of the currently running method handler, or the context set
+ * with varlink_set_traceparent(). Returns NULL when untraced.
+ */
+const VarlinkSpan *varlink_trace_get_current(void);
+
+/*
+ * Makes @span the current span of the calling thread while a method
+ * handler runs. Returns the previous one, to be restored afterwards.
+ */
+const VarlinkSpan *varlink_trace_push(const VarlinkSpan *span);
+void varlink_trace_pop(const VarlinkSpan *previous);
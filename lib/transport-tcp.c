@@ -1,10 +1,13 @@
 // SPDX-License-Identifier: Apache-2.0
 
+#include "alloc.h"
+#include "shard.h"
 #include "transport.h"
 #include "util.h"
 #include "varlink.h"
 
 #include <errno.h>
+#include <linux/filter.h>
 #include <netdb.h>
 #include <stdio.h>
 #include <sys/socket.h>
@@ -119,29 +122,22 @@ int varlink_connect_tcp(const char *address) {
         return r;
 }
 
-int varlink_listen_tcp(const char *address) {
-        _cleanup_(freep) char *host = NULL;
+static int listen_addr(const struct sockaddr *addr, socklen_t addrlen, bool reuseport) {
         _cleanup_(closep) int fd = -1;
         const int on = 1;
-        _cleanup_(freeaddrinfop) struct addrinfo *result = NULL;
         int r;
 
-        r = strip_parameters(address, &host);
-        if (r < 0)
-                return r;
-
-        r = resolve_addrinfo(host, &result);
-        if (r < 0)
-                return r;
-
-        fd = socket(result->ai_family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+        fd = socket(addr->sa_family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
         if (fd < 0)
                 return -VARLINK_ERROR_CANNOT_LISTEN;
 
         if (setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on)) < 0)
                 return -VARLINK_ERROR_CANNOT_LISTEN;
 
-        if (bind(fd, result->ai_addr, result->ai_addrlen))
+        if (reuseport && setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &on, sizeof(on)) < 0)
+                return -VARLINK_ERROR_CANNOT_LISTEN;
+
+        if (bind(fd, addr, addrlen))
                 return -VARLINK_ERROR_CANNOT_LISTEN;
 
         if (listen(fd, SOMAXCONN) < 0)
@@ -153,6 +149,103 @@ int varlink_listen_tcp(const char *address) {
         return r;
 }
 
+int varlink_listen_tcp(const char *address) {
+        _cleanup_(freep) char *host = NULL;
+        _cleanup_(freeaddrinfop) struct addrinfo *result = NULL;
+        int r;
+
+        r = strip_parameters(address, &host);
+        if (r < 0)
+                return r;
+
+        r = resolve_addrinfo(host, &result);
+        if (r < 0)
+                return r;
+
+        return listen_addr(result->ai_addr, result->ai_addrlen, false);
+}
+
+int varlink_listen_tcp_shards(const char *address, unsigned long n_shards, int *fds) {
+        _cleanup_(freep) char *host = NULL;
+        _cleanup_(freeaddrinfop) struct addrinfo *result = NULL;
+        _cleanup_(varlink_freep) int *cpus = NULL;
+        _cleanup_(varlink_freep) struct sock_filter *code = NULL;
+        struct sockaddr_storage addr;
+        socklen_t addrlen;
+        struct sock_fprog program = {};
+        unsigned long n_cpus;
+        unsigned long i;
+        int r;
+
+        cpus = varlink_calloc(CPU_SETSIZE, sizeof(int));
+        code = varlink_calloc(2 * CPU_SETSIZE + 3, sizeof(struct sock_filter));
+        if (!cpus || !code)
+                return -VARLINK_ERROR_PANIC;
+
+        /*
+         * Map the CPUs the shards are pinned to to their listeners, the
+         * same way varlink_run_shards() does, in the order the listeners
+         * joined the group.
+         */
+        n_cpus = varlink_shard_cpus(cpus);
+
+        /* A = the CPU which received the connection request */
+        code[program.len++] = (struct sock_filter){ BPF_LD | BPF_W | BPF_ABS, 0, 0, SKF_AD_OFF + SKF_AD_CPU };
+
+        for (i = 0; i < n_cpus; i += 1) {
+                code[program.len++] = (struct sock_filter){ BPF_JMP | BPF_JEQ | BPF_K, 0, 1, cpus[i] };
+                code[program.len++] = (struct sock_filter){ BPF_RET | BPF_K, 0, 0, i % n_shards };
+        }
+
+        /* Any other CPU: A % n_shards */
+        code[program.len++] = (struct sock_filter){ BPF_ALU | BPF_MOD | BPF_K, 0, 0, n_shards };
+        code[program.len++] = (struct sock_filter){ BPF_RET | BPF_A, 0, 0, 0 };
+        program.filter = code;
+
+        r = strip_parameters(address, &host);
+        if (r < 0)
+                return r;
+
+        r = resolve_addrinfo(host, &result);
+        if (r < 0)
+                return r;
+
+        memcpy(&addr, result->ai_addr, result->ai_addrlen);
+        addrlen = result->ai_addrlen;
+
+        for (i = 0; i < n_shards; i += 1) {
+                r = listen_addr((struct sockaddr *)&addr, addrlen, true);
+                if (r < 0)
+                        goto fail;
+
+                fds[i] = r;
+
+                /* Port 0 picks a free port for the first one, the others join it. */
+                if (i == 0 && getsockname(fds[0], (struct sockaddr *)&addr, &addrlen) < 0) {
+                        i += 1;
+                        r = -VARLINK_ERROR_CANNOT_LISTEN;
+                        goto fail;
+                }
+        }
+
+        /*
+         * Steer connections to the listener of the shard pinned to the
+         * CPU which received them; without it, the kernel hashes them
+         * over the listeners.
+         */
+        (void)setsockopt(fds[0], SOL_SOCKET, SO_ATTACH_REUSEPORT_CBPF, &program, sizeof(program));
+
+        return 0;
+
+fail:
+        while (i > 0) {
+                i -= 1;
+                close(fds[i]);
+        }
+
+        return r;
+}
+
 int varlink_accept_tcp(int listen_fd) {
         _cleanup_(closep) int fd = -1;
         int r;
@@ -33,6 +33,24 @@ _public_ int varlink_listen(const char *address, char **pathp) {
         return varlink_transport_listen(uri, pathp);
 }
 
+_public_ int varlink_listen_shards(const char *address, unsigned long n_shards, int *fds) {
+        _cleanup_(varlink_uri_freep) VarlinkURI *uri = NULL;
+        long r;
+
+        if (n_shards == 0)
+                return -VARLINK_ERROR_INVALID_CALL;
+
+        r = varlink_uri_new(&uri, address, false);
+        if (r < 0)
+                return (int) r;
+
+        /* Only TCP sockets can share an address. */
+        if (uri->type != VARLINK_URI_PROTOCOL_TCP)
+                return -VARLINK_ERROR_INVALID_ADDRESS;
+
+        return varlink_listen_tcp_shards(uri->host, n_shards, fds);
+}
+
 int varlink_transport_accept(VarlinkURI *uri, int listen_fd) {
         switch (uri->type) {
                 case VARLINK_URI_PROTOCOL_TCP:
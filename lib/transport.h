@@ -12,6 +12,7 @@ int varlink_transport_connect(VarlinkURI *uri);
 int varlink_connect_device(const char *device);
 
 int varlink_listen_tcp(const char *address);
+int varlink_listen_tcp_shards(const char *address, unsigned long n_shards, int *fds);
 int varlink_accept_tcp(int listen_fd);
 int varlink_connect_tcp(const char *address);
 
@@ -1,5 +1,6 @@
 // SPDX-License-Identifier: Apache-2.0
 
+#include "alloc.h"
 #include "interface.h"
 #include "scanner.h"
 #include "util.h"
@@ -116,7 +117,7 @@ long varlink_type_new_from_scanner(VarlinkType **typep, Scanner *scanner) {
                                 if (scanner_expect_operator(scanner, ",") < 0)
                                         return -VARLINK_ERROR_INVALID_TYPE;
 
-                        field = calloc(1, sizeof(VarlinkTypeField));
+                        field = varlink_calloc(1, sizeof(VarlinkTypeField));
                         if (!field)
                                 return -VARLINK_ERROR_PANIC;
 
@@ -155,7 +156,7 @@ long varlink_type_new_from_scanner(VarlinkType **typep, Scanner *scanner) {
 
                         if (type->n_fields == n_fields_allocated) {
                                 n_fields_allocated = MAX(n_fields_allocated * 2, 4);
-                                type->fields = realloc(type->fields, n_fields_allocated * sizeof(VarlinkTypeField *));
+                                type->fields = varlink_realloc(type->fields, n_fields_allocated * sizeof(VarlinkTypeField *));
                                 if (!type->fields)
                                         return -VARLINK_ERROR_PANIC;
                         }
@@ -169,7 +170,7 @@ long varlink_type_new_from_scanner(VarlinkType **typep, Scanner *scanner) {
                         return -VARLINK_ERROR_INVALID_TYPE;
 
         } else {
-                _cleanup_(freep) char *alias = NULL;
+                _cleanup_(varlink_freep) char *alias = NULL;
 
                 r = scanner_expect_type_name(scanner, &alias);
                 if (r < 0) {
@@ -193,13 +194,13 @@ long varlink_type_new_from_scanner(VarlinkType **typep, Scanner *scanner) {
 
 static VarlinkTypeField *varlink_type_field_free(VarlinkTypeField *field) {
         if (field->name)
-                free(field->name);
+                varlink_free(field->name);
 
         if (field->type)
                 varlink_type_unref(field->type);
 
         free(field->description);
-        free(field);
+        varlink_free(field);
 
         return NULL;
 }
@@ -232,7 +233,7 @@ long varlink_type_allocate(VarlinkType **typep,
         _cleanup_(varlink_type_unrefp) VarlinkType *type = NULL;
         long r;
 
-        type = calloc(1, sizeof(VarlinkType));
+        type = varlink_calloc(1, sizeof(VarlinkType));
         if (!type)
                 return -VARLINK_ERROR_PANIC;
 
@@ -278,7 +279,7 @@ VarlinkType *varlink_type_unref(VarlinkType *type) {
                                 for (unsigned long i = 0; i < type->n_fields; i += 1)
                                         varlink_type_field_free(type->fields[i]);
 
-                                free(type->fields);
+                                varlink_free(type->fields);
                                 avl_tree_free(type->fields_sorted);
                                 break;
 
@@ -290,12 +291,12 @@ VarlinkType *varlink_type_unref(VarlinkType *type) {
                                 break;
 
                         case VARLINK_TYPE_ALIAS:
-                                free(type->alias);
+                                varlink_free(type->alias);
                                 break;
                 }
 
                 free(type->typestring);
-                free(type);
+                varlink_free(type);
         }
 
         return NULL;
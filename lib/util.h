@@ -7,6 +7,7 @@
 #include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 #include <unistd.h>
 
 #define _cleanup_(_x) __attribute__((__cleanup__(_x)))
@@ -39,6 +40,14 @@ int epoll_add(int epfd, int fd, uint32_t events, void *ptr);
 int epoll_mod(int epfd, int fd, uint32_t events, void *ptr);
 int epoll_del(int epfd, int fd);
 
+static inline uint64_t now_usec(void) {
+        struct timespec ts;
+
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+
+        return (uint64_t)ts.tv_sec * 1000000ULL + ts.tv_nsec / 1000;
+}
+
 #define MIN(_a, _b) ((_a) < (_b) ? (_a) : (_b))
 #define MAX(_a, _b) ((_a) > (_b) ? (_a) : (_b))
 #define ARRAY_SIZE(_x) (sizeof(_x) / sizeof((_x)[0]))
@@ -1,5 +1,6 @@
 // SPDX-License-Identifier: Apache-2.0
 
+#include "alloc.h"
 #include "array.h"
 #include "object.h"
 #include "scanner.h"
@@ -9,7 +10,7 @@
 #include <inttypes.h>
 #include <math.h>
 
-void varlink_value_clear(VarlinkValue *value) {
+void varlink_value_clear(VarlinkValue *value, const VarlinkAllocator *allocator) {
         switch (value->kind) {
                 case VARLINK_VALUE_UNDEFINED:
                 case VARLINK_VALUE_NULL:
@@ -19,7 +20,7 @@ void varlink_value_clear(VarlinkValue *value) {
                         break;
 
                 case VARLINK_VALUE_STRING:
-                        free(value->s);
+                        varlink_allocator_free(allocator, value->s);
                         break;
 
                 case VARLINK_VALUE_ARRAY:
@@ -34,7 +35,21 @@ void varlink_value_clear(VarlinkValue *value) {
         }
 }
 
-long varlink_value_read_from_scanner(VarlinkValue *value, Scanner *scanner, locale_t locale, unsigned long depth_cnt) {
+long varlink_value_freeze(VarlinkValue *value) {
+        switch (value->kind) {
+                case VARLINK_VALUE_ARRAY:
+                        return value->array ? varlink_array_freeze(value->array) : 0;
+
+                case VARLINK_VALUE_OBJECT:
+                        return value->object ? varlink_object_freeze(value->object, 0) : 0;
+
+                default:
+                        return 0;
+        }
+}
+
+long varlink_value_read_from_scanner(VarlinkValue *value, Scanner *scanner, const VarlinkAllocator *allocator,
+                                     locale_t locale, unsigned long depth_cnt) {
         ScannerNumber number;
         long r;
 
@@ -71,7 +86,7 @@ long varlink_value_read_from_scanner(VarlinkValue *value, Scanner *scanner, loca
                 value->kind = VARLINK_VALUE_BOOL;
 
         } else if (scanner_peek(scanner) == '"') {
-                r = scanner_expect_string(scanner, &value->s);
+                r = scanner_expect_string(scanner, allocator, &value->s);
                 if (r < 0)
                         return r;
 
@@ -35,11 +35,17 @@ typedef struct {
         };
 } VarlinkValue;
 
-long varlink_value_read_from_scanner(VarlinkValue *value, Scanner *scanner, locale_t locale, unsigned long depth_cnt);
+/* Strings are allocated with @allocator, nested objects and arrays take the one of the thread. */
+long varlink_value_read_from_scanner(VarlinkValue *value, Scanner *scanner, const VarlinkAllocator *allocator,
+                                     locale_t locale, unsigned long depth_cnt);
 long varlink_value_write_json(VarlinkValue *value,
                               FILE *stream,
                               long indent,
                               const char *key_pre, const char *key_post,
                               const char *value_pre, const char *value_post);
 
-void varlink_value_clear(VarlinkValue *value);
+/* Freezes nested objects and arrays, see varlink_object_freeze(). */
+long varlink_value_freeze(VarlinkValue *value);
+
+/* Releases the value of an object or array which was created with @allocator. */
+void varlink_value_clear(VarlinkValue *value, const VarlinkAllocator *allocator);
@@ -0,0 +1,819 @@
+// SPDX-License-Identifier: Apache-2.0
+
+#pragma once
+
+/*
+ * Interfaces of varlink.hpp, parsed at compile time.
+ *
+ *   using Calc = varlink::idl::Interface<"interface org.example.calc\n"
+ *                                        "method Sum(a: int, b: ?int) -> (sum: int)\n">;
+ *
+ * The description is parsed by a constexpr parser with the grammar of
+ * varlink_interface_new(); an invalid one does not compile. The types of
+ * the interface become records whose fields are read by name at compile
+ * time and by index at run time:
+ *
+ *   Calc::In<"Sum"> in(parameters);
+ *   int64_t a = in.get<"a">();                 // int64_t
+ *   std::optional<int64_t> b = in.get<"b">();  // std::optional<int64_t>
+ *
+ * A Dispatcher finds the handler of a call by a perfect hash of its
+ * method name, computed at compile time.
+ *
+ * The service still parses the description once in add_interface(), to
+ * validate calls and to answer GetInterfaceDescription().
+ */
+
+#if __cplusplus < 202002L
+#error "varlink-idl.hpp needs C++20"
+#endif
+
+#include "varlink.hpp"
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <optional>
+#include <string_view>
+#include <tuple>
+#include <utility>
+
+namespace varlink::idl {
+
+/* A string literal as a template argument. */
+template<size_t N>
+struct FixedString {
+        char data[N];
+
+        constexpr FixedString(const char (&string)[N]) {
+                for (size_t i = 0; i < N; i += 1)
+                        data[i] = string[i];
+        }
+
+        constexpr std::string_view view() const { return std::string_view(data, N - 1); }
+};
+
+enum class Kind : uint8_t {
+        Bool,
+        Int,
+        Float,
+        String,
+        Object,         /* "object", of any content */
+        Struct,
+        Enum,
+        Array,
+        Map,
+        Maybe,
+        Alias
+};
+
+struct Type {
+        Kind kind{};
+
+        /* The element of an Array, Map or Maybe. */
+        uint16_t element = 0;
+
+        /* The fields of a Struct or the values of an Enum. */
+        uint16_t first_field = 0;
+        uint16_t n_fields = 0;
+
+        std::string_view alias;
+};
+
+struct Field {
+        std::string_view name;
+        uint16_t type = 0;
+};
+
+enum class MemberKind : uint8_t {
+        Type,
+        Method,
+        Error
+};
+
+struct Member {
+        MemberKind kind{};
+        std::string_view name;
+
+        /* The type of a Type or Error, the input of a Method. */
+        uint16_t type = 0;
+        uint16_t out = 0;
+};
+
+namespace detail {
+
+/* Capacities of the first pass, which counts what the interface needs. */
+inline constexpr size_t max_members = 256;
+inline constexpr size_t max_types = 2048;
+inline constexpr size_t max_fields = 2048;
+inline constexpr size_t max_fields_per_type = 256;
+
+/* Not constexpr: reaching it while parsing at compile time is a compile error which names it. */
+[[noreturn]] inline void invalid_interface() {
+        throw Error(VARLINK_ERROR_INVALID_INTERFACE);
+}
+
+constexpr bool is_lower(char c) { return c >= 'a' && c <= 'z'; }
+constexpr bool is_upper(char c) { return c >= 'A' && c <= 'Z'; }
+constexpr bool is_digit(char c) { return c >= '0' && c <= '9'; }
+constexpr bool is_alpha(char c) { return is_lower(c) || is_upper(c); }
+constexpr bool is_alnum(char c) { return is_alpha(c) || is_digit(c); }
+
+/* Mirrors interface_name_valid() of the scanner. */
+constexpr bool interface_name_valid(std::string_view name) {
+        char previous = 0;
+        unsigned sections = 1;
+
+        if (name.size() < 3 || name.size() > 255)
+                return false;
+
+        for (char c : name) {
+                if (c == '-') {
+                        if (previous == '.')
+                                return false;
+                } else if (c == '.') {
+                        if (previous == '.' || previous == '-')
+                                return false;
+                        sections += 1;
+                } else if (!is_lower(c) && !is_digit(c))
+                        return false;
+
+                previous = c;
+        }
+
+        return is_lower(name.front()) && sections >= 2 && (is_lower(name.back()) || is_digit(name.back()));
+}
+
+constexpr bool member_name_valid(std::string_view name) {
+        if (name.empty() || !is_upper(name.front()))
+                return false;
+
+        for (char c : name.substr(1))
+                if (!is_alnum(c))
+                        return false;
+
+        return true;
+}
+
+constexpr bool field_name_valid(std::string_view name) {
+        if (name.empty() || !is_alpha(name.front()) || !is_alnum(name.back()))
+                return false;
+
+        for (size_t i = 1; i < name.size(); i += 1) {
+                if (name[i] == '_') {
+                        if (name[i - 1] == '_')
+                                return false;
+                } else if (!is_alnum(name[i]))
+                        return false;
+        }
+
+        return true;
+}
+
+/* A member of this interface, or a qualified one of another. */
+constexpr bool type_name_valid(std::string_view name) {
+        if (member_name_valid(name))
+                return true;
+
+        for (size_t i = 1; i < name.size(); i += 1)
+                if (is_upper(name[i]))
+                        return name[i - 1] == '.' &&
+                               interface_name_valid(name.substr(0, i - 1)) &&
+                               member_name_valid(name.substr(i));
+
+        return false;
+}
+
+template<size_t M, size_t T, size_t F>
+struct Tables {
+        std::string_view name;
+
+        std::array<Member, M> members{};
+        std::array<Type, T> types{};
+        std::array<Field, F> fields{};
+        size_t n_members = 0;
+        size_t n_types = 0;
+        size_t n_fields = 0;
+};
+
+template<size_t M, size_t T, size_t F>
+class Parser {
+public:
+        constexpr explicit Parser(std::string_view description) : s_(description) {}
+
+        constexpr Tables<M, T, F> parse() {
+                if (!read_keyword("interface"))
+                        invalid_interface();
+
+                tables_.name = word();
+                if (!interface_name_valid(tables_.name))
+                        invalid_interface();
+                p_ += tables_.name.size();
+
+                while (peek() != '\0') {
+                        Member member;
+
+                        if (read_keyword("type")) {
+                                member.kind = MemberKind::Type;
+                                member.name = expect_member_name();
+                                member.type = parse_type();
+
+                                Kind kind = tables_.types[member.type].kind;
+                                if (kind != Kind::Struct && kind != Kind::Enum)
+                                        invalid_interface();
+                        } else if (read_keyword("method")) {
+                                member.kind = MemberKind::Method;
+                                member.name = expect_member_name();
+                                member.type = parse_type();
+                                expect_operator("->");
+                                member.out = parse_type();
+
+                                if (tables_.types[member.type].kind != Kind::Struct ||
+                                    tables_.types[member.out].kind != Kind::Struct)
+                                        invalid_interface();
+                        } else if (read_keyword("error")) {
+                                member.kind = MemberKind::Error;
+                                member.name = expect_member_name();
+                                member.type = parse_type();
+
+                                if (tables_.types[member.type].kind != Kind::Struct)
+                                        invalid_interface();
+                        } else
+                                invalid_interface();
+
+                        for (size_t i = 0; i < tables_.n_members; i += 1)
+                                if (tables_.members[i].name == member.name)
+                                        invalid_interface();
+
+                        if (tables_.n_members == M)
+                                invalid_interface();
+                        tables_.members[tables_.n_members++] = member;
+                }
+
+                /* Check if all referenced types exist */
+                for (size_t i = 0; i < tables_.n_members; i += 1) {
+                        const Member &member = tables_.members[i];
+
+                        if (!resolves(member.type) || (member.kind == MemberKind::Method && !resolves(member.out)))
+                                invalid_interface();
+                }
+
+                return tables_;
+        }
+
+private:
+        std::string_view s_;
+        size_t p_ = 0;
+        Tables<M, T, F> tables_;
+
+        constexpr void advance() {
+                while (p_ < s_.size()) {
+                        char c = s_[p_];
+
+                        if (c == ' ' || c == '\t' || c == '\n')
+                                p_ += 1;
+                        else if (c == '#') {
+                                while (p_ < s_.size() && s_[p_] != '\n')
+                                        p_ += 1;
+                        } else
+                                break;
+                }
+        }
+
+        constexpr char peek() {
+                advance();
+
+                return p_ < s_.size() ? s_[p_] : '\0';
+        }
+
+        constexpr std::string_view word() {
+                size_t n = 1;
+
+                if (!is_alpha(peek()))
+                        return {};
+
+                while (p_ + n < s_.size()) {
+                        char c = s_[p_ + n];
+
+                        if (!is_alnum(c) && c != '_' && c != '-' && c != '.')
+                                break;
+
+                        n += 1;
+                }
+
+                return s_.substr(p_, n);
+        }
+
+        constexpr bool read_keyword(std::string_view keyword) {
+                if (word() != keyword)
+                        return false;
+
+                p_ += keyword.size();
+
+                return true;
+        }
+
+        constexpr void expect_operator(std::string_view op) {
+                advance();
+
+                if (s_.substr(p_, op.size()) != op)
+                        invalid_interface();
+
+                p_ += op.size();
+        }
+
+        constexpr std::string_view expect_member_name() {
+                std::string_view name = word();
+
+                if (!member_name_valid(name))
+                        invalid_interface();
+
+                p_ += name.size();
+
+                return name;
+        }
+
+        /* Mirrors varlink_interface_try_resolve(), which does not look into maybes. */
+        constexpr bool resolves(uint16_t index) {
+                const Type &type = tables_.types[index];
+
+                switch (type.kind) {
+                        case Kind::Array:
+                        case Kind::Map:
+                                return resolves(type.element);
+
+                        case Kind::Struct:
+                                for (size_t i = 0; i < type.n_fields; i += 1)
+                                        if (!resolves(tables_.fields[type.first_field + i].type))
+                                                return false;
+                                return true;
+
+                        case Kind::Alias:
+                                for (size_t i = 0; i < tables_.n_members; i += 1)
+                                        if (tables_.members[i].kind == MemberKind::Type &&
+                                            tables_.members[i].name == type.alias)
+                                                return true;
+                                return false;
+
+                        default:
+                                return true;
+                }
+        }
+
+        constexpr uint16_t add_type(const Type &type) {
+                if (tables_.n_types == T)
+                        invalid_interface();
+
+                tables_.types[tables_.n_types] = type;
+
+                return tables_.n_types++;
+        }
+
+        /* Mirrors varlink_type_new_from_scanner(). */
+        constexpr uint16_t parse_type() {
+                Type type;
+
+                if (peek() == '[') {
+                        expect_operator("[");
+                        type.kind = read_keyword("string") ? Kind::Map : Kind::Array;
+                        expect_operator("]");
+                        type.element = parse_type();
+                } else if (peek() == '?') {
+                        expect_operator("?");
+                        type.kind = Kind::Maybe;
+                        type.element = parse_type();
+
+                        /* Do not nest maybes */
+                        if (tables_.types[type.element].kind == Kind::Maybe)
+                                invalid_interface();
+                } else if (read_keyword("bool"))
+                        type.kind = Kind::Bool;
+                else if (read_keyword("int"))
+                        type.kind = Kind::Int;
+                else if (read_keyword("float"))
+                        type.kind = Kind::Float;
+                else if (read_keyword("string"))
+                        type.kind = Kind::String;
+                else if (read_keyword("object"))
+                        type.kind = Kind::Object;
+                else if (peek() == '(') {
+                        /* Nested types add their fields first, these are collected to stay adjacent. */
+                        std::array<Field, max_fields_per_type> fields{};
+                        size_t n_fields = 0;
+
+                        expect_operator("(");
+                        type.kind = Kind::Struct;
+
+                        for (size_t i = 0; peek() != ')'; i += 1) {
+                                Field field;
+
+                                if (i > 0)
+                                        expect_operator(",");
+
+                                field.name = word();
+                                if (!field_name_valid(field.name))
+                                        invalid_interface();
+                                p_ += field.name.size();
+
+                                if (i == 0 && peek() != ':')
+                                        type.kind = Kind::Enum;
+
+                                if (type.kind == Kind::Struct) {
+                                        expect_operator(":");
+                                        field.type = parse_type();
+                                }
+
+                                for (size_t k = 0; k < n_fields; k += 1)
+                                        if (fields[k].name == field.name)
+                                                invalid_interface();
+
+                                if (n_fields == fields.size())
+                                        invalid_interface();
+                                fields[n_fields++] = field;
+                        }
+
+                        expect_operator(")");
+
+                        if (tables_.n_fields + n_fields > F)
+                                invalid_interface();
+
+                        type.first_field = tables_.n_fields;
+                        type.n_fields = n_fields;
+                        for (size_t k = 0; k < n_fields; k += 1)
+                                tables_.fields[tables_.n_fields++] = fields[k];
+                } else {
+                        type.kind = Kind::Alias;
+                        type.alias = word();
+                        if (!type_name_valid(type.alias))
+                                invalid_interface();
+                        p_ += type.alias.size();
+                }
+
+                return add_type(type);
+        }
+};
+
+struct Sizes {
+        size_t n_members;
+        size_t n_types;
+        size_t n_fields;
+};
+
+/* Names point into the description, which is NUL-terminated only at its end. */
+template<size_t N>
+constexpr std::array<char, N + 1> terminated(std::string_view string) {
+        std::array<char, N + 1> copy{};
+
+        for (size_t i = 0; i < N; i += 1)
+                copy[i] = string[i];
+
+        return copy;
+}
+
+constexpr uint32_t hash(std::string_view name, uint32_t seed) {
+        uint32_t h = 2166136261u ^ seed;
+
+        for (char c : name) {
+                h ^= static_cast<uint8_t>(c);
+                h *= 16777619u;
+        }
+
+        return h;
+}
+
+/* Slots of the perfect hash table hold the member index plus one, 0 is empty. */
+template<size_t N>
+struct PerfectHash {
+        uint32_t seed = 0;
+        std::array<uint16_t, N> slots{};
+};
+
+template<typename T> struct KindValue;
+
+template<Kind K> struct KindTag {};
+
+template<> struct KindValue<KindTag<Kind::Bool>> { using type = bool; };
+template<> struct KindValue<KindTag<Kind::Int>> { using type = int64_t; };
+template<> struct KindValue<KindTag<Kind::Float>> { using type = double; };
+template<> struct KindValue<KindTag<Kind::String>> { using type = std::string_view; };
+template<> struct KindValue<KindTag<Kind::Enum>> { using type = std::string_view; };
+template<> struct KindValue<KindTag<Kind::Object>> { using type = ObjectView; };
+template<> struct KindValue<KindTag<Kind::Struct>> { using type = ObjectView; };
+template<> struct KindValue<KindTag<Kind::Map>> { using type = ObjectView; };
+template<> struct KindValue<KindTag<Kind::Array>> { using type = ArrayView; };
+
+} // namespace detail
+
+template<FixedString Description>
+class Interface {
+private:
+        static constexpr detail::Sizes sizes = [] {
+                auto tables = detail::Parser<detail::max_members, detail::max_types, detail::max_fields>(
+                        Description.view()).parse();
+
+                return detail::Sizes{ tables.n_members, tables.n_types, tables.n_fields };
+        }();
+
+public:
+        static constexpr auto tables =
+                detail::Parser<sizes.n_members, sizes.n_types, sizes.n_fields>(Description.view()).parse();
+
+        static constexpr std::string_view name = tables.name;
+        static constexpr const char *description = Description.data;
+        static constexpr size_t n_members = sizes.n_members;
+
+        /* The index of a member, which does not compile if it does not exist. */
+        static consteval size_t member(std::string_view name, MemberKind kind) {
+                for (size_t i = 0; i < n_members; i += 1)
+                        if (tables.members[i].name == name && tables.members[i].kind == kind)
+                                return i;
+
+                detail::invalid_interface();
+        }
+
+        static consteval size_t method(std::string_view name) { return member(name, MemberKind::Method); }
+
+private:
+        static constexpr size_t hash_size = [] {
+                size_t size = 1;
+
+                while (size < 2 * n_members)
+                        size *= 2;
+
+                return size;
+        }();
+
+        static constexpr detail::PerfectHash<hash_size> method_hash = [] {
+                detail::PerfectHash<hash_size> hash;
+
+                /* Try seeds until no two methods share a slot; with a table of twice the size, few are needed. */
+                for (hash.seed = 0;; hash.seed += 1) {
+                        bool collision = false;
+
+                        hash.slots = {};
+                        for (size_t i = 0; i < n_members && !collision; i += 1) {
+                                size_t slot;
+
+                                if (tables.members[i].kind != MemberKind::Method)
+                                        continue;
+
+                                slot = detail::hash(tables.members[i].name, hash.seed) & (hash_size - 1);
+                                if (hash.slots[slot] != 0)
+                                        collision = true;
+                                else
+                                        hash.slots[slot] = i + 1;
+                        }
+
+                        if (!collision)
+                                return hash;
+                }
+        }();
+
+public:
+        /* The member index of the method @name, a one string comparison. */
+        static constexpr std::optional<size_t> find_method(std::string_view name) {
+                uint16_t slot = method_hash.slots[detail::hash(name, method_hash.seed) & (hash_size - 1)];
+
+                if (slot == 0 || tables.members[slot - 1].name != name)
+                        return std::nullopt;
+
+                return slot - 1;
+        }
+
+        /* Follows aliases; those in maybes are not checked and may name nothing, which reads as an object. */
+        static consteval size_t resolve(size_t type) {
+                if (tables.types[type].kind != Kind::Alias)
+                        return type;
+
+                for (size_t i = 0; i < n_members; i += 1)
+                        if (tables.members[i].kind == MemberKind::Type && tables.members[i].name == tables.types[type].alias)
+                                return tables.members[i].type;
+
+                return type;
+        }
+
+        static consteval Kind kind(size_t type) {
+                Kind k = tables.types[resolve(type)].kind;
+
+                return k == Kind::Alias ? Kind::Object : k;
+        }
+
+        template<size_t StructType>
+        class Record;
+
+        template<FixedString Method>
+        using In = Record<tables.members[method(Method.view())].type>;
+
+        template<FixedString Method>
+        using Out = Record<tables.members[method(Method.view())].out>;
+
+        template<FixedString Error>
+        using ErrorParameters = Record<tables.members[member(Error.view(), MemberKind::Error)].type>;
+
+        template<FixedString Type>
+        using TypeRecord = Record<resolve(tables.members[member(Type.view(), MemberKind::Type)].type)>;
+
+        class Dispatcher;
+};
+
+/*
+ * The fields of a struct type, in a tuple of std::optional values at
+ * fixed offsets. Reading an object fills in all of them, get<"name">()
+ * looks up the index at compile time. Fields of a maybe type are
+ * returned as std::optional, the others as their value: bool, int64_t,
+ * double, std::string_view for strings and enums, ObjectView for
+ * objects, structs and maps, and ArrayView.
+ */
+template<FixedString Description>
+template<size_t StructType>
+class Interface<Description>::Record {
+private:
+        using I = Interface<Description>;
+        static constexpr Type type = I::tables.types[StructType];
+
+        static_assert(type.kind == Kind::Struct, "records are made of struct types");
+
+        static constexpr const Field &field(size_t index) { return I::tables.fields[type.first_field + index]; }
+
+        static consteval bool is_maybe(size_t index) { return I::tables.types[field(index).type].kind == Kind::Maybe; }
+
+        static consteval Kind value_kind(size_t index) {
+                size_t t = field(index).type;
+
+                if (I::tables.types[t].kind == Kind::Maybe)
+                        t = I::tables.types[t].element;
+
+                return I::kind(t);
+        }
+
+        template<size_t Index>
+        using Value = typename detail::KindValue<detail::KindTag<value_kind(Index)>>::type;
+
+        template<size_t... Index>
+        static auto make_storage(std::index_sequence<Index...>) -> std::tuple<std::optional<Value<Index>>...>;
+
+        using Storage = decltype(make_storage(std::make_index_sequence<type.n_fields>()));
+
+public:
+        static constexpr size_t n_fields = type.n_fields;
+
+        static consteval size_t index(std::string_view name) {
+                for (size_t i = 0; i < n_fields; i += 1)
+                        if (field(i).name == name)
+                                return i;
+
+                detail::invalid_interface();
+        }
+
+        /* An empty record, to set the fields of a reply. */
+        Record() = default;
+
+        /* Reads all fields of @object; it is kept, for the strings and objects it holds. */
+        explicit Record(ObjectView object) : object_(Object::ref(object)) {
+                read(std::make_index_sequence<n_fields>());
+        }
+
+        template<FixedString Name>
+        auto get() const {
+                constexpr size_t i = index(Name.view());
+                const auto &value = std::get<i>(values_);
+
+                if constexpr (is_maybe(i))
+                        return value;
+                else {
+                        if (!value)
+                                throw Error(VARLINK_ERROR_UNKNOWN_FIELD);
+
+                        return *value;
+                }
+        }
+
+        template<FixedString Name>
+        void set(const Value<index(Name.view())> &value) {
+                constexpr size_t i = index(Name.view());
+
+                object_.set(name_of<i>(), value);
+
+                /* Strings are read back, to point into the object rather than @value. */
+                std::get<i>(values_) = object_.template find<Value<i>>(name_of<i>());
+        }
+
+        /* Clears a field of a maybe type. */
+        template<FixedString Name>
+        void reset() {
+                constexpr size_t i = index(Name.view());
+
+                static_assert(is_maybe(i), "only fields of a maybe type can be null");
+
+                object_.set(name_of<i>(), nullptr);
+                std::get<i>(values_).reset();
+        }
+
+        ObjectView object() const noexcept { return object_; }
+
+private:
+        Object object_;
+        Storage values_;
+
+        template<size_t Index>
+        static const char *name_of() {
+                static constexpr auto name = detail::terminated<field(Index).name.size()>(field(Index).name);
+
+                return name.data();
+        }
+
+        template<size_t Index>
+        void read_field() {
+                std::optional<Value<Index>> value = object_.find<Value<Index>>(name_of<Index>());
+
+                if (!value && !is_maybe(Index))
+                        throw Error(VARLINK_ERROR_UNKNOWN_FIELD);
+
+                std::get<Index>(values_) = value;
+        }
+
+        template<size_t... Index>
+        void read(std::index_sequence<Index...>) {
+                (read_field<Index>(), ...);
+        }
+};
+
+/*
+ * Calls handlers of the interface's methods, found with a perfect hash
+ * of the method name:
+ *
+ *   Calc::Dispatcher dispatcher;
+ *   dispatcher.on<"Sum">(sum, &state);
+ *   dispatcher.add_to(service);
+ *
+ * Methods without a handler reply with MethodNotImplemented. The
+ * dispatcher must outlive the service.
+ */
+template<FixedString Description>
+class Interface<Description>::Dispatcher {
+public:
+        using Handler = long (*)(Call call, ObjectView parameters, uint64_t flags, void *userdata);
+
+        template<FixedString Method>
+        void on(Handler handler, void *userdata = nullptr) noexcept {
+                constexpr size_t i = method(Method.view());
+
+                handlers_[i] = { handler, userdata };
+        }
+
+        void add_to(Service &service) {
+                add_to(service, std::make_index_sequence<n_members>());
+        }
+
+private:
+        struct Entry {
+                Handler handler = nullptr;
+                void *userdata = nullptr;
+        };
+
+        std::array<Entry, n_members> handlers_{};
+
+        static long callback(VarlinkService *, VarlinkCall *call, VarlinkObject *parameters, uint64_t flags, void *userdata) {
+                Dispatcher *dispatcher = static_cast<Dispatcher *>(userdata);
+                std::string_view method = varlink_call_get_method(call);
+                std::optional<size_t> i;
+
+                /* The service only passes calls of this interface. */
+                i = find_method(method.substr(method.rfind('.') + 1));
+                if (!i || !dispatcher->handlers_[*i].handler) {
+                        Object error;
+
+                        error.set("method", method);
+                        return varlink_call_reply_error(call, "org.varlink.service.MethodNotImplemented", error.get());
+                }
+
+                return dispatcher->handlers_[*i].handler(Call(call), ObjectView(parameters), flags,
+                                                         dispatcher->handlers_[*i].userdata);
+        }
+
+        template<size_t Index>
+        static const char *method_name() {
+                static constexpr auto name =
+                        detail::terminated<tables.members[Index].name.size()>(tables.members[Index].name);
+
+                return name.data();
+        }
+
+        /* The methods are passed as name, callback and userdata triples; other members as nothing. */
+        template<size_t Index>
+        auto method_arguments() {
+                if constexpr (tables.members[Index].kind == MemberKind::Method)
+                        return std::tuple<const char *, VarlinkMethodCallback, void *>(method_name<Index>(), callback, this);
+                else
+                        return std::tuple<>();
+        }
+
+        template<size_t... Index>
+        void add_to(Service &service, std::index_sequence<Index...>) {
+                std::apply([&](auto... arguments) {
+                        service.add_interface(description, arguments...);
+                }, std::tuple_cat(method_arguments<Index>()...));
+        }
+};
+
+} // namespace varlink::idl
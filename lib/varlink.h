@@ -5,6 +5,7 @@
 #include <stdbool.h>
 #include <stdint.h>
 #include <stdlib.h>
+#include <sys/types.h>
 
 #ifdef __cplusplus
 extern "C" {
@@ -52,6 +53,13 @@ enum {
         VARLINK_REPLY_CONTINUES = 1
 };
 
+/*
+ * Flags of varlink_object_freeze().
+ */
+enum {
+        VARLINK_FREEZE_CACHE_JSON = 1
+};
+
 /*
  * Objects and arrays represent basic data types corresponding with JSON
  * objects and arrays.
@@ -97,6 +105,24 @@ typedef void (*VarlinkConnectionClosedFunc)(VarlinkConnection *connection,
 typedef void (*VarlinkCallConnectionClosed)(VarlinkCall *call,
                                             void *userdata);
 
+/*
+ * Called when a method handler of a service ran longer than the
+ * threshold passed to varlink_service_set_slow_call_callback(). The
+ * parameters are the ones the handler was called with.
+ */
+typedef void (*VarlinkSlowCallFunc)(VarlinkService *service,
+                                    const char *method,
+                                    VarlinkObject *parameters,
+                                    uint64_t usec,
+                                    void *userdata);
+
+/*
+ * Runs a shard started with varlink_run_shards(), in its own thread.
+ * The shard owns @listen_fd, usually by passing it on to
+ * varlink_service_new().
+ */
+typedef long (*VarlinkShardFunc)(unsigned long shard, int listen_fd, void *userdata);
+
 /*
  * Called when a client receives a reply to its call.
  */
@@ -106,11 +132,160 @@ typedef long (*VarlinkReplyFunc)(VarlinkConnection *connection,
                                  uint64_t flags,
                                  void *userdata);
 
+/*
+ * Counters of a single client or service connection. Times are
+ * CLOCK_MONOTONIC microseconds.
+ */
+typedef struct {
+        uint64_t n_messages_in;
+        uint64_t n_messages_out;
+        uint64_t n_bytes_in;
+        uint64_t n_bytes_out;
+
+        /* Received bytes not parsed yet, and queued bytes not sent yet. */
+        uint64_t in_buffered;
+        uint64_t out_buffered;
+        uint64_t out_buffered_max;
+
+        uint64_t n_calls_in_flight;
+
+        uint64_t connect_usec;
+        uint64_t last_activity_usec;
+} VarlinkConnectionStats;
+
+/*
+ * A span of a distributed trace, in the W3C Trace Context format. Calls
+ * carry the context in the "traceparent" field of the call message.
+ * Services start a span for every call with a context; calls made from
+ * within its method handler become its children.
+ */
+typedef struct {
+        char trace_id[33];
+        char span_id[17];
+        char parent_id[17];
+        uint8_t flags;
+
+        /* A call made by a client, otherwise the handling of a call by a service. */
+        bool client;
+} VarlinkSpan;
+
+/*
+ * Limits for the calls a service accepts, refilled continuously. Bursts
+ * of 0 default to one second worth of the rate; a rate of 0 does not
+ * limit. Bytes count the messages as received, before they are parsed.
+ */
+typedef struct {
+        uint64_t calls_per_sec;
+        uint64_t calls_burst;
+        uint64_t bytes_per_sec;
+        uint64_t bytes_burst;
+
+        /* Share the limits between all connections of a UNIX domain socket peer's UID. */
+        bool per_uid;
+
+        /* Reply with org.varlink.ratelimit.LimitExceeded instead of waiting. */
+        bool reject;
+} VarlinkRateLimit;
+
+typedef struct {
+        void (*span_start)(const VarlinkSpan *span, const char *method, void *userdata);
+        void (*span_end)(const VarlinkSpan *span, bool error, void *userdata);
+        void *userdata;
+} VarlinkTraceHooks;
+
 /*
  * Translate the error code into the error ID string
  */
 const char *varlink_error_string(long error);
 
+/*
+ * Memory allocation functions used for all objects, arrays, messages,
+ * connections and calls. Each function gets the userdata pointer of the
+ * allocator as its last argument.
+ */
+typedef struct {
+        void *(*malloc)(size_t size, void *userdata);
+        void *(*calloc)(size_t n, size_t size, void *userdata);
+        void *(*realloc)(void *ptr, size_t size, void *userdata);
+        void (*free)(void *ptr, void *userdata);
+        void *userdata;
+} VarlinkAllocator;
+
+/*
+ * Allocation counters of the calling thread, see
+ * varlink_set_allocation_counting().
+ */
+typedef struct {
+        uint64_t n_allocations;
+        uint64_t n_bytes;
+
+        /* Allocations made while parsing received messages. */
+        uint64_t n_messages_parsed;
+        uint64_t n_parse_allocations;
+
+        /* Allocations made while building and serializing replies. */
+        uint64_t n_replies;
+        uint64_t n_reply_allocations;
+} VarlinkAllocationStats;
+
+/*
+ * Route the allocations of the library through @allocator, or back to
+ * the libc functions if it is NULL. The allocator is global and must be
+ * set before any library object is created.
+ *
+ * Strings handed to the caller to be released with free(), e.g. by
+ * varlink_object_to_json(), are still allocated by libc.
+ *
+ * Returns 0 or a negative VARLINK_ERROR.
+ */
+long varlink_set_allocator(const VarlinkAllocator *allocator);
+
+/*
+ * Create the objects and arrays of the calling thread with @allocator,
+ * or with the global allocator again if it is NULL. This covers objects
+ * parsed from JSON, with all their nested values, and objects built for
+ * replies. A monotonic arena which is reset after a request completes
+ * releases all of them at once.
+ *
+ * Objects and arrays keep the allocator they were created with; it is
+ * used for all their values and to release them, from any thread, also
+ * after it was unset here. @allocator must outlive them. Other memory of
+ * the library, like that of connections, calls and message buffers,
+ * always comes from the global allocator.
+ *
+ * The previous allocator of the thread is returned in @previousp.
+ *
+ * Returns 0 or a negative VARLINK_ERROR.
+ */
+long varlink_set_thread_allocator(const VarlinkAllocator *allocator, const VarlinkAllocator **previousp);
+
+/*
+ * Enable or disable counting the allocations made by the calling
+ * thread. Enabling it resets the counters.
+ */
+void varlink_set_allocation_counting(bool enable);
+
+/*
+ * Get the allocation counters of the calling thread.
+ */
+void varlink_get_allocation_stats(VarlinkAllocationStats *stats);
+
+/*
+ * Install global hooks which are called when a span starts and ends, or
+ * remove them if @hooks is NULL.
+ */
+void varlink_set_trace_hooks(const VarlinkTraceHooks *hooks);
+
+/*
+ * Set the trace context for calls the calling thread makes outside of
+ * method handlers, as a traceparent value like
+ * "00-0af7651916cd43dd8448eb211c80319c-b7ad6b7169203331-01". NULL
+ * clears it.
+ *
+ * Returns 0 or a negative VARLINK_ERROR.
+ */
+long varlink_set_traceparent(const char *traceparent);
+
 /*
  * Create a new empty object.
  */
@@ -149,6 +324,26 @@ VarlinkObject *varlink_object_ref(VarlinkObject *object);
  */
 long varlink_object_to_json(VarlinkObject *object, char **stringp);
 
+/*
+ * Make @object and all objects and arrays nested in it immutable, for
+ * sharing them between threads. Setting values of a frozen object or
+ * array fails with VARLINK_ERROR_READ_ONLY, its references are counted
+ * atomically and it can be read, serialized, passed to replies and
+ * released from any thread.
+ *
+ * With VARLINK_FREEZE_CACHE_JSON, the JSON of @object is kept with it,
+ * replies and other objects which contain it copy these bytes instead
+ * of serializing it again.
+ *
+ * An object must be frozen before it is shared. Freezing a frozen
+ * object again does nothing; as it might be shared already, asking for
+ * the cache then fails with VARLINK_ERROR_READ_ONLY, unless it was
+ * created by the first freeze.
+ *
+ * Returns 0 or a negative VARLINK_ERROR.
+ */
+long varlink_object_freeze(VarlinkObject *object, uint64_t flags);
+
 /*
  * Retrieve an array of strings with the filed names of the object.
  */
@@ -284,6 +479,183 @@ long varlink_service_add_interface(VarlinkService *service,
                                    const char *interface_description,
                                    ...);
 
+/*
+ * Start collecting call counts, latencies and traffic statistics. Unless
+ * the service was created with varlink_service_new_raw(), they are also
+ * exposed to clients with the org.varlink.metrics interface.
+ *
+ * Returns 0 or a negative VARLINK_ERROR.
+ */
+long varlink_service_enable_metrics(VarlinkService *service);
+
+/*
+ * Get the current metrics of the service, in the format of the
+ * org.varlink.metrics.GetMetrics() reply.
+ *
+ * Returns 0 or a negative VARLINK_ERROR.
+ */
+long varlink_service_get_metrics(VarlinkService *service, VarlinkObject **metricsp);
+
+/*
+ * Call @callback whenever a method handler blocks the event loop for
+ * @threshold_usec microseconds or longer. Handlers run inline, so every
+ * other connection of the service waits for them. Pass a NULL
+ * @callback to stop watching.
+ *
+ * With metrics enabled, the handler run time and the slow calls are
+ * also counted per method.
+ *
+ * Returns 0 or a negative VARLINK_ERROR.
+ */
+long varlink_service_set_slow_call_callback(VarlinkService *service,
+                                            uint64_t threshold_usec,
+                                            VarlinkSlowCallFunc callback,
+                                            void *userdata);
+
+/*
+ * Keep the serialized replies of cached methods for up to @max_bytes,
+ * dropping the least recently used ones first. Pass 0 for a default
+ * size; calling it again resizes the cache.
+ *
+ * Returns 0 or a negative VARLINK_ERROR.
+ */
+long varlink_service_enable_cache(VarlinkService *service, unsigned long max_bytes);
+
+/*
+ * Answer calls of the fully-qualified @method from the cache for
+ * @ttl_usec microseconds after the handler replied, if they carry the
+ * same parameters and no flags. The method must be idempotent, its
+ * handler only runs when there is no fresh reply; a @ttl_usec of 0 stops
+ * caching it. Requires varlink_service_enable_cache().
+ *
+ * Returns 0 or a negative VARLINK_ERROR.
+ */
+long varlink_service_cache_method(VarlinkService *service, const char *method, uint64_t ttl_usec);
+
+/*
+ * Drop the cached reply for a call of @method with @parameters, all
+ * cached replies of @method if @parameters is NULL, or the whole cache
+ * if @method is NULL. Replies of calls which are still in progress are
+ * not stored.
+ *
+ * Returns 0 or a negative VARLINK_ERROR.
+ */
+long varlink_service_invalidate_cache(VarlinkService *service,
+                                      const char *method,
+                                      VarlinkObject *parameters);
+
+/*
+ * Let calls of the fully-qualified @method which carry the same
+ * parameters and no flags as a call already in progress wait for it,
+ * instead of running the handler again. Its reply is serialized once and
+ * sent to all of them. This only has an effect on handlers which reply
+ * asynchronously, and requires the method to be idempotent.
+ *
+ * Returns 0 or a negative VARLINK_ERROR.
+ */
+long varlink_service_coalesce_method(VarlinkService *service, const char *method, bool enable);
+
+/*
+ * Run the handler of the fully-qualified @method on a pool of worker
+ * threads, one for every CPU, instead of the thread running
+ * varlink_service_process_events(). Calls are still read and their
+ * replies written by the event loop; varlink_call_reply() and
+ * varlink_call_reply_error() made while the handler runs hand the reply
+ * over to it. Replies made after the handler returned need to come from
+ * the event loop again. Handlers of different calls run concurrently,
+ * and must only use thread-safe functions besides the reply ones; the
+ * references of the call are counted atomically. When the client closes
+ * the connection while the handler runs, the callback set with
+ * varlink_call_set_connection_closed_callback() is called by the event
+ * loop after the handler returned.
+ *
+ * Returns 0 or a negative VARLINK_ERROR.
+ */
+long varlink_service_offload_method(VarlinkService *service, const char *method, bool enable);
+
+/*
+ * Run the handler of the fully-qualified @method as a coroutine on its
+ * own stack, so it can wait for calls to other services with
+ * varlink_connection_await() without blocking the event loop. It
+ * continues in varlink_service_process_events() once the reply arrived.
+ * Offloaded methods do not run as coroutines.
+ *
+ * Returns 0 or a negative VARLINK_ERROR.
+ */
+long varlink_service_coroutine_method(VarlinkService *service, const char *method, bool enable);
+
+/*
+ * Register connections accepted from now on, and client connections
+ * attached from now on, edge-triggered for all events at once. Their
+ * readiness is tracked by the service until reading or writing runs into
+ * EAGAIN, which saves changing the epoll set whenever a connection starts
+ * or finishes a call. Connections still readable after their dispatch
+ * budget get another turn in the same varlink_service_process_events().
+ *
+ * Returns 0 or a negative VARLINK_ERROR.
+ */
+long varlink_service_set_edge_triggered(VarlinkService *service, bool enable);
+
+/*
+ * Accept connections from now on through an io_uring, which also
+ * receives and sends their messages: a multishot receive into buffers
+ * shared by all connections stays in flight, and replies are sent in
+ * batches when varlink_service_process_events() returns. The fd of the
+ * service becomes readable for completions like for epoll events. The
+ * service stays with epoll if the kernel lacks io_uring or multishot
+ * receives. Disabling it again only affects new connections.
+ *
+ * varlink_service_process_events() must always be called from the same
+ * thread.
+ *
+ * Returns 0 or a negative VARLINK_ERROR.
+ */
+long varlink_service_set_io_uring(VarlinkService *service, bool enable);
+
+/*
+ * Dispatch at most @n_messages messages of a connection in a row. A
+ * connection which has more waits until every other ready connection had
+ * its turn, so a single flooding client cannot starve the others. Pass 0
+ * to read every connection until it runs dry or waits for a reply.
+ *
+ * Returns 0 or a negative VARLINK_ERROR.
+ */
+long varlink_service_set_dispatch_budget(VarlinkService *service, unsigned long n_messages);
+
+/*
+ * Multiply the dispatch budget of connections from UNIX domain socket
+ * peers running as @uid by @weight. It applies to connections accepted
+ * afterwards; all others have a weight of 1.
+ *
+ * Returns 0 or a negative VARLINK_ERROR.
+ */
+long varlink_service_set_peer_weight(VarlinkService *service, uid_t uid, unsigned long weight);
+
+/*
+ * Limit the calls every connection of @service may make, or every UNIX
+ * domain socket peer with @limit->per_uid. Connections over the limit
+ * are not read until they are below it again, unless @limit->reject is
+ * set. Pass NULL to remove the limit.
+ *
+ * Returns 0 or a negative VARLINK_ERROR.
+ */
+long varlink_service_set_rate_limit(VarlinkService *service, const VarlinkRateLimit *limit);
+
+/*
+ * Get the file descriptors of all open connections of the service, in a
+ * newly-allocated array which has to be freed with free().
+ *
+ * Returns the number of connections or a negative VARLINK_ERROR.
+ */
+long varlink_service_get_connections(VarlinkService *service, int **fdsp);
+
+/*
+ * Get the counters of the service connection with file descriptor @fd.
+ *
+ * Returns 0 or a negative VARLINK_ERROR.
+ */
+long varlink_service_get_connection_stats(VarlinkService *service, int fd, VarlinkConnectionStats *stats);
+
 /*
  * Get the file descriptor to integrate with poll() into a mainloop; it becomes
  * readable whenever there is a connection which gets ready to receive or send
@@ -293,6 +665,25 @@ long varlink_service_add_interface(VarlinkService *service,
  */
 int varlink_service_get_fd(VarlinkService *service);
 
+/*
+ * Dispatch the events of the client @connection in
+ * varlink_service_process_events(), together with the service's own, so
+ * that a service which calls others needs no second event loop. The
+ * events it waits for are kept up to date by the calls made on it. A
+ * connection which is closed, also on an error, is detached; it still
+ * belongs to the caller.
+ *
+ * Returns 0 or a negative VARLINK_ERROR.
+ */
+long varlink_service_attach_connection(VarlinkService *service, VarlinkConnection *connection);
+
+/*
+ * Stop dispatching the events of an attached client @connection.
+ *
+ * Returns 0 or a negative VARLINK_ERROR.
+ */
+long varlink_service_detach_connection(VarlinkService *service, VarlinkConnection *connection);
+
 /*
  * Create a listen file descriptor for a varlink address and return it.
  * If the address is for a UNIX domain socket in the file system, it's
@@ -301,6 +692,34 @@ int varlink_service_get_fd(VarlinkService *service);
  */
 int varlink_listen(const char *address, char **pathp);
 
+/*
+ * Create @n_shards listen file descriptors for the same TCP address,
+ * with SO_REUSEPORT, and store them in @fds. A new connection goes to
+ * the listener with the position of the CPU which received it among
+ * the CPUs the process may run on, modulo @n_shards, which is the
+ * listener of the shard varlink_run_shards() pins to that CPU; a port
+ * of 0 picks a free port for all of them.
+ *
+ * Returns 0 or a negative VARLINK_ERROR.
+ */
+int varlink_listen_shards(const char *address, unsigned long n_shards, int *fds);
+
+/*
+ * Run @n_shards event loops on the TCP address, one thread per
+ * listener of varlink_listen_shards(), each pinned to one of the CPUs
+ * the process may run on. The threads call @func, which creates its
+ * own service and runs it until it is done; nothing is shared between
+ * them. A @n_shards of 0 starts one shard per CPU. If not all threads
+ * can be started, @func is not called at all.
+ *
+ * Returns when all shards returned, with the first negative result of
+ * @func, 0 or a negative VARLINK_ERROR.
+ */
+long varlink_run_shards(const char *address,
+                        unsigned long n_shards,
+                        VarlinkShardFunc func,
+                        void *userdata);
+
 /*
  * Process pending events; It needs to be called whenever the file descriptor
  * becomes readable. Messages are sent and received, method calls are dispatched
@@ -319,6 +738,25 @@ void varlink_call_unrefp(VarlinkCall **callp);
  */
 const char *varlink_call_get_method(VarlinkCall *call);
 
+/*
+ * Get the trace context of the service's span for @call, to pass on to
+ * work done outside of the method handler. Calls made from within the
+ * handler get it automatically.
+ *
+ * Returns the traceparent value, or NULL if the call is not traced.
+ */
+const char *varlink_call_get_traceparent(VarlinkCall *call);
+
+/*
+ * Advertise in the final reply to @call that the client may cache it
+ * for @ttl_usec microseconds. The reply carries it in a "ttl" field,
+ * a libvarlink extension of the varlink protocol; clients which do not
+ * cache, or know nothing about it, ignore it.
+ *
+ * Returns 0 or a negative VARLINK_ERROR.
+ */
+long varlink_call_set_cache_ttl(VarlinkCall *call, uint64_t ttl_usec);
+
 /*
  * Sets a function which is called when the client closes the connection.
  *
@@ -413,6 +851,13 @@ long varlink_connection_process_events(VarlinkConnection *connection, uint32_t e
 
 uint32_t varlink_connection_get_events(VarlinkConnection *connection);
 
+/*
+ * Get the counters of a client connection.
+ *
+ * Returns 0 or a negative VARLINK_ERROR.
+ */
+long varlink_connection_get_stats(VarlinkConnection *connection, VarlinkConnectionStats *stats);
+
 /*
  * Call the specified method with the given argument. The reply will execute
  * the given callback.
@@ -426,6 +871,58 @@ long varlink_connection_call(VarlinkConnection *connection,
                              VarlinkReplyFunc callback,
                              void *userdata);
 
+/*
+ * Call the specified method and wait for its reply, from a handler of a
+ * method which runs as coroutine. The handler is suspended meanwhile and
+ * the service dispatches other calls; @connection still needs to be
+ * processed by whoever runs its event loop.
+ *
+ * On success, @errorp is set to the error of the reply or NULL, and
+ * @parametersp to its parameters; the caller owns both and frees the
+ * error with free().
+ *
+ * Returns 0 or a negative VARLINK_ERROR, VARLINK_ERROR_INVALID_CALL
+ * outside of a coroutine.
+ */
+long varlink_connection_await(VarlinkConnection *connection,
+                              const char *qualified_method,
+                              VarlinkObject *parameters,
+                              char **errorp,
+                              VarlinkObject **parametersp);
+
+/*
+ * Keep up to @max_entries replies to calls without flags, for as long as
+ * the service advertised in the reply. Pass 0 for a default size.
+ *
+ * Calls which have a cached reply do not go to the service; @callback
+ * is called with the cached parameters before varlink_connection_call()
+ * returns, and must not modify them. For @stale_usec after a reply
+ * expired, it is still returned while a single call in the background
+ * refreshes it.
+ *
+ * Returns 0 or a negative VARLINK_ERROR.
+ */
+long varlink_connection_enable_cache(VarlinkConnection *connection,
+                                     unsigned long max_entries,
+                                     uint64_t stale_usec);
+
+/*
+ * Drop the cached replies of the fully-qualified @method, or all cached
+ * replies if @method is NULL.
+ *
+ * Returns 0 or a negative VARLINK_ERROR.
+ */
+long varlink_connection_invalidate_cache(VarlinkConnection *connection, const char *method);
+
+/*
+ * Stop calling back for the calls made with @userdata which still wait
+ * for replies, for callers whose @userdata goes away first. The replies
+ * are still received, and dropped.
+ *
+ * Returns 0 or a negative VARLINK_ERROR.
+ */
+long varlink_connection_forget_calls(VarlinkConnection *connection, void *userdata);
+
 /*
  * Closes @connection.
  */
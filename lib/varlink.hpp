@@ -0,0 +1,1032 @@
+// SPDX-License-Identifier: Apache-2.0
+
+#pragma once
+
+/*
+ * C++17 binding of varlink.h, in this header only.
+ *
+ * The classes hold nothing but the pointer of the C object and call the C
+ * functions inline: Object, Array, Connection and Service own their
+ * object and are move-only, ObjectView, ArrayView and Call borrow one.
+ * Strings are returned as std::string_view into the object which holds
+ * them. Errors are thrown as varlink::Error.
+ *
+ * With C++20, handlers and callers can be coroutines which co_await
+ * replies; see Task below.
+ *
+ * Objects can be allocated from a std::pmr::memory_resource, like a
+ * per-request arena; see AllocatorScope below.
+ */
+
+#include "varlink.h"
+
+#include <cstddef>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <memory>
+#include <optional>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+#if __has_include(<memory_resource>)
+#include <memory_resource>
+#define VARLINK_HPP_MEMORY_RESOURCE 1
+#endif
+
+#if __cplusplus >= 202002L && __has_include(<coroutine>)
+#include <coroutine>
+#include <sys/socket.h>
+#define VARLINK_HPP_COROUTINES 1
+#endif
+
+namespace varlink {
+
+class Error : public std::runtime_error {
+public:
+        explicit Error(long error) : std::runtime_error(varlink_error_string(error)), error_(error) {}
+
+        /* The positive VARLINK_ERROR. */
+        long code() const noexcept { return error_; }
+
+private:
+        long error_;
+};
+
+class ObjectView;
+class Object;
+class ArrayView;
+class Array;
+class Connection;
+
+#ifdef VARLINK_HPP_COROUTINES
+class CallAwaiter;
+class ReplyStream;
+#endif
+
+namespace detail {
+
+inline long check(long r) {
+        if (r < 0)
+                throw Error(-r);
+
+        return r;
+}
+
+template<typename T>
+struct dependent_false : std::false_type {};
+
+struct Free {
+        void operator()(void *p) const noexcept { std::free(p); }
+};
+
+/* A NUL-terminated copy, only for a std::string_view which is not one already. */
+template<typename T>
+decltype(auto) c_str(const T &s) {
+        if constexpr (std::is_convertible_v<const T &, const char *>)
+                return static_cast<const char *>(s);
+        else if constexpr (std::is_same_v<T, std::string>)
+                return s.c_str();
+        else
+                return std::string(s);
+}
+
+inline const char *as_c_str(const char *s) { return s; }
+inline const char *as_c_str(const std::string &s) { return s.c_str(); }
+
+} // namespace detail
+
+/*
+ * A borrowed VarlinkObject, like the parameters of a call or a nested
+ * object. It must not outlive the object which owns it.
+ *
+ * get<T>() takes bool, int64_t, double, std::string_view, ObjectView or
+ * ArrayView; the kind of the field is checked by the C library.
+ */
+class ObjectView {
+public:
+        ObjectView() noexcept = default;
+        explicit ObjectView(VarlinkObject *object) noexcept : object_(object) {}
+
+        VarlinkObject *get() const noexcept { return object_; }
+        explicit operator bool() const noexcept { return object_ != nullptr; }
+
+        template<typename T>
+        T get(const char *field) const {
+                T value{};
+
+                detail::check(get_value(field, &value));
+
+                return value;
+        }
+
+        /* Like get(), but returns nothing for a field which is not set. */
+        template<typename T>
+        std::optional<T> find(const char *field) const {
+                T value{};
+                long r = get_value(field, &value);
+
+                if (r == -VARLINK_ERROR_UNKNOWN_FIELD)
+                        return std::nullopt;
+
+                detail::check(r);
+
+                return value;
+        }
+
+        /* Sets bool, integer, floating point, string, object or array values, or nullptr to clear one. */
+        template<typename T>
+        void set(const char *field, const T &value) const;
+
+        /* Makes the object immutable and shareable between threads, see varlink_object_freeze(). */
+        void freeze(uint64_t flags = 0) const {
+                detail::check(varlink_object_freeze(object_, flags));
+        }
+
+        std::vector<std::string_view> field_names() const {
+                std::unique_ptr<const char *[], detail::Free> names;
+                std::vector<std::string_view> result;
+                const char **p;
+
+                detail::check(varlink_object_get_field_names(object_, &p));
+                names.reset(p);
+
+                for (const char **name = p; *name; name += 1)
+                        result.emplace_back(*name);
+
+                return result;
+        }
+
+        std::string to_json() const {
+                std::unique_ptr<char, detail::Free> json;
+                char *p;
+                long length;
+
+                length = detail::check(varlink_object_to_json(object_, &p));
+                json.reset(p);
+
+                return std::string(p, length);
+        }
+
+protected:
+        VarlinkObject *object_ = nullptr;
+
+private:
+        template<typename T>
+        long get_value(const char *field, T *value) const;
+};
+
+/*
+ * A borrowed VarlinkArray. get<T>() and append() take the same types
+ * as the ones of ObjectView.
+ */
+class ArrayView {
+public:
+        ArrayView() noexcept = default;
+        explicit ArrayView(VarlinkArray *array) noexcept : array_(array) {}
+
+        VarlinkArray *get() const noexcept { return array_; }
+        explicit operator bool() const noexcept { return array_ != nullptr; }
+
+        unsigned long size() const noexcept { return varlink_array_get_n_elements(array_); }
+
+        template<typename T>
+        T get(unsigned long index) const;
+
+        template<typename T>
+        void append(const T &value) const;
+
+protected:
+        VarlinkArray *array_ = nullptr;
+};
+
+/* An owned reference to a VarlinkObject. */
+class Object : public ObjectView {
+public:
+        /* A new, empty object. */
+        Object() {
+                detail::check(varlink_object_new(&object_));
+        }
+
+        explicit Object(const char *json) {
+                detail::check(varlink_object_new_from_json(&object_, json));
+        }
+
+        explicit Object(const std::string &json) : Object(json.c_str()) {}
+
+        Object(Object &&other) noexcept : ObjectView(std::exchange(other.object_, nullptr)) {}
+
+        Object &operator=(Object &&other) noexcept {
+                std::swap(object_, other.object_);
+                return *this;
+        }
+
+        Object(const Object &) = delete;
+        Object &operator=(const Object &) = delete;
+
+        ~Object() {
+                if (object_)
+                        varlink_object_unref(object_);
+        }
+
+        /* Takes over the reference the caller owns. */
+        static Object adopt(VarlinkObject *object) noexcept { return Object(object); }
+
+        /* Takes a new reference of a borrowed object. */
+        static Object ref(ObjectView view) noexcept {
+                return Object(view.get() ? varlink_object_ref(view.get()) : nullptr);
+        }
+
+        /* Gives up the reference, to pass it on to a C function which takes it. */
+        VarlinkObject *release() noexcept { return std::exchange(object_, nullptr); }
+
+private:
+        explicit Object(VarlinkObject *object) noexcept : ObjectView(object) {}
+};
+
+/* An owned reference to a VarlinkArray. */
+class Array : public ArrayView {
+public:
+        Array() {
+                detail::check(varlink_array_new(&array_));
+        }
+
+        Array(Array &&other) noexcept : ArrayView(std::exchange(other.array_, nullptr)) {}
+
+        Array &operator=(Array &&other) noexcept {
+                std::swap(array_, other.array_);
+                return *this;
+        }
+
+        Array(const Array &) = delete;
+        Array &operator=(const Array &) = delete;
+
+        ~Array() {
+                if (array_)
+                        varlink_array_unref(array_);
+        }
+
+        static Array adopt(VarlinkArray *array) noexcept { return Array(array); }
+        static Array ref(ArrayView view) noexcept { return Array(varlink_array_ref(view.get())); }
+
+        VarlinkArray *release() noexcept { return std::exchange(array_, nullptr); }
+
+private:
+        explicit Array(VarlinkArray *array) noexcept : ArrayView(array) {}
+};
+
+#ifdef VARLINK_HPP_MEMORY_RESOURCE
+/*
+ * A VarlinkAllocator on top of a std::pmr::memory_resource. The objects
+ * allocated from it point to it, it must outlive them and cannot move.
+ */
+class MemoryResource {
+public:
+        explicit MemoryResource(std::pmr::memory_resource *resource) noexcept :
+                allocator_{ allocate, allocate_zeroed, reallocate, deallocate, resource } {}
+
+        MemoryResource(const MemoryResource &) = delete;
+        MemoryResource &operator=(const MemoryResource &) = delete;
+
+        const VarlinkAllocator *get() const noexcept { return &allocator_; }
+
+private:
+        VarlinkAllocator allocator_;
+
+        /* The C functions do not pass the size to free(), each block starts with it. */
+        struct alignas(std::max_align_t) Header {
+                size_t size;
+        };
+
+        static Header *header(void *ptr) noexcept { return static_cast<Header *>(ptr) - 1; }
+
+        static void *allocate(size_t size, void *userdata) noexcept {
+                auto resource = static_cast<std::pmr::memory_resource *>(userdata);
+
+                try {
+                        auto h = static_cast<Header *>(resource->allocate(sizeof(Header) + size, alignof(Header)));
+
+                        h->size = size;
+                        return h + 1;
+                } catch (...) {
+                        return nullptr;
+                }
+        }
+
+        static void *allocate_zeroed(size_t n, size_t size, void *userdata) noexcept {
+                void *ptr;
+
+                if (size != 0 && n > SIZE_MAX / size)
+                        return nullptr;
+
+                ptr = allocate(n * size, userdata);
+                if (ptr)
+                        std::memset(ptr, 0, n * size);
+
+                return ptr;
+        }
+
+        static void deallocate(void *ptr, void *userdata) noexcept {
+                auto resource = static_cast<std::pmr::memory_resource *>(userdata);
+
+                if (ptr)
+                        resource->deallocate(header(ptr), sizeof(Header) + header(ptr)->size, alignof(Header));
+        }
+
+        static void *reallocate(void *ptr, size_t size, void *userdata) noexcept {
+                void *p;
+
+                if (ptr && header(ptr)->size >= size)
+                        return ptr;
+
+                p = allocate(size, userdata);
+                if (p && ptr) {
+                        std::memcpy(p, ptr, header(ptr)->size);
+                        deallocate(ptr, userdata);
+                }
+
+                return p;
+        }
+};
+
+/*
+ * While it exists, the objects and arrays the thread creates, parsed
+ * ones included, are allocated from @resource; see
+ * varlink_set_thread_allocator(). With a monotonic arena, a request is
+ * released by resetting it:
+ *
+ *   std::pmr::monotonic_buffer_resource arena;
+ *   varlink::MemoryResource resource(&arena);
+ *
+ *   {
+ *           varlink::AllocatorScope scope(resource);
+ *           service.process_events();
+ *   }
+ *   arena.release();
+ *
+ * This holds only if every call dispatched inside the scope was replied
+ * to and no object of it was kept: calls which reply later, stream with
+ * "more", are offloaded or run as coroutines still use their parameters,
+ * and a client connection's reply cache keeps the replies.
+ */
+class AllocatorScope {
+public:
+        explicit AllocatorScope(const MemoryResource &resource) {
+                detail::check(varlink_set_thread_allocator(resource.get(), &previous_));
+        }
+
+        AllocatorScope(const AllocatorScope &) = delete;
+        AllocatorScope &operator=(const AllocatorScope &) = delete;
+
+        ~AllocatorScope() {
+                varlink_set_thread_allocator(previous_, nullptr);
+        }
+
+private:
+        const VarlinkAllocator *previous_ = nullptr;
+};
+#endif
+
+template<typename T>
+long ObjectView::get_value(const char *field, T *value) const {
+        if constexpr (std::is_same_v<T, bool>)
+                return varlink_object_get_bool(object_, field, value);
+        else if constexpr (std::is_same_v<T, int64_t>)
+                return varlink_object_get_int(object_, field, value);
+        else if constexpr (std::is_same_v<T, double>)
+                return varlink_object_get_float(object_, field, value);
+        else if constexpr (std::is_same_v<T, std::string_view>) {
+                const char *string;
+                long r = varlink_object_get_string(object_, field, &string);
+
+                if (r >= 0)
+                        *value = string;
+
+                return r;
+        } else if constexpr (std::is_same_v<T, ObjectView>) {
+                VarlinkObject *nested;
+                long r = varlink_object_get_object(object_, field, &nested);
+
+                if (r >= 0)
+                        *value = ObjectView(nested);
+
+                return r;
+        } else if constexpr (std::is_same_v<T, ArrayView>) {
+                VarlinkArray *array;
+                long r = varlink_object_get_array(object_, field, &array);
+
+                if (r >= 0)
+                        *value = ArrayView(array);
+
+                return r;
+        } else
+                static_assert(detail::dependent_false<T>::value,
+                              "a field is a bool, int64_t, double, std::string_view, ObjectView or ArrayView");
+}
+
+template<typename T>
+void ObjectView::set(const char *field, const T &value) const {
+        long r;
+
+        if constexpr (std::is_same_v<T, std::nullptr_t>)
+                r = varlink_object_set_null(object_, field);
+        else if constexpr (std::is_same_v<T, bool>)
+                r = varlink_object_set_bool(object_, field, value);
+        else if constexpr (std::is_integral_v<T>)
+                r = varlink_object_set_int(object_, field, value);
+        else if constexpr (std::is_floating_point_v<T>)
+                r = varlink_object_set_float(object_, field, value);
+        else if constexpr (std::is_convertible_v<const T &, std::string_view>) {
+                decltype(auto) string = detail::c_str(value);
+                r = varlink_object_set_string(object_, field, detail::as_c_str(string));
+        } else if constexpr (std::is_base_of_v<ObjectView, T>)
+                r = varlink_object_set_object(object_, field, value.get());
+        else if constexpr (std::is_base_of_v<ArrayView, T>)
+                r = varlink_object_set_array(object_, field, value.get());
+        else
+                static_assert(detail::dependent_false<T>::value, "no varlink type for this value");
+
+        detail::check(r);
+}
+
+template<typename T>
+T ArrayView::get(unsigned long index) const {
+        T value{};
+
+        if constexpr (std::is_same_v<T, bool>)
+                detail::check(varlink_array_get_bool(array_, index, &value));
+        else if constexpr (std::is_same_v<T, int64_t>)
+                detail::check(varlink_array_get_int(array_, index, &value));
+        else if constexpr (std::is_same_v<T, double>)
+                detail::check(varlink_array_get_float(array_, index, &value));
+        else if constexpr (std::is_same_v<T, std::string_view>) {
+                const char *string;
+
+                detail::check(varlink_array_get_string(array_, index, &string));
+                value = string;
+        } else if constexpr (std::is_same_v<T, ObjectView>) {
+                VarlinkObject *object;
+
+                detail::check(varlink_array_get_object(array_, index, &object));
+                value = ObjectView(object);
+        } else if constexpr (std::is_same_v<T, ArrayView>) {
+                VarlinkArray *element;
+
+                detail::check(varlink_array_get_array(array_, index, &element));
+                value = ArrayView(element);
+        } else
+                static_assert(detail::dependent_false<T>::value,
+                              "an element is a bool, int64_t, double, std::string_view, ObjectView or ArrayView");
+
+        return value;
+}
+
+template<typename T>
+void ArrayView::append(const T &value) const {
+        long r;
+
+        if constexpr (std::is_same_v<T, std::nullptr_t>)
+                r = varlink_array_append_null(array_);
+        else if constexpr (std::is_same_v<T, bool>)
+                r = varlink_array_append_bool(array_, value);
+        else if constexpr (std::is_integral_v<T>)
+                r = varlink_array_append_int(array_, value);
+        else if constexpr (std::is_floating_point_v<T>)
+                r = varlink_array_append_float(array_, value);
+        else if constexpr (std::is_convertible_v<const T &, std::string_view>) {
+                decltype(auto) string = detail::c_str(value);
+                r = varlink_array_append_string(array_, detail::as_c_str(string));
+        } else if constexpr (std::is_base_of_v<ObjectView, T>)
+                r = varlink_array_append_object(array_, value.get());
+        else if constexpr (std::is_base_of_v<ArrayView, T>)
+                r = varlink_array_append_array(array_, value.get());
+        else
+                static_assert(detail::dependent_false<T>::value, "no varlink type for this value");
+
+        detail::check(r);
+}
+
+/* An incoming method call, borrowed for the time of the handler; Call::ref() keeps it. */
+class Call {
+public:
+        explicit Call(VarlinkCall *call) noexcept : call_(call) {}
+
+        VarlinkCall *get() const noexcept { return call_; }
+
+        std::string_view method() const noexcept { return varlink_call_get_method(call_); }
+        int connection_fd() const noexcept { return varlink_call_get_connection_fd(call_); }
+
+        void reply(ObjectView parameters = {}, uint64_t flags = 0) const {
+                detail::check(varlink_call_reply(call_, parameters.get(), flags));
+        }
+
+        void reply_error(const char *error, ObjectView parameters = {}) const {
+                detail::check(varlink_call_reply_error(call_, error, parameters.get()));
+        }
+
+        void reply_invalid_parameter(const char *parameter) const {
+                detail::check(varlink_call_reply_invalid_parameter(call_, parameter));
+        }
+
+        /* A reference to answer the call after the handler returned; release with varlink_call_unref(). */
+        VarlinkCall *ref() const noexcept { return varlink_call_ref(call_); }
+
+protected:
+        VarlinkCall *call_;
+};
+
+/* An owned reference to a call, to answer it after the handler returned. */
+class CallRef : public Call {
+public:
+        explicit CallRef(Call call) noexcept : Call(varlink_call_ref(call.get())) {}
+
+        CallRef(CallRef &&other) noexcept : Call(std::exchange(other.call_, nullptr)) {}
+
+        CallRef &operator=(CallRef &&other) noexcept {
+                std::swap(call_, other.call_);
+                return *this;
+        }
+
+        CallRef(const CallRef &) = delete;
+        CallRef &operator=(const CallRef &) = delete;
+
+        ~CallRef() {
+                if (call_)
+                        varlink_call_unref(call_);
+        }
+};
+
+namespace detail {
+
+template<typename F, typename... Args>
+long invoke(F &&f, Args &&...args) noexcept {
+        try {
+                if constexpr (std::is_void_v<std::invoke_result_t<F, Args...>>) {
+                        std::forward<F>(f)(std::forward<Args>(args)...);
+                        return 0;
+                } else
+                        return std::forward<F>(f)(std::forward<Args>(args)...);
+        } catch (const Error &e) {
+                return -e.code();
+        } catch (...) {
+                return -VARLINK_ERROR_PANIC;
+        }
+}
+
+template<auto Handler>
+long method_callback(VarlinkService *, VarlinkCall *call, VarlinkObject *parameters, uint64_t flags, void *userdata) {
+        return invoke(Handler, Call(call), ObjectView(parameters), flags, userdata);
+}
+
+template<typename F>
+long reply_callback(VarlinkConnection *,
+                    const char *error,
+                    VarlinkObject *parameters,
+                    uint64_t flags,
+                    void *userdata) {
+        return invoke(*static_cast<F *>(userdata), error, ObjectView(parameters), flags);
+}
+
+} // namespace detail
+
+/*
+ * The VarlinkMethodCallback of a handler, to pass to
+ * Service::add_interface():
+ *
+ *   long Handler(varlink::Call call, varlink::ObjectView parameters, uint64_t flags, void *userdata);
+ *
+ * It may also return void. A thrown varlink::Error is returned as its
+ * negative VARLINK_ERROR, anything else as VARLINK_ERROR_PANIC.
+ */
+template<auto Handler>
+inline constexpr VarlinkMethodCallback method = &detail::method_callback<Handler>;
+
+class Service {
+public:
+        Service(const char *vendor,
+                const char *product,
+                const char *version,
+                const char *url,
+                const char *address,
+                int listen_fd = -1) {
+                detail::check(varlink_service_new(&service_, vendor, product, version, url, address, listen_fd));
+        }
+
+        Service(Service &&other) noexcept : service_(std::exchange(other.service_, nullptr)) {}
+
+        Service &operator=(Service &&other) noexcept {
+                std::swap(service_, other.service_);
+                return *this;
+        }
+
+        Service(const Service &) = delete;
+        Service &operator=(const Service &) = delete;
+
+        ~Service() {
+                if (service_)
+                        varlink_service_free(service_);
+        }
+
+        VarlinkService *get() const noexcept { return service_; }
+
+        /*
+         * Takes triples of a method name, its VarlinkMethodCallback and
+         * userdata, like varlink_service_add_interface():
+         *
+         *   service.add_interface(description, "Ping", varlink::method<ping>, &state);
+         */
+        template<typename... Methods>
+        void add_interface(const char *description, Methods... methods) {
+                static_assert(sizeof...(Methods) % 3 == 0, "methods are passed as name, callback, userdata");
+
+                detail::check(varlink_service_add_interface(service_, description, methods..., nullptr));
+        }
+
+        int fd() const noexcept { return varlink_service_get_fd(service_); }
+
+        void process_events() const {
+                detail::check(varlink_service_process_events(service_));
+        }
+
+        /* Dispatches the events of @connection with the ones of the service. */
+        void attach(const Connection &connection) const;
+        void detach(const Connection &connection) const;
+
+private:
+        VarlinkService *service_ = nullptr;
+};
+
+/* The reply of Connection::await(). */
+struct Reply {
+        std::unique_ptr<char, detail::Free> error;
+        std::optional<Object> parameters;
+};
+
+class Connection {
+public:
+        explicit Connection(const char *address) {
+                detail::check(varlink_connection_new(&connection_, address));
+        }
+
+        Connection(Connection &&other) noexcept : connection_(std::exchange(other.connection_, nullptr)) {}
+
+        Connection &operator=(Connection &&other) noexcept {
+                std::swap(connection_, other.connection_);
+                return *this;
+        }
+
+        Connection(const Connection &) = delete;
+        Connection &operator=(const Connection &) = delete;
+
+        ~Connection() {
+                if (connection_)
+                        varlink_connection_free(connection_);
+        }
+
+        VarlinkConnection *get() const noexcept { return connection_; }
+
+        int fd() const noexcept { return varlink_connection_get_fd(connection_); }
+        uint32_t events() const noexcept { return varlink_connection_get_events(connection_); }
+        bool is_closed() const noexcept { return varlink_connection_is_closed(connection_); }
+
+        void process_events(uint32_t events) const {
+                detail::check(varlink_connection_process_events(connection_, events));
+        }
+
+        void close() const {
+                detail::check(varlink_connection_close(connection_));
+        }
+
+        /*
+         * Calls @method; @callback is called with each reply as
+         *
+         *   callback(const char *error, varlink::ObjectView parameters, uint64_t flags)
+         *
+         * and is not copied: it must stay alive until the last reply
+         * arrived or the connection is freed.
+         */
+        template<typename F>
+        void call(const char *method, ObjectView parameters, uint64_t flags, F &callback) const {
+                detail::check(varlink_connection_call(connection_, method, parameters.get(), flags,
+                                                      detail::reply_callback<F>, &callback));
+        }
+
+        /* From a handler which runs as a coroutine, see varlink_connection_await(). */
+        Reply await(const char *method, ObjectView parameters = {}) const {
+                Reply reply;
+                char *error;
+                VarlinkObject *out;
+
+                detail::check(varlink_connection_await(connection_, method, parameters.get(), &error, &out));
+                reply.error.reset(error);
+                if (out)
+                        reply.parameters = Object::adopt(out);
+
+                return reply;
+        }
+
+#ifdef VARLINK_HPP_COROUTINES
+        /* co_await the reply; see CallAwaiter. */
+        CallAwaiter call(const char *method, ObjectView parameters = {}) const;
+
+        /* The replies of a "more" call; see ReplyStream. */
+        ReplyStream stream(const char *method, ObjectView parameters = {}) const;
+#endif
+
+private:
+        VarlinkConnection *connection_ = nullptr;
+};
+
+inline void Service::attach(const Connection &connection) const {
+        detail::check(varlink_service_attach_connection(service_, connection.get()));
+}
+
+inline void Service::detach(const Connection &connection) const {
+        detail::check(varlink_service_detach_connection(service_, connection.get()));
+}
+
+#ifdef VARLINK_HPP_COROUTINES
+
+/*
+ * An error reply, thrown when a coroutine resumes from a call which
+ * failed. what() is the error name.
+ */
+class ReplyError : public std::runtime_error {
+public:
+        ReplyError(const std::string &error, VarlinkObject *parameters) :
+                std::runtime_error(error),
+                parameters_(parameters ? varlink_object_ref(parameters) : nullptr) {}
+
+        ReplyError(const ReplyError &other) noexcept :
+                std::runtime_error(other),
+                parameters_(other.parameters_ ? varlink_object_ref(other.parameters_) : nullptr) {}
+
+        ReplyError &operator=(const ReplyError &) = delete;
+
+        ~ReplyError() override {
+                if (parameters_)
+                        varlink_object_unref(parameters_);
+        }
+
+        ObjectView parameters() const noexcept { return ObjectView(parameters_); }
+
+private:
+        VarlinkObject *parameters_;
+};
+
+/*
+ * Returned by Connection::call(), to co_await the reply of a call:
+ *
+ *   varlink::Object out = co_await connection.call("org.example.Get", parameters);
+ *
+ * The coroutine is resumed from within varlink_connection_process_events()
+ * of whoever runs the connection's event loop, e.g. a service it is
+ * attached to. The awaiter lives in the coroutine frame; nothing else is
+ * allocated, except for the name of an error reply. If the connection
+ * closes before the reply, the coroutine is not resumed.
+ */
+class CallAwaiter {
+public:
+        CallAwaiter(VarlinkConnection *connection, const char *method, ObjectView parameters) noexcept :
+                connection_(connection), method_(method), parameters_(parameters.get()) {}
+
+        CallAwaiter(const CallAwaiter &) = delete;
+        CallAwaiter &operator=(const CallAwaiter &) = delete;
+
+        ~CallAwaiter() {
+                if (suspended_)
+                        varlink_connection_forget_calls(connection_, this);
+
+                if (reply_)
+                        varlink_object_unref(reply_);
+        }
+
+        bool await_ready() const noexcept { return false; }
+
+        bool await_suspend(std::coroutine_handle<> handle) noexcept {
+                long r;
+
+                handle_ = handle;
+
+                /* A cached reply arrives before the call returns, the coroutine goes on right away. */
+                r = varlink_connection_call(connection_, method_, parameters_, 0, reply_callback, this);
+                if (r < 0) {
+                        result_ = r;
+                        return false;
+                }
+
+                suspended_ = !done_;
+
+                return suspended_;
+        }
+
+        Object await_resume() {
+                detail::check(result_);
+
+                if (!error_.empty())
+                        throw ReplyError(error_, reply_);
+
+                return Object::adopt(std::exchange(reply_, nullptr));
+        }
+
+private:
+        static long reply_callback(VarlinkConnection *,
+                                   const char *error,
+                                   VarlinkObject *parameters,
+                                   uint64_t,
+                                   void *userdata) {
+                CallAwaiter *awaiter = static_cast<CallAwaiter *>(userdata);
+
+                awaiter->done_ = true;
+                if (error)
+                        awaiter->error_ = error;
+                if (parameters)
+                        awaiter->reply_ = varlink_object_ref(parameters);
+
+                /* The coroutine may finish and free the awaiter, it is not touched afterwards. */
+                if (awaiter->suspended_) {
+                        awaiter->suspended_ = false;
+                        awaiter->handle_.resume();
+                }
+
+                return 0;
+        }
+
+        VarlinkConnection *connection_;
+        const char *method_;
+        VarlinkObject *parameters_;
+
+        std::coroutine_handle<> handle_;
+        bool suspended_ = false;
+        bool done_ = false;
+        long result_ = 0;
+        std::string error_;
+        VarlinkObject *reply_ = nullptr;
+};
+
+/*
+ * The replies of a call with VARLINK_CALL_MORE, as an asynchronous
+ * generator:
+ *
+ *   varlink::ReplyStream stream = connection.stream("org.example.List", parameters);
+ *
+ *   while (std::optional<varlink::Object> reply = co_await stream.next())
+ *           ...
+ *
+ * next() ends with std::nullopt after the last reply, or throws
+ * ReplyError. Replies which arrive while the coroutine does something
+ * else are queued. The stream must not outlive the connection.
+ */
+class ReplyStream {
+public:
+        ReplyStream(VarlinkConnection *connection, const char *method, ObjectView parameters) :
+                connection_(connection) {
+                detail::check(varlink_connection_call(connection_, method, parameters.get(), VARLINK_CALL_MORE,
+                                                      reply_callback, this));
+                pending_ = true;
+        }
+
+        ReplyStream(const ReplyStream &) = delete;
+        ReplyStream &operator=(const ReplyStream &) = delete;
+
+        ~ReplyStream() {
+                if (pending_)
+                        varlink_connection_forget_calls(connection_, this);
+
+                for (size_t i = head_; i < queue_.size(); i += 1)
+                        varlink_object_unref(queue_[i]);
+        }
+
+        class NextAwaiter {
+        public:
+                explicit NextAwaiter(ReplyStream *stream) noexcept : stream_(stream) {}
+
+                bool await_ready() const noexcept { return stream_->head_ < stream_->queue_.size() || !stream_->pending_; }
+                void await_suspend(std::coroutine_handle<> handle) noexcept { stream_->waiter_ = handle; }
+                std::optional<Object> await_resume() { return stream_->pop(); }
+
+        private:
+                ReplyStream *stream_;
+        };
+
+        NextAwaiter next() noexcept { return NextAwaiter(this); }
+
+private:
+        static long reply_callback(VarlinkConnection *,
+                                   const char *error,
+                                   VarlinkObject *parameters,
+                                   uint64_t flags,
+                                   void *userdata) {
+                ReplyStream *stream = static_cast<ReplyStream *>(userdata);
+
+                if (error) {
+                        stream->error_ = error;
+                        stream->error_parameters_ = Object::ref(ObjectView(parameters));
+                } else
+                        stream->queue_.push_back(parameters ? varlink_object_ref(parameters) : nullptr);
+
+                if (!(flags & VARLINK_REPLY_CONTINUES))
+                        stream->pending_ = false;
+
+                if (stream->waiter_)
+                        std::exchange(stream->waiter_, nullptr).resume();
+
+                return 0;
+        }
+
+        std::optional<Object> pop() {
+                if (head_ < queue_.size()) {
+                        Object reply = Object::adopt(queue_[head_]);
+
+                        head_ += 1;
+                        if (head_ == queue_.size()) {
+                                queue_.clear();
+                                head_ = 0;
+                        }
+
+                        return reply;
+                }
+
+                if (!error_.empty())
+                        throw ReplyError(error_, error_parameters_ ? error_parameters_->get() : nullptr);
+
+                return std::nullopt;
+        }
+
+        VarlinkConnection *connection_;
+        bool pending_ = false;
+        std::coroutine_handle<> waiter_;
+
+        std::vector<VarlinkObject *> queue_;
+        size_t head_ = 0;
+
+        std::string error_;
+        std::optional<Object> error_parameters_;
+};
+
+inline CallAwaiter Connection::call(const char *method, ObjectView parameters) const {
+        return CallAwaiter(connection_, method, parameters);
+}
+
+inline ReplyStream Connection::stream(const char *method, ObjectView parameters) const {
+        return ReplyStream(connection_, method, parameters);
+}
+
+/*
+ * The return type of a coroutine which runs on its own: it starts
+ * right away, runs until its first co_await, and frees itself when it
+ * is done. Nobody waits for it.
+ *
+ * As a method handler, passed with varlink::task_method<Handler>:
+ *
+ *   varlink::Task Handler(varlink::CallRef call, varlink::Object parameters, uint64_t flags, void *userdata);
+ *
+ * it keeps the call and its parameters until it replies. An exception
+ * which leaves it closes the connection of the call, like a negative
+ * result of a C handler; for any other task, it terminates the program.
+ */
+class Task {
+public:
+        struct promise_type {
+                VarlinkCall *call = nullptr;
+
+                promise_type() noexcept = default;
+
+                template<typename... Args>
+                explicit promise_type(const Call &c, const Args &...) noexcept : call(c.get()) {}
+
+                Task get_return_object() noexcept { return {}; }
+                std::suspend_never initial_suspend() noexcept { return {}; }
+                std::suspend_never final_suspend() noexcept { return {}; }
+                void return_void() noexcept {}
+
+                void unhandled_exception() noexcept {
+                        if (!call)
+                                std::terminate();
+
+                        shutdown(varlink_call_get_connection_fd(call), SHUT_RDWR);
+                }
+        };
+};
+
+namespace detail {
+
+template<auto Handler>
+long task_method_callback(VarlinkService *, VarlinkCall *call, VarlinkObject *parameters, uint64_t flags, void *userdata) {
+        Handler(CallRef(Call(call)), Object::ref(ObjectView(parameters)), flags, userdata);
+
+        return 0;
+}
+
+} // namespace detail
+
+template<auto Handler>
+inline constexpr VarlinkMethodCallback task_method = &detail::task_method_callback<Handler>;
+
+#endif
+
+} // namespace varlink
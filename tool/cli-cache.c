@@ -0,0 +1,179 @@
+// SPDX-License-Identifier: Apache-2.0
+
+#include "cli.h"
+#include "util.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+
+/*
+ * Entries younger than this are used without asking the service; older
+ * ones are revalidated against the version reported by GetInfo().
+ */
+#define CLI_CACHE_MAX_AGE 60
+
+static long cache_get_directory(char **directoryp) {
+        const char *base;
+        _cleanup_(freep) char *parent = NULL;
+        _cleanup_(freep) char *directory = NULL;
+
+        base = getenv("XDG_CACHE_HOME");
+        if (base && base[0] == '/') {
+                parent = strdup(base);
+                if (!parent)
+                        return -CLI_ERROR_PANIC;
+        } else {
+                base = getenv("HOME");
+                if (!base || base[0] != '/')
+                        return -CLI_ERROR_PANIC;
+
+                if (asprintf(&parent, "%s/.cache", base) < 0)
+                        return -CLI_ERROR_PANIC;
+        }
+
+        if (asprintf(&directory, "%s/varlink", parent) < 0)
+                return -CLI_ERROR_PANIC;
+
+        if (mkdir(parent, 0700) < 0 && errno != EEXIST)
+                return -CLI_ERROR_PANIC;
+
+        if (mkdir(directory, 0700) < 0 && errno != EEXIST)
+                return -CLI_ERROR_PANIC;
+
+        *directoryp = directory;
+        directory = NULL;
+
+        return 0;
+}
+
+/*
+ * The file name is the percent-encoded "ADDRESS/INTERFACE", so every
+ * entry maps to exactly one file and no two keys can collide.
+ */
+static long cache_get_path(const char *address, const char *interface, char **pathp) {
+        _cleanup_(freep) char *directory = NULL;
+        _cleanup_(fclosep) FILE *stream = NULL;
+        _cleanup_(freep) char *path = NULL;
+        size_t size;
+        long r;
+
+        r = cache_get_directory(&directory);
+        if (r < 0)
+                return r;
+
+        stream = open_memstream(&path, &size);
+        if (!stream)
+                return -CLI_ERROR_PANIC;
+
+        fprintf(stream, "%s/", directory);
+
+        for (const char *key[] = { address, "/", interface, NULL }, **k = key; *k; k += 1) {
+                for (const char *c = *k; *c; c += 1) {
+                        if ((*c >= 'a' && *c <= 'z') ||
+                            (*c >= 'A' && *c <= 'Z') ||
+                            (*c >= '0' && *c <= '9') ||
+                            *c == '.' || *c == '-' || *c == '_')
+                                fputc(*c, stream);
+                        else
+                                fprintf(stream, "%%%02X", (unsigned char)*c);
+                }
+        }
+
+        fclose(stream);
+        stream = NULL;
+
+        *pathp = path;
+        path = NULL;
+
+        return 0;
+}
+
+long cli_cache_load(const char *address,
+                    const char *interface,
+                    VarlinkObject **entryp,
+                    bool *freshp) {
+        _cleanup_(freep) char *path = NULL;
+        _cleanup_(closep) int fd = -1;
+        _cleanup_(freep) char *json = NULL;
+        struct stat st;
+        size_t n_read = 0;
+        long r;
+
+        r = cache_get_path(address, interface, &path);
+        if (r < 0)
+                return r;
+
+        fd = open(path, O_RDONLY | O_CLOEXEC);
+        if (fd < 0)
+                return -CLI_ERROR_CANNOT_RESOLVE;
+
+        if (fstat(fd, &st) < 0 || !S_ISREG(st.st_mode))
+                return -CLI_ERROR_PANIC;
+
+        json = malloc(st.st_size + 1);
+        if (!json)
+                return -CLI_ERROR_PANIC;
+
+        while (n_read < (size_t)st.st_size) {
+                ssize_t n;
+
+                n = read(fd, json + n_read, st.st_size - n_read);
+                if (n < 0) {
+                        if (errno == EINTR)
+                                continue;
+
+                        return -CLI_ERROR_PANIC;
+                }
+
+                if (n == 0)
+                        break;
+
+                n_read += n;
+        }
+        json[n_read] = '\0';
+
+        if (varlink_object_new_from_json(entryp, json) < 0)
+                return -CLI_ERROR_INVALID_JSON;
+
+        if (freshp)
+                *freshp = time(NULL) - st.st_mtime < CLI_CACHE_MAX_AGE;
+
+        return 0;
+}
+
+long cli_cache_store(const char *address,
+                     const char *interface,
+                     VarlinkObject *entry) {
+        _cleanup_(freep) char *path = NULL;
+        _cleanup_(freep) char *path_tmp = NULL;
+        _cleanup_(freep) char *json = NULL;
+        _cleanup_(closep) int fd = -1;
+        long length;
+        long r;
+
+        r = cache_get_path(address, interface, &path);
+        if (r < 0)
+                return r;
+
+        length = varlink_object_to_json(entry, &json);
+        if (length < 0)
+                return -CLI_ERROR_INVALID_JSON;
+
+        if (asprintf(&path_tmp, "%s.XXXXXX", path) < 0)
+                return -CLI_ERROR_PANIC;
+
+        fd = mkostemp(path_tmp, O_CLOEXEC);
+        if (fd < 0)
+                return -CLI_ERROR_PANIC;
+
+        /* Concurrent completions race to replace the entry; the last rename() wins. */
+        if (write(fd, json, length) != length || rename(path_tmp, path) < 0) {
+                unlink(path_tmp);
+                return -CLI_ERROR_PANIC;
+        }
+
+        return 0;
+}
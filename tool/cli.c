@@ -287,6 +287,181 @@ long cli_connect(Cli *cli,
         return 0;
 }
 
+/*
+ * Cache entries are keyed by the address a URI connects to; interfaces
+ * without an address are keyed by the resolver which looks them up.
+ */
+static long cli_cache_get_address(Cli *cli, VarlinkURI *uri, char **addressp) {
+        long r;
+
+        if (uri->type == VARLINK_URI_PROTOCOL_NONE)
+                r = asprintf(addressp, "%s", cli->resolver);
+        else
+                r = asprintf(addressp, "%s:%s", uri->protocol, uri->path ?: uri->host);
+
+        if (r < 0)
+                return -CLI_ERROR_PANIC;
+
+        return 0;
+}
+
+static long cli_get_service_version(Cli *cli, VarlinkURI *uri, char **versionp) {
+        _cleanup_(varlink_connection_freep) VarlinkConnection *connection = NULL;
+        _cleanup_(varlink_object_unrefp) VarlinkObject *out = NULL;
+        _cleanup_(freep) char *error = NULL;
+        const char *version;
+        long r;
+
+        r = cli_connect(cli, &connection, uri);
+        if (r < 0)
+                return r;
+
+        r = cli_call(cli,
+                     connection,
+                     "org.varlink.service.GetInfo",
+                     NULL,
+                     0,
+                     &error,
+                     &out);
+        if (r < 0)
+                return r;
+
+        if (error || varlink_object_get_string(out, "version", &version) < 0) {
+                *versionp = NULL;
+                return 0;
+        }
+
+        *versionp = strdup(version);
+        if (!*versionp)
+                return -CLI_ERROR_PANIC;
+
+        return 0;
+}
+
+static long cli_fetch_interface_info(Cli *cli,
+                                     VarlinkURI *uri,
+                                     const char *version,
+                                     char **errorp,
+                                     VarlinkObject **infop) {
+        _cleanup_(varlink_connection_freep) VarlinkConnection *connection = NULL;
+        _cleanup_(varlink_object_unrefp) VarlinkObject *parameters = NULL;
+        _cleanup_(varlink_object_unrefp) VarlinkObject *out = NULL;
+        _cleanup_(varlink_object_unrefp) VarlinkObject *info = NULL;
+        _cleanup_(varlink_array_unrefp) VarlinkArray *methods = NULL;
+        _cleanup_(varlink_interface_freep) VarlinkInterface *interface = NULL;
+        _cleanup_(freep) char *error = NULL;
+        const char *description = NULL;
+        long r;
+
+        r = cli_connect(cli, &connection, uri);
+        if (r < 0)
+                return r;
+
+        varlink_object_new(&parameters);
+        varlink_object_set_string(parameters, "interface", uri->interface);
+
+        r = cli_call(cli,
+                     connection,
+                     "org.varlink.service.GetInterfaceDescription",
+                     parameters,
+                     0,
+                     &error,
+                     &out);
+        if (r < 0)
+                return r;
+
+        if (error) {
+                *errorp = error;
+                error = NULL;
+                *infop = NULL;
+                return 0;
+        }
+
+        if (varlink_object_get_string(out, "description", &description) < 0)
+                return -CLI_ERROR_INVALID_MESSAGE;
+
+        r = varlink_interface_new(&interface, description, NULL);
+        if (r < 0)
+                return -CLI_ERROR_INVALID_MESSAGE;
+
+        varlink_array_new(&methods);
+        for (unsigned long i = 0; i < interface->n_members; i += 1) {
+                const VarlinkInterfaceMember *member = interface->members[i];
+
+                if (member->type != VARLINK_MEMBER_METHOD)
+                        continue;
+
+                if (varlink_array_append_string(methods, member->name) < 0)
+                        return -CLI_ERROR_PANIC;
+        }
+
+        varlink_object_new(&info);
+        if (version)
+                varlink_object_set_string(info, "version", version);
+        varlink_object_set_string(info, "description", description);
+        varlink_object_set_array(info, "methods", methods);
+
+        *errorp = NULL;
+        *infop = info;
+        info = NULL;
+
+        return 0;
+}
+
+long cli_get_interface_info(Cli *cli, VarlinkURI *uri, char **errorp, VarlinkObject **infop) {
+        _cleanup_(freep) char *address = NULL;
+        _cleanup_(varlink_object_unrefp) VarlinkObject *cached = NULL;
+        _cleanup_(freep) char *version = NULL;
+        const char *cached_version;
+        bool fresh = false;
+        long r;
+
+        /* Activated or bridged services only live as long as this process. */
+        if (cli->activate || cli->bridge)
+                return cli_fetch_interface_info(cli, uri, NULL, errorp, infop);
+
+        r = cli_cache_get_address(cli, uri, &address);
+        if (r < 0)
+                return r;
+
+        /* A missing or unreadable entry just means we have to ask the service. */
+        cli_cache_load(address, uri->interface, &cached, &fresh);
+        if (cached && fresh)
+                goto out;
+
+        r = cli_get_service_version(cli, uri, &version);
+        if (r < 0)
+                return r;
+
+        if (cached && version &&
+            varlink_object_get_string(cached, "version", &cached_version) >= 0 &&
+            strcmp(version, cached_version) == 0) {
+                /* Still valid; rewrite it to restart its lifetime. */
+                cli_cache_store(address, uri->interface, cached);
+                goto out;
+        }
+
+        if (cached)
+                cached = varlink_object_unref(cached);
+
+        r = cli_fetch_interface_info(cli, uri, version, errorp, &cached);
+        if (r < 0 || !cached)
+                return r;
+
+        cli_cache_store(address, uri->interface, cached);
+        *infop = cached;
+        cached = NULL;
+
+        return 0;
+
+out:
+        *errorp = NULL;
+        *infop = cached;
+        cached = NULL;
+
+        return 0;
+}
+
 long cli_process_all_events(Cli *cli, VarlinkConnection *connection) {
         long r;
 
@@ -571,24 +746,33 @@ long cli_complete_interfaces(Cli *cli, const char *current, bool end_with_dot) {
         _cleanup_(freep) char *error = NULL;
         VarlinkArray *interfaces;
         unsigned long n_interfaces;
+        bool fresh = false;
         long r;
 
-        r = varlink_connection_new(&connection, cli->resolver);
-        if (r < 0)
-                return -CLI_ERROR_CANNOT_CONNECT;
-
-        r = cli_call(cli,
-                     connection,
-                     "org.varlink.resolver.GetInfo",
-                     NULL,
-                     0,
-                     &error,
-                     &out);
-        if (r < 0)
-                return -r;
-
-        if (error)
-                return -CLI_ERROR_CALL_FAILED;
+        /* The resolver has no cheaper way to validate its list than returning it. */
+        if (cli_cache_load(cli->resolver, "org.varlink.resolver", &out, &fresh) < 0 || !fresh) {
+                if (out)
+                        out = varlink_object_unref(out);
+
+                r = varlink_connection_new(&connection, cli->resolver);
+                if (r < 0)
+                        return -CLI_ERROR_CANNOT_CONNECT;
+
+                r = cli_call(cli,
+                             connection,
+                             "org.varlink.resolver.GetInfo",
+                             NULL,
+                             0,
+                             &error,
+                             &out);
+                if (r < 0)
+                        return -r;
+
+                if (error)
+                        return -CLI_ERROR_CALL_FAILED;
+
+                cli_cache_store(cli->resolver, "org.varlink.resolver", out);
+        }
 
         r = varlink_object_get_array(out, "interfaces", &interfaces);
         if (r < 0)
@@ -607,52 +791,34 @@ long cli_complete_interfaces(Cli *cli, const char *current, bool end_with_dot) {
 
 long cli_complete_methods(Cli *cli, const char *current) {
         _cleanup_(varlink_uri_freep) VarlinkURI *uri = NULL;
-        _cleanup_(varlink_connection_freep) VarlinkConnection *connection = NULL;
-        _cleanup_(varlink_object_unrefp) VarlinkObject *parameters = NULL;
-        _cleanup_(varlink_object_unrefp) VarlinkObject *out = NULL;
-        _cleanup_(varlink_interface_freep) VarlinkInterface *interface = NULL;
+        _cleanup_(varlink_object_unrefp) VarlinkObject *info = NULL;
         _cleanup_(freep) char *error = NULL;
-        const char *description = NULL;
+        VarlinkArray *methods;
+        unsigned long n_methods;
         long r;
 
         r = varlink_uri_new(&uri, current, true);
         if (r < 0 || !uri->interface)
                 return cli_complete_interfaces(cli, current, true);
 
-        r = cli_connect(cli, &connection, uri);
+        r = cli_get_interface_info(cli, uri, &error, &info);
         if (r < 0)
                 return cli_complete_interfaces(cli, current, true);
 
-        varlink_object_new(&parameters);
-        varlink_object_set_string(parameters, "interface", uri->interface);
-
-        r = cli_call(cli,
-                     connection,
-                     "org.varlink.service.GetInterfaceDescription",
-                     parameters,
-                     0,
-                     &error,
-                     &out);
-        if (r < 0)
-                return r;
-
         if (error)
                 return -CLI_ERROR_REMOTE_ERROR;
 
-        if (varlink_object_get_string(out, "description", &description) < 0)
-                return -CLI_ERROR_CALL_FAILED;
+        if (varlink_object_get_array(info, "methods", &methods) < 0)
+                return -CLI_ERROR_INVALID_MESSAGE;
 
-        r = varlink_interface_new(&interface, description, NULL);
-        if (r < 0)
-                return -CLI_ERROR_PANIC;
+        n_methods = varlink_array_get_n_elements(methods);
+        for (unsigned long i = 0; i < n_methods; i += 1) {
+                const char *method;
 
-        for (unsigned long i = 0; i < interface->n_members; i += 1) {
-                const VarlinkInterfaceMember *member = interface->members[i];
-
-                if (member->type != VARLINK_MEMBER_METHOD)
-                        continue;
+                if (varlink_array_get_string(methods, i, &method) < 0)
+                        return -CLI_ERROR_INVALID_MESSAGE;
 
-                cli_print_completion(current, "%s.%s", uri->interface, member->name);
+                cli_print_completion(current, "%s.%s", uri->interface, method);
         }
 
         return 0;
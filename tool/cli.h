@@ -57,6 +57,7 @@ __attribute__ ((format (printf, 2, 3)))
 void cli_print_completion(const char *current, const char *format, ...);
 
 long cli_connect(Cli *cli, VarlinkConnection **connectionp, VarlinkURI *uri);
+long cli_get_interface_info(Cli *cli, VarlinkURI *uri, char **errorp, VarlinkObject **infop);
 long cli_call(Cli *cli,
               VarlinkConnection *connection,
               const char *method,
@@ -65,5 +66,13 @@ long cli_call(Cli *cli,
               char **errorp,
               VarlinkObject **outp);
 
+long cli_cache_load(const char *address,
+                    const char *interface,
+                    VarlinkObject **entryp,
+                    bool *freshp);
+long cli_cache_store(const char *address,
+                     const char *interface,
+                     VarlinkObject *entry);
+
 int cli_activate(const char *command, char **pathp, pid_t *pidp);
 int cli_bridge(const char *command, pid_t *pidp);
@@ -1,5 +1,6 @@
 // SPDX-License-Identifier: Apache-2.0
 
+#include "alloc.h"
 #include "command.h"
 #include "interface.h"
 #include "message.h"
@@ -91,12 +92,13 @@ static long bridge_new(Bridge **bridgep, Cli *cli) {
 static long bridge_reply(Bridge *UNUSED(bridge),
                          const char *error,
                          VarlinkObject *parameters,
-                         uint64_t flags) {
+                         uint64_t flags,
+                         uint64_t ttl_usec) {
         _cleanup_(varlink_object_unrefp) VarlinkObject *message = NULL;
         _cleanup_(freep) char *json = NULL;
         long r;
 
-        r = varlink_message_pack_reply(error, parameters, flags, &message);
+        r = varlink_message_pack_reply(error, parameters, flags, ttl_usec, &message);
         if (r < 0)
                 return -CLI_ERROR_PANIC;
 
@@ -118,7 +120,8 @@ static long reply_callback(VarlinkConnection *connection,
         Bridge *bridge = userdata;
         long r;
 
-        r = bridge_reply(bridge, error, parameters, flags);
+        /* The service's cache hint is passed on, for clients which cache. */
+        r = bridge_reply(bridge, error, parameters, flags, varlink_connection_get_reply_ttl(connection));
         if (r < 0)
                 bridge->status = r;
 
@@ -137,7 +140,7 @@ static const struct option options[] = {
 static long handleBridge(Cli *cli, Bridge *bridge) {
         while (bridge->status >= 0) {
                 _cleanup_(varlink_object_unrefp) VarlinkObject *call = NULL;
-                _cleanup_(freep) char *method = NULL;
+                _cleanup_(varlink_freep) char *method = NULL;
                 _cleanup_(varlink_object_unrefp) VarlinkObject *parameters = NULL;
                 uint64_t flags;
                 _cleanup_(varlink_connection_freep) VarlinkConnection *connection = NULL;
@@ -179,7 +182,7 @@ static long handleBridge(Cli *cli, Bridge *bridge) {
                                 return -CLI_ERROR_PANIC;
                 }
 
-                r = varlink_message_unpack_call(call, &method, &parameters, &flags);
+                r = varlink_message_unpack_call(call, &method, &parameters, &flags, NULL);
                 if (r < 0)
                         return -CLI_ERROR_INVALID_MESSAGE;
 
@@ -208,7 +211,7 @@ static long handleBridge(Cli *cli, Bridge *bridge) {
 
                         r = cli_resolve(cli, interf, &address);
                         if (r < 0) {
-                                bridge_reply(bridge, "org.varlink.service.InterfaceNotFound", NULL, 0);
+                                bridge_reply(bridge, "org.varlink.service.InterfaceNotFound", NULL, 0, 0);
                                 return -CLI_ERROR_PANIC;
                         }
 
@@ -231,13 +234,13 @@ static long handleBridge(Cli *cli, Bridge *bridge) {
 
                         r = varlink_uri_new(&uri, method, true);
                         if (r < 0) {
-                                bridge_reply(bridge, "org.varlink.service.InvalidParameter", NULL, 0);
+                                bridge_reply(bridge, "org.varlink.service.InvalidParameter", NULL, 0, 0);
                                 return -CLI_ERROR_INVALID_MESSAGE;
                         }
 
                         r = cli_resolve(cli, uri->interface, &address);
                         if (r < 0) {
-                                bridge_reply(bridge, "org.varlink.service.InterfaceNotFound", NULL, 0);
+                                bridge_reply(bridge, "org.varlink.service.InterfaceNotFound", NULL, 0, 0);
                                 return -CLI_ERROR_PANIC;
                         }
 
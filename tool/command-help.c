@@ -11,29 +11,17 @@
 #include <getopt.h>
 #include <string.h>
 
-static long help_interface(Cli *cli,
-                           VarlinkConnection *connection,
-                           const char *name) {
-        _cleanup_(varlink_object_unrefp) VarlinkObject *parameters = NULL;
-        _cleanup_(varlink_object_unrefp) VarlinkObject *out = NULL;
+static long help_interface(Cli *cli, VarlinkURI *uri) {
+        _cleanup_(varlink_object_unrefp) VarlinkObject *info = NULL;
         _cleanup_(freep) char *error = NULL;
         _cleanup_(varlink_interface_freep) VarlinkInterface *interface = NULL;
         const char *description = NULL;
         _cleanup_(freep) char *string = NULL;
         long r;
 
-        varlink_object_new(&parameters);
-        varlink_object_set_string(parameters, "interface", name);
-
-        r = cli_call(cli,
-                     connection,
-                     "org.varlink.service.GetInterfaceDescription",
-                     parameters,
-                     0,
-                     &error,
-                     &out);
+        r = cli_get_interface_info(cli, uri, &error, &info);
         if (r < 0) {
-                fprintf(stderr, "Unable to call method: %s\n", cli_error_string(-r));
+                fprintf(stderr, "Unable to get interface description: %s\n", cli_error_string(-r));
                 return r;
         }
 
@@ -42,7 +30,7 @@ static long help_interface(Cli *cli,
                 return -CLI_ERROR_REMOTE_ERROR;
         }
 
-        if (varlink_object_get_string(out, "description", &description) < 0)
+        if (varlink_object_get_string(info, "description", &description) < 0)
                 return -CLI_ERROR_INVALID_MESSAGE;
 
         r = varlink_interface_new(&interface, description, NULL);
@@ -75,7 +63,6 @@ static long help_run(Cli *cli, int argc, char **argv) {
         };
         int c;
         _cleanup_(varlink_uri_freep) VarlinkURI *uri = NULL;
-        _cleanup_(varlink_connection_freep) VarlinkConnection *connection = NULL;
         long r;
 
         while ((c = getopt_long(argc, argv, "h", options, NULL)) >= 0) {
@@ -106,13 +93,7 @@ static long help_run(Cli *cli, int argc, char **argv) {
                 return -CLI_ERROR_INVALID_ARGUMENT;
         }
 
-        r = cli_connect(cli, &connection, uri);
-        if (r < 0) {
-                fprintf(stderr, "Unable to connect: %s\n", cli_error_string(-r));
-                return r;
-        }
-
-        r = help_interface(cli, connection, uri->interface);
+        r = help_interface(cli, uri);
         if (r < 0)
                 return r;
 
@@ -7,6 +7,7 @@
 #include <dirent.h>
 #include <errno.h>
 #include <getopt.h>
+#include <inttypes.h>
 #include <string.h>
 
 static long print_service(Cli *cli, VarlinkConnection *connection) {
@@ -84,18 +85,298 @@ static long print_service(Cli *cli, VarlinkConnection *connection) {
         return 0;
 }
 
+static void print_label_value(const char *value) {
+        for (const char *c = value; *c; c += 1) {
+                switch (*c) {
+                        case '\\':
+                        case '"':
+                                printf("\\%c", *c);
+                                break;
+
+                        case '\n':
+                                printf("\\n");
+                                break;
+
+                        default:
+                                putchar(*c);
+                                break;
+                }
+        }
+}
+
+/*
+ * Prints the metrics in the Prometheus text exposition format, latencies
+ * are converted to seconds.
+ */
+static long print_metrics_text(VarlinkObject *metrics, VarlinkArray *buckets, VarlinkArray *methods) {
+        static const struct {
+                const char *field;
+                const char *name;
+                const char *type;
+                double scale;
+        } values[] = {
+                { "calls_in_flight", "varlink_calls_in_flight", "gauge", 1 },
+                { "connections", "varlink_connections", "gauge", 1 },
+                { "connections_total", "varlink_connections_total", "counter", 1 },
+                { "bytes_in", "varlink_received_bytes_total", "counter", 1 },
+                { "bytes_out", "varlink_sent_bytes_total", "counter", 1 },
+                { "buffered_bytes", "varlink_buffered_bytes", "gauge", 1 },
+                { "loop_lag_max", "varlink_loop_lag_max_seconds", "gauge", 1e-6 },
+                { "dispatch_delay_max", "varlink_dispatch_delay_max_seconds", "gauge", 1e-6 },
+                { "slow_calls", "varlink_slow_calls_total", "counter", 1 },
+        };
+        unsigned long n_methods = varlink_array_get_n_elements(methods);
+        unsigned long n_buckets = varlink_array_get_n_elements(buckets);
+
+        for (unsigned long i = 0; i < ARRAY_SIZE(values); i += 1) {
+                int64_t value;
+
+                if (varlink_object_get_int(metrics, values[i].field, &value) < 0)
+                        continue;
+
+                printf("# TYPE %s %s\n", values[i].name, values[i].type);
+                printf("%s %.9g\n", values[i].name, (double)value * values[i].scale);
+        }
+
+        printf("# TYPE varlink_calls_total counter\n");
+        printf("# TYPE varlink_errors_total counter\n");
+        printf("# TYPE varlink_call_duration_seconds histogram\n");
+        printf("# TYPE varlink_handler_seconds_total counter\n");
+        printf("# TYPE varlink_handler_max_seconds gauge\n");
+        printf("# TYPE varlink_slow_handler_calls_total counter\n");
+
+        for (unsigned long i = 0; i < n_methods; i += 1) {
+                VarlinkObject *method;
+                const char *name;
+                int64_t calls, errors, duration;
+                int64_t handler_time = 0, handler_time_max = 0, slow = 0;
+                VarlinkArray *latency;
+                int64_t count = 0;
+
+                if (varlink_array_get_object(methods, i, &method) < 0 ||
+                    varlink_object_get_string(method, "method", &name) < 0 ||
+                    varlink_object_get_int(method, "calls", &calls) < 0 ||
+                    varlink_object_get_int(method, "errors", &errors) < 0 ||
+                    varlink_object_get_int(method, "duration", &duration) < 0 ||
+                    varlink_object_get_array(method, "latency", &latency) < 0 ||
+                    varlink_array_get_n_elements(latency) != n_buckets + 1)
+                        return -CLI_ERROR_INVALID_MESSAGE;
+
+                printf("varlink_calls_total{method=\"");
+                print_label_value(name);
+                printf("\"} %" PRIi64 "\n", calls);
+
+                printf("varlink_errors_total{method=\"");
+                print_label_value(name);
+                printf("\"} %" PRIi64 "\n", errors);
+
+                /* Prometheus buckets are cumulative. */
+                for (unsigned long b = 0; b <= n_buckets; b += 1) {
+                        int64_t n;
+
+                        if (varlink_array_get_int(latency, b, &n) < 0)
+                                return -CLI_ERROR_INVALID_MESSAGE;
+
+                        count += n;
+
+                        printf("varlink_call_duration_seconds_bucket{method=\"");
+                        print_label_value(name);
+                        if (b < n_buckets) {
+                                int64_t le;
+
+                                if (varlink_array_get_int(buckets, b, &le) < 0)
+                                        return -CLI_ERROR_INVALID_MESSAGE;
+
+                                printf("\",le=\"%.9g\"} %" PRIi64 "\n", (double)le * 1e-6, count);
+                        } else
+                                printf("\",le=\"+Inf\"} %" PRIi64 "\n", count);
+                }
+
+                printf("varlink_call_duration_seconds_sum{method=\"");
+                print_label_value(name);
+                printf("\"} %.9g\n", (double)duration * 1e-6);
+
+                printf("varlink_call_duration_seconds_count{method=\"");
+                print_label_value(name);
+                printf("\"} %" PRIi64 "\n", count);
+
+                /* Only reported by newer services. */
+                if (varlink_object_get_int(method, "handler_time", &handler_time) < 0)
+                        continue;
+
+                varlink_object_get_int(method, "handler_time_max", &handler_time_max);
+                varlink_object_get_int(method, "slow", &slow);
+
+                printf("varlink_handler_seconds_total{method=\"");
+                print_label_value(name);
+                printf("\"} %.9g\n", (double)handler_time * 1e-6);
+
+                printf("varlink_handler_max_seconds{method=\"");
+                print_label_value(name);
+                printf("\"} %.9g\n", (double)handler_time_max * 1e-6);
+
+                printf("varlink_slow_handler_calls_total{method=\"");
+                print_label_value(name);
+                printf("\"} %" PRIi64 "\n", slow);
+        }
+
+        return 0;
+}
+
+static long print_metrics_summary(VarlinkObject *metrics, VarlinkArray *buckets, VarlinkArray *methods) {
+        unsigned long n_methods = varlink_array_get_n_elements(methods);
+        unsigned long n_buckets = varlink_array_get_n_elements(buckets);
+        int64_t in_flight, connections, connections_total;
+        int64_t bytes_in, bytes_out, buffered, lag;
+        int64_t delay = 0, slow_calls = 0;
+
+        if (varlink_object_get_int(metrics, "calls_in_flight", &in_flight) < 0 ||
+            varlink_object_get_int(metrics, "connections", &connections) < 0 ||
+            varlink_object_get_int(metrics, "connections_total", &connections_total) < 0 ||
+            varlink_object_get_int(metrics, "bytes_in", &bytes_in) < 0 ||
+            varlink_object_get_int(metrics, "bytes_out", &bytes_out) < 0 ||
+            varlink_object_get_int(metrics, "buffered_bytes", &buffered) < 0 ||
+            varlink_object_get_int(metrics, "loop_lag_max", &lag) < 0)
+                return -CLI_ERROR_INVALID_MESSAGE;
+
+        printf("%sMetrics:%s\n",
+               terminal_color(TERMINAL_BOLD),
+               terminal_color(TERMINAL_NORMAL));
+        printf("  Calls in flight: %" PRIi64 "\n", in_flight);
+        printf("  Connections: %" PRIi64 " (%" PRIi64 " total)\n", connections, connections_total);
+        printf("  Bytes received: %" PRIi64 "\n", bytes_in);
+        printf("  Bytes sent: %" PRIi64 "\n", bytes_out);
+        printf("  Bytes buffered: %" PRIi64 "\n", buffered);
+        printf("  Longest dispatch: %" PRIi64 " us\n", lag);
+
+        if (varlink_object_get_int(metrics, "dispatch_delay_max", &delay) >= 0 &&
+            varlink_object_get_int(metrics, "slow_calls", &slow_calls) >= 0) {
+                printf("  Longest wait for dispatch: %" PRIi64 " us\n", delay);
+                printf("  Slow calls: %" PRIi64 "\n", slow_calls);
+        }
+
+        if (n_methods == 0)
+                return 0;
+
+        printf("\n");
+        printf("  %-48s %10s %10s %10s %10s %10s %10s\n",
+               "Method", "Calls", "Errors", "Avg us", "P99 us", "Max run us", "Slow");
+
+        for (unsigned long i = 0; i < n_methods; i += 1) {
+                VarlinkObject *method;
+                const char *name;
+                int64_t calls, errors, duration;
+                int64_t handler_time_max = 0, slow = 0;
+                VarlinkArray *latency;
+                int64_t count = 0;
+                int64_t n_below = 0;
+                char p99[32] = "-";
+
+                if (varlink_array_get_object(methods, i, &method) < 0 ||
+                    varlink_object_get_string(method, "method", &name) < 0 ||
+                    varlink_object_get_int(method, "calls", &calls) < 0 ||
+                    varlink_object_get_int(method, "errors", &errors) < 0 ||
+                    varlink_object_get_int(method, "duration", &duration) < 0 ||
+                    varlink_object_get_array(method, "latency", &latency) < 0 ||
+                    varlink_array_get_n_elements(latency) != n_buckets + 1)
+                        return -CLI_ERROR_INVALID_MESSAGE;
+
+                for (unsigned long b = 0; b <= n_buckets; b += 1) {
+                        int64_t n;
+
+                        if (varlink_array_get_int(latency, b, &n) < 0)
+                                return -CLI_ERROR_INVALID_MESSAGE;
+
+                        count += n;
+                }
+
+                /* The upper bound of the bucket holding the 99th percentile. */
+                for (unsigned long b = 0; count > 0 && b <= n_buckets; b += 1) {
+                        int64_t n, le;
+
+                        varlink_array_get_int(latency, b, &n);
+                        n_below += n;
+                        if (n_below * 100 < count * 99)
+                                continue;
+
+                        if (b < n_buckets && varlink_array_get_int(buckets, b, &le) >= 0)
+                                snprintf(p99, sizeof(p99), "%" PRIi64, le);
+                        else
+                                snprintf(p99, sizeof(p99), "inf");
+                        break;
+                }
+
+                varlink_object_get_int(method, "handler_time_max", &handler_time_max);
+                varlink_object_get_int(method, "slow", &slow);
+
+                printf("  %-48s %10" PRIi64 " %10" PRIi64 " %10" PRIi64 " %10s %10" PRIi64 " %10" PRIi64 "\n",
+                       name, calls, errors,
+                       count > 0 ? duration / count : 0,
+                       p99, handler_time_max, slow);
+        }
+
+        return 0;
+}
+
+static long print_metrics(Cli *cli, VarlinkConnection *connection, bool text) {
+        _cleanup_(varlink_object_unrefp) VarlinkObject *metrics = NULL;
+        _cleanup_(freep) char *error = NULL;
+        VarlinkArray *buckets;
+        VarlinkArray *methods;
+        long r;
+
+        r = cli_call(cli,
+                     connection,
+                     "org.varlink.metrics.GetMetrics",
+                     NULL,
+                     0,
+                     &error,
+                     &metrics);
+        if (r < 0) {
+                fprintf(stderr, "Unable to call method: %s\n", cli_error_string(-r));
+                return r;
+        }
+
+        if (error) {
+                fprintf(stderr, "Call failed with error: %s\n", error);
+                return -CLI_ERROR_REMOTE_ERROR;
+        }
+
+        if (varlink_object_get_array(metrics, "latency_buckets", &buckets) < 0 ||
+            varlink_object_get_array(metrics, "methods", &methods) < 0) {
+                fprintf(stderr, "Unable to parse reply\n");
+                return -CLI_ERROR_INVALID_MESSAGE;
+        }
+
+        if (text)
+                r = print_metrics_text(metrics, buckets, methods);
+        else
+                r = print_metrics_summary(metrics, buckets, methods);
+
+        if (r < 0) {
+                fprintf(stderr, "Unable to parse reply\n");
+                return r;
+        }
+
+        return 0;
+}
+
 static long info_run(Cli *cli, int argc, char **argv) {
         static const struct option options[] = {
-                { "help",    no_argument,       NULL, 'h' },
+                { "help",         no_argument,       NULL, 'h' },
+                { "metrics",      no_argument,       NULL, 'm' },
+                { "metrics-text", no_argument,       NULL, 'M' },
                 {}
         };
+        bool metrics = false;
+        bool metrics_text = false;
         const char *address = NULL;
         _cleanup_(varlink_uri_freep) VarlinkURI *uri = NULL;
         _cleanup_(varlink_connection_freep) VarlinkConnection *connection = NULL;
         int c;
         long r;
 
-        while ((c = getopt_long(argc, argv, "h", options, NULL)) >= 0) {
+        while ((c = getopt_long(argc, argv, "hmM", options, NULL)) >= 0) {
                 switch (c) {
                         case 'h':
                                 printf("Usage: %s info ADDRESS\n", program_invocation_short_name);
@@ -103,8 +384,19 @@ static long info_run(Cli *cli, int argc, char **argv) {
                                 printf("Prints information about the service running at ADDRESS.\n");
                                 printf("\n");
                                 printf("  -h, --help             display this help text and exit\n");
+                                printf("  -m, --metrics          also print the metrics of the service\n");
+                                printf("  -M, --metrics-text     only print the metrics, in the Prometheus\n");
+                                printf("                         text exposition format\n");
                                 return 0;
 
+                        case 'm':
+                                metrics = true;
+                                break;
+
+                        case 'M':
+                                metrics_text = true;
+                                break;
+
                         default:
                                 fprintf(stderr, "Try '%s --help' for more information\n",
                                         program_invocation_short_name);
@@ -121,17 +413,31 @@ static long info_run(Cli *cli, int argc, char **argv) {
                 }
         }
 
+        if (!metrics_text) {
+                r = cli_connect(cli, &connection, uri);
+                if (r < 0) {
+                        fprintf(stderr, "Unable to connect: %s\n", varlink_error_string(-r));
+                        return r;
+                }
+
+                r = print_service(cli, connection);
+                if (r < 0)
+                        return r;
+
+                if (!metrics)
+                        return 0;
+
+                /* The connection is closed after the reply. */
+                connection = varlink_connection_free(connection);
+        }
+
         r = cli_connect(cli, &connection, uri);
         if (r < 0) {
                 fprintf(stderr, "Unable to connect: %s\n", varlink_error_string(-r));
                 return r;
         }
 
-        r = print_service(cli, connection);
-        if (r < 0)
-                return r;
-
-        return 0;
+        return print_metrics(cli, connection, metrics_text);
 }
 
 static long info_complete(Cli *UNUSED(cli), int argc, char **UNUSED(argv), const char *current) {